@@ -1,50 +1,86 @@
 #include "src/phase_limiter/auto_mastering.h"
+#include "src/phase_limiter/phase_limit.h"
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <emscripten.h>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 #include <vector>
 
 // Forward declare gflags variables or use DECLARE_string if you prefer macros
 #include "gflags/gflags.h"
 DECLARE_string(sound_quality2_cache);
 
-extern "C" {
+namespace {
 
-EMSCRIPTEN_KEEPALIVE
-int phaselimiter_pro_process(float *left_ptr, float *right_ptr, int length,
-                             int sample_rate, int mode,
-                             void (*progress_cb)(float)) {
+const char *const kSoundQuality2CachePath = "/sound_quality2_cache";
+
+// Points FLAGS_sound_quality2_cache at the preloaded asset.
+void UsePreloadedSoundQuality2Cache() {
+  // Check filesystem for preloaded data
+  struct stat st;
+  if (stat(kSoundQuality2CachePath, &st) == 0) {
+    std::cerr << "[adapter_pro] Found " << kSoundQuality2CachePath
+              << ", size: " << (long long)st.st_size << " bytes" << std::endl;
+  } else {
+    std::cerr << "[adapter_pro] ERROR: " << kSoundQuality2CachePath
+              << " NOT FOUND!" << std::endl;
+  }
+  FLAGS_sound_quality2_cache = kSoundQuality2CachePath;
+}
+
+// Wraps progress_cb so that it is only called on the calling thread.
+// progress_cb lives in the function table of the calling worker only, so
+// reports from tbb pool threads are stashed and forwarded on the next
+// report made by the calling thread.
+std::function<void(float)> MakeProgressReporter(void (*progress_cb)(float)) {
+  const std::thread::id caller_thread = std::this_thread::get_id();
+  auto pending_progress = std::make_shared<std::atomic<float>>(0.0f);
+  return [progress_cb, caller_thread, pending_progress](float p) {
+    if (!progress_cb)
+      return;
+    if (std::this_thread::get_id() != caller_thread) {
+      float current = pending_progress->load();
+      while (current < p &&
+             !pending_progress->compare_exchange_weak(current, p)) {
+      }
+      return;
+    }
+    progress_cb(std::max(p, pending_progress->load()));
+  };
+}
+
+// Engine-lifetime state handed out by phaselimiter_pro_init.
+struct ProContext {
+  std::shared_ptr<const phase_limiter::AutoMastering5Context> mastering5;
+};
+
+// context == nullptr builds the Level 5 state for this call only.
+int Process(const ProContext *context, float *left_ptr, float *right_ptr,
+            int length, int sample_rate, int mode,
+            void (*progress_cb)(float)) {
   if (!left_ptr || !right_ptr)
     return -1;
   int channels = 2;
 
   std::cerr << "[adapter_pro] START: len=" << length << ", rate=" << sample_rate
-            << ", mode=" << mode << std::endl;
+            << ", mode=" << mode << ", context=" << (context ? "yes" : "no")
+            << std::endl;
   std::cerr << "[adapter_pro] DEBUG: sizeof(long)=" << sizeof(long)
             << ", sizeof(size_t)=" << sizeof(size_t) << std::endl;
 
   bool fallback_occurred = false;
 
-  // Create progress callback wrapper that safely calls JS if provided
-  auto report_progress = [progress_cb](float p) {
-    if (progress_cb)
-      progress_cb(p);
-  };
+  // Create progress callback wrapper that safely calls JS if provided.
+  const auto report_progress = MakeProgressReporter(progress_cb);
 
   try {
-    // Check filesystem for preloaded data
-    struct stat st;
-    if (stat("/sound_quality2_cache", &st) == 0) {
-      std::cerr << "[adapter_pro] Found /sound_quality2_cache, size: "
-                << (long long)st.st_size << " bytes" << std::endl;
-    } else {
-      std::cerr << "[adapter_pro] ERROR: /sound_quality2_cache NOT FOUND!"
-                << std::endl;
-    }
-
     std::cerr << "[adapter_pro] Copying data to vector..." << std::endl;
     std::vector<float> wave(length * channels);
     for (int i = 0; i < length; ++i) {
@@ -63,14 +99,14 @@ int phaselimiter_pro_process(float *left_ptr, float *right_ptr, int length,
     } else {
       std::cerr << "[adapter_pro] Calling AutoMastering5" << std::endl;
 
-      // Set the cache path
-      FLAGS_sound_quality2_cache = "/sound_quality2_cache";
-
-      std::cerr << "[adapter_pro] FLAGS_sound_quality2_cache set to: "
-                << FLAGS_sound_quality2_cache << std::endl;
-
       try {
-        phase_limiter::AutoMastering5(&wave, sample_rate, report_progress);
+        if (context) {
+          phase_limiter::AutoMastering5(&wave, sample_rate, report_progress,
+                                        *context->mastering5);
+        } else {
+          UsePreloadedSoundQuality2Cache();
+          phase_limiter::AutoMastering5(&wave, sample_rate, report_progress);
+        }
       } catch (const std::exception &e) {
         std::cerr << "[adapter_pro] Level 5 failed: " << e.what()
                   << ". Falling back to Level 3..." << std::endl;
@@ -126,4 +162,156 @@ int phaselimiter_pro_process(float *left_ptr, float *right_ptr, int length,
     return -6;
   }
 }
+
+} // namespace
+
+extern "C" {
+
+// Uses the sound_quality2_cache in |data| (flat or legacy boost binary format)
+// instead of /sound_quality2_cache. A flat cache is referenced in place, so
+// |data| must stay allocated until this is called again (nullptr resets).
+// Works without a filesystem (-sFILESYSTEM=0).
+EMSCRIPTEN_KEEPALIVE
+int phaselimiter_pro_set_sound_quality2_cache(const void *data, int size) {
+  try {
+    phase_limiter::SetSoundQuality2CacheData(data, size);
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << "[adapter_pro] set_sound_quality2_cache failed: " << e.what()
+              << std::endl;
+    return -3;
+  }
+}
+
+// Creates the engine state once per module: loads the sound_quality2_cache
+// and the mastering reference, and prepares the band filters and FFT plans
+// for sample_rate (other rates are prepared on first use). Returns nullptr on
+// failure. Release with phaselimiter_pro_destroy.
+EMSCRIPTEN_KEEPALIVE
+void *phaselimiter_pro_init(int sample_rate) {
+  try {
+    UsePreloadedSoundQuality2Cache();
+    std::unique_ptr<ProContext> context(new ProContext);
+    context->mastering5 = phase_limiter::CreateAutoMastering5Context();
+    if (sample_rate > 0) {
+      phase_limiter::PrepareAutoMastering5Context(*context->mastering5,
+                                                  sample_rate);
+    }
+    std::cerr << "[adapter_pro] Context initialized" << std::endl;
+    return context.release();
+  } catch (const std::exception &e) {
+    std::cerr << "[adapter_pro] init failed: " << e.what() << std::endl;
+    return nullptr;
+  } catch (...) {
+    std::cerr << "[adapter_pro] init failed with unknown error" << std::endl;
+    return nullptr;
+  }
+}
+
+// Same as phaselimiter_pro_process, reusing the state created by
+// phaselimiter_pro_init.
+EMSCRIPTEN_KEEPALIVE
+int phaselimiter_pro_process_with_context(void *context, float *left_ptr,
+                                          float *right_ptr, int length,
+                                          int sample_rate, int mode,
+                                          void (*progress_cb)(float)) {
+  if (!context)
+    return -2;
+  return Process(static_cast<const ProContext *>(context), left_ptr, right_ptr,
+                 length, sample_rate, mode, progress_cb);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void phaselimiter_pro_destroy(void *context) {
+  delete static_cast<ProContext *>(context);
+}
+
+// Phase-optimizing limiter (GradCalculator FISTA, PhaseLimitInplace of the
+// native engine). Peaks above ceiling_db are removed by optimizing the phase
+// instead of scaling the whole signal down. The caller applies any loudness
+// gain beforehand. max_iter1 / max_iter2 cap the outer / line search
+// iterations (<= 0: native defaults 100 / 400), max_sec bounds the
+// optimization time (<= 0: unlimited). segment_sec > 0 optimizes overlapping
+// segments of that length one by one, so memory stays proportional to the
+// segment length instead of the track length (<= 0: whole track at once).
+// The buffers are processed in place at sample_rate (any rate).
+// Returns 0 on success, -1 / -2 for invalid buffers / arguments, <= -3 on
+// exceptions (same codes as phaselimiter_pro_process, buffers undefined).
+EMSCRIPTEN_KEEPALIVE
+int phaselimiter_limit(float *left_ptr, float *right_ptr, int length,
+                       int sample_rate, float ceiling_db, int max_iter1,
+                       int max_iter2, float max_sec, float segment_sec,
+                       void (*progress_cb)(float)) {
+  if (!left_ptr || !right_ptr)
+    return -1;
+  if (length <= 0) {
+    std::cerr << "[adapter_pro] limit: empty buffer (length " << length << ")"
+              << std::endl;
+    return -2;
+  }
+  if (sample_rate <= 0) {
+    std::cerr << "[adapter_pro] limit: unsupported sample rate "
+              << sample_rate << std::endl;
+    return -2;
+  }
+  if (max_iter1 <= 0)
+    max_iter1 = 100;
+  if (max_iter2 <= 0)
+    max_iter2 = 400;
+
+  std::cerr << "[adapter_pro] LIMIT: len=" << length << ", rate=" << sample_rate
+            << ", ceiling=" << ceiling_db << ", max_iter=" << max_iter1 << "/"
+            << max_iter2 << ", max_sec=" << max_sec
+            << ", segment_sec=" << segment_sec << std::endl;
+
+  const auto report_progress = MakeProgressReporter(progress_cb);
+  try {
+    // ceilingを1に正規化
+    const float scale = std::pow(10.0f, -ceiling_db / 20);
+    bool need_limiting = false;
+    for (int i = 0; i < length && !need_limiting; ++i) {
+      if (std::max(std::abs(left_ptr[i] * scale),
+                   std::abs(right_ptr[i] * scale)) >= 1 + 0.5 / 65536) {
+        need_limiting = true;
+      }
+    }
+
+    if (need_limiting) {
+      // no interleaved copy of the whole track; the segments are read from
+      // and written back to the caller's buffers
+      for (int i = 0; i < length; ++i) {
+        left_ptr[i] *= scale;
+        right_ptr[i] *= scale;
+      }
+      float *channels[2] = {left_ptr, right_ptr};
+      phase_limiter::PhaseLimitSegmented(channels, 1, length, sample_rate,
+                                         sample_rate / 2.0, segment_sec,
+                                         max_iter1, max_iter2, max_sec,
+                                         report_progress);
+      for (int i = 0; i < length; ++i) {
+        left_ptr[i] /= scale;
+        right_ptr[i] /= scale;
+      }
+    }
+    report_progress(1);
+
+    std::cerr << "[adapter_pro] LIMIT SUCCESS (limited: "
+              << (need_limiting ? "yes" : "no") << ")" << std::endl;
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << "[adapter_pro] limit failed: " << e.what() << std::endl;
+    return -3;
+  } catch (...) {
+    std::cerr << "[adapter_pro] limit failed with unknown error" << std::endl;
+    return -6;
+  }
+}
+
+EMSCRIPTEN_KEEPALIVE
+int phaselimiter_pro_process(float *left_ptr, float *right_ptr, int length,
+                             int sample_rate, int mode,
+                             void (*progress_cb)(float)) {
+  return Process(nullptr, left_ptr, right_ptr, length, sample_rate, mode,
+                 progress_cb);
+}
 }
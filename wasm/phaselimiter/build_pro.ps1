@@ -32,6 +32,7 @@ $srcFiles = @(
   (Join-Path $scriptDir "src_original/src/phase_limiter/enhancement.cpp"),
   (Join-Path $scriptDir "src_original/src/phase_limiter/equalization.cpp"),
   (Join-Path $scriptDir "src_original/src/phase_limiter/freq_expander.cpp"),
+  (Join-Path $scriptDir "src_original/src/phase_limiter/phase_limit.cpp"),
   (Join-Path $scriptDir "src_original/src/phase_limiter/pre_compression.cpp"),
   (Join-Path $scriptDir "src_original/src/phase_limiter/resampling.cpp"),
   (Join-Path $scriptDir "src_original/deps/bakuage/src/bessel.cpp"),
@@ -49,6 +50,7 @@ $srcFiles = @(
   (Join-Path $scriptDir "src_original/deps/bakuage/src/memory.cpp"),
   (Join-Path $scriptDir "src_original/deps/bakuage/src/rnnoise.cpp"),
   (Join-Path $scriptDir "src_original/deps/bakuage/src/sndfile_wrapper.cpp"),
+  (Join-Path $scriptDir "src_original/deps/bakuage/src/sound_quality2_flat.cpp"),
   (Join-Path $scriptDir "src_original/deps/bakuage/src/stacktrace.cpp"),
   (Join-Path $scriptDir "src_original/deps/bakuage/src/utils.cpp"),
   (Join-Path $scriptDir "src_original/deps/bakuage/src/vector_math.cpp"),
@@ -67,7 +69,6 @@ $includePaths = @(
 
 # External dependency paths
 $optimPath = "v:\Slowverb\wasm\phaselimiter\src_original\prebuilt\win64\optim\header_only_version"
-$libsimdppPath = "v:\Slowverb\docs\slowverb-mastering-toggle-plan-v3\phaselimiter-master\deps\libsimdpp"
 
 $libsndfilePath = "$(Join-Path $scriptDir "src_original/prebuilt/win64/libsndfile-1.2.2-win64/include")"
 $armaPath = "$(Join-Path $scriptDir "src_original/armadillo-15.2.3/include")"
@@ -76,7 +77,6 @@ $boostPath = "$(Join-Path $scriptDir "src_original/boost_1_89_0")"
 $eigenPath = "$(Join-Path $scriptDir "src_original/eigen-master")"
 
 if (Test-Path $optimPath) { $includePaths += "-I$optimPath" }
-if (Test-Path $libsimdppPath) { $includePaths += "-I$libsimdppPath" }
 if (Test-Path $libsndfilePath) { $includePaths += "-I$libsndfilePath" }
 if (Test-Path $armaPath) { $includePaths += "-I$armaPath" }
 if (Test-Path $hnswPath) { $includePaths += "-I$hnswPath" }
@@ -138,6 +138,9 @@ try {
   $compileArgs += "-msse"
   $compileArgs += "-msse2"
   $compileArgs += "-msimd128"
+  # tbb stubs run on a pthread pool (requires COOP/COEP, see web/vercel.json)
+  $compileArgs += "-pthread"
+  $compileArgs += "-sPTHREAD_POOL_SIZE=navigator.hardwareConcurrency"
   $compileArgs += "-DPHASELIMITER_ENABLE_FFTW"
   $compileArgs += "-DOPTIM_USE_TBB"
   $compileArgs += "-DNO_MANUAL_VECTORIZATION"
@@ -156,11 +159,16 @@ try {
   $compileArgs += "-sEXPORT_NAME=createPhaseLimiterProModule"
   $compileArgs += "-sENVIRONMENT=web,worker"
   $compileArgs += "-sFILESYSTEM=1"
-  $compileArgs += "-sEXPORTED_FUNCTIONS=['_phaselimiter_pro_process','_malloc','_free']"
+  $compileArgs += "-sEXPORTED_FUNCTIONS=['_phaselimiter_pro_process','_phaselimiter_pro_set_sound_quality2_cache','_phaselimiter_pro_init','_phaselimiter_pro_process_with_context','_phaselimiter_pro_destroy','_phaselimiter_limit','_malloc','_free']"
   $compileArgs += "-sEXPORTED_RUNTIME_METHODS=['ccall']"
   
   # Add sound_quality2_cache asset
+  # Prefer the flat format (see flat_converter.cpp), which is used in place
+  # without parsing. The boost binary format is converted at first use.
   $cacheFile = "src_original/phaselimiter-win/phaselimiter/resource/sound_quality2_cache"
+  if (Test-Path "sound_quality2_cache.flat") {
+    $cacheFile = "sound_quality2_cache.flat"
+  }
   $compileArgs += "--preload-file"
   $compileArgs += "${cacheFile}@/sound_quality2_cache"
 
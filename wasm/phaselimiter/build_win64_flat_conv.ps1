@@ -0,0 +1,52 @@
+$scriptDir = Split-Path -Parent $MyInvocation.MyCommand.Path
+$boostDir = "v:\Slowverb\wasm\phaselimiter\src_original\boost_1_90_0-bin-msvc-all-32-64\boost_1_90_0"
+$boostInclude = $boostDir
+$boostLib = "$boostDir\lib64-msvc-14.3"
+
+# We'll use the environment's cl.exe if available, otherwise we'll try to find it.
+# Assuming typical VS 2022 Community install if not in path.
+$cl = "cl.exe"
+
+$srcs = @(
+    "v:\Slowverb\wasm\phaselimiter\flat_converter.cpp",
+    "v:\Slowverb\wasm\phaselimiter\src_original\deps\bakuage\src\sound_quality2_flat.cpp",
+    "v:\Slowverb\wasm\phaselimiter\src_original\deps\bakuage\src\vector_math.cpp",
+    "v:\Slowverb\wasm\phaselimiter\src_original\deps\bakuage\src\memory.cpp",
+    "v:\Slowverb\wasm\phaselimiter\src_original\deps\bakuage\src\get_peak_rss.cpp",
+    "v:\Slowverb\wasm\phaselimiter\src_original\deps\bakuage\src\utils.cpp"
+)
+$out = "v:\Slowverb\wasm\phaselimiter\flat_converter_win64.exe"
+
+$includePaths = @(
+    "/I v:\Slowverb\wasm\phaselimiter",
+    "/I v:\Slowverb\wasm\phaselimiter\stubs",
+    "/I v:\Slowverb\wasm\phaselimiter\src_original",
+    "/I v:\Slowverb\wasm\phaselimiter\src_original\src",
+    "/I v:\Slowverb\wasm\phaselimiter\src_original\deps\bakuage\include",
+    "/I v:\Slowverb\wasm\phaselimiter\src_original\deps\bakuage\include\bakuage",
+    "/I $boostInclude",
+    "/I v:\Slowverb\wasm\phaselimiter\src_original\hnswlib-0.8.0",
+    "/I v:\Slowverb\wasm\phaselimiter\src_original\armadillo-15.2.3\include",
+    "/I v:\Slowverb\wasm\phaselimiter\src_original\eigen-master",
+    "/I v:\Slowverb\wasm\phaselimiter\src_original\prebuilt\win64\optim\header_only_version"
+)
+
+$libs = @(
+    "$boostLib\libboost_serialization-vc143-mt-s-x64-1_90.lib",
+    "$boostLib\libboost_filesystem-vc143-mt-s-x64-1_90.lib",
+    "$boostLib\libboost_iostreams-vc143-mt-s-x64-1_90.lib"
+)
+
+# The resource cache is written by the win64 phaselimiter, so the converter
+# reads it as x64 (hnswlib stores size_t fields in the embedded index).
+Write-Host "Compiling Native Win64 Flat Converter..."
+& $cl /nologo /O2 /MT /EHsc /std:c++17 $includePaths $srcs /Fe:$out /DBOOST_ALL_NO_LIB /DARMA_DONT_USE_WRAPPER $libs /link /MACHINE:X64
+
+if ($LASTEXITCODE -eq 0) {
+    Write-Host "Build complete: $out"
+    Write-Host "Running conversion..."
+    & $out "v:\Slowverb\wasm\phaselimiter\src_original\phaselimiter-win\phaselimiter\resource\sound_quality2_cache" "v:\Slowverb\wasm\phaselimiter\sound_quality2_cache.flat"
+}
+else {
+    Write-Host "Build FAILED"
+}
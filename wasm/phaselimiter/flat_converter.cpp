@@ -0,0 +1,67 @@
+#include "bakuage/sound_quality2.h"
+#include "bakuage/sound_quality2_flat.h"
+#include "gflags/gflags.h"
+#include <boost/archive/binary_iarchive.hpp>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+// Stubs for gflags used in bakuage
+DEFINE_string(sound_quality2_cache, "", "");
+DEFINE_string(mastering5_optimization_algorithm, "", "");
+DEFINE_int32(mastering5_optimization_max_eval_count, 0, "");
+DEFINE_double(mastering5_mastering_level, 0, "");
+DEFINE_string(mastering5_mastering_reference_file, "", "");
+
+// Converts the boost binary sound_quality2_cache into the flat format that
+// AutoMastering5 can mmap (or reference in place in the wasm build).
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cout << "Usage: flat_converter <input_bin> <output_flat>"
+              << std::endl;
+    return 1;
+  }
+  const char *input_path = argv[1];
+  const char *output_path = argv[2];
+
+  try {
+    bakuage::SoundQuality2Calculator calculator;
+    {
+      std::cout << "Loading binary cache from " << input_path << "..."
+                << std::endl;
+      std::ifstream ifs(input_path, std::ios::binary);
+      if (!ifs) {
+        std::cerr << "Failed to open input" << std::endl;
+        return 1;
+      }
+      boost::archive::binary_iarchive ia(ifs);
+      ia >> calculator;
+    }
+    std::vector<char> buffer;
+    bakuage::FlatSoundQuality2Writer::Write(calculator, &buffer);
+    {
+      std::cout << "Saving flat cache to " << output_path << "..."
+                << std::endl;
+      std::ofstream ofs(output_path, std::ios::binary);
+      if (!ofs) {
+        std::cerr << "Failed to open output" << std::endl;
+        return 1;
+      }
+      ofs.write(buffer.data(), buffer.size());
+    }
+    {
+      // verify that the written file can be referenced as is
+      const auto flat_calculator =
+          bakuage::LoadFlatSoundQuality2Calculator(output_path);
+      if (flat_calculator->band_count() != calculator.band_count()) {
+        std::cerr << "Verification failed" << std::endl;
+        return 1;
+      }
+    }
+    std::cout << "Success! (" << buffer.size() << " bytes)" << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << "Exception: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -13,6 +13,12 @@ DEFINE_int32(mastering3_iteration, 1000,
              "Mastering 3 optimization iteration count.");
 DEFINE_double(mastering3_target_sn, 12,
               "Target S/N in dB used for Acoustic entropy calculation.");
+DEFINE_int32(mastering3_chain_count, 4,
+             "Mastering 3 parallel tempering chain count (independent of "
+             "the thread count, so the result does not depend on it).");
+DEFINE_int32(mastering3_exchange_interval, 20,
+             "Mastering 3 iterations between parallel tempering state "
+             "exchanges.");
 
 // Mastering 5
 DEFINE_string(sound_quality2_cache, "./sound_quality2_cache",
@@ -37,6 +43,23 @@ DEFINE_double(pre_compression_threshold, 6.0,
               "Pre-compression threshold relative to loudness.");
 DEFINE_double(pre_compression_mean_sec, 0.2, "Pre-compression mean sec.");
 
+// Phase limiter (noise schedule of GradCalculator)
+DEFINE_string(noise_update_mode, "linear", "linear / adaptive");
+DEFINE_double(noise_update_min_noise, 1e-6, "min noise");
+DEFINE_double(noise_update_initial_noise, 1, "initial noise");
+DEFINE_double(noise_update_fista_enable_ratio, 1.0,
+              "the ratio of fista enable iteration.");
+DEFINE_double(limiter_convergence_eval_tolerance, 0,
+              "limiter early exit: relative eval improvement per iteration "
+              "(0: disabled).");
+DEFINE_double(limiter_convergence_peak_tolerance, 1e-4,
+              "limiter early exit: sample peak overshoot of the FISTA "
+              "iterate (not true peak).");
+DEFINE_double(limiter_inactive_tolerance, 1e-6,
+              "limiter (approximate): treat task groups whose input differs "
+              "from the source by at most this value as error free and skip "
+              "them (negative: disabled, exact).");
+
 // Other common flags if needed
 DEFINE_int32(worker_count, 0, "worker count (0: auto detect)");
 DEFINE_bool(erb_eval_func_weighting, false,
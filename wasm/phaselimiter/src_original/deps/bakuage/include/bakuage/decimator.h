@@ -4,10 +4,17 @@
 #include <algorithm>
 #include <vector>
 #include "bakuage/fir_design.h"
-#include "bakuage/fir_filter.h"
+#include "bakuage/interleaved_dot.h"
+#include "bakuage/memory.h"
 
 namespace bakuage {
 
+// Lowpass + keep every factor-th sample (output[m] = fir * input at m *
+// factor, causal, zero initial state).
+// Polyphase: only the retained outputs are computed, on the interleaved
+// samples directly (all channels in one pass). Process(input, frames, ...) can
+// be called chunk by chunk; the filter history and the decimation phase are
+// carried over, so the chunked output is identical to the one-shot output.
 template <typename Float>
 class Decimator {
 public:
@@ -39,6 +46,73 @@ public:
                                     alpha);
   }
 
+  int factor() const { return factor_; }
+  // lowpass fir (empty when factor <= 1)
+  const std::vector<Float> &fir() const { return lowpass_fir_; }
+
+  // upper bound of the output frames of Process(input, frames, ...)
+  int MaxOutputFrames(int frames) const {
+    return (frames + factor_ - 1) / factor_;
+  }
+
+  // Forget the stream history (next input frame is retained).
+  void Reset() {
+    channels_ = 0;
+    phase_ = 0;
+    history_.clear();
+  }
+
+  // Streaming. input: interleaved frames, output: interleaved, at least
+  // MaxOutputFrames(frames) frames. Returns the number of output frames.
+  // Changing channels starts a new stream.
+  int Process(const Float *input, int frames, int channels, Float *output) {
+    if (channels <= 0 || frames <= 0) {
+      return 0;
+    }
+    if (factor_ <= 1) {
+      TypedMemcpy(output, input, frames * channels);
+      return frames;
+    }
+    if (channels != channels_) {
+      Prepare(channels);
+    }
+
+    const int taps = lowpass_fir_.size();
+    const int history_frames = taps - 1;
+    const int n = taps * channels;
+
+    // windows that reach into the history: history_ + the head of input
+    const int head_frames = std::min(frames, history_frames);
+    head_.resize((history_frames + head_frames) * channels);
+    std::copy(history_.begin(), history_.end(), head_.begin());
+    std::copy(input, input + head_frames * channels,
+              head_.begin() + history_frames * channels);
+
+    int out_frames = 0;
+    int t = phase_;
+    for (; t < frames; t += factor_) {
+      // window = frames [t - history_frames, t]
+      const Float *window = t < history_frames
+                                ? head_.data() + t * channels
+                                : input + (t - history_frames) * channels;
+      InterleavedDot(window, expanded_fir_.data(), n, channels,
+                     output + out_frames * channels);
+      out_frames++;
+    }
+    phase_ = t - frames;
+
+    // keep the last history_frames frames
+    if (frames >= history_frames) {
+      std::copy(input + (frames - history_frames) * channels,
+                input + frames * channels, history_.begin());
+    } else {
+      std::copy(head_.begin() + frames * channels, head_.end(),
+                history_.begin());
+    }
+    return out_frames;
+  }
+
+  // One-shot (resets the stream). Returns frames / factor frames.
   std::vector<Float> Process(const std::vector<Float> &input, int channels) {
     if (factor_ <= 1) {
       return input;
@@ -53,28 +127,36 @@ public:
       return {};
     }
 
-    std::vector<Float> output(output_frames * channels);
-    for (int ch = 0; ch < channels; ch++) {
-      FirFilter<Float> filter(lowpass_fir_.begin(), lowpass_fir_.end());
-      int out_index = 0;
-      for (int i = 0; i < frames; i++) {
-        const Float y = filter.Clock(input[channels * i + ch]);
-        if (i % factor_ == 0) {
-          output[channels * out_index + ch] = y;
-          out_index++;
-          if (out_index >= output_frames) {
-            break;
-          }
-        }
-      }
-    }
-
+    Reset();
+    std::vector<Float> output(MaxOutputFrames(frames) * channels);
+    Process(input.data(), frames, channels, output.data());
+    output.resize(output_frames * channels);
+    Reset();
     return output;
   }
 
 private:
+  void Prepare(int channels) {
+    channels_ = channels;
+    phase_ = 0;
+    const int taps = lowpass_fir_.size();
+    history_.assign((taps - 1) * channels, 0);
+    // reversed (window is oldest first) and repeated for each channel
+    expanded_fir_.resize(taps * channels);
+    for (int j = 0; j < taps; j++) {
+      for (int c = 0; c < channels; c++) {
+        expanded_fir_[j * channels + c] = lowpass_fir_[taps - 1 - j];
+      }
+    }
+  }
+
   int factor_ = 1;
   std::vector<Float> lowpass_fir_;
+  int channels_ = 0;
+  int phase_ = 0; // input frames to skip before the next retained frame
+  std::vector<Float> expanded_fir_;
+  std::vector<Float> history_;
+  std::vector<Float> head_;
 };
 
 } // namespace bakuage
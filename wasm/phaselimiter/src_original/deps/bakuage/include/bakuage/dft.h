@@ -3,7 +3,9 @@
 
 #include <complex>
 #include <memory>
+#include <tuple>
 #include <unordered_map>
+#include <utility>
 
 // FFTWと互換性のあるFFTを、thread safeで、バックエンドに依存させずに使えるようにするためのもの
 // ライセンスとかを考えるとサーバーサイドの場合はFFTW or IPP、クライアントサイドはIPPなので、
@@ -11,6 +13,15 @@
 // 本当にスピードが重要な場合は使わない
 
 namespace bakuage {
+    namespace impl {
+        // mixed radix (2, 3, 4, 5, generic) Stockham FFT. dft.cppで定義
+        template <class Float>
+        class FftPlan;
+        // N/2 complex FFT + post twiddle (even N)
+        template <class Float>
+        class RealFftPlan;
+    }
+
     class FftMemoryBuffer {
     public:
         FftMemoryBuffer(int size = 0);
@@ -42,7 +53,7 @@ namespace bakuage {
         void Forward(const Float *input, Float *output);
         void Backward(const Float *input, Float *output);
     private:
-        const void *dft_ptr_;
+        std::shared_ptr<const impl::FftPlan<Float>> plan_;
         FftMemoryBuffer work_;
     };
     
@@ -56,7 +67,7 @@ namespace bakuage {
         void Forward(const Float *input, Float *output);
         void Backward(const Float *input, Float *output);
     private:
-        const void *dft_ptr_;
+        std::shared_ptr<const impl::FftPlan<Float>> plan_;
         FftMemoryBuffer work_;
     };
     
@@ -129,8 +140,7 @@ namespace bakuage {
         }
         size_t work_size() const;
     private:
-        const void *dft_ptr_;
-        const void *fft_ptr_;
+        std::shared_ptr<const impl::RealFftPlan<Float>> plan_;
         FftMemoryBuffer work_;
     };
     
@@ -167,8 +177,7 @@ namespace bakuage {
         }
         size_t work_size() const;
     private:
-        const void *dft_ptr_;
-        const void *fft_ptr_;
+        std::shared_ptr<const impl::RealFftPlan<Float>> plan_;
         FftMemoryBuffer work_;
     };
     
@@ -200,23 +209,22 @@ namespace bakuage {
             static thread_local ThreadLocalDftPool instance;
             return instance;
         }
+        // Dftはプロセス共有のplan(twiddle等)へのhandleとwork無しなので軽い。
+        // planの生成はdft.cppのregistryで一回だけ行われる
         Dft *Get(int len) {
             auto found = dfts_.find(len);
             if (found == dfts_.end()) {
-                dfts_.emplace(len, std::unique_ptr<Dft>(new Dft(len, true)));
-                Dft *result = dfts_[len].get();
-                work_->Reserve(result->work_size());
-                return result;
-            } else {
-                return found->second.get();
+                found = dfts_.emplace(std::piecewise_construct, std::forward_as_tuple(len), std::forward_as_tuple(len, true)).first;
+                work_->Reserve(found->second.work_size());
             }
+            return &found->second;
         }
         void *work() {
             return work_->work();
         }
     private:
         ThreadLocalDftWork *work_;
-        std::unordered_map<int, std::unique_ptr<Dft>> dfts_;
+        std::unordered_map<int, Dft> dfts_;
     };
 
 	static_assert(2 * sizeof(float) == sizeof(std::complex<float>), "2 * sizeof(float) == sizeof(std::complex<float>)");
@@ -1,6 +1,9 @@
 #ifndef BAKUAGE_BAKUAGE_DISSONANCE_H_
 #define BAKUAGE_BAKUAGE_DISSONANCE_H_
 
+#include <memory>
+#include "bakuage/shared_stft.h"
+
 namespace bakuage {
     // reference
     // https://pypi.org/project/dissonant/
@@ -8,6 +11,19 @@ namespace bakuage {
     // https://essentia.upf.edu/documentation/reference/streaming_Dissonance.html
     // amp^2 = energy
     double DissonancePairSethares1993(double hz1, double hz2, double amp1, double amp2);
+
+    // CalculateDissonanceのSharedStftのconsumer版
+    // STFT: 幅AnalysisStftWidth(sample_freq), シフト幅/2, 先頭-幅/2, hanning窓
+    class DissonanceCalculator {
+    public:
+        DissonanceCalculator(int width, int sample_freq, bool tbb_parallel = false);
+        ~DissonanceCalculator();
+        void Add(const SharedStftBatch &batch);
+        double dissonance() const;
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
     
     // mfccはenergy sum modeを想定している
     template <class Float>
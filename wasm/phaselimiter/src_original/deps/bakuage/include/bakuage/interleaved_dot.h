@@ -0,0 +1,86 @@
+#ifndef BAKUAGE_BAKUAGE_INTERLEAVED_DOT_H_
+#define BAKUAGE_BAKUAGE_INTERLEAVED_DOT_H_
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+namespace bakuage {
+
+// out[c] = sum_j x[j] * h[j] over n interleaved samples (j % channels == c).
+// Independent partial sums per lane so that the loop is vectorized.
+template <typename Float>
+inline void InterleavedDot(const Float *x, const Float *h, int n, int channels,
+                           Float *out) {
+  constexpr int kLanes = 8;
+  if (kLanes % channels != 0) {
+    for (int c = 0; c < channels; c++) {
+      Float sum = 0;
+      for (int j = c; j < n; j += channels) {
+        sum += x[j] * h[j];
+      }
+      out[c] = sum;
+    }
+    return;
+  }
+  Float acc[kLanes] = {0};
+  int j = 0;
+  for (; j + kLanes <= n; j += kLanes) {
+    for (int l = 0; l < kLanes; l++) {
+      acc[l] += x[j + l] * h[j + l];
+    }
+  }
+  for (int l = 0; j < n; j++, l++) {
+    acc[l] += x[j] * h[j];
+  }
+  for (int c = 0; c < channels; c++) {
+    Float sum = 0;
+    for (int l = c; l < kLanes; l += channels) {
+      sum += acc[l];
+    }
+    out[c] = sum;
+  }
+}
+
+#if defined(__wasm_simd128__)
+template <>
+inline void InterleavedDot<float>(const float *x, const float *h, int n,
+                                  int channels, float *out) {
+  if (4 % channels != 0) {
+    for (int c = 0; c < channels; c++) {
+      float sum = 0;
+      for (int j = c; j < n; j += channels) {
+        sum += x[j] * h[j];
+      }
+      out[c] = sum;
+    }
+    return;
+  }
+  v128_t acc0 = wasm_f32x4_splat(0);
+  v128_t acc1 = wasm_f32x4_splat(0);
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    acc0 = wasm_f32x4_add(acc0, wasm_f32x4_mul(wasm_v128_load(x + j),
+                                               wasm_v128_load(h + j)));
+    acc1 = wasm_f32x4_add(acc1, wasm_f32x4_mul(wasm_v128_load(x + j + 4),
+                                               wasm_v128_load(h + j + 4)));
+  }
+  alignas(16) float lanes[4];
+  wasm_v128_store(lanes, wasm_f32x4_add(acc0, acc1));
+  for (int l = 0; j < n; j++, l = (l + 1) & 3) {
+    lanes[l] += x[j] * h[j];
+  }
+  for (int c = 0; c < channels; c++) {
+    float sum = 0;
+    for (int l = c; l < 4; l += channels) {
+      sum += lanes[l];
+    }
+    out[c] = sum;
+  }
+}
+#endif
+
+
+} // namespace bakuage
+
+#endif
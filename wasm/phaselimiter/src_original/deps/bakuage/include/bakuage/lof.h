@@ -19,6 +19,8 @@ class access;
 } // namespace boost
 
 namespace bakuage {
+class FlatSoundQuality2Writer;
+
 // hnswによってファイルに書き込まれるのでpackedである必要があるし、なるべく小さいと良い
 // コードを見たが、LofPointはhnswに渡したあとは破棄して良い
 // しかもPODである必要がある
@@ -155,6 +157,7 @@ public:
   }
 #endif
 private:
+  friend class FlatSoundQuality2Writer;
   // for boost
   friend class boost::serialization::access;
   template <class Archive>
@@ -1,7 +1,11 @@
 #ifndef BAKUAGE_LOUDNESS_EBU_R128_H_
 #define BAKUAGE_LOUDNESS_EBU_R128_H_
 
+#include <memory>
 #include <vector>
+#include "bakuage/loudness_filter.h"
+#include "bakuage/memory.h"
+#include "bakuage/partitioned_convolution.h"
 
 namespace bakuage {
 namespace loudness_ebu_r128 {
@@ -11,6 +15,74 @@ namespace loudness_ebu_r128 {
 // http://jp.music-group.com/TCE/Tech/LRA.pdf
 // block_sec = 3, shift_sec = 2, relative_threshold_db = -20
 
+// 同じ入力から複数の(ブロック長, シフト, 閾値)の組(variant)のラウドネスを計算する。
+// 重み付けとブロックのエネルギーの計算は全variantで1回だけで、入力は少しずつ渡せる (Clock)。
+// フィルタ済みの波形は保持しないので、メモリはブロック数に比例する
+template <typename Float>
+class LoudnessAnalyzer {
+public:
+	enum Weighting {
+		kWeightingK, // BS.1770のK特性 (ステレオの1kHz正弦波で0になるように補正する)
+		kWeightingNone, // 重み付け済みの入力
+		kWeightingYoutube, // loudness_contours::HzToYoutubeWeightingに合わせた直線位相FIR (遅延は補償する)
+	};
+
+	struct Result {
+		Float loudness;
+		Float loudness_range;
+		Float max_loudness;
+		std::vector<int> histogram; // 140 bins, -70 <-> [-70, -69)
+		std::vector<Float> time_series;
+		int block_samples;
+	};
+
+	LoudnessAnalyzer(int channels, int sample_freq, Weighting weighting = kWeightingK);
+
+	// 最初のClockより前に呼ぶ。戻り値はresultのindex
+	int AddVariant(Float block_sec, Float shift_sec, Float absolute_threshold_db, Float relative_threshold_db);
+
+	// input[channels * i + ch] (0 <= i < frames)
+	void Clock(const Float *input, int frames);
+
+	// 入力の終わり。全variantのresultを計算する
+	void Finish();
+
+	const Result &result(int i) const { return results_[i]; }
+private:
+	struct Variant {
+		int width;
+		int shift;
+		Float absolute_threshold_db;
+		Float relative_threshold_db;
+	};
+
+	void Start();
+	void PushChunk();
+	void AccumulateEnergy(const Float *input, int frames, bool k_weighting);
+	// input: nullptrなら0
+	void ClockYoutube(const Float *input, int frames);
+
+	int channels_;
+	int sample_freq_;
+	Weighting weighting_;
+	std::vector<Variant> variants_;
+	std::vector<Result> results_;
+	std::vector<LoudnessFilter<double>> filters_;
+	std::vector<std::unique_ptr<PartitionedConvolver<Float>>> youtube_filters_;
+	int youtube_delay_;
+	int youtube_skip_; // まだ捨てていない遅延分
+	AlignedPodVector<Float> youtube_input_;
+	AlignedPodVector<Float> youtube_output_;
+	AlignedPodVector<Float> youtube_weighted_;
+	// 全variantのブロック長とシフトの最大公約数 (0: 未開始)
+	int chunk_;
+	int chunk_fill_;
+	double chunk_energy_;
+	int samples_;
+	// chunkごとの全チャンネルの二乗和
+	std::vector<double> chunk_energies_;
+};
+
 template <typename Float>
 void CalculateLoudnessCore(const Float *input, const int channels, const int samples, const int sample_freq,
 	const Float block_sec, const Float shift_sec, const Float absolute_threshold_db, const Float relative_threshold_db,
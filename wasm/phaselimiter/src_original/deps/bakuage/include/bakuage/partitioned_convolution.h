@@ -0,0 +1,302 @@
+#ifndef BAKUAGE_BAKUAGE_PARTITIONED_CONVOLUTION_H_
+#define BAKUAGE_BAKUAGE_PARTITIONED_CONVOLUTION_H_
+
+#include <algorithm>
+#include <complex>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include "bakuage/dft.h"
+#include "bakuage/memory.h"
+#include "bakuage/utils.h"
+#include "bakuage/vector_math.h"
+
+namespace bakuage {
+
+namespace partitioned_convolution_detail {
+
+// acc += x * y (complex, written out so that it vectorizes without the NaN
+// handling of std::complex multiplication)
+template <typename Float>
+inline void ComplexMadInplace(const std::complex<Float> *x,
+                              const std::complex<Float> *y,
+                              std::complex<Float> *acc, int n) {
+  const Float *a = (const Float *)x;
+  const Float *b = (const Float *)y;
+  Float *c = (Float *)acc;
+  for (int i = 0; i < n; i++) {
+    const Float re = a[2 * i] * b[2 * i] - a[2 * i + 1] * b[2 * i + 1];
+    const Float im = a[2 * i] * b[2 * i + 1] + a[2 * i + 1] * b[2 * i];
+    c[2 * i] += re;
+    c[2 * i + 1] += im;
+  }
+}
+
+} // namespace partitioned_convolution_detail
+
+// Uniformly partitioned convolution in the frequency domain (overlap-save).
+// The fir is split into partitions of block_size taps. Their spectra (FFT size
+// 2 * block_size) are computed once and shared (immutable) between filter
+// instances and threads. The FFT size, the latency of a block and the working
+// set depend only on block_size; the fir length only sets how many spectra are
+// multiplied and accumulated per block.
+
+// spectra of the partitions of a fir (normalization of the inverse FFT
+// included)
+template <typename Float>
+class PartitionedFirSpectrum {
+public:
+  static constexpr int kMinDefaultBlockSize = 256;
+  static constexpr int kMaxDefaultBlockSize = 16384;
+
+  // block_size: 2^x, 0: DefaultBlockSize(fir size)
+  template <typename Iterator>
+  PartitionedFirSpectrum(Iterator bg, Iterator ed, int block_size = 0)
+      : fir_size_(std::distance(bg, ed)),
+        block_size_(block_size > 0 ? block_size
+                                   : DefaultBlockSize(fir_size_)),
+        partition_count_(
+            std::max(1, (fir_size_ + block_size_ - 1) / block_size_)),
+        spec_len_(block_size_ + 1), spectra_(partition_count_ * spec_len_) {
+    if (block_size_ != static_cast<int>(CeilPowerOf2(block_size_))) {
+      throw std::logic_error("PartitionedFirSpectrum: block_size must be 2^x");
+    }
+    // computed in double like FirFilter2
+    const int fft_len = 2 * block_size_;
+    RealDft<double> dft(fft_len);
+    AlignedPodVector<double> work(fft_len);
+    AlignedPodVector<std::complex<double>> spec(spec_len_);
+    const double scale = 1.0 / fft_len;
+    Iterator it = bg;
+    for (int p = 0; p < partition_count_; p++) {
+      TypedFillZero(work.data(), fft_len);
+      for (int i = 0; i < block_size_ && it != ed; i++, ++it) {
+        work[i] = *it;
+      }
+      dft.Forward(work.data(), (double *)spec.data());
+      for (int i = 0; i < spec_len_; i++) {
+        spectra_[p * spec_len_ + i] = std::complex<Float>(spec[i] * scale);
+      }
+    }
+  }
+
+  // about 4 partitions, at most kMaxDefaultBlockSize (longer firs get more
+  // partitions instead of larger FFTs)
+  static int DefaultBlockSize(int fir_size) {
+    return std::max<int>(
+        kMinDefaultBlockSize,
+        std::min<int>(kMaxDefaultBlockSize,
+                      CeilPowerOf2(std::max(1, fir_size)) / 4));
+  }
+
+  int fir_size() const { return fir_size_; }
+  int block_size() const { return block_size_; }
+  int partition_count() const { return partition_count_; }
+  // block_size + 1
+  int spec_len() const { return spec_len_; }
+  const std::complex<Float> *partition(int p) const {
+    return &spectra_[p * spec_len_];
+  }
+
+private:
+  int fir_size_;
+  int block_size_;
+  int partition_count_;
+  int spec_len_;
+  AlignedPodVector<std::complex<Float>> spectra_;
+};
+
+// Inverse transform of an accumulated output spectrum to the block_size output
+// samples. Separate from the delay line so that several outputs (e.g. the bands
+// of a filterbank) can be synthesized in parallel from one delay line.
+template <typename Float>
+class PartitionedOutputTransform {
+public:
+  explicit PartitionedOutputTransform(int block_size)
+      : block_size_(block_size), dft_(2 * block_size), frame_(2 * block_size) {}
+
+  // time samples (frame [block_size, 2 * block_size)) of the output spectrum
+  // (spec is destroyed)
+  void Backward(std::complex<Float> *spec, Float *output) {
+    dft_.Backward((Float *)spec, frame_.data());
+    TypedMemcpy(output, frame_.data() + block_size_, block_size_);
+  }
+
+private:
+  int block_size_;
+  RealDft<Float> dft_;
+  AlignedPodVector<Float> frame_;
+};
+
+// Frequency domain delay line: the spectra of [previous block | block] of the
+// last partition_count input blocks.
+template <typename Float>
+class PartitionedInputSpectra {
+public:
+  PartitionedInputSpectra(int block_size, int partition_count)
+      : block_size_(block_size), partition_count_(partition_count),
+        spec_len_(block_size + 1), newest_(0), dft_(2 * block_size),
+        frame_(2 * block_size), previous_(block_size),
+        spectra_(partition_count * spec_len_), output_transform_(block_size) {}
+
+  int block_size() const { return block_size_; }
+  int partition_count() const { return partition_count_; }
+
+  void Clear() {
+    TypedFillZero(previous_.data(), previous_.size());
+    TypedFillZero(spectra_.data(), spectra_.size());
+    newest_ = 0;
+  }
+
+  // spectrum of [last pushed block | input[stride * i] (i < frames) | 0]
+  // without pushing (frames <= block_size)
+  void Transform(const Float *input, int frames, int stride,
+                 std::complex<Float> *spec) {
+    TypedMemcpy(frame_.data(), previous_.data(), block_size_);
+    Float *block = frame_.data() + block_size_;
+    for (int i = 0; i < frames; i++) {
+      block[i] = input[stride * i];
+    }
+    TypedFillZero(block + frames, block_size_ - frames);
+    dft_.Forward(frame_.data(), (Float *)spec);
+  }
+
+  // Pushes a full block (input[stride * i], i < block_size) and returns its
+  // spectrum (X(0) below).
+  const std::complex<Float> *Push(const Float *input, int stride = 1) {
+    newest_ = (newest_ + partition_count_ - 1) % partition_count_;
+    std::complex<Float> *spec = &spectra_[newest_ * spec_len_];
+    Transform(input, block_size_, stride, spec);
+    TypedMemcpy(previous_.data(), frame_.data() + block_size_, block_size_);
+    return spec;
+  }
+
+  // acc += sum_{p >= first_partition} fir.partition(p) * X(p - first_partition)
+  // X(k): the spectrum pushed k blocks ago (X(0): the newest)
+  // After Push of block j, first_partition 0 gives the output spectrum of block
+  // j, first_partition 1 the part of block j + 1 that does not depend on it.
+  void MultiplyAccumulate(const PartitionedFirSpectrum<Float> &fir,
+                          int first_partition,
+                          std::complex<Float> *acc) const {
+    const int end = std::min(fir.partition_count(),
+                             first_partition + partition_count_);
+    for (int p = first_partition; p < end; p++) {
+      const int k = (newest_ + p - first_partition) % partition_count_;
+      partitioned_convolution_detail::ComplexMadInplace(
+          fir.partition(p), &spectra_[k * spec_len_], acc, spec_len_);
+    }
+  }
+
+  // PartitionedOutputTransform::Backward
+  void Backward(std::complex<Float> *spec, Float *output) {
+    output_transform_.Backward(spec, output);
+  }
+
+private:
+  int block_size_;
+  int partition_count_;
+  int spec_len_;
+  int newest_;
+  RealDft<Float> dft_;
+  AlignedPodVector<Float> frame_;
+  AlignedPodVector<Float> previous_;
+  AlignedPodVector<std::complex<Float>> spectra_;
+  PartitionedOutputTransform<Float> output_transform_;
+};
+
+// Streaming fir filter on top of a shared PartitionedFirSpectrum. Same result
+// as FirFilter2 (output[i] = sum_k fir[k] * input[i - k] over the whole stream,
+// no latency) for any chunk size; a partial block is completed with zeros and
+// recomputed when the rest arrives.
+template <typename Float>
+class PartitionedConvolver {
+public:
+  explicit PartitionedConvolver(
+      std::shared_ptr<const PartitionedFirSpectrum<Float>> fir)
+      : fir_(std::move(fir)),
+        input_(fir_->block_size(), fir_->partition_count()),
+        block_(fir_->block_size()), partial_spec_(fir_->spec_len()),
+        spec_(fir_->spec_len()), tail_spec_(fir_->spec_len()),
+        output_(fir_->block_size()), fill_(0) {}
+
+  int fir_size() const { return fir_->fir_size(); }
+
+  // clear state
+  void Clear() {
+    input_.Clear();
+    TypedFillZero(tail_spec_.data(), tail_spec_.size());
+    fill_ = 0;
+  }
+
+  void Clock(const Float *bg, const Float *ed, Float *output) {
+    const int block_size = fir_->block_size();
+    const int spec_len = fir_->spec_len();
+    const std::complex<Float> *h = fir_->partition(0);
+    while (bg < ed) {
+      const int n = std::min<int>(block_size - fill_, ed - bg);
+      TypedMemcpy(block_.data() + fill_, bg, n);
+      const int end = fill_ + n;
+      const std::complex<Float> *x;
+      if (end == block_size) {
+        x = input_.Push(block_.data());
+      } else {
+        input_.Transform(block_.data(), end, 1, partial_spec_.data());
+        x = partial_spec_.data();
+      }
+      TypedMemcpy(spec_.data(), tail_spec_.data(), spec_len);
+      partitioned_convolution_detail::ComplexMadInplace(h, x, spec_.data(),
+                                                         spec_len);
+      input_.Backward(spec_.data(), output_.data());
+      TypedMemcpy(output, output_.data() + fill_, n);
+
+      if (end == block_size) {
+        TypedFillZero(tail_spec_.data(), tail_spec_.size());
+        input_.MultiplyAccumulate(*fir_, 1, tail_spec_.data());
+        fill_ = 0;
+      } else {
+        fill_ = end;
+      }
+      bg += n;
+      output += n;
+    }
+  }
+
+  // Filters a whole signal (input[stride * i], i < frames) from the cleared
+  // state with the delay compensated:
+  // output[out_stride * i] = sum_k fir[k] * input[i + delay - k]
+  // (input is 0 outside [0, frames)). output may be input (in place).
+  void ProcessCompensated(const Float *input, int stride, int frames,
+                          int delay, Float *output, int out_stride) {
+    Clear();
+    const int chunk = fir_->block_size();
+    AlignedPodVector<Float> in(chunk);
+    AlignedPodVector<Float> out(chunk);
+    for (int bg = 0; bg < frames + delay; bg += chunk) {
+      const int n = std::min(chunk, frames + delay - bg);
+      const int read = std::max(0, std::min(n, frames - bg));
+      for (int i = 0; i < read; i++) {
+        in[i] = input[stride * (bg + i)];
+      }
+      TypedFillZero(in.data() + read, n - read);
+      Clock(in.data(), in.data() + n, out.data());
+      // output position bg + i - delay <= bg + i has been read already
+      for (int i = std::max(0, delay - bg); i < n; i++) {
+        output[out_stride * (bg + i - delay)] = out[i];
+      }
+    }
+  }
+
+private:
+  std::shared_ptr<const PartitionedFirSpectrum<Float>> fir_;
+  PartitionedInputSpectra<Float> input_;
+  AlignedPodVector<Float> block_;
+  AlignedPodVector<std::complex<Float>> partial_spec_;
+  AlignedPodVector<std::complex<Float>> spec_;
+  AlignedPodVector<std::complex<Float>> tail_spec_; // from the pushed blocks
+  AlignedPodVector<Float> output_;
+  int fill_;
+};
+
+} // namespace bakuage
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef BAKUAGE_BAKUAGE_POLYPHASE_RESAMPLER_H_
+#define BAKUAGE_BAKUAGE_POLYPHASE_RESAMPLER_H_
+
+#include <algorithm>
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "bakuage/dft.h"
+#include "bakuage/fir_design.h"
+#include "bakuage/interleaved_dot.h"
+#include "bakuage/memory.h"
+#include "bakuage/partitioned_convolution.h"
+#include "bakuage/utils.h"
+
+namespace bakuage {
+
+// Polyphase resamplers. The prototype fir runs at the upsampled rate
+// (input rate * factor); only the outputs that are kept are computed and the
+// zero-stuffed samples are never multiplied. All of them process interleaved
+// frames chunk by chunk with the filter state carried over and start from a
+// zero state. The output is the causal convolution (delay: (fir size - 1) / 2
+// at the upsampled rate), the caller compensates it.
+
+namespace polyphase_detail {
+
+// partitioned spectra of the polyphase components fir[factor * k + p] * scale
+template <typename Float>
+std::vector<std::shared_ptr<const PartitionedFirSpectrum<Float>>>
+PhaseSpectra(const std::vector<double> &fir, int factor, double scale) {
+  const int phase_len = (fir.size() + factor - 1) / factor;
+  // Offline use: as few partitions as possible (the oversampling firs have
+  // about 20000 taps per phase -> one partition), the FFT size still bounded.
+  const int block_size = std::min<int>(
+      2 * PartitionedFirSpectrum<Float>::kMaxDefaultBlockSize,
+      CeilPowerOf2(std::max(1, phase_len)));
+  std::vector<std::shared_ptr<const PartitionedFirSpectrum<Float>>> result;
+  std::vector<double> phase_fir(phase_len);
+  for (int p = 0; p < factor; p++) {
+    for (int k = 0; k < phase_len; k++) {
+      const int t = factor * k + p;
+      phase_fir[k] = t < (int)fir.size() ? scale * fir[t] : 0;
+    }
+    result.push_back(std::make_shared<const PartitionedFirSpectrum<Float>>(
+        phase_fir.begin(), phase_fir.end(), block_size));
+  }
+  return result;
+}
+
+} // namespace polyphase_detail
+
+// Integer upsampler for long (sharp) firs. Every phase is a partitioned
+// convolution at the input rate, sharing the input spectra of the block.
+// output[factor * m + p] = factor * sum_k fir[factor * k + p] * input[m - k]
+template <typename Float>
+class PolyphaseFftUpsampler {
+public:
+  PolyphaseFftUpsampler(int factor, int channels, const std::vector<double> &fir)
+      : factor_(factor), channels_(channels),
+        phase_firs_(polyphase_detail::PhaseSpectra<Float>(fir, factor, factor)),
+        block_frames_(phase_firs_[0]->block_size()),
+        spec_(phase_firs_[0]->spec_len()), work_(block_frames_) {
+    for (int ch = 0; ch < channels; ch++) {
+      inputs_.emplace_back(block_frames_, phase_firs_[0]->partition_count());
+    }
+  }
+
+  int factor() const { return factor_; }
+  // input frames of ProcessBlock (output: block_frames() * factor())
+  int block_frames() const { return block_frames_; }
+
+  void Clear() {
+    for (auto &input : inputs_) {
+      input.Clear();
+    }
+  }
+
+  void ProcessBlock(const Float *input, Float *output) {
+    for (int ch = 0; ch < channels_; ch++) {
+      inputs_[ch].Push(input + ch, channels_);
+      for (int p = 0; p < factor_; p++) {
+        TypedFillZero(spec_.data(), spec_.size());
+        inputs_[ch].MultiplyAccumulate(*phase_firs_[p], 0, spec_.data());
+        inputs_[ch].Backward(spec_.data(), work_.data());
+        for (int i = 0; i < block_frames_; i++) {
+          output[channels_ * (factor_ * i + p) + ch] = work_[i];
+        }
+      }
+    }
+  }
+
+private:
+  int factor_;
+  int channels_;
+  std::vector<std::shared_ptr<const PartitionedFirSpectrum<Float>>> phase_firs_;
+  int block_frames_;
+  std::vector<PartitionedInputSpectra<Float>> inputs_; // per channel
+  AlignedPodVector<std::complex<Float>> spec_;
+  AlignedPodVector<Float> work_;
+};
+
+// Integer downsampler for long (sharp) firs. The polyphase components of the
+// input are convolved at the output rate, the spectra are summed and only one
+// inverse FFT per block is needed.
+// output[m] = sum_t fir[t] * input[factor * m + factor - 1 - t]
+template <typename Float>
+class PolyphaseFftDownsampler {
+public:
+  PolyphaseFftDownsampler(int factor, int channels,
+                          const std::vector<double> &fir)
+      : factor_(factor), channels_(channels),
+        phase_firs_(polyphase_detail::PhaseSpectra<Float>(fir, factor, 1)),
+        block_frames_(phase_firs_[0]->block_size()),
+        spec_(phase_firs_[0]->spec_len()), work_(block_frames_) {
+    for (int i = 0; i < channels * factor; i++) {
+      inputs_.emplace_back(block_frames_, phase_firs_[0]->partition_count());
+    }
+  }
+
+  int factor() const { return factor_; }
+  // output frames of ProcessBlock (input: block_frames() * factor())
+  int block_frames() const { return block_frames_; }
+
+  void Clear() {
+    for (auto &input : inputs_) {
+      input.Clear();
+    }
+  }
+
+  void ProcessBlock(const Float *input, Float *output) {
+    for (int ch = 0; ch < channels_; ch++) {
+      TypedFillZero(spec_.data(), spec_.size());
+      for (int p = 0; p < factor_; p++) {
+        auto &phase_input = inputs_[ch * factor_ + p];
+        phase_input.Push(input + channels_ * (factor_ - 1 - p) + ch,
+                         channels_ * factor_);
+        phase_input.MultiplyAccumulate(*phase_firs_[p], 0, spec_.data());
+      }
+      // one inverse FFT (any of the delay lines, they share the FFT size)
+      inputs_[ch * factor_].Backward(spec_.data(), work_.data());
+      for (int i = 0; i < block_frames_; i++) {
+        output[channels_ * i + ch] = work_[i];
+      }
+    }
+  }
+
+private:
+  int factor_;
+  int channels_;
+  std::vector<std::shared_ptr<const PartitionedFirSpectrum<Float>>> phase_firs_;
+  int block_frames_;
+  std::vector<PartitionedInputSpectra<Float>> inputs_; // per channel and phase
+  AlignedPodVector<std::complex<Float>> spec_;
+  AlignedPodVector<Float> work_;
+};
+
+// Rational L / M resampler (e.g. 44100 <-> 48000: 160 / 147) in direct form,
+// for firs that are short per phase. Each output is one inner product of the
+// reversed phase fir with the interleaved input window.
+// output[j] = up * sum_i fir[j * down + offset - i * up] * input[i]
+template <typename Float>
+class PolyphaseResampler {
+public:
+  // offset: output 0 is at upsampled position offset (e.g. (fir size - 1) / 2
+  // to compensate the delay)
+  PolyphaseResampler(int up, int down, int channels,
+                     const std::vector<double> &fir, int offset = 0)
+      : up_(up), down_(down), channels_(channels),
+        phase_len_((fir.size() + up - 1) / up),
+        history_(channels * (phase_len_ - 1)) {
+    // phase p, window frame t (oldest first) -> fir[p + up * (phase_len - 1 - t)]
+    phase_firs_.resize(up_ * phase_len_ * channels_);
+    for (int p = 0; p < up_; p++) {
+      for (int t = 0; t < phase_len_; t++) {
+        const int k = p + up_ * (phase_len_ - 1 - t);
+        const Float h = k < (int)fir.size() ? up_ * fir[k] : 0;
+        for (int ch = 0; ch < channels_; ch++) {
+          phase_firs_[(p * phase_len_ + t) * channels_ + ch] = h;
+        }
+      }
+    }
+    Clear(offset);
+  }
+
+  // Firs for resampling from input_sample_rate to output_sample_rate.
+  // stopband_reduce_db at and above the lower Nyquist frequency,
+  // transition_hz below it.
+  static void CalcFactors(int input_sample_rate, int output_sample_rate,
+                          int *up, int *down) {
+    const int64_t l = lcm(input_sample_rate, output_sample_rate);
+    *up = l / input_sample_rate;
+    *down = l / output_sample_rate;
+  }
+  static std::vector<double> DesignFir(int input_sample_rate,
+                                       int output_sample_rate,
+                                       double stopband_reduce_db,
+                                       double transition_hz) {
+    const double l = lcm(input_sample_rate, output_sample_rate);
+    const double nyquist =
+        0.5 * std::min(input_sample_rate, output_sample_rate);
+    int filter_len;
+    double alpha;
+    CalcKeiserFirParams(stopband_reduce_db, transition_hz / l, &filter_len,
+                        &alpha);
+    return CalculateBandPassFir<double>(
+        0, (nyquist - 0.5 * transition_hz) / l, filter_len, alpha);
+  }
+
+  void Clear(int offset = 0) {
+    TypedFillZero(history_.data(), history_.size());
+    position_ = offset;
+  }
+
+  // upper bound of the output frames of Process(input, frames, ...)
+  int MaxOutputFrames(int frames) const {
+    return ((int64_t)frames * up_ + position_) / down_ + 1;
+  }
+
+  // Returns the number of output frames.
+  int Process(const Float *input, int frames, Float *output) {
+    const int history_frames = phase_len_ - 1;
+    const int n = phase_len_ * channels_;
+    const int head_frames = std::min(frames, history_frames);
+    head_.resize((history_frames + head_frames) * channels_);
+    std::copy(history_.begin(), history_.end(), head_.begin());
+    std::copy(input, input + head_frames * channels_,
+              head_.begin() + history_frames * channels_);
+
+    // position_: next output in upsampled samples from input frame 0
+    int out_frames = 0;
+    int64_t position = position_;
+    const int64_t end = (int64_t)frames * up_;
+    for (; position < end; position += down_) {
+      const int t = position / up_; // latest input frame of the window
+      const int p = position - (int64_t)t * up_;
+      const Float *window = t < history_frames
+                                ? head_.data() + t * channels_
+                                : input + (t - history_frames) * channels_;
+      InterleavedDot(window, &phase_firs_[p * n], n, channels_,
+                     output + out_frames * channels_);
+      out_frames++;
+    }
+    position_ = position - end;
+
+    if (frames >= history_frames) {
+      std::copy(input + (frames - history_frames) * channels_,
+                input + frames * channels_, history_.begin());
+    } else {
+      std::copy(head_.begin() + frames * channels_, head_.end(),
+                history_.begin());
+    }
+    return out_frames;
+  }
+
+private:
+  int up_;
+  int down_;
+  int channels_;
+  int phase_len_;
+  int64_t position_;
+  AlignedPodVector<Float> phase_firs_;
+  AlignedPodVector<Float> history_;
+  AlignedPodVector<Float> head_;
+};
+
+} // namespace bakuage
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef BAKUAGE_BAKUAGE_SHARED_STFT_H_
+#define BAKUAGE_BAKUAGE_SHARED_STFT_H_
+
+#include <algorithm>
+#include <complex>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "tbb/tbb.h"
+#include "bakuage/dft.h"
+#include "bakuage/memory.h"
+#include "bakuage/utils.h"
+
+namespace bakuage {
+    // 解析ごとに同じSTFTを計算し直さないように、
+    // 同じ(窓幅, シフト, 窓関数, 前処理済みの入力)のSTFTを一回だけ計算して
+    // 複数の解析(consumer)に流す。
+    // フレームはバッチ単位で計算して(FFTは並列)、
+    // 各consumerにはバッチをフレーム順に渡す。
+    // consumerどうしは同じバッチを並列に読むので、consumer間で状態を共有しないこと
+    // (consumer内は逐次に呼ばれる)。
+    // メモリはバッチ分だけ (曲の長さに依存しない)
+
+    // 解析 (dissonance, bandwidth, single modeのmfcc, nmf spectrogram) で共有するSTFTの幅
+    // 0.372 sec, 4x only。192kHzでもオーバーフローしないようにint64で計算する
+    // 44100Hz以外ではFFTが速い長さ (2^a 3^b 5^c) に丸める (Mastering3StftWidthと同じ)
+    inline int AnalysisStftWidth(int sample_freq) {
+        const int shift_resolution = 2;
+        return RoundToSmoothNumber(static_cast<int>(16384LL * sample_freq / 44100), shift_resolution);
+    }
+
+    // 連続するフレームのスペクトル (窓はSharedStftのもの。FFTの正規化はしない)
+    class SharedStftBatch {
+    public:
+        SharedStftBatch(int channels, int width, int max_frame_count):
+        channels_(channels), width_(width), spec_len_(width / 2 + 1), frame_count_(0),
+        pos_(max_frame_count), spectra_(max_frame_count * channels * spec_len_) {}
+
+        int channels() const { return channels_; }
+        int width() const { return width_; }
+        int spec_len() const { return spec_len_; }
+        int frame_count() const { return frame_count_; }
+        // フレーム先頭のサンプル位置
+        int pos(int i) const { return pos_[i]; }
+        // 長さspec_len
+        const std::complex<float> *spectrum(int i, int ch) const {
+            return &spectra_[(i * channels_ + ch) * spec_len_];
+        }
+    private:
+        template <class Float> friend class SharedStft;
+        int channels_;
+        int width_;
+        int spec_len_;
+        int frame_count_;
+        std::vector<int> pos_;
+        AlignedPodVector<std::complex<float>> spectra_;
+    };
+
+    template <class Float>
+    class SharedStft {
+    public:
+        typedef std::function<void (const SharedStftBatch &)> Consumer;
+
+        // フレーム先頭位置は start_pos, start_pos + shift, ... (samples未満)
+        // window: 長さwidth
+        SharedStft(int width, int shift, int start_pos, const std::vector<float> &window, int batch_frames = 16):
+        width_(width), shift_(shift), start_pos_(start_pos), batch_frames_(batch_frames),
+        window_(window.begin(), window.end()) {}
+
+        void AddConsumer(const Consumer &consumer) {
+            consumers_.push_back(consumer);
+        }
+
+        // input[channels * k + ch] (0 <= k < samplesの外は0) に窓をかけてFFTする
+        void Run(const Float *input, int channels, int samples, bool tbb_parallel = true) {
+            SharedStftBatch batch(channels, width_, batch_frames_);
+            int pos = start_pos_;
+            while (pos < samples) {
+                batch.frame_count_ = 0;
+                while (batch.frame_count_ < batch_frames_ && pos < samples) {
+                    batch.pos_[batch.frame_count_++] = pos;
+                    pos += shift_;
+                }
+
+                const auto fft_func = [this, &batch, input, channels, samples](int k) {
+                    const int i = k / channels;
+                    const int ch = k % channels;
+                    auto &pool = ThreadLocalDftPool<RealDft<float>>::GetThreadInstance();
+                    const auto dft = pool.Get(width_);
+                    AlignedPodVector<float> &fft_input = ThreadLocalFftInput(width_);
+                    const int frame_pos = batch.pos_[i];
+                    for (int j = 0; j < width_; j++) {
+                        const int t = frame_pos + j;
+                        fft_input[j] = (0 <= t && t < samples) ? input[channels * t + ch] * window_[j] : 0;
+                    }
+                    dft->Forward(fft_input.data(), (float *)&batch.spectra_[(i * channels + ch) * batch.spec_len_], pool.work());
+                };
+                const int fft_count = batch.frame_count_ * channels;
+                if (tbb_parallel) {
+                    tbb::parallel_for(0, fft_count, fft_func);
+                    tbb::parallel_for(0, (int)consumers_.size(), [this, &batch](int i) {
+                        consumers_[i](batch);
+                    });
+                } else {
+                    for (int k = 0; k < fft_count; k++) {
+                        fft_func(k);
+                    }
+                    for (const auto &consumer: consumers_) {
+                        consumer(batch);
+                    }
+                }
+            }
+        }
+    private:
+        static AlignedPodVector<float> &ThreadLocalFftInput(int width) {
+            static thread_local AlignedPodVector<float> fft_input;
+            if (fft_input.size() < static_cast<size_t>(width)) {
+                fft_input.resize(width);
+            }
+            return fft_input;
+        }
+
+        int width_;
+        int shift_;
+        int start_pos_;
+        int batch_frames_;
+        AlignedPodVector<float> window_;
+        std::vector<Consumer> consumers_;
+    };
+}
+
+#endif /* BAKUAGE_BAKUAGE_SHARED_STFT_H_ */
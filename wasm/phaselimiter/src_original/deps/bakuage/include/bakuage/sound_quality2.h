@@ -100,6 +100,7 @@ struct MasteringReference2 {
   }
   int vec_size() const { return vec_.size(); }
   float *vec() { return vec_.data(); }
+  const float *vec() const { return vec_.data(); }
 
 #ifdef BA_SOUND_QUALITY2_KL
   Eigen::VectorXf mean_;
@@ -362,6 +363,7 @@ public:
   const Band *bands() const { return bands_.data(); }
 
 private:
+  friend class FlatSoundQuality2Writer;
   friend class boost::serialization::access;
   template <class Archive>
   void serialize(Archive &ar, const unsigned int version) {
@@ -543,6 +545,7 @@ public:
   }
 
 private:
+  friend class FlatSoundQuality2Writer;
   friend class boost::serialization::access;
   template <class Archive>
   void serialize(Archive &ar, const unsigned int version) {
@@ -0,0 +1,205 @@
+#ifndef bakuage_sound_quality2_flat_h
+#define bakuage_sound_quality2_flat_h
+
+#include <Eigen/Dense>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bakuage/sound_quality2.h"
+
+#if defined(BA_SOUND_QUALITY2_KL) || defined(BA_SOUND_QUALITY2_MEAN_COV_DIAG_ONLY)
+#error "sound_quality2_flat supports the default SoundQuality2 preprocessing only"
+#endif
+
+namespace bakuage {
+// sound_quality2_cache のフラットなバイナリ形式 (little endian)
+// boost::serialization と違いパースが不要で、mmapしたファイルや
+// WASMでpreloadしたバッファをそのまま参照して使える (コピーもtemp fileも無し)
+//
+// FileHeader のあとに Section が並ぶ。各 Section は SectionHeader +
+// count * element_size バイトのpayloadで、payloadは kAlignment
+// 境界に揃える。 Section の並び (version 1):
+//   calculator の sorted_reference_lofs (f32)
+//   unit (full, mean only) ごとに
+//     unit info (i32 x kUnitInfoSize), bands (f32 x 2), sorted_reference_lofs,
+//     standard scaler shifts, scales (f32), pca_mat (f64, column major),
+//     LOF points (f32, point_count x vec_size), kds, lrds (f32),
+//     HNSW level0 links (u32, point_count x (maxM0 + 1), 先頭はリンク数),
+//     HNSW point data (u32, LofPoint), HNSW labels (u32),
+//     HNSW upper link offsets (u32, point_count + 1),
+//     HNSW upper links (u32, level 1 から順に (maxM + 1) ずつ)
+namespace sound_quality2_flat {
+static const char kMagic[8] = {'B', 'K', 'S', 'Q', '2', 'F', 'L', 'T'};
+static const uint32_t kVersion = 1;
+static const size_t kAlignment = 16;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  uint64_t file_size;
+};
+
+struct SectionHeader {
+  uint32_t type;
+  uint32_t element_size;
+  uint64_t count;
+};
+
+enum SectionType {
+  kSectionSortedLofs = 1,
+  kSectionUnitInfo,
+  kSectionBands,
+  kSectionUnitSortedLofs,
+  kSectionScalerShifts,
+  kSectionScalerScales,
+  kSectionPcaMat,
+  kSectionPoints,
+  kSectionKds,
+  kSectionLrds,
+  kSectionLevel0Links,
+  kSectionPointData,
+  kSectionLabels,
+  kSectionUpperLinkOffsets,
+  kSectionUpperLinks,
+};
+
+enum UnitInfoIndex {
+  kUnitInfoMode,
+  kUnitInfoBandCount,
+  kUnitInfoVecSize,
+  kUnitInfoPointCount,
+  kUnitInfoLofK,
+  kUnitInfoMaxLevel,
+  kUnitInfoEnterpoint,
+  kUnitInfoMaxM0,
+  kUnitInfoMaxM,
+  kUnitInfoEf,
+  kUnitInfoSize,
+};
+} // namespace sound_quality2_flat
+
+// SoundQuality2Calculator をフラット形式に書き出す
+class FlatSoundQuality2Writer {
+public:
+  static void Write(const SoundQuality2Calculator &calculator,
+                    std::vector<char> *output);
+};
+
+// フラット形式を参照する読み取り専用の SoundQuality2Calculator
+// 結果は元の SoundQuality2Calculator とビット単位で一致する
+// (HNSWの探索も hnswlib の searchKnn と同じ順序で行う)
+// データは owner が生きている間だけ参照される
+class FlatSoundQuality2Calculator {
+public:
+  typedef SoundQuality2CalculatorUnit::Band Band;
+
+  // 不正なデータなら std::runtime_error
+  FlatSoundQuality2Calculator(std::shared_ptr<const void> owner,
+                              const void *data, size_t size);
+
+  double CalculateDistance(const MasteringReference2 &reference,
+                           const MasteringReference2 &target) const;
+
+  void CalculateSoundQuality(const MasteringReference2 &reference,
+                             float *output_sound_quality,
+                             float *output_lof) const;
+
+  void CalculateSoundQuality(const Eigen::VectorXd &mean,
+                             const Eigen::MatrixXd &covariance,
+                             float *output_sound_quality,
+                             float *output_lof) const {
+    MasteringReference2 reference(mean, covariance);
+    CalculateSoundQuality(reference, output_sound_quality, output_lof);
+  }
+
+  // references[0, count) をまとめて計算する (Level5の最適化の候補など)。
+  // 結果は1つずつ CalculateSoundQuality した場合とビット単位で一致する
+  // output_sound_quality, output_lof: 長さcount (nullptr可)
+  void CalculateSoundQuality(const MasteringReference2 *references, int count,
+                             float *output_sound_quality,
+                             float *output_lof) const;
+
+  int band_count() const { return units_[0].band_count; }
+  const Band *bands() const { return units_[0].bands; }
+
+private:
+  struct Unit {
+    typedef std::priority_queue<std::pair<float, uint32_t>> KnnQueue;
+
+    void Preprocess(const MasteringReference2 &reference,
+                    std::vector<float> *output) const;
+    // output[i] = queryとpoint(ids[i])のL2距離
+    void CalculateDistances(const float *query, const uint32_t *ids,
+                            int count, float *output) const;
+    KnnQueue SearchKnn(const float *query, int k) const;
+    float CalculateLof(const float *query) const;
+    // output_sound_quality: 長さcount
+    void CalculateSoundQuality(const MasteringReference2 *references,
+                               int count, float *output_sound_quality) const;
+    double CalculateDistance(const MasteringReference2 &reference,
+                             const MasteringReference2 &target) const;
+
+    const float *point(uint32_t internal_id) const {
+      return points + static_cast<size_t>(point_data[internal_id]) * vec_size;
+    }
+    const uint32_t *level0_links(uint32_t internal_id) const {
+      return level0 + static_cast<size_t>(internal_id) * (max_m0 + 1);
+    }
+    const uint32_t *upper_link_list(uint32_t internal_id, int level) const {
+      return upper_links + upper_link_offsets[internal_id] +
+             static_cast<size_t>(level - 1) * (max_m + 1);
+    }
+
+    int mode;
+    int band_count;
+    int vec_size;
+    int point_count;
+    int lof_k;
+    int max_level;
+    int enterpoint;
+    int max_m0;
+    int max_m;
+    int ef;
+    const Band *bands;
+    const float *sorted_reference_lofs;
+    size_t sorted_reference_lof_count;
+    const float *standard_scaler_shifts;
+    const float *standard_scaler_scales;
+    const double *pca_mat;
+    const float *points;
+    const float *kds;
+    const float *lrds;
+    const uint32_t *level0;
+    const uint32_t *point_data;
+    const uint32_t *labels;
+    const uint32_t *upper_link_offsets;
+    const uint32_t *upper_links;
+  };
+
+  std::shared_ptr<const void> owner_;
+  const float *sorted_reference_lofs_;
+  size_t sorted_reference_lof_count_;
+  Unit units_[2];
+};
+
+// data がフラット形式 (magicとversion) かどうか
+bool IsFlatSoundQuality2Cache(const void *data, size_t size);
+
+// data がフラット形式ならそのまま参照し、boost binary_iarchive 形式なら
+// メモリ上でフラット形式に変換する (変換はHNSWの読み込みでtemp fileを使う)
+std::shared_ptr<const FlatSoundQuality2Calculator>
+LoadFlatSoundQuality2Calculator(std::shared_ptr<const void> owner,
+                                const void *data, size_t size);
+
+// path をmmapして上と同じように読み込む
+std::shared_ptr<const FlatSoundQuality2Calculator>
+LoadFlatSoundQuality2Calculator(const std::string &path);
+} // namespace bakuage
+
+#endif
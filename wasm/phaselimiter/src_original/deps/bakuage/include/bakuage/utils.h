@@ -2,6 +2,7 @@
 #define BAKUAGE_BAKUAGE_UTILS_H_
 
 #include <cmath>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
 #include <chrono>
@@ -123,6 +124,25 @@ inline unsigned int CeilPowerOf2(unsigned int v) {
 	return v;
 }
 
+// xに最も近い、unitの倍数かつ2^a 3^b 5^cの数 (同じ距離なら小さい方)。unitも2, 3, 5の積であること
+// DFTの長さ用 (大きな素因数があるとgeneric radixのO(R^2)になって遅い)
+inline int RoundToSmoothNumber(int x, int unit = 1) {
+	int64_t best = unit;
+	for (int64_t p2 = 1; p2 <= 2LL * x; p2 *= 2) {
+		for (int64_t p3 = p2; p3 <= 2LL * x; p3 *= 3) {
+			for (int64_t p5 = p3; p5 <= 2LL * x; p5 *= 5) {
+				if (p5 % unit != 0) continue;
+				const int64_t d = std::abs(p5 - x);
+				const int64_t best_d = std::abs(best - x);
+				if (d < best_d || (d == best_d && p5 < best)) {
+					best = p5;
+				}
+			}
+		}
+	}
+	return (int)best;
+}
+
 inline void SleepMs(int ms) {
 	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
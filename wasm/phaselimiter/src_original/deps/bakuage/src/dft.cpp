@@ -3,62 +3,762 @@
 #include <cmath>
 #include <complex>
 #include <cstring>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
+#include "bakuage/memory.h"
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
 namespace bakuage {
 
+namespace impl {
+
+// Plan for a complex FFT of arbitrary length.
+// The length is factorized into radix 4/2/3/5 stages (other primes fall back
+// to a generic O(R^2) butterfly) which are run as a self-sorting Stockham
+// FFT, so no bit reversal pass is needed. Twiddles are precomputed per stage.
+// Backward is unnormalized (same as IPP_FFT_NODIV_BY_ANY / FFTW).
+template <class Float> class FftPlan {
+public:
+  typedef std::complex<Float> Complex;
+
+  explicit FftPlan(int len);
+  int len() const { return len_; }
+  // len() elements for the Stockham ping-pong plus the generic radix
+  // butterfly scratch
+  size_t work_size() const; // bytes
+  // input may alias output. work must hold work_size() bytes.
+  void Execute(const Complex *input, Complex *output, Complex *work,
+               bool inverse) const;
+
+private:
+  struct Stage {
+    int radix;
+    int ns; // product of the radices of the previous stages
+    int twiddle_offset;
+    int root_offset; // generic radix only
+  };
+  void RunStage(const Stage &stage, const Complex *src, Complex *dst,
+                std::complex<double> *scratch, bool inverse) const;
+  bool RunRadix4Simd(const Stage &stage, const Complex *src, Complex *dst,
+                     bool inverse) const;
+  bool RunRadix2Simd(const Stage &stage, const Complex *src,
+                     Complex *dst) const;
+
+  int len_;
+  std::vector<Stage> stages_;
+  AlignedPodVector<Complex> twiddles_;
+  AlignedPodVector<Complex> inverse_twiddles_;
+  std::vector<std::complex<double>> roots_;
+  int max_generic_radix_; // 0 if every stage is radix 2/3/4/5
+};
+
+// Plan for a real FFT.
+// Even lengths pack the input into len / 2 complex values, run a half length
+// complex FFT and split the result with one post-twiddle pass (and the
+// mirror image for backward). Odd lengths fall back to a full length complex
+// FFT of the zero-imaginary input.
+// Output layouts follow IPP:
+//   CCS:  [R0, 0, R1, I1, ..., R(N/2), 0] (N + 2)
+//   Perm: [R0, R(N/2), R1, I1, ...] (N, odd N: same as Pack)
+//   Pack: [R0, R1, I1, ..., R(N/2)] (N)
+template <class Float> class RealFftPlan {
+public:
+  typedef std::complex<Float> Complex;
+  enum class Layout { kCcs, kPerm, kPack };
+
+  explicit RealFftPlan(int len);
+  int len() const { return len_; }
+  size_t work_size() const; // bytes
+  // input may alias output
+  void Forward(const Float *input, Float *output, void *work,
+               Layout layout) const;
+  void Backward(const Float *input, Float *output, void *work,
+                Layout layout) const;
+
+private:
+  void ForwardEven(const Float *input, Float *output, void *work,
+                   Layout layout) const;
+  void BackwardEven(const Float *input, Float *output, void *work,
+                    Layout layout) const;
+  void ForwardOdd(const Float *input, Float *output, void *work,
+                  Layout layout) const;
+  void BackwardOdd(const Float *input, Float *output, void *work,
+                   Layout layout) const;
+
+  int len_;
+  std::shared_ptr<const FftPlan<Float>> fft_; // len / 2 (even) or len (odd)
+  AlignedPodVector<Complex> twiddles_; // exp(-2 pi i k / len), k <= len / 4
+};
+
+// Process-wide plan registry keyed by (size, precision, layout).
+// Plans are immutable once built, so the returned handles can be shared
+// read-only by every thread; each thread only brings its own work buffer.
+// Plans are never evicted (the set of sizes used by the engine is small).
+template <class Float>
+std::shared_ptr<const FftPlan<Float>> GetFftPlan(int len);
+template <class Float>
+std::shared_ptr<const RealFftPlan<Float>> GetRealFftPlan(int len);
+
 namespace {
 
-// Simple FFT implementation (Cooley-Tukey)
-// Not optimized, but dependency-free.
-template <typename T>
-void SimpleFft(std::complex<T> *data, int n, bool inverse) {
-  if (n <= 1)
-    return;
+// 128bit SIMD helpers for two interleaved complex<float> values
+// ([re0, im0, re1, im1]). The wasm build gets wasm_simd128, native builds SSE2.
+#if defined(__wasm_simd128__)
+#define BAKUAGE_DFT_SIMD
+typedef v128_t ComplexVec2;
+inline ComplexVec2 LoadVec2(const std::complex<float> *p) {
+  return wasm_v128_load(p);
+}
+inline void StoreVec2(std::complex<float> *p, ComplexVec2 x) {
+  wasm_v128_store(p, x);
+}
+inline ComplexVec2 AddVec2(ComplexVec2 a, ComplexVec2 b) {
+  return wasm_f32x4_add(a, b);
+}
+inline ComplexVec2 SubVec2(ComplexVec2 a, ComplexVec2 b) {
+  return wasm_f32x4_sub(a, b);
+}
+// (re, im) -> (im, re) * sign
+inline ComplexVec2 SwapReImVec2(ComplexVec2 a, ComplexVec2 sign) {
+  return wasm_f32x4_mul(wasm_i32x4_shuffle(a, a, 1, 0, 3, 2), sign);
+}
+inline ComplexVec2 MulVec2(ComplexVec2 a, ComplexVec2 b) {
+  const ComplexVec2 a_re = wasm_i32x4_shuffle(a, a, 0, 0, 2, 2);
+  const ComplexVec2 a_im = wasm_i32x4_shuffle(a, a, 1, 1, 3, 3);
+  const ComplexVec2 b_swap = wasm_i32x4_shuffle(b, b, 1, 0, 3, 2);
+  return wasm_f32x4_add(
+      wasm_f32x4_mul(a_re, b),
+      wasm_f32x4_mul(wasm_f32x4_mul(a_im, b_swap),
+                     wasm_f32x4_make(-1.0f, 1.0f, -1.0f, 1.0f)));
+}
+inline ComplexVec2 MakeSignVec2(float re, float im) {
+  return wasm_f32x4_make(re, im, re, im);
+}
+// [a0, a1], [b0, b1] -> [a0, b0] / [a1, b1]
+inline ComplexVec2 InterleaveLowVec2(ComplexVec2 a, ComplexVec2 b) {
+  return wasm_i32x4_shuffle(a, b, 0, 1, 4, 5);
+}
+inline ComplexVec2 InterleaveHighVec2(ComplexVec2 a, ComplexVec2 b) {
+  return wasm_i32x4_shuffle(a, b, 2, 3, 6, 7);
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+#define BAKUAGE_DFT_SIMD
+typedef __m128 ComplexVec2;
+inline ComplexVec2 LoadVec2(const std::complex<float> *p) {
+  return _mm_loadu_ps(reinterpret_cast<const float *>(p));
+}
+inline void StoreVec2(std::complex<float> *p, ComplexVec2 x) {
+  _mm_storeu_ps(reinterpret_cast<float *>(p), x);
+}
+inline ComplexVec2 AddVec2(ComplexVec2 a, ComplexVec2 b) {
+  return _mm_add_ps(a, b);
+}
+inline ComplexVec2 SubVec2(ComplexVec2 a, ComplexVec2 b) {
+  return _mm_sub_ps(a, b);
+}
+inline ComplexVec2 SwapReImVec2(ComplexVec2 a, ComplexVec2 sign) {
+  return _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)), sign);
+}
+inline ComplexVec2 MulVec2(ComplexVec2 a, ComplexVec2 b) {
+  const ComplexVec2 a_re = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 0, 0));
+  const ComplexVec2 a_im = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 1, 1));
+  const ComplexVec2 b_swap = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_add_ps(_mm_mul_ps(a_re, b),
+                    _mm_mul_ps(_mm_mul_ps(a_im, b_swap),
+                               _mm_setr_ps(-1.0f, 1.0f, -1.0f, 1.0f)));
+}
+inline ComplexVec2 MakeSignVec2(float re, float im) {
+  return _mm_setr_ps(re, im, re, im);
+}
+inline ComplexVec2 InterleaveLowVec2(ComplexVec2 a, ComplexVec2 b) {
+  return _mm_movelh_ps(a, b);
+}
+inline ComplexVec2 InterleaveHighVec2(ComplexVec2 a, ComplexVec2 b) {
+  return _mm_movehl_ps(b, a);
+}
+#endif
+
+// multiply by -i (forward) or +i (inverse)
+template <class Float>
+inline std::complex<Float> MulNegI(const std::complex<Float> &x,
+                                   bool inverse) {
+  return inverse ? std::complex<Float>(-x.imag(), x.real())
+                 : std::complex<Float>(x.imag(), -x.real());
+}
+
+} // namespace
+
+template <class Float> FftPlan<Float>::FftPlan(int len) : len_(len), max_generic_radix_(0) {
+  // Factorize. A single radix-2 stage goes first so that every radix-4
+  // stage except a leading one has an even Ns (required by the SIMD
+  // kernels). Remaining primes are handled by the generic odd radix kernel.
+  std::vector<int> radices;
+  int n = len;
+  int fours = 0;
+  while (n % 4 == 0) {
+    n /= 4;
+    fours++;
+  }
+  if (n % 2 == 0) {
+    n /= 2;
+    radices.push_back(2);
+  }
+  for (int i = 0; i < fours; i++) {
+    radices.push_back(4);
+  }
+  for (int p = 3; p * p <= n; p += 2) {
+    while (n % p == 0) {
+      n /= p;
+      radices.push_back(p);
+    }
+  }
+  if (n > 1) {
+    radices.push_back(n);
+  }
+
+  int ns = 1;
+  int twiddle_size = 0;
+  for (const int radix : radices) {
+    Stage stage;
+    stage.radix = radix;
+    stage.ns = ns;
+    stage.twiddle_offset = twiddle_size;
+    stage.root_offset = -1;
+    twiddle_size += (radix - 1) * ns;
+    stages_.push_back(stage);
+    ns *= radix;
+  }
 
-  // Bit reversal
-  int j = 0;
-  for (int i = 0; i < n; ++i) {
-    if (j > i) {
-      std::swap(data[j], data[i]);
+  twiddles_.resize(twiddle_size);
+  inverse_twiddles_.resize(twiddle_size);
+  for (auto &stage : stages_) {
+    // w_r(b) = exp(-2 pi i r b / (Ns R)), laid out as [r - 1][b]
+    for (int r = 1; r < stage.radix; r++) {
+      for (int b = 0; b < stage.ns; b++) {
+        const double theta = -2 * M_PI * ((double)r * b) /
+                             ((double)stage.ns * stage.radix);
+        const int k = stage.twiddle_offset + (r - 1) * stage.ns + b;
+        twiddles_[k] = std::complex<Float>(std::cos(theta), std::sin(theta));
+        inverse_twiddles_[k] = std::conj(twiddles_[k]);
+      }
     }
-    int m = n / 2;
-    while (m >= 1 && j >= m) {
-      j -= m;
-      m /= 2;
+    if (stage.radix != 2 && stage.radix != 3 && stage.radix != 4 &&
+        stage.radix != 5) {
+      stage.root_offset = roots_.size();
+      max_generic_radix_ = std::max(max_generic_radix_, stage.radix);
+      for (int k = 0; k < stage.radix; k++) {
+        const double theta = -2 * M_PI * k / stage.radix;
+        roots_.emplace_back(std::cos(theta), std::sin(theta));
+      }
     }
-    j += m;
   }
+}
 
-  // Butterfly
-  for (int len = 2; len <= n; len <<= 1) {
-    double ang = 2 * M_PI / len * (inverse ? 1 : -1);
-    std::complex<T> wlen(std::cos(ang), std::sin(ang));
-    for (int i = 0; i < n; i += len) {
-      std::complex<T> w(1.0, 0.0);
-      for (int k = 0; k < len / 2; ++k) {
-        std::complex<T> u = data[i + k];
-        std::complex<T> v = data[i + k + len / 2] * w;
-        data[i + k] = u + v;
-        data[i + k + len / 2] = u - v;
-        w *= wlen;
+template <class Float> size_t FftPlan<Float>::work_size() const {
+  return len_ * sizeof(Complex) +
+         max_generic_radix_ * sizeof(std::complex<double>);
+}
+
+template <class Float>
+void FftPlan<Float>::Execute(const Complex *input, Complex *output,
+                             Complex *work, bool inverse) const {
+  const int stage_count = stages_.size();
+  if (stage_count == 0) {
+    if (len_ == 1 && input != output) {
+      output[0] = input[0];
+    }
+    return;
+  }
+
+  // Stockham stages ping-pong between output and work. Choose the first
+  // destination so that the last stage lands in output.
+  // work + len_ is 8 byte aligned, which is enough for complex<double>
+  std::complex<double> *scratch =
+      reinterpret_cast<std::complex<double> *>(work + len_);
+  const Complex *src = input;
+  Complex *dst = (stage_count % 2) ? output : work;
+  if (input == output && (stage_count % 2)) {
+    std::memcpy(work, input, sizeof(Complex) * len_);
+    src = work;
+  }
+  for (const auto &stage : stages_) {
+    RunStage(stage, src, dst, scratch, inverse);
+    src = dst;
+    dst = dst == output ? work : output;
+  }
+}
+
+template <class Float>
+void FftPlan<Float>::RunStage(const Stage &stage, const Complex *src,
+                              Complex *dst, std::complex<double> *scratch,
+                              bool inverse) const {
+  const int radix = stage.radix;
+  const int ns = stage.ns;
+  const int m = len_ / radix; // distance between butterfly inputs
+  const int blocks = m / ns;
+  const Complex *tw =
+      (inverse ? inverse_twiddles_.data() : twiddles_.data()) +
+      stage.twiddle_offset;
+
+  // y = DFT_R(v_r * w_r(b)), x[a Ns + b + r m] -> y[a Ns R + b + r Ns]
+  if (radix == 4) {
+    if (ns == 1) {
+      for (int a = 0; a < blocks; a++) {
+        const Complex *x = src + a;
+        Complex *y = dst + 4 * a;
+        const Complex t0 = x[0] + x[2 * m];
+        const Complex t1 = x[0] - x[2 * m];
+        const Complex t2 = x[m] + x[3 * m];
+        const Complex t3 = MulNegI(x[m] - x[3 * m], inverse);
+        y[0] = t0 + t2;
+        y[1] = t1 + t3;
+        y[2] = t0 - t2;
+        y[3] = t1 - t3;
+      }
+      return;
+    }
+    if (RunRadix4Simd(stage, src, dst, inverse)) {
+      return;
+    }
+    for (int a = 0; a < blocks; a++) {
+      for (int b = 0; b < ns; b++) {
+        const Complex *x = src + a * ns + b;
+        Complex *y = dst + a * ns * 4 + b;
+        const Complex v0 = x[0];
+        const Complex v1 = x[m] * tw[b];
+        const Complex v2 = x[2 * m] * tw[ns + b];
+        const Complex v3 = x[3 * m] * tw[2 * ns + b];
+        const Complex t0 = v0 + v2;
+        const Complex t1 = v0 - v2;
+        const Complex t2 = v1 + v3;
+        const Complex t3 = MulNegI(v1 - v3, inverse);
+        y[0] = t0 + t2;
+        y[ns] = t1 + t3;
+        y[2 * ns] = t0 - t2;
+        y[3 * ns] = t1 - t3;
+      }
+    }
+  } else if (radix == 2) {
+    if (RunRadix2Simd(stage, src, dst)) {
+      return;
+    }
+    for (int a = 0; a < blocks; a++) {
+      for (int b = 0; b < ns; b++) {
+        const Complex *x = src + a * ns + b;
+        Complex *y = dst + a * ns * 2 + b;
+        const Complex v0 = x[0];
+        const Complex v1 = ns == 1 ? x[m] : x[m] * tw[b];
+        y[0] = v0 + v1;
+        y[ns] = v0 - v1;
       }
     }
+  } else if (radix == 3) {
+    const Float s = (inverse ? 1 : -1) * std::sqrt(Float(0.75));
+    for (int a = 0; a < blocks; a++) {
+      for (int b = 0; b < ns; b++) {
+        const Complex *x = src + a * ns + b;
+        Complex *y = dst + a * ns * 3 + b;
+        const Complex v0 = x[0];
+        const Complex v1 = x[m] * tw[b];
+        const Complex v2 = x[2 * m] * tw[ns + b];
+        const Complex t1 = v1 + v2;
+        const Complex t2 = v0 - Float(0.5) * t1;
+        const Complex d = v1 - v2;
+        const Complex t3(-s * d.imag(), s * d.real()); // i s (v1 - v2)
+        y[0] = v0 + t1;
+        y[ns] = t2 + t3;
+        y[2 * ns] = t2 - t3;
+      }
+    }
+  } else if (radix == 5) {
+    const Float c1 = std::cos(2 * M_PI / 5);
+    const Float c2 = std::cos(4 * M_PI / 5);
+    const Float s1 = std::sin(2 * M_PI / 5);
+    const Float s2 = std::sin(4 * M_PI / 5);
+    for (int a = 0; a < blocks; a++) {
+      for (int b = 0; b < ns; b++) {
+        const Complex *x = src + a * ns + b;
+        Complex *y = dst + a * ns * 5 + b;
+        const Complex v0 = x[0];
+        const Complex v1 = x[m] * tw[b];
+        const Complex v2 = x[2 * m] * tw[ns + b];
+        const Complex v3 = x[3 * m] * tw[2 * ns + b];
+        const Complex v4 = x[4 * m] * tw[3 * ns + b];
+        const Complex a1 = v1 + v4;
+        const Complex b1 = v1 - v4;
+        const Complex a2 = v2 + v3;
+        const Complex b2 = v2 - v3;
+        const Complex t1 = v0 + c1 * a1 + c2 * a2;
+        const Complex t2 = v0 + c2 * a1 + c1 * a2;
+        const Complex u1 = MulNegI(s1 * b1 + s2 * b2, inverse);
+        const Complex u2 = MulNegI(s2 * b1 - s1 * b2, inverse);
+        y[0] = v0 + a1 + a2;
+        y[ns] = t1 + u1;
+        y[2 * ns] = t2 + u2;
+        y[3 * ns] = t2 - u2;
+        y[4 * ns] = t1 - u1;
+      }
+    }
+  } else {
+    // generic odd radix (O(R^2) per butterfly, accumulated in double
+    // because R can be large)
+    const std::complex<double> *roots = roots_.data() + stage.root_offset;
+    std::complex<double> *v = scratch;
+    for (int a = 0; a < blocks; a++) {
+      for (int b = 0; b < ns; b++) {
+        const Complex *x = src + a * ns + b;
+        Complex *y = dst + a * ns * radix + b;
+        v[0] = x[0];
+        for (int r = 1; r < radix; r++) {
+          const std::complex<double> w = tw[(r - 1) * ns + b];
+          v[r] = std::complex<double>(x[r * m]) * w;
+        }
+        for (int q = 0; q < radix; q++) {
+          std::complex<double> sum = v[0];
+          int k = 0;
+          for (int r = 1; r < radix; r++) {
+            k += q;
+            if (k >= radix) {
+              k -= radix;
+            }
+            sum += v[r] * (inverse ? std::conj(roots[k]) : roots[k]);
+          }
+          y[q * ns] = Complex(sum);
+        }
+      }
+    }
+  }
+}
+
+// no SIMD kernel for this precision: the caller runs the scalar butterflies
+template <class Float>
+bool FftPlan<Float>::RunRadix4Simd(const Stage &, const Complex *, Complex *,
+                                   bool) const {
+  return false;
+}
+
+template <class Float>
+bool FftPlan<Float>::RunRadix2Simd(const Stage &, const Complex *,
+                                   Complex *) const {
+  return false;
+}
+
+#ifdef BAKUAGE_DFT_SIMD
+template <>
+bool FftPlan<float>::RunRadix4Simd(const Stage &stage, const Complex *src,
+                                   Complex *dst, bool inverse) const {
+  const int ns = stage.ns;
+  if (ns % 2) {
+    return false;
+  }
+  const int m = len_ / 4;
+  const int blocks = m / ns;
+  const Complex *tw =
+      (inverse ? inverse_twiddles_.data() : twiddles_.data()) +
+      stage.twiddle_offset;
+  // -i * (re, im) = (im, -re), +i * (re, im) = (-im, re)
+  const ComplexVec2 rot_sign =
+      inverse ? MakeSignVec2(-1.0f, 1.0f) : MakeSignVec2(1.0f, -1.0f);
+  for (int a = 0; a < blocks; a++) {
+    const Complex *x = src + a * ns;
+    Complex *y = dst + a * ns * 4;
+    for (int b = 0; b < ns; b += 2) {
+      const ComplexVec2 v0 = LoadVec2(x + b);
+      const ComplexVec2 v1 = MulVec2(LoadVec2(x + m + b), LoadVec2(tw + b));
+      const ComplexVec2 v2 =
+          MulVec2(LoadVec2(x + 2 * m + b), LoadVec2(tw + ns + b));
+      const ComplexVec2 v3 =
+          MulVec2(LoadVec2(x + 3 * m + b), LoadVec2(tw + 2 * ns + b));
+      const ComplexVec2 t0 = AddVec2(v0, v2);
+      const ComplexVec2 t1 = SubVec2(v0, v2);
+      const ComplexVec2 t2 = AddVec2(v1, v3);
+      const ComplexVec2 t3 = SwapReImVec2(SubVec2(v1, v3), rot_sign);
+      StoreVec2(y + b, AddVec2(t0, t2));
+      StoreVec2(y + ns + b, AddVec2(t1, t3));
+      StoreVec2(y + 2 * ns + b, SubVec2(t0, t2));
+      StoreVec2(y + 3 * ns + b, SubVec2(t1, t3));
+    }
   }
+  return true;
+}
+
+template <>
+bool FftPlan<float>::RunRadix2Simd(const Stage &stage, const Complex *src,
+                                   Complex *dst) const {
+  // radix-2 only appears as the first stage (Ns = 1, no twiddles)
+  const int m = len_ / 2;
+  if (stage.ns != 1 || m % 2) {
+    return false;
+  }
+  for (int a = 0; a < m; a += 2) {
+    const ComplexVec2 v0 = LoadVec2(src + a);
+    const ComplexVec2 v1 = LoadVec2(src + m + a);
+    const ComplexVec2 s = AddVec2(v0, v1);
+    const ComplexVec2 d = SubVec2(v0, v1);
+    StoreVec2(dst + 2 * a, InterleaveLowVec2(s, d));
+    StoreVec2(dst + 2 * a + 2, InterleaveHighVec2(s, d));
+  }
+  return true;
+}
+#endif
 
-  /*if (inverse) {
-    for (int i = 0; i < n; ++i) {
-      data[i] /= T(n);
+template <class Float>
+RealFftPlan<Float>::RealFftPlan(int len)
+    : len_(len), fft_(GetFftPlan<Float>(len % 2 ? len : len / 2)) {
+  if (len % 2 == 0) {
+    twiddles_.resize(len / 4 + 1);
+    for (int k = 0; k < (int)twiddles_.size(); k++) {
+      const double theta = -2 * M_PI * k / len;
+      twiddles_[k] = Complex(std::cos(theta), std::sin(theta));
     }
-  }*/
+  }
+}
+
+template <class Float> size_t RealFftPlan<Float>::work_size() const {
+  // even: half spectrum + fft work, odd: full spectrum + fft work
+  return fft_->len() * sizeof(Complex) + fft_->work_size();
+}
+
+template <class Float>
+void RealFftPlan<Float>::Forward(const Float *input, Float *output,
+                                 void *work, Layout layout) const {
+  if (len_ % 2) {
+    ForwardOdd(input, output, work, layout);
+  } else {
+    ForwardEven(input, output, work, layout);
+  }
+}
+
+template <class Float>
+void RealFftPlan<Float>::Backward(const Float *input, Float *output,
+                                  void *work, Layout layout) const {
+  if (len_ % 2) {
+    BackwardOdd(input, output, work, layout);
+  } else {
+    BackwardEven(input, output, work, layout);
+  }
 }
 
+template <class Float>
+void RealFftPlan<Float>::ForwardEven(const Float *input, Float *output,
+                                     void *work, Layout layout) const {
+  const int h = len_ / 2;
+  Complex *z = reinterpret_cast<Complex *>(output);
+  // z[k] = x[2k] + i x[2k + 1] is the memory layout of the real input
+  fft_->Execute(reinterpret_cast<const Complex *>(input), z,
+               reinterpret_cast<Complex *>(work), false);
+
+  // X[k] = E[k] + W^k O[k], X[h - k] = conj(E[k] - W^k O[k])
+  // E[k] = (Z[k] + conj(Z[h - k])) / 2, O[k] = -i (Z[k] - conj(Z[h - k])) / 2
+  // W^(h - k) = -conj(W^k), so only W^k for k <= h / 2 is needed.
+  const Float dc = z[0].real() + z[0].imag();
+  const Float nyquist = z[0].real() - z[0].imag();
+  for (int k = 1; k <= h / 2; k++) {
+    const Complex a = z[k];
+    const Complex b = std::conj(z[h - k]);
+    const Complex e = Float(0.5) * (a + b);
+    const Complex d = Float(0.5) * (a - b);
+    const Complex o(d.imag(), -d.real());
+    const Complex wo = twiddles_[k] * o;
+    z[k] = e + wo;
+    z[h - k] = std::conj(e - wo);
+  }
+
+  switch (layout) {
+  case Layout::kCcs:
+    z[0] = Complex(dc, 0);
+    z[h] = Complex(nyquist, 0);
+    break;
+  case Layout::kPerm:
+    output[0] = dc;
+    output[1] = nyquist;
+    break;
+  case Layout::kPack:
+    std::memmove(output + 1, output + 2, sizeof(Float) * (len_ - 2));
+    output[0] = dc;
+    output[len_ - 1] = nyquist;
+    break;
+  }
+}
+
+template <class Float>
+void RealFftPlan<Float>::BackwardEven(const Float *input, Float *output,
+                                      void *work, Layout layout) const {
+  const int h = len_ / 2;
+  Complex *z = reinterpret_cast<Complex *>(work);
+  Complex *scratch = z + h;
+
+  // 2 Z[k] = (X[k] + conj(X[h - k])) + i conj(W^k) (X[k] - conj(X[h - k]))
+  // (the factor 2 makes the result match the unnormalized length N inverse)
+  Float dc, nyquist;
+  const auto unpack = [&](const auto &get) {
+    z[0] = Complex(dc + nyquist, dc - nyquist);
+    for (int k = 1; k <= h / 2; k++) {
+      const Complex a = get(k);
+      const Complex b = std::conj(get(h - k));
+      const Complex e = a + b;
+      const Complex d = std::conj(twiddles_[k]) * (a - b);
+      const Complex id(-d.imag(), d.real());
+      z[k] = e + id;
+      z[h - k] = std::conj(e - id);
+    }
+  };
+  switch (layout) {
+  case Layout::kCcs: {
+    const Complex *x = reinterpret_cast<const Complex *>(input);
+    dc = x[0].real();
+    nyquist = x[h].real();
+    unpack([x](int k) { return x[k]; });
+  } break;
+  case Layout::kPerm: {
+    const Complex *x = reinterpret_cast<const Complex *>(input);
+    dc = input[0];
+    nyquist = input[1];
+    unpack([x](int k) { return x[k]; });
+  } break;
+  case Layout::kPack:
+    dc = input[0];
+    nyquist = input[len_ - 1];
+    unpack([input](int k) {
+      return Complex(input[2 * k - 1], input[2 * k]);
+    });
+    break;
+  }
+
+  fft_->Execute(z, reinterpret_cast<Complex *>(output), scratch, true);
+}
+
+template <class Float>
+void RealFftPlan<Float>::ForwardOdd(const Float *input, Float *output,
+                                    void *work_in, Layout layout) const {
+  Complex *work = reinterpret_cast<Complex *>(work_in);
+  for (int i = 0; i < len_; ++i)
+    work[i] = input[i];
+  fft_->Execute(work, work, work + len_, false);
+
+  if (layout == Layout::kCcs) {
+    Complex *out_c = reinterpret_cast<Complex *>(output);
+    for (int i = 0; i <= len_ / 2; ++i)
+      out_c[i] = work[i];
+  } else {
+    // odd length Perm and Pack: [R0, R1, I1, ..., R(N-1)/2, I(N-1)/2]
+    output[0] = work[0].real();
+    for (int i = 1; i <= len_ / 2; ++i) {
+      output[2 * i - 1] = work[i].real();
+      output[2 * i] = work[i].imag();
+    }
+  }
+}
+
+template <class Float>
+void RealFftPlan<Float>::BackwardOdd(const Float *input, Float *output,
+                                     void *work_in, Layout layout) const {
+  Complex *work = reinterpret_cast<Complex *>(work_in);
+  if (layout == Layout::kCcs) {
+    const Complex *in_c = reinterpret_cast<const Complex *>(input);
+    for (int i = 0; i <= len_ / 2; ++i)
+      work[i] = in_c[i];
+  } else {
+    work[0] = Complex(input[0], 0);
+    for (int i = 1; i <= len_ / 2; ++i)
+      work[i] = Complex(input[2 * i - 1], input[2 * i]);
+  }
+  for (int i = len_ / 2 + 1; i < len_; ++i)
+    work[i] = std::conj(work[len_ - i]);
+  fft_->Execute(work, work, work + len_, true);
+  for (int i = 0; i < len_; ++i)
+    output[i] = work[i].real();
+}
+
+namespace {
+
+enum class PlanLayout { kComplex, kReal };
+
+struct PlanKey {
+  int len;
+  int precision; // sizeof(Float)
+  PlanLayout layout;
+  bool operator==(const PlanKey &other) const {
+    return len == other.len && precision == other.precision &&
+           layout == other.layout;
+  }
+};
+
+struct PlanKeyHash {
+  size_t operator()(const PlanKey &key) const {
+    return std::hash<int>()(key.len) ^
+           (std::hash<int>()(key.precision) << 1) ^
+           (std::hash<int>()(static_cast<int>(key.layout)) << 2);
+  }
+};
+
+class PlanRegistry {
+public:
+  static PlanRegistry &GetInstance() {
+    static PlanRegistry instance;
+    return instance;
+  }
+
+  template <class Plan>
+  std::shared_ptr<const Plan> Get(const PlanKey &key) {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      const auto found = plans_.find(key);
+      if (found != plans_.end()) {
+        return std::static_pointer_cast<const Plan>(found->second);
+      }
+    }
+    // build outside of the lock (a real plan recursively asks for its
+    // complex plan). If two threads race, the first insertion wins.
+    std::shared_ptr<const Plan> plan = std::make_shared<Plan>(key.len);
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto inserted = plans_.emplace(key, plan);
+    return std::static_pointer_cast<const Plan>(inserted.first->second);
+  }
+
+private:
+  std::mutex mtx_;
+  std::unordered_map<PlanKey, std::shared_ptr<const void>, PlanKeyHash> plans_;
+};
+
 } // namespace
 
+template <class Float>
+std::shared_ptr<const FftPlan<Float>> GetFftPlan(int len) {
+  return PlanRegistry::GetInstance().Get<FftPlan<Float>>(
+      PlanKey{len, sizeof(Float), PlanLayout::kComplex});
+}
+
+template <class Float>
+std::shared_ptr<const RealFftPlan<Float>> GetRealFftPlan(int len) {
+  return PlanRegistry::GetInstance().Get<RealFftPlan<Float>>(
+      PlanKey{len, sizeof(Float), PlanLayout::kReal});
+}
+
+template class FftPlan<float>;
+template class FftPlan<double>;
+template class RealFftPlan<float>;
+template class RealFftPlan<double>;
+template std::shared_ptr<const FftPlan<float>> GetFftPlan<float>(int len);
+template std::shared_ptr<const FftPlan<double>> GetFftPlan<double>(int len);
+template std::shared_ptr<const RealFftPlan<float>>
+GetRealFftPlan<float>(int len);
+template std::shared_ptr<const RealFftPlan<double>>
+GetRealFftPlan<double>(int len);
+
+} // namespace impl
+
 FftMemoryBuffer::FftMemoryBuffer(int size) : size_(size) {
   if (size > 0) {
     data_ = malloc(size);
@@ -111,252 +811,135 @@ FftMemoryBuffer &FftMemoryBuffer::operator=(FftMemoryBuffer &&x) {
   return *this;
 }
 
-// Dft<float>
-Dft<float>::Dft(int len)
-    : dft_ptr_(reinterpret_cast<void *>(len)),
-      work_(len * sizeof(std::complex<float>)) {}
+namespace {
 
-void Dft<float>::Forward(const float *input, float *output) {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<float> *out_c = reinterpret_cast<std::complex<float> *>(output);
-  // Copy input (real) to complex
-  for (int i = 0; i < len; ++i)
-    out_c[i] = input[i];
-  // Wait, Dft<float>::Forward input is Float*, output is Float*.
-  // Dft<float> is likely Complex-to-Complex?
-  // The types in dft.h say typedef float Float;
-  // But Dft<float> usually implies general complex DFT.
-  // However, the signature takes float* input.
-  // Let's assume input is complex interleaved (2*len floats), output is complex
-  // interleaved. If input was real, we'd use RealDft.
+template <class Float>
+void ExecuteComplex(const impl::FftPlan<Float> &plan, const Float *input,
+                    Float *output, void *work, bool inverse) {
+  plan.Execute(reinterpret_cast<const std::complex<Float> *>(input),
+               reinterpret_cast<std::complex<Float> *>(output),
+               reinterpret_cast<std::complex<Float> *>(work), inverse);
+}
 
-  // Safety copy to work buffer to allow in-place
-  std::complex<float> *work = (std::complex<float> *)work_.data();
-  memcpy(work, input, len * sizeof(std::complex<float>));
+} // namespace
 
-  SimpleFft(work, len, false);
+// Dft<float>
+Dft<float>::Dft(int len)
+    : plan_(impl::GetFftPlan<float>(len)), work_(plan_->work_size()) {}
 
-  memcpy(output, work, len * sizeof(std::complex<float>));
+// input and output are interleaved complex (2 * len floats)
+void Dft<float>::Forward(const float *input, float *output) {
+  ExecuteComplex(*plan_, input, output, work_.data(), false);
 }
 
 void Dft<float>::Backward(const float *input, float *output) {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<float> *work = (std::complex<float> *)work_.data();
-  memcpy(work, input, len * sizeof(std::complex<float>));
-
-  SimpleFft(work, len, true);
-
-  memcpy(output, work, len * sizeof(std::complex<float>));
+  ExecuteComplex(*plan_, input, output, work_.data(), true);
 }
 
 // Dft<double>
 Dft<double>::Dft(int len)
-    : dft_ptr_(reinterpret_cast<void *>(len)),
-      work_(len * sizeof(std::complex<double>)) {}
+    : plan_(impl::GetFftPlan<double>(len)), work_(plan_->work_size()) {}
 
 void Dft<double>::Forward(const double *input, double *output) {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<double> *work = (std::complex<double> *)work_.data();
-  memcpy(work, input, len * sizeof(std::complex<double>));
-  SimpleFft(work, len, false);
-  memcpy(output, work, len * sizeof(std::complex<double>));
+  ExecuteComplex(*plan_, input, output, work_.data(), false);
 }
 
 void Dft<double>::Backward(const double *input, double *output) {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<double> *work = (std::complex<double> *)work_.data();
-  memcpy(work, input, len * sizeof(std::complex<double>));
-  SimpleFft(work, len, true);
-  memcpy(output, work, len * sizeof(std::complex<double>));
+  ExecuteComplex(*plan_, input, output, work_.data(), true);
 }
 
 // RealDft<float>
-// Basic implementation: Expand to Complex, FFT, Pack.
-RealDft<float>::RealDft(int len, bool no)
-    : dft_ptr_(reinterpret_cast<void *>(len)),
-      work_(len * sizeof(std::complex<float>)) {}
+RealDft<float>::RealDft(int len, bool no_internal_work)
+    : plan_(impl::GetRealFftPlan<float>(len)),
+      work_(no_internal_work ? 0 : work_size()) {}
 
-size_t RealDft<float>::work_size() const {
-  return reinterpret_cast<intptr_t>(dft_ptr_) * sizeof(std::complex<float>);
-}
+size_t RealDft<float>::work_size() const { return plan_->work_size(); }
 
 void RealDft<float>::Forward(const float *input, float *output,
-                             void *work_in) const {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<float> *work = (std::complex<float> *)
-      work_in; // We need complex buffer of size N not N/2+1 for simple impl
-
-  // Copy real to complex
-  for (int i = 0; i < len; ++i)
-    work[i] = input[i];
-
-  SimpleFft(work, len, false);
-
-  // Output standard sorted complex?
-  // IPP RToCCS: [R0, 0, R1, I1, .... R(N/2), 0] (Size N+2)
-  // dft.h usually expects this for generic Forward.
-  std::complex<float> *out_c = (std::complex<float> *)output;
-  for (int i = 0; i <= len / 2; ++i) {
-    out_c[i] = work[i];
-  }
+                             void *work) const {
+  plan_->Forward(input, output, work,
+                 impl::RealFftPlan<float>::Layout::kCcs);
 }
 
 void RealDft<float>::ForwardPerm(const float *input, float *output,
-                                 void *work_in) const {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<float> *work = (std::complex<float> *)work_in;
-
-  for (int i = 0; i < len; ++i)
-    work[i] = input[i];
-  SimpleFft(work, len, false);
-
-  // IPP Perm Format: [R0, R(N/2), R1, I1, R2, I2, ...]
-  output[0] = work[0].real();
-  if ((len % 2) == 0)
-    output[1] = work[len / 2].real();
-
-  for (int i = 1; i < len / 2; ++i) {
-    output[2 * i] = work[i].real();
-    output[2 * i + 1] = work[i].imag();
-  }
+                                 void *work) const {
+  plan_->Forward(input, output, work,
+                 impl::RealFftPlan<float>::Layout::kPerm);
 }
 
 void RealDft<float>::ForwardPack(const float *input, float *output,
-                                 void *work_in) const {
-  // Pack usually similar to Perm but maybe different order.
-  // IPP Pack: [R0, R1, I1, R2, I2 ... R(N/2)]
-  // Actually, let's treat it same as Perm for now or check IPP details.
-  // IPP Pack for odd N is different.
-  // Assuming even N for audio usually.
-  ForwardPerm(input, output, work_in);
+                                 void *work) const {
+  plan_->Forward(input, output, work,
+                 impl::RealFftPlan<float>::Layout::kPack);
 }
 
 void RealDft<float>::Backward(const float *input, float *output,
-                              void *work_in) const {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<float> *work = (std::complex<float> *)work_in;
-
-  // Reconstruct full complex spectrum from CCS
-  // CCS: [R0, I0(0), R1, I1, ..., RN/2, IN/2(0)]
-  const std::complex<float> *in_c = (const std::complex<float> *)input;
-
-  for (int i = 0; i <= len / 2; ++i)
-    work[i] = in_c[i];
-  for (int i = len / 2 + 1; i < len; ++i)
-    work[i] = std::conj(work[len - i]);
-
-  SimpleFft(work, len, true);
-
-  for (int i = 0; i < len; ++i)
-    output[i] = work[i].real();
+                              void *work) const {
+  plan_->Backward(input, output, work,
+                 impl::RealFftPlan<float>::Layout::kCcs);
 }
 
 void RealDft<float>::BackwardPerm(const float *input, float *output,
-                                  void *work_in) const {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<float> *work = (std::complex<float> *)work_in;
-
-  // Perm: [R0, R(N/2), R1, I1, R2, I2...]
-  work[0] = std::complex<float>(input[0], 0);
-  if ((len % 2) == 0)
-    work[len / 2] = std::complex<float>(input[1], 0);
-
-  for (int i = 1; i < len / 2; ++i) {
-    work[i] = std::complex<float>(input[2 * i], input[2 * i + 1]);
-  }
-  for (int i = len / 2 + 1; i < len; ++i)
-    work[i] = std::conj(work[len - i]);
-
-  SimpleFft(work, len, true);
-
-  for (int i = 0; i < len; ++i)
-    output[i] = work[i].real();
+                                  void *work) const {
+  plan_->Backward(input, output, work,
+                 impl::RealFftPlan<float>::Layout::kPerm);
 }
 
 void RealDft<float>::BackwardPack(const float *input, float *output,
-                                  void *work_in) const {
-  BackwardPerm(input, output, work_in);
+                                  void *work) const {
+  plan_->Backward(input, output, work,
+                 impl::RealFftPlan<float>::Layout::kPack);
 }
 
-// RealDft<double> (Copy paste with double)
-RealDft<double>::RealDft(int len, bool no)
-    : dft_ptr_(reinterpret_cast<void *>(len)),
-      work_(len * sizeof(std::complex<double>)) {}
-size_t RealDft<double>::work_size() const {
-  return reinterpret_cast<intptr_t>(dft_ptr_) * sizeof(std::complex<double>);
-}
+// RealDft<double>
+RealDft<double>::RealDft(int len, bool no_internal_work)
+    : plan_(impl::GetRealFftPlan<double>(len)),
+      work_(no_internal_work ? 0 : work_size()) {}
+
+size_t RealDft<double>::work_size() const { return plan_->work_size(); }
 
 void RealDft<double>::Forward(const double *input, double *output,
-                              void *work_in) const {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<double> *work = (std::complex<double> *)work_in;
-  for (int i = 0; i < len; ++i)
-    work[i] = input[i];
-  SimpleFft(work, len, false);
-  std::complex<double> *out_c = (std::complex<double> *)output;
-  for (int i = 0; i <= len / 2; ++i)
-    out_c[i] = work[i];
+                              void *work) const {
+  plan_->Forward(input, output, work,
+                 impl::RealFftPlan<double>::Layout::kCcs);
 }
+
 void RealDft<double>::ForwardPerm(const double *input, double *output,
-                                  void *work_in) const {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<double> *work = (std::complex<double> *)work_in;
-  for (int i = 0; i < len; ++i)
-    work[i] = input[i];
-  SimpleFft(work, len, false);
-  output[0] = work[0].real();
-  if ((len % 2) == 0)
-    output[1] = work[len / 2].real();
-  for (int i = 1; i < len / 2; ++i) {
-    output[2 * i] = work[i].real();
-    output[2 * i + 1] = work[i].imag();
-  }
+                                  void *work) const {
+  plan_->Forward(input, output, work,
+                 impl::RealFftPlan<double>::Layout::kPerm);
 }
+
 void RealDft<double>::ForwardPack(const double *input, double *output,
-                                  void *work_in) const {
-  ForwardPerm(input, output, work_in);
+                                  void *work) const {
+  plan_->Forward(input, output, work,
+                 impl::RealFftPlan<double>::Layout::kPack);
 }
+
 void RealDft<double>::Backward(const double *input, double *output,
-                               void *work_in) const {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<double> *work = (std::complex<double> *)work_in;
-  const std::complex<double> *in_c = (const std::complex<double> *)input;
-  for (int i = 0; i <= len / 2; ++i)
-    work[i] = in_c[i];
-  for (int i = len / 2 + 1; i < len; ++i)
-    work[i] = std::conj(work[len - i]);
-  SimpleFft(work, len, true);
-  for (int i = 0; i < len; ++i)
-    output[i] = work[i].real();
+                               void *work) const {
+  plan_->Backward(input, output, work,
+                 impl::RealFftPlan<double>::Layout::kCcs);
 }
+
 void RealDft<double>::BackwardPerm(const double *input, double *output,
-                                   void *work_in) const {
-  int len = reinterpret_cast<intptr_t>(dft_ptr_);
-  std::complex<double> *work = (std::complex<double> *)work_in;
-  work[0] = std::complex<double>(input[0], 0);
-  if ((len % 2) == 0)
-    work[len / 2] = std::complex<double>(input[1], 0);
-
-  for (int i = 1; i < len / 2; ++i) {
-    work[i] = std::complex<double>(input[2 * i], input[2 * i + 1]);
-  }
-  for (int i = len / 2 + 1; i < len; ++i)
-    work[i] = std::conj(work[len - i]);
-  SimpleFft(work, len, true);
-  for (int i = 0; i < len; ++i)
-    output[i] = work[i].real();
+                                   void *work) const {
+  plan_->Backward(input, output, work,
+                 impl::RealFftPlan<double>::Layout::kPerm);
 }
+
 void RealDft<double>::BackwardPack(const double *input, double *output,
-                                   void *work_in) const {
-  BackwardPerm(input, output, work_in);
+                                   void *work) const {
+  plan_->Backward(input, output, work,
+                 impl::RealFftPlan<double>::Layout::kPack);
 }
 
 // 2D Stubs (Empty for now until needed)
-Dft2D<float>::Dft2D(int size0, int size1) {}
-void Dft2D<float>::Forward(const float *input, float *output) {}
-void Dft2D<float>::Backward(const float *input, float *output) {}
+Dft2D<float>::Dft2D(int, int) {}
+void Dft2D<float>::Forward(const float *, float *) {}
+void Dft2D<float>::Backward(const float *, float *) {}
 
-Dct2D<float>::Dct2D(int size0, int size1) {}
-void Dct2D<float>::Forward(const float *input, float *output) {}
+Dct2D<float>::Dct2D(int, int) {}
+void Dct2D<float>::Forward(const float *, float *) {}
 
 } // namespace bakuage
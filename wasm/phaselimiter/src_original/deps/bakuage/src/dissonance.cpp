@@ -49,27 +49,6 @@ namespace {
         double energy;
     };
     
-    struct CalculateDissonanceThreadVar {
-        CalculateDissonanceThreadVar(int width): spec_len(width / 2 + 1), fft_input(width), fft_output(spec_len), fft_energy(spec_len) {}
-        
-        static std::shared_ptr<CalculateDissonanceThreadVar> GetThreadInstance(int width) {
-            static thread_local std::weak_ptr<CalculateDissonanceThreadVar> instance;
-            auto locked = instance.lock();
-            if (locked) {
-                return locked;
-            } else {
-                locked = std::make_shared<CalculateDissonanceThreadVar>(width);
-                instance = locked;
-                return locked;
-            }
-        }
-        
-        int spec_len;
-        bakuage::AlignedPodVector<float> fft_input;
-        bakuage::AlignedPodVector<std::complex<float>> fft_output;
-        bakuage::AlignedPodVector<float> fft_energy;
-    };
-    
     // spec contains energy (freqs must be ASC sorted)
     template <class Float>
     double DissonanceSethares1993(const Float *freqs, const Float *amps, int count, const DissonanceSethares1993Cache<Float> *cache) {
@@ -122,80 +101,93 @@ namespace bakuage {
         return spl * d;
     }
     
-    // mfccはenergy sum modeを想定している
-    template <class Float>
-    void CalculateDissonance(Float *input, int channels, int samples, int sample_freq, Float *dissonance, bool tbb_parallel) {
-        // calculate mfcc
-        const int shift_resolution = 2;
-        const int output_shift_resolution = 2;
-        const int width = output_shift_resolution * ((16384 * sample_freq / 44100) / output_shift_resolution); // 0.372 sec, 4x only
-        const int shift = width / shift_resolution;
-        const int spec_len = width / 2 + 1;
-        
-        // common const data
-        bakuage::AlignedPodVector<float> window(width);
-        bakuage::CopyHanning(width, window.begin());
-        bakuage::AlignedPodVector<float> freqs(spec_len);
-        for (int i = 0; i < spec_len; i++) {
-            freqs[i] = 1.0 * (i + 0.5) * sample_freq / width;
+    struct DissonanceCalculator::Impl {
+        Impl(int _width, int _sample_freq, bool _tbb_parallel):
+        width(_width), spec_len(_width / 2 + 1), sample_freq(_sample_freq), tbb_parallel(_tbb_parallel),
+        freqs(CreateFreqs(_width, _sample_freq)), cache(freqs.data(), spec_len) {
+            result.dissonance = 0;
+            result.energy = 0;
         }
-        DissonanceSethares1993Cache<float> cache(freqs.data(), spec_len);
-        
-        // for parallel_for
-        bakuage::AlignedPodVector<int> pos_list;
-        {
-            int pos = -width + shift;
-            while (pos < samples) {
-                pos_list.push_back(pos);
-                pos += shift;
+
+        static bakuage::AlignedPodVector<float> CreateFreqs(int width, int sample_freq) {
+            bakuage::AlignedPodVector<float> freqs(width / 2 + 1);
+            for (size_t i = 0; i < freqs.size(); i++) {
+                freqs[i] = 1.0 * (i + 0.5) * sample_freq / width;
             }
+            return freqs;
         }
-        std::vector<std::shared_ptr<CalculateDissonanceThreadVar>> allocated_thread_vars(pos_list.size());
-        
-        const auto reduce_loop_func = [&](tbb::blocked_range<int> r, CalculateDissonanceResult init) {
-            for (int pos_list_i = r.begin(); pos_list_i != r.end(); pos_list_i++) {
-                const int pos = pos_list[pos_list_i];
-                auto tv = CalculateDissonanceThreadVar::GetThreadInstance(width);
-                allocated_thread_vars[pos_list_i] = tv;
-                
-                bakuage::TypedFillZero(tv->fft_energy.data(), tv->fft_energy.size());
-                for (int i = 0; i < channels; i++) {
-                    for (int j = 0; j < width; j++) {
-                        int k = pos + j;
-                        tv->fft_input[j] = (0 <= k && k < samples) ? input[channels * k + i] * window[j] : 0;
-                    }
-                    auto &pool = bakuage::ThreadLocalDftPool<bakuage::RealDft<float>>::GetThreadInstance();
-                    const auto dft = pool.Get(width);
-                    dft->Forward(tv->fft_input.data(), (float *)tv->fft_output.data(), pool.work());
+
+        int width;
+        int spec_len;
+        int sample_freq;
+        bool tbb_parallel;
+        bakuage::AlignedPodVector<float> freqs;
+        DissonanceSethares1993Cache<float> cache;
+        CalculateDissonanceResult result;
+    };
+
+    DissonanceCalculator::DissonanceCalculator(int width, int sample_freq, bool tbb_parallel):
+    impl_(new Impl(width, sample_freq, tbb_parallel)) {}
+
+    DissonanceCalculator::~DissonanceCalculator() {}
+
+    void DissonanceCalculator::Add(const SharedStftBatch &batch) {
+        Impl &impl = *impl_;
+        const int spec_len = impl.spec_len;
+        const auto reduce_loop_func = [&batch, &impl, spec_len](tbb::blocked_range<int> r, CalculateDissonanceResult init) {
+            static thread_local bakuage::AlignedPodVector<float> fft_energy;
+            fft_energy.resize(spec_len);
+            for (int i = r.begin(); i != r.end(); i++) {
+                bakuage::TypedFillZero(fft_energy.data(), spec_len);
+                for (int ch = 0; ch < batch.channels(); ch++) {
+                    const auto spec = batch.spectrum(i, ch);
                     for (int j = 0; j < spec_len; j++) {
-                        tv->fft_energy[j] += std::norm(tv->fft_output[j]);
+                        fft_energy[j] += std::norm(spec[j]);
                     }
                 }
-                
-                init.energy += bakuage::VectorSum(tv->fft_energy.data(), spec_len);
-                bakuage::VectorSqrtInplace(tv->fft_energy.data(), spec_len);
-                init.dissonance += DissonanceSethares1993(freqs.data(), tv->fft_energy.data(), spec_len, &cache);
+
+                init.energy += bakuage::VectorSum(fft_energy.data(), spec_len);
+                bakuage::VectorSqrtInplace(fft_energy.data(), spec_len);
+                init.dissonance += DissonanceSethares1993(impl.freqs.data(), fft_energy.data(), spec_len, &impl.cache);
             }
             return init;
         };
-        
+
         const auto reduce_func = [](const CalculateDissonanceResult &x, const CalculateDissonanceResult &y) {
             return x + y;
         };
-        
+
         CalculateDissonanceResult result;
         result.dissonance = 0;
         result.energy = 0;
-        
-        if (tbb_parallel) {
-            result = tbb::parallel_reduce(tbb::blocked_range<int>(0, pos_list.size()), result, reduce_loop_func, reduce_func);
+        if (impl.tbb_parallel) {
+            result = tbb::parallel_reduce(tbb::blocked_range<int>(0, batch.frame_count()), result, reduce_loop_func, reduce_func);
         } else {
-            result = reduce_loop_func(tbb::blocked_range<int>(0, pos_list.size()), result);
+            result = reduce_loop_func(tbb::blocked_range<int>(0, batch.frame_count()), result);
         }
-        
-        *dissonance = result.dissonance
-        * (1.0 * sample_freq / width) // compensation
-        / (1e-37 + result.energy);
+        impl.result = impl.result + result;
+    }
+
+    double DissonanceCalculator::dissonance() const {
+        return impl_->result.dissonance
+        * (1.0 * impl_->sample_freq / impl_->width) // compensation
+        / (1e-37 + impl_->result.energy);
+    }
+
+    // mfccはenergy sum modeを想定している
+    template <class Float>
+    void CalculateDissonance(Float *input, int channels, int samples, int sample_freq, Float *dissonance, bool tbb_parallel) {
+        const int shift_resolution = 2;
+        const int width = AnalysisStftWidth(sample_freq);
+        const int shift = width / shift_resolution;
+
+        std::vector<float> window(width);
+        bakuage::CopyHanning(width, window.begin());
+        SharedStft<Float> stft(width, shift, -width + shift, window);
+        DissonanceCalculator calculator(width, sample_freq, tbb_parallel);
+        stft.AddConsumer([&calculator](const SharedStftBatch &batch) { calculator.Add(batch); });
+        stft.Run(input, channels, samples, tbb_parallel);
+        *dissonance = calculator.dissonance();
     }
     
     template
@@ -4,6 +4,10 @@
 #include <vector>
 #include <functional>
 #include <complex>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
 
 #include "bakuage/loudness_filter.h"
 #include "bakuage/ms_compressor_filter.h"
@@ -12,6 +16,7 @@
 #include "bakuage/dft.h"
 #include "bakuage/loudness_contours.h"
 #include "bakuage/vector_math.h"
+#include "bakuage/window_func.h"
 
 namespace bakuage {
     namespace loudness_ebu_r128 {
@@ -21,154 +26,284 @@ namespace bakuage {
         // http://jp.music-group.com/TCE/Tech/LRA.pdf
         // block_sec = 3, shift_sec = 2, relative_threshold_db = -20
         
-        template <typename Float>
-        void CalculateLoudnessCore(const Float *input, const int channels, const int samples, const int sample_freq,
-                                   const Float block_sec, const Float shift_sec, const Float absolute_threshold_db, const Float relative_threshold_db,
-                                   Float *loudness, Float *loudness_range, std::vector<int> *histogram,
-                                   std::vector<Float> *loudness_time_series,
-                                   int *block_samples, bool use_youtube_weighting, Float *max_loudness) {
-            using namespace bakuage;
-            
-            bakuage::AlignedPodVector<Float> filtered(channels * samples);
-            if (use_youtube_weighting) {
-                const int fft_len = bakuage::CeilPowerOf2(samples);
-                bakuage::RealDft<Float> dft(fft_len);
-                bakuage::AlignedPodVector<Float> split(fft_len);
-                bakuage::AlignedPodVector<std::complex<Float>> spec(fft_len / 2 + 1);
-                
-                bakuage::AlignedPodVector<Float> weights(spec.size());
-                const auto scale = 1.0 / fft_len;
-                for (int j = 0; j < spec.size(); j++) {
-                    const auto hz = 1.0 * j * sample_freq / fft_len;
-                    weights[j] = std::pow(10, bakuage::loudness_contours::HzToYoutubeWeighting(hz) / 20) * scale;
-                }
+        namespace {
+            // loudness_contours::HzToYoutubeWeightingに合わせた直線位相FIR。
+            // 重みを周波数サンプリングしてKeiser窓で切り出す。
+            // 長さは0.5秒 (周波数分解能は数Hzで、表の一番低い44Hzより十分細かい)
+            template <typename Float>
+            std::shared_ptr<const PartitionedFirSpectrum<Float>> GetYoutubeWeightingFirSpectrum(int sample_freq) {
+                static std::mutex mtx;
+                static std::map<int, std::shared_ptr<const PartitionedFirSpectrum<Float>>> cache;
                 
-                for (int i = 0; i < channels; i++) {
-                    for (int j = 0; j < samples; j++) {
-                        int k = channels * j + i;
-                        split[j] = input[k];
+                std::lock_guard<std::mutex> lock(mtx);
+                auto &spectrum = cache[sample_freq];
+                if (!spectrum) {
+                    const int n = 2 * (sample_freq / 4) + 1;
+                    const int center = (n - 1) / 2;
+                    const double alpha = 8;
+                    const int fft_len = bakuage::CeilPowerOf2(4 * n);
+                    bakuage::RealDft<double> dft(fft_len);
+                    bakuage::AlignedPodVector<std::complex<double>> spec(fft_len / 2 + 1);
+                    bakuage::AlignedPodVector<double> impulse(fft_len);
+                    for (int j = 0; j < (int)spec.size(); j++) {
+                        const auto hz = 1.0 * j * sample_freq / fft_len;
+                        spec[j] = std::pow(10, bakuage::loudness_contours::HzToYoutubeWeighting(hz) / 20) / fft_len;
                     }
-                    bakuage::TypedFillZero(split.data() + samples, fft_len - samples);
-                    
-                    // fft
-                    dft.Forward(split.data(), (Float *)spec.data());
-                    
-                    // filter
-                    bakuage::VectorMulInplace(weights.data(), spec.data(), spec.size());
+                    dft.Backward((double *)spec.data(), impulse.data());
                     
-                    // ifft
-                    dft.Backward((Float *)spec.data(), split.data());
-                    
-                    for (int j = 0; j < samples; j++) {
-                        int k = channels * j + i;
-                        filtered[k] = split[j];
+                    // 実数の重みなのでimpulseは0を中心に対称
+                    std::vector<double> fir(n);
+                    for (int i = 0; i <= center; i++) {
+                        const double h = impulse[i] * Keiser(center + i, n - 1, alpha);
+                        fir[center - i] = h;
+                        fir[center + i] = h;
                     }
+                    spectrum = std::make_shared<const PartitionedFirSpectrum<Float>>(fir.begin(), fir.end());
                 }
-            } else {
-                std::vector<LoudnessFilter<double>> filters;
-                for (int i = 0; i < channels; i++) {
-                    LoudnessFilter<double> filter(sample_freq);
-                    for (int j = 0; j < samples; j++) {
-                        int k = channels * j + i;
-                        filtered[k] = filter.Clock(input[k]);
-                    }
+                return spectrum;
+            }
+        }
+        
+        template <typename Float>
+        LoudnessAnalyzer<Float>::LoudnessAnalyzer(int channels, int sample_freq, Weighting weighting):
+        channels_(channels), sample_freq_(sample_freq), weighting_(weighting),
+        youtube_delay_(0), youtube_skip_(0),
+        chunk_(0), chunk_fill_(0), chunk_energy_(0), samples_(0) {
+            if (weighting_ == kWeightingK) {
+                filters_.resize(channels_, LoudnessFilter<double>(sample_freq_));
+            } else if (weighting_ == kWeightingYoutube) {
+                const auto spectrum = GetYoutubeWeightingFirSpectrum<Float>(sample_freq_);
+                for (int i = 0; i < channels_; i++) {
+                    youtube_filters_.emplace_back(new PartitionedConvolver<Float>(spectrum));
                 }
+                youtube_delay_ = spectrum->fir_size() / 2;
+                youtube_skip_ = youtube_delay_;
+                const int block_size = spectrum->block_size();
+                youtube_input_.resize(block_size);
+                youtube_output_.resize(block_size);
+                youtube_weighted_.resize(channels_ * block_size);
             }
-            
-            std::vector<int> &histo = *histogram;
-            
-            histo.clear();
-            histo.resize(140);
-            
-            std::vector<Float> blocks;
-            
-            if (max_loudness) *max_loudness = -1e37;
-            
-            int pos = 0;
+        }
+        
+        template <typename Float>
+        int LoudnessAnalyzer<Float>::AddVariant(Float block_sec, Float shift_sec, Float absolute_threshold_db, Float relative_threshold_db) {
+            if (chunk_) {
+                throw std::logic_error("LoudnessAnalyzer: AddVariant must be called before Clock");
+            }
+            Variant variant;
             // 400ms block
-            int width = (int)(sample_freq * block_sec); // nearest samples
-            int shift = (int)(sample_freq * shift_sec);
-            // 規格では最後のブロックは使わないけど、
-            // 使ったほうが実用的なので使う
-            while (pos < samples) {
+            variant.width = (int)(sample_freq_ * block_sec); // nearest samples
+            variant.shift = (int)(sample_freq_ * shift_sec);
+            variant.absolute_threshold_db = absolute_threshold_db;
+            variant.relative_threshold_db = relative_threshold_db;
+            variants_.push_back(variant);
+            results_.emplace_back();
+            return variants_.size() - 1;
+        }
+        
+        template <typename Float>
+        void LoudnessAnalyzer<Float>::Start() {
+            // 全variantのブロックとシフトはchunkの倍数なので、ブロックのエネルギーはchunkのエネルギーの和で計算できる。
+            // 各サンプルの二乗和は1回だけ計算すればよい (ブロックごとに足し直すとwidth / shift倍かかる)
+            int chunk = 0;
+            for (const auto &variant: variants_) {
+                chunk = std::gcd(chunk, std::gcd(variant.width, variant.shift));
+            }
+            chunk_ = std::max(1, chunk);
+        }
+        
+        template <typename Float>
+        void LoudnessAnalyzer<Float>::PushChunk() {
+            chunk_energies_.push_back(chunk_energy_);
+            chunk_energy_ = 0;
+            chunk_fill_ = 0;
+        }
+        
+        template <typename Float>
+        void LoudnessAnalyzer<Float>::AccumulateEnergy(const Float *input, int frames, bool k_weighting) {
+            while (frames > 0) {
+                const int n = std::min<int>(chunk_ - chunk_fill_, frames);
                 double sum = 0;
-                int end = std::min<int>(pos + width, samples);
-                int len = end - pos;
-                const Float *filtered_pos = filtered.data() + channels * pos;
-                for (int i = pos; i < end; i++) {
-                    for (int j = 0; j < channels; j++) {
-                        sum += bakuage::Sqr(*filtered_pos);
-                        filtered_pos++;
+                if (k_weighting) {
+                    // IIRなのでフィルタ結果は保存せずに、そのままエネルギーにする
+                    for (int j = 0; j < n; j++) {
+                        for (int i = 0; i < channels_; i++) {
+                            const Float y = filters_[i].Clock(input[channels_ * j + i]);
+                            sum += bakuage::Sqr(y);
+                        }
+                    }
+                } else {
+                    // インターリーブのまま全チャンネルをまとめて足す
+                    const Float *ed = input + channels_ * n;
+                    for (const Float *it = input; it < ed; ++it) {
+                        sum += bakuage::Sqr(*it);
+                    }
+                }
+                chunk_energy_ += sum;
+                chunk_fill_ += n;
+                if (chunk_fill_ == chunk_) {
+                    PushChunk();
+                }
+                input += channels_ * n;
+                frames -= n;
+            }
+        }
+        
+        template <typename Float>
+        void LoudnessAnalyzer<Float>::ClockYoutube(const Float *input, int frames) {
+            const int block_size = youtube_input_.size();
+            while (frames > 0) {
+                const int n = std::min<int>(block_size, frames);
+                for (int i = 0; i < channels_; i++) {
+                    for (int j = 0; j < n; j++) {
+                        youtube_input_[j] = input ? input[channels_ * j + i] : 0;
+                    }
+                    youtube_filters_[i]->Clock(youtube_input_.data(), youtube_input_.data() + n, youtube_output_.data());
+                    for (int j = 0; j < n; j++) {
+                        youtube_weighted_[channels_ * j + i] = youtube_output_[j];
                     }
                 }
+                // 遅延を補償するので最初のyoutube_delay_サンプルは捨てる
+                const int skip = std::min<int>(youtube_skip_, n);
+                AccumulateEnergy(youtube_weighted_.data() + channels_ * skip, n - skip, false);
+                youtube_skip_ -= skip;
+                if (input) input += channels_ * n;
+                frames -= n;
+            }
+        }
+        
+        template <typename Float>
+        void LoudnessAnalyzer<Float>::Clock(const Float *input, int frames) {
+            if (!chunk_) Start();
+            samples_ += frames;
+            if (weighting_ == kWeightingYoutube) {
+                ClockYoutube(input, frames);
+            } else {
+                AccumulateEnergy(input, frames, weighting_ == kWeightingK);
+            }
+        }
+        
+        template <typename Float>
+        void LoudnessAnalyzer<Float>::Finish() {
+            if (!chunk_) Start();
+            if (weighting_ == kWeightingYoutube) {
+                // 遅延分の残りを出す
+                ClockYoutube(nullptr, youtube_delay_);
+            }
+            if (chunk_fill_) {
+                PushChunk();
+            }
+            const int chunk_count = chunk_energies_.size();
+            
+            for (int v = 0; v < (int)variants_.size(); v++) {
+                const Variant &variant = variants_[v];
+                Result &result = results_[v];
                 
-                double z = 10 * std::log10(1e-37 + sum / len);
-                if (!use_youtube_weighting) z -= 0.691; // ステレオの1kHz正弦波で0になるように補正。
-                blocks.push_back(z);
-                if (max_loudness) *max_loudness = std::max<Float>(*max_loudness, z);
+                std::vector<int> &histo = result.histogram;
+                histo.clear();
+                histo.resize(140);
                 
-                // -70 <-> [-70, -69)
-                int index = std::floor(z) + 70;
-                if (0 <= index && index < histo.size()) {
-                    histo[index]++;
-                }
+                std::vector<Float> &blocks = result.time_series;
+                blocks.clear();
+                
+                result.max_loudness = -1e37;
                 
+                const int chunks_per_block = variant.width / chunk_;
+                const int chunks_per_shift = variant.shift / chunk_;
+                // 規格では最後のブロックは使わないけど、
+                // 使ったほうが実用的なので使う
                 // 75% overlap
-                pos += shift;
-            }
-            
-            double threshold = absolute_threshold_db;
-            for (int k = 0; k < 2; k++) {
-                double count = 0;
-                double sum = 0;
-                for (double z : blocks) {
-                    const bool valid = z >= threshold;
-                    count += valid;
-                    sum += valid * z;
+                for (int c = 0; c < chunk_count; c += std::max(1, chunks_per_shift)) {
+                    const int pos = c * chunk_;
+                    const int end = std::min<int>(pos + variant.width, samples_);
+                    const int len = end - pos;
+                    const int chunk_end = std::min<int>(c + chunks_per_block, chunk_count);
+                    double sum = 0;
+                    for (int k = c; k < chunk_end; k++) {
+                        sum += chunk_energies_[k];
+                    }
+                    
+                    double z = 10 * std::log10(1e-37 + sum / len);
+                    if (weighting_ == kWeightingK) z -= 0.691; // ステレオの1kHz正弦波で0になるように補正。
+                    blocks.push_back(z);
+                    result.max_loudness = std::max<Float>(result.max_loudness, z);
+                    
+                    // -70 <-> [-70, -69)
+                    int index = std::floor(z) + 70;
+                    if (0 <= index && index < (int)histo.size()) {
+                        histo[index]++;
+                    }
                 }
                 
-                double mean = sum / (1e-37 + count);
-                if (k == 0) {
-                    threshold = mean + relative_threshold_db;
-                }
-                else if (k == 1) {
-                    if (loudness) {
-                        *loudness = mean;
+                double threshold = variant.absolute_threshold_db;
+                for (int k = 0; k < 2; k++) {
+                    double count = 0;
+                    double sum = 0;
+                    for (double z : blocks) {
+                        const bool valid = z >= threshold;
+                        count += valid;
+                        sum += valid * z;
+                    }
+                    
+                    double mean = sum / (1e-37 + count);
+                    if (k == 0) {
+                        threshold = mean + variant.relative_threshold_db;
+                    }
+                    else if (k == 1) {
+                        result.loudness = mean;
                     }
                 }
-            }
-            
-            if (loudness_range) {
+                
                 std::vector<Float> sorted_blocks;
                 for (double z : blocks) {
                     if (z < threshold) continue;
                     sorted_blocks.push_back(z);
                 }
                 std::sort(sorted_blocks.begin(), sorted_blocks.end());
+                const int sorted_count = sorted_blocks.size();
                 
                 double q10 = 0;
-                for (int i = 0; i < sorted_blocks.size(); i++) {
-                    if (10 * sorted_blocks.size() <= 100 * i) {
+                for (int i = 0; i < sorted_count; i++) {
+                    if (10 * sorted_count <= 100 * i) {
                         q10 = sorted_blocks[i];
                         break;
                     }
                 }
                 double q95 = 0;
-                for (int i = 0; i < sorted_blocks.size(); i++) {
-                    if (95 * sorted_blocks.size() <= 100 * i) {
+                for (int i = 0; i < sorted_count; i++) {
+                    if (95 * sorted_count <= 100 * i) {
                         q95 = sorted_blocks[i];
                         break;
                     }
                 }
-                *loudness_range = q95 - q10;
+                result.loudness_range = q95 - q10;
+                
+                result.block_samples = variant.width;
             }
+        }
+        
+        template class LoudnessAnalyzer<float>;
+        template class LoudnessAnalyzer<double>;
+        
+        template <typename Float>
+        void CalculateLoudnessCore(const Float *input, const int channels, const int samples, const int sample_freq,
+                                   const Float block_sec, const Float shift_sec, const Float absolute_threshold_db, const Float relative_threshold_db,
+                                   Float *loudness, Float *loudness_range, std::vector<int> *histogram,
+                                   std::vector<Float> *loudness_time_series,
+                                   int *block_samples, bool use_youtube_weighting, Float *max_loudness) {
+            typedef LoudnessAnalyzer<Float> Analyzer;
+            Analyzer analyzer(channels, sample_freq, use_youtube_weighting ? Analyzer::kWeightingYoutube : Analyzer::kWeightingK);
+            analyzer.AddVariant(block_sec, shift_sec, absolute_threshold_db, relative_threshold_db);
+            analyzer.Clock(input, samples);
+            analyzer.Finish();
             
-            if (loudness_time_series) {
-                *loudness_time_series = blocks;
-            }
-            if (block_samples) {
-                *block_samples = width;
-            }
+            const auto &result = analyzer.result(0);
+            if (loudness) *loudness = result.loudness;
+            if (loudness_range) *loudness_range = result.loudness_range;
+            if (histogram) *histogram = result.histogram;
+            if (loudness_time_series) *loudness_time_series = result.time_series;
+            if (block_samples) *block_samples = result.block_samples;
+            if (max_loudness) *max_loudness = result.max_loudness;
         }
         template void CalculateLoudnessCore<float>(const float *input, const int channels, const int samples, const int sample_freq,
                                    const float block_sec, const float shift_sec, const float absolute_threshold_db, const float relative_threshold_db,
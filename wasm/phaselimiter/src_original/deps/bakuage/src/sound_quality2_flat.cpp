@@ -0,0 +1,685 @@
+#include "bakuage/sound_quality2_flat.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/stream.hpp>
+
+#include "bakuage/vector_math.h"
+
+namespace bakuage {
+namespace {
+using namespace sound_quality2_flat;
+
+typedef SoundQuality2CalculatorUnit::Band Band;
+static_assert(sizeof(Band) == 2 * sizeof(float) &&
+                  std::is_standard_layout<Band>::value,
+              "Band must be two packed floats");
+
+bool IsLittleEndian() {
+  const uint16_t x = 1;
+  uint8_t first;
+  std::memcpy(&first, &x, 1);
+  return first == 1;
+}
+
+size_t AlignUp(size_t x) { return (x + kAlignment - 1) / kAlignment * kAlignment; }
+
+std::runtime_error InvalidData(const std::string &what) {
+  return std::runtime_error("invalid flat sound_quality2_cache: " + what);
+}
+
+class SectionWriter {
+public:
+  SectionWriter(std::vector<char> *output)
+      : output_(output), section_count_(0) {
+    output_->assign(AlignUp(sizeof(FileHeader)), 0);
+  }
+
+  template <class T>
+  void Add(SectionType type, const T *data, size_t count) {
+    SectionHeader header;
+    header.type = type;
+    header.element_size = sizeof(T);
+    header.count = count;
+    Append(&header, sizeof(header));
+    Append(data, sizeof(T) * count);
+    section_count_++;
+  }
+
+  void Finish() {
+    FileHeader header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.section_count = section_count_;
+    header.file_size = output_->size();
+    std::memcpy(output_->data(), &header, sizeof(header));
+  }
+
+private:
+  void Append(const void *data, size_t size) {
+    const size_t pos = output_->size();
+    output_->resize(AlignUp(pos + size));
+    if (size) {
+      std::memcpy(output_->data() + pos, data, size);
+    }
+  }
+
+  std::vector<char> *output_;
+  uint32_t section_count_;
+};
+
+class SectionReader {
+public:
+  SectionReader(const char *data, size_t size)
+      : data_(data), size_(size), pos_(AlignUp(sizeof(FileHeader))),
+        section_count_(0) {}
+
+  template <class T> const T *Read(SectionType type, size_t *count) {
+    if (pos_ + sizeof(SectionHeader) > size_) {
+      throw InvalidData("truncated");
+    }
+    SectionHeader header;
+    std::memcpy(&header, data_ + pos_, sizeof(header));
+    if (header.type != type || header.element_size != sizeof(T)) {
+      throw InvalidData("unexpected section " + std::to_string(header.type) +
+                        " (expected " + std::to_string(type) + ")");
+    }
+    pos_ = AlignUp(pos_ + sizeof(SectionHeader));
+    if (pos_ > size_ || header.count > (size_ - pos_) / sizeof(T)) {
+      throw InvalidData("truncated");
+    }
+    const T *result = reinterpret_cast<const T *>(data_ + pos_);
+    pos_ = AlignUp(pos_ + sizeof(T) * header.count);
+    *count = header.count;
+    section_count_++;
+    return result;
+  }
+
+  template <class T> const T *Read(SectionType type, size_t expected_count) {
+    size_t count;
+    const T *result = Read<T>(type, &count);
+    if (count != expected_count) {
+      throw InvalidData("unexpected size of section " + std::to_string(type));
+    }
+    return result;
+  }
+
+  uint32_t section_count() const { return section_count_; }
+
+private:
+  const char *data_;
+  size_t size_;
+  size_t pos_;
+  uint32_t section_count_;
+};
+
+// hnswlib の VisitedList と同じくタグで訪問済みを管理する
+std::vector<uint32_t> &ThreadLocalVisited(int point_count,
+                                          uint32_t *tag) {
+  static thread_local std::vector<uint32_t> visited;
+  static thread_local uint32_t current_tag = 0;
+  current_tag++;
+  if (current_tag == 0) {
+    std::fill(visited.begin(), visited.end(), 0);
+    current_tag = 1;
+  }
+  if (visited.size() < static_cast<size_t>(point_count)) {
+    visited.resize(point_count, 0);
+  }
+  *tag = current_tag;
+  return visited;
+}
+
+inline void Prefetch(const void *p) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(p);
+#endif
+}
+
+// VectorNormDiffL2<float> と同じ順序で足す (ビット単位で一致する)。
+// 関数ポインタを通さずにインライン展開させる
+inline float NormDiffL2(const float *query, const float *p, int n) {
+  float sum = 0;
+  for (int i = 0; i < n; i++) {
+    const float diff = query[i] - p[i];
+    sum += diff * diff;
+  }
+  return std::sqrt(sum);
+}
+
+// NormDiffL2 を4点同時に計算する。和は点ごとに逐次の依存になるので、
+// 4点分の独立な和を並べて並列に計算させる (足す順序は NormDiffL2 と同じ)
+inline void NormDiffL2x4(const float *query, const float *p0, const float *p1,
+                         const float *p2, const float *p3, int n,
+                         float *output) {
+  float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+  for (int i = 0; i < n; i++) {
+    const float q = query[i];
+    const float diff0 = q - p0[i];
+    const float diff1 = q - p1[i];
+    const float diff2 = q - p2[i];
+    const float diff3 = q - p3[i];
+    sum0 += diff0 * diff0;
+    sum1 += diff1 * diff1;
+    sum2 += diff2 * diff2;
+    sum3 += diff3 * diff3;
+  }
+  output[0] = std::sqrt(sum0);
+  output[1] = std::sqrt(sum1);
+  output[2] = std::sqrt(sum2);
+  output[3] = std::sqrt(sum3);
+}
+} // namespace
+
+void FlatSoundQuality2Writer::Write(const SoundQuality2Calculator &calculator,
+                                    std::vector<char> *output) {
+  if (!IsLittleEndian()) {
+    throw std::runtime_error(
+        "flat sound_quality2_cache requires a little endian host");
+  }
+  SectionWriter writer(output);
+  writer.Add(kSectionSortedLofs, calculator.sorted_reference_lofs_.data(),
+             calculator.sorted_reference_lofs_.size());
+
+  const SoundQuality2CalculatorUnit *units[] = {&calculator.full_unit_,
+                                                &calculator.mean_only_unit_};
+  for (const auto unit : units) {
+    const auto &lof = unit->lof_;
+    const auto &hnsw = *lof.hnsw_;
+    const int point_count = lof.points_.size();
+    const int vec_size = point_count ? lof.points_[0].vec_size() : 0;
+    if (hnsw.cur_element_count != static_cast<size_t>(point_count) ||
+        hnsw.num_deleted_) {
+      throw std::logic_error("FlatSoundQuality2Writer: unsupported hnsw state");
+    }
+
+    int32_t info[kUnitInfoSize];
+    info[kUnitInfoMode] = unit->mode_;
+    info[kUnitInfoBandCount] = unit->bands_.size();
+    info[kUnitInfoVecSize] = vec_size;
+    info[kUnitInfoPointCount] = point_count;
+    info[kUnitInfoLofK] = lof.k_;
+    info[kUnitInfoMaxLevel] = hnsw.maxlevel_;
+    info[kUnitInfoEnterpoint] = hnsw.enterpoint_node_;
+    info[kUnitInfoMaxM0] = hnsw.maxM0_;
+    info[kUnitInfoMaxM] = hnsw.maxM_;
+    info[kUnitInfoEf] = hnsw.ef_;
+    writer.Add(kSectionUnitInfo, info, kUnitInfoSize);
+
+    writer.Add(kSectionBands,
+               reinterpret_cast<const float *>(unit->bands_.data()),
+               2 * unit->bands_.size());
+    writer.Add(kSectionUnitSortedLofs, unit->sorted_reference_lofs_.data(),
+               unit->sorted_reference_lofs_.size());
+    // mean only の unit の scaler は full の長さのまま (先頭だけ使われる)
+    if (unit->standard_scaler_shifts_.size() < static_cast<size_t>(vec_size) ||
+        unit->standard_scaler_scales_.size() < static_cast<size_t>(vec_size) ||
+        unit->pca_mat_.rows() != vec_size ||
+        unit->pca_mat_.cols() != vec_size) {
+      throw std::logic_error("FlatSoundQuality2Writer: inconsistent unit");
+    }
+    writer.Add(kSectionScalerShifts, unit->standard_scaler_shifts_.data(),
+               vec_size);
+    writer.Add(kSectionScalerScales, unit->standard_scaler_scales_.data(),
+               vec_size);
+    writer.Add(kSectionPcaMat, unit->pca_mat_.data(), unit->pca_mat_.size());
+
+    std::vector<float> points(static_cast<size_t>(point_count) * vec_size);
+    for (int i = 0; i < point_count; i++) {
+      if (lof.points_[i].vec_size() != vec_size) {
+        throw std::logic_error("FlatSoundQuality2Writer: inconsistent points");
+      }
+      std::copy_n(lof.points_[i].vec(), vec_size,
+                  points.data() + static_cast<size_t>(i) * vec_size);
+    }
+    writer.Add(kSectionPoints, points.data(), points.size());
+    writer.Add(kSectionKds, lof.kds_.data(), point_count);
+    writer.Add(kSectionLrds, lof.lrds_.data(), point_count);
+
+    std::vector<uint32_t> level0(static_cast<size_t>(point_count) *
+                                 (hnsw.maxM0_ + 1));
+    std::vector<uint32_t> point_data(point_count);
+    std::vector<uint32_t> labels(point_count);
+    std::vector<uint32_t> upper_link_offsets(point_count + 1);
+    std::vector<uint32_t> upper_links;
+    for (int i = 0; i < point_count; i++) {
+      const auto list = hnsw.get_linklist0(i);
+      const int count = hnsw.getListCount(list);
+      uint32_t *row = level0.data() + static_cast<size_t>(i) * (hnsw.maxM0_ + 1);
+      row[0] = count;
+      std::copy_n(list + 1, count, row + 1);
+
+      LofPoint p;
+      std::memcpy(&p, hnsw.getDataByInternalId(i), sizeof(p));
+      point_data[i] = p;
+      labels[i] = hnsw.getExternalLabel(i);
+
+      upper_link_offsets[i] = upper_links.size();
+      for (int level = 1; level <= hnsw.element_levels_[i]; level++) {
+        const auto upper_list = hnsw.get_linklist(i, level);
+        const int upper_count = hnsw.getListCount(upper_list);
+        const size_t pos = upper_links.size();
+        upper_links.resize(pos + hnsw.maxM_ + 1);
+        upper_links[pos] = upper_count;
+        std::copy_n(upper_list + 1, upper_count, upper_links.data() + pos + 1);
+      }
+    }
+    upper_link_offsets[point_count] = upper_links.size();
+    writer.Add(kSectionLevel0Links, level0.data(), level0.size());
+    writer.Add(kSectionPointData, point_data.data(), point_data.size());
+    writer.Add(kSectionLabels, labels.data(), labels.size());
+    writer.Add(kSectionUpperLinkOffsets, upper_link_offsets.data(),
+               upper_link_offsets.size());
+    writer.Add(kSectionUpperLinks, upper_links.data(), upper_links.size());
+  }
+  writer.Finish();
+}
+
+FlatSoundQuality2Calculator::FlatSoundQuality2Calculator(
+    std::shared_ptr<const void> owner, const void *data, size_t size)
+    : owner_(std::move(owner)) {
+  if (!IsLittleEndian()) {
+    throw std::runtime_error(
+        "flat sound_quality2_cache requires a little endian host");
+  }
+  if (!IsFlatSoundQuality2Cache(data, size)) {
+    throw InvalidData("bad magic");
+  }
+  if (reinterpret_cast<uintptr_t>(data) % alignof(double)) {
+    throw InvalidData("misaligned buffer");
+  }
+  FileHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  if (header.version != kVersion) {
+    throw InvalidData("unsupported version " + std::to_string(header.version));
+  }
+  if (header.file_size > size) {
+    throw InvalidData("truncated");
+  }
+
+  SectionReader reader(static_cast<const char *>(data), header.file_size);
+  sorted_reference_lofs_ =
+      reader.Read<float>(kSectionSortedLofs, &sorted_reference_lof_count_);
+  for (int unit_index = 0; unit_index < 2; unit_index++) {
+    Unit &unit = units_[unit_index];
+    const int32_t *info = reader.Read<int32_t>(kSectionUnitInfo, kUnitInfoSize);
+    unit.mode = info[kUnitInfoMode];
+    unit.band_count = info[kUnitInfoBandCount];
+    unit.vec_size = info[kUnitInfoVecSize];
+    unit.point_count = info[kUnitInfoPointCount];
+    unit.lof_k = info[kUnitInfoLofK];
+    unit.max_level = info[kUnitInfoMaxLevel];
+    unit.enterpoint = info[kUnitInfoEnterpoint];
+    unit.max_m0 = info[kUnitInfoMaxM0];
+    unit.max_m = info[kUnitInfoMaxM];
+    unit.ef = info[kUnitInfoEf];
+    const int expected_mode = unit_index == 0
+                                  ? SoundQuality2CalculatorUnit::kModeFull
+                                  : SoundQuality2CalculatorUnit::kModeMeanOnly;
+    if (unit.mode != expected_mode || unit.band_count < 0 ||
+        unit.vec_size <= 0 || unit.point_count <= 0 || unit.lof_k <= 0 ||
+        unit.max_level < 0 || unit.enterpoint < 0 ||
+        unit.enterpoint >= unit.point_count || unit.max_m0 <= 0 ||
+        unit.max_m <= 0 || unit.ef <= 0) {
+      throw InvalidData("bad unit info");
+    }
+
+    const size_t n = unit.point_count;
+    const size_t vec_size = unit.vec_size;
+    unit.bands = reinterpret_cast<const Band *>(
+        reader.Read<float>(kSectionBands, 2 * unit.band_count));
+    unit.sorted_reference_lofs = reader.Read<float>(
+        kSectionUnitSortedLofs, &unit.sorted_reference_lof_count);
+    unit.standard_scaler_shifts =
+        reader.Read<float>(kSectionScalerShifts, vec_size);
+    unit.standard_scaler_scales =
+        reader.Read<float>(kSectionScalerScales, vec_size);
+    unit.pca_mat = reader.Read<double>(kSectionPcaMat, vec_size * vec_size);
+    unit.points = reader.Read<float>(kSectionPoints, n * vec_size);
+    unit.kds = reader.Read<float>(kSectionKds, n);
+    unit.lrds = reader.Read<float>(kSectionLrds, n);
+    unit.level0 =
+        reader.Read<uint32_t>(kSectionLevel0Links, n * (unit.max_m0 + 1));
+    unit.point_data = reader.Read<uint32_t>(kSectionPointData, n);
+    unit.labels = reader.Read<uint32_t>(kSectionLabels, n);
+    unit.upper_link_offsets =
+        reader.Read<uint32_t>(kSectionUpperLinkOffsets, n + 1);
+    size_t upper_link_count;
+    unit.upper_links =
+        reader.Read<uint32_t>(kSectionUpperLinks, &upper_link_count);
+
+    // 探索中に範囲外を読まないように、グラフを一通り検証しておく
+    const size_t upper_stride = unit.max_m + 1;
+    const auto level_of = [&unit, upper_stride](uint32_t i) {
+      return static_cast<int>(
+          (unit.upper_link_offsets[i + 1] - unit.upper_link_offsets[i]) /
+          upper_stride);
+    };
+    if (unit.upper_link_offsets[0] != 0 ||
+        unit.upper_link_offsets[n] != upper_link_count) {
+      throw InvalidData("bad hnsw upper links");
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (unit.upper_link_offsets[i + 1] < unit.upper_link_offsets[i] ||
+          (unit.upper_link_offsets[i + 1] - unit.upper_link_offsets[i]) %
+              upper_stride) {
+        throw InvalidData("bad hnsw upper links");
+      }
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (unit.point_data[i] >= n || unit.labels[i] >= n) {
+        throw InvalidData("bad hnsw point");
+      }
+      const uint32_t *list = unit.level0_links(i);
+      if (list[0] > static_cast<uint32_t>(unit.max_m0)) {
+        throw InvalidData("bad hnsw level0 links");
+      }
+      for (uint32_t j = 1; j <= list[0]; j++) {
+        if (list[j] >= n) {
+          throw InvalidData("bad hnsw level0 links");
+        }
+      }
+      const int level = level_of(i);
+      if (level > unit.max_level) {
+        throw InvalidData("bad hnsw level");
+      }
+      for (int l = 1; l <= level; l++) {
+        const uint32_t *upper_list = unit.upper_link_list(i, l);
+        if (upper_list[0] > static_cast<uint32_t>(unit.max_m)) {
+          throw InvalidData("bad hnsw upper links");
+        }
+        for (uint32_t j = 1; j <= upper_list[0]; j++) {
+          if (upper_list[j] >= n || level_of(upper_list[j]) < l) {
+            throw InvalidData("bad hnsw upper links");
+          }
+        }
+      }
+    }
+    if (level_of(unit.enterpoint) < unit.max_level) {
+      throw InvalidData("bad hnsw enterpoint");
+    }
+  }
+  if (units_[0].band_count != units_[1].band_count) {
+    throw InvalidData("band count mismatch");
+  }
+  if (reader.section_count() != header.section_count) {
+    throw InvalidData("unexpected section count");
+  }
+}
+
+double FlatSoundQuality2Calculator::CalculateDistance(
+    const MasteringReference2 &reference,
+    const MasteringReference2 &target) const {
+  double distance = 0;
+  for (const auto &unit : units_) {
+    distance += unit.CalculateDistance(reference, target);
+  }
+  return distance;
+}
+
+void FlatSoundQuality2Calculator::CalculateSoundQuality(
+    const MasteringReference2 &reference, float *output_sound_quality,
+    float *output_lof) const {
+  CalculateSoundQuality(&reference, 1, output_sound_quality, output_lof);
+}
+
+void FlatSoundQuality2Calculator::CalculateSoundQuality(
+    const MasteringReference2 *references, int count,
+    float *output_sound_quality, float *output_lof) const {
+  std::vector<float> unit_sound_qualities[2];
+  for (int u = 0; u < 2; u++) {
+    unit_sound_qualities[u].resize(count);
+    units_[u].CalculateSoundQuality(references, count,
+                                    unit_sound_qualities[u].data());
+  }
+
+  for (int i = 0; i < count; i++) {
+    // SoundQuality2Calculator::CalculateSoundQuality と同じ
+    double mean_lof = 0;
+    for (const auto &sound_qualities : unit_sound_qualities) {
+      mean_lof += -sound_qualities[i];
+    }
+    mean_lof /= 2;
+
+    if (output_sound_quality) {
+      const auto it = std::lower_bound(
+          sorted_reference_lofs_,
+          sorted_reference_lofs_ + sorted_reference_lof_count_, mean_lof);
+      const int pos = std::distance(sorted_reference_lofs_, it);
+      output_sound_quality[i] =
+          1.0 - 1.0 * pos / sorted_reference_lof_count_;
+    }
+    if (output_lof) {
+      output_lof[i] = mean_lof;
+    }
+  }
+}
+
+// SoundQuality2CalculatorUnit::PreprocessReference と同じ
+void FlatSoundQuality2Calculator::Unit::Preprocess(
+    const MasteringReference2 &reference, std::vector<float> *output) const {
+  const int size = mode == SoundQuality2CalculatorUnit::kModeMeanOnly
+                       ? reference.mean_count()
+                       : reference.vec_size();
+  if (size != vec_size) {
+    throw std::logic_error(
+        "FlatSoundQuality2Calculator: reference size mismatch");
+  }
+  Eigen::VectorXd vec(size);
+  for (int j = 0; j < size; j++) {
+    vec[j] = (reference.vec()[j] + standard_scaler_shifts[j]) *
+             standard_scaler_scales[j];
+  }
+  const Eigen::VectorXd transformed =
+      Eigen::Map<const Eigen::MatrixXd>(pca_mat, size, size) * vec;
+  output->resize(size);
+  for (int j = 0; j < size; j++) {
+    (*output)[j] = transformed[j];
+  }
+}
+
+void FlatSoundQuality2Calculator::Unit::CalculateDistances(
+    const float *query, const uint32_t *ids, int count, float *output) const {
+  for (int i = 0; i < count; i++) {
+    Prefetch(point(ids[i]));
+  }
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    NormDiffL2x4(query, point(ids[i]), point(ids[i + 1]), point(ids[i + 2]),
+                 point(ids[i + 3]), vec_size, output + i);
+  }
+  for (; i < count; i++) {
+    output[i] = NormDiffL2(query, point(ids[i]), vec_size);
+  }
+}
+
+// hnswlib::HierarchicalNSW::searchKnn (bare bone search) と同じ順序で探索する
+FlatSoundQuality2Calculator::Unit::KnnQueue
+FlatSoundQuality2Calculator::Unit::SearchKnn(const float *query,
+                                             int k) const {
+  typedef std::pair<float, uint32_t> Pair;
+  struct CompareByFirst {
+    bool operator()(const Pair &a, const Pair &b) const {
+      return a.first < b.first;
+    }
+  };
+  typedef std::priority_queue<Pair, std::vector<Pair>, CompareByFirst> Queue;
+  const auto distance = [this, query](uint32_t internal_id) {
+    return NormDiffL2(query, point(internal_id), vec_size);
+  };
+  // 距離はリストごとにまとめて計算する (更新の順序は変えない)
+  static thread_local std::vector<float> distances;
+  static thread_local std::vector<uint32_t> unvisited;
+  distances.resize(std::max<size_t>(distances.size(), std::max(max_m, max_m0)));
+  unvisited.resize(std::max<size_t>(unvisited.size(), max_m0));
+
+  uint32_t current = enterpoint;
+  float current_distance = distance(current);
+  for (int level = max_level; level > 0; level--) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      const uint32_t *list = upper_link_list(current, level);
+      CalculateDistances(query, list + 1, list[0], distances.data());
+      for (uint32_t i = 1; i <= list[0]; i++) {
+        const float d = distances[i - 1];
+        if (d < current_distance) {
+          current_distance = d;
+          current = list[i];
+          changed = true;
+        }
+      }
+    }
+  }
+
+  const size_t search_ef = std::max<size_t>(ef, k);
+  uint32_t visited_tag;
+  auto &visited = ThreadLocalVisited(point_count, &visited_tag);
+  Queue top_candidates;
+  Queue candidate_set;
+  float lower_bound = distance(current);
+  top_candidates.emplace(lower_bound, current);
+  candidate_set.emplace(-lower_bound, current);
+  visited[current] = visited_tag;
+
+  while (!candidate_set.empty()) {
+    const Pair current_pair = candidate_set.top();
+    if (-current_pair.first > lower_bound) {
+      break;
+    }
+    candidate_set.pop();
+
+    const uint32_t *list = level0_links(current_pair.second);
+    for (uint32_t j = 1; j <= list[0]; j++) {
+      Prefetch(&visited[list[j]]);
+    }
+    int unvisited_count = 0;
+    for (uint32_t j = 1; j <= list[0]; j++) {
+      const uint32_t candidate = list[j];
+      if (visited[candidate] == visited_tag) {
+        continue;
+      }
+      visited[candidate] = visited_tag;
+      unvisited[unvisited_count++] = candidate;
+    }
+    CalculateDistances(query, unvisited.data(), unvisited_count,
+                       distances.data());
+
+    for (int j = 0; j < unvisited_count; j++) {
+      const uint32_t candidate = unvisited[j];
+      const float d = distances[j];
+      if (top_candidates.size() < search_ef || lower_bound > d) {
+        candidate_set.emplace(-d, candidate);
+        top_candidates.emplace(d, candidate);
+        while (top_candidates.size() > search_ef) {
+          top_candidates.pop();
+        }
+        if (!top_candidates.empty()) {
+          lower_bound = top_candidates.top().first;
+        }
+      }
+    }
+    // 次に展開する点のリンク
+    if (!candidate_set.empty()) {
+      Prefetch(level0_links(candidate_set.top().second));
+    }
+  }
+
+  while (top_candidates.size() > static_cast<size_t>(k)) {
+    top_candidates.pop();
+  }
+  KnnQueue result;
+  while (top_candidates.size() > 0) {
+    const Pair &pair = top_candidates.top();
+    result.emplace(pair.first, labels[pair.second]);
+    top_candidates.pop();
+  }
+  return result;
+}
+
+// Lof::CalculateLof と同じ
+float FlatSoundQuality2Calculator::Unit::CalculateLof(
+    const float *query) const {
+  auto neighbors_queue = SearchKnn(query, lof_k);
+  const int neighbors_size = neighbors_queue.size();
+
+  float dist_sum = 0;
+  float lrd_sum = 0;
+  while (neighbors_queue.size()) {
+    const auto &pair = neighbors_queue.top();
+    // reachable distance
+    dist_sum += (std::max)(pair.first, kds[pair.second]);
+    lrd_sum += lrds[pair.second];
+    neighbors_queue.pop();
+  }
+  const float dist_mean = dist_sum / (1e-37 + neighbors_size);
+  const float lrd = 1.0 / (1e-37 + dist_mean);
+  return lrd_sum / (1e-37 + neighbors_size * lrd);
+}
+
+void FlatSoundQuality2Calculator::Unit::CalculateSoundQuality(
+    const MasteringReference2 *references, int count,
+    float *output_sound_quality) const {
+  std::vector<float> preprocessed;
+  for (int i = 0; i < count; i++) {
+    Preprocess(references[i], &preprocessed);
+    const float lof = CalculateLof(preprocessed.data());
+    const auto it = std::lower_bound(
+        sorted_reference_lofs,
+        sorted_reference_lofs + sorted_reference_lof_count, lof);
+    const int pos = std::distance(sorted_reference_lofs, it);
+    output_sound_quality[i] = 1.0 - 1.0 * pos / sorted_reference_lof_count;
+  }
+}
+
+double FlatSoundQuality2Calculator::Unit::CalculateDistance(
+    const MasteringReference2 &reference,
+    const MasteringReference2 &target) const {
+  std::vector<float> preprocessed;
+  std::vector<float> preprocessed_target;
+  Preprocess(reference, &preprocessed);
+  Preprocess(target, &preprocessed_target);
+  return VectorNormDiffL2(preprocessed.data(), preprocessed_target.data(),
+                          vec_size);
+}
+
+bool IsFlatSoundQuality2Cache(const void *data, size_t size) {
+  return size >= sizeof(FileHeader) &&
+         std::memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+std::shared_ptr<const FlatSoundQuality2Calculator>
+LoadFlatSoundQuality2Calculator(std::shared_ptr<const void> owner,
+                                const void *data, size_t size) {
+  if (IsFlatSoundQuality2Cache(data, size)) {
+    return std::make_shared<const FlatSoundQuality2Calculator>(owner, data,
+                                                               size);
+  }
+
+  // 旧形式 (boost binary_iarchive)
+  SoundQuality2Calculator calculator;
+  {
+    boost::iostreams::stream<boost::iostreams::array_source> is(
+        static_cast<const char *>(data), size);
+    boost::archive::binary_iarchive ia(is);
+    ia >> calculator;
+  }
+  auto buffer = std::make_shared<std::vector<char>>();
+  FlatSoundQuality2Writer::Write(calculator, buffer.get());
+  return std::make_shared<const FlatSoundQuality2Calculator>(
+      buffer, buffer->data(), buffer->size());
+}
+
+std::shared_ptr<const FlatSoundQuality2Calculator>
+LoadFlatSoundQuality2Calculator(const std::string &path) {
+  auto file = std::make_shared<boost::iostreams::mapped_file_source>(path);
+  return LoadFlatSoundQuality2Calculator(file, file->data(), file->size());
+}
+} // namespace bakuage
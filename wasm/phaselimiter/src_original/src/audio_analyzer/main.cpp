@@ -30,7 +30,7 @@ DEFINE_string(spectrum_distribution_output, "", "spectrum distribution output pn
 DEFINE_string(stereo_distribution_output, "", "stereo distribution output png path");
 DEFINE_string(analysis_data_dir, "resource/analysis_data", "analysis data dir path");
 DEFINE_string(sound_quality2_cache, "resource/sound_quality2_cache", "sound quality2 cache path.");
-DEFINE_string(sound_quality2_cache_archiver, "binary", "sound quality2 cache archiver type. binary/text");
+DEFINE_string(sound_quality2_cache_archiver, "binary", "sound quality2 cache archiver type. binary/text/flat");
 DEFINE_int32(mastering3_acoustic_entropy_band_count, 40, "band count of mel bands used by mastering3 acoustic entropy");
 DEFINE_int32(true_peak_oversample, 4, "true peak oversample");
 
@@ -41,7 +41,7 @@ DEFINE_double(youtube_loudness_shift_sec, 0.1, "youtube loudness shift sec");
 DEFINE_double(youtube_loudness_absolute_threshold, -70, "youtube loudness absolute threshold");
 DEFINE_double(youtube_loudness_relative_threshold, -10, "youtube loudness relative threshold");
 
-DEFINE_string(mode, "default", "default / sound_quality2_preparation / sound_quality2_find_nn / sound_quality_test / dft_test");
+DEFINE_string(mode, "default", "default / sound_quality2_preparation / sound_quality2_find_nn / sound_quality_test / sound_quality2_flat_test / dft_test / polyphase_resampler_test / partitioned_convolution_test / decimator_test");
 
 #ifdef _MSC_VER
 DEFINE_string(tmp, "tmp", "Temporary file directory.");
@@ -66,7 +66,11 @@ using std::fprintf;
 void PrepareSoundQuality2();
 void SoundQuality2FindNn();
 void TestSoundQuality();
+void TestSoundQuality2Flat();
 void TestDft();
+void TestPolyphaseResampler();
+void TestPartitionedConvolution();
+void TestDecimator();
 
 int main(int argc, char* argv[]) {
     int exit_status = 0;
@@ -95,9 +99,21 @@ int main(int argc, char* argv[]) {
 		else if (FLAGS_mode == "sound_quality_test") {
 			TestSoundQuality();
 		}
+		else if (FLAGS_mode == "sound_quality2_flat_test") {
+			TestSoundQuality2Flat();
+		}
 		else if (FLAGS_mode == "dft_test") {
 			TestDft();
 		}
+		else if (FLAGS_mode == "polyphase_resampler_test") {
+			TestPolyphaseResampler();
+		}
+		else if (FLAGS_mode == "partitioned_convolution_test") {
+			TestPartitionedConvolution();
+		}
+		else if (FLAGS_mode == "decimator_test") {
+			TestDecimator();
+		}
 		else {
 			throw std::logic_error("Unknown mode");
 		}
@@ -9,6 +9,7 @@
 #include "bakuage/memory.h"
 #include "bakuage/loudness_filter.h"
 #include "bakuage/ms_compressor_filter.h"
+#include "bakuage/shared_stft.h"
 #include "bakuage/utils.h"
 
 namespace audio_analyzer {
@@ -79,18 +80,15 @@ Float Mean(const std::vector<Float> &v) {
 // だから、STFTを使った解析をする。
 // BS.1770を少し拡張した感じ(bandが一つのときにBS.1770と等価になるようにする <- 窓関数かけないとダメだ)
 
+// STFTの部分はSharedStftのconsumerとして、
+// 同じパラメータのCalculateMultibandLoudnessとCalculateMultibandLoudness2で共有できるようにしている
+// 入力: LoudnessFilterWave
+// STFT: 幅MultibandLoudnessWidth, シフトMultibandLoudnessShift, 先頭0, MultibandLoudnessWindow
+
 template <typename Float>
-void CalculateMultibandLoudness(const Float *input, const int channels, const int samples, const int sample_freq,
-	const Float block_sec, const Float shift_sec, const Float relative_threshold_db,
-	Band<Float> *bands, const int band_count, int *block_samples) {
+std::vector<Float> LoudnessFilterWave(const Float *input, const int channels, const int samples, const int sample_freq) {
 	using namespace bakuage;
-
-	// 400ms block
-	int width = (int)(sample_freq * block_sec); // nearest samples
-	int shift = (int)(sample_freq * shift_sec);
-
 	std::vector<Float> filtered(channels * samples);
-	std::vector<LoudnessFilter<double>> filters;
 	for (int i = 0; i < channels; i++) {
 		LoudnessFilter<double> filter(sample_freq);
 		for (int j = 0; j < samples; j++) {
@@ -98,76 +96,145 @@ void CalculateMultibandLoudness(const Float *input, const int channels, const in
 			filtered[k] = filter.Clock(input[k]);
 		}
 	}
+	return filtered;
+}
 
-	std::vector<std::vector<Float>> blocks(band_count);
-	std::vector<std::vector<Float>> mid_to_side_blocks(band_count);
+template <typename Float>
+int MultibandLoudnessWidth(const int sample_freq, const Float block_sec) {
+	return (int)(sample_freq * block_sec); // nearest samples
+}
 
-    const int spec_len = width / 2 + 1;
-    float *fft_input = (float *)bakuage::AlignedMalloc(sizeof(float) * width);
-	std::vector<std::complex<float> *> fft_outputs(channels);
-    for (int ch = 0; ch < channels; ch++) {
-        fft_outputs[ch] = (std::complex<float> *)bakuage::AlignedMalloc(sizeof(std::complex<float>) * spec_len);
-    }
-    bakuage::RealDft<float> dft(width);
+template <typename Float>
+int MultibandLoudnessShift(const int sample_freq, const Float shift_sec) {
+	return (int)(sample_freq * shift_sec);
+}
 
-	// FFTの正規化も行う (sqrt(hanning)窓)
+// FFTの正規化も行う (sqrt(hanning)窓)
+inline std::vector<float> MultibandLoudnessWindow(const int width) {
 	std::vector<float> window(width);
 	for (int i = 0; i < width; i++) {
 		window[i] = std::sqrt(0.5 - 0.5 * std::cos(2.0 * M_PI * i / width)) / std::sqrt(width);
 	}
+	return window;
+}
 
-	int pos = 0;
-	// 規格では最後のブロックは使わないけど、
-	// 使ったほうが実用的なので使う
-	while (pos < samples) {
-		int end = std::min<int>(pos + width, samples);
+// CalculateMultibandLoudnessのSTFT部分
+template <typename Float>
+class MultibandLoudnessBlocks {
+public:
+	MultibandLoudnessBlocks(const Band<Float> *bands, const int band_count, const int sample_freq, const int width):
+		width_(width), blocks_(band_count), mid_to_side_blocks_(band_count),
+		low_bin_indices_(band_count), high_bin_indices_(band_count) {
+		const int spec_len = width / 2 + 1;
+		for (int band_index = 0; band_index < band_count; band_index++) {
+			low_bin_indices_[band_index] = std::floor(width * bands[band_index].low_freq / sample_freq);
+			high_bin_indices_[band_index] = std::min<int>(std::floor(width * bands[band_index].high_freq / sample_freq), spec_len);
+		}
+	}
+
+	void Add(const bakuage::SharedStftBatch &batch) {
+		const int channels = batch.channels();
+		for (int frame = 0; frame < batch.frame_count(); frame++) {
+			// binをbandに振り分けていく
+			for (int band_index = 0; band_index < blocks_.size(); band_index++) {
+				int low_bin_index = low_bin_indices_[band_index];
+				int high_bin_index = high_bin_indices_[band_index];
 
-		// FFT
-		for (int ch = 0; ch < channels; ch++) {
-			for (int i = 0; i < width; i++) {
-				fft_input[i] = pos + i < end ? filtered[channels * (pos + i) + ch] * window[i] : 0;
+				// total
+				double sum = 0;
+				for (int ch = 0; ch < channels; ch++) {
+					const auto fft_output = batch.spectrum(frame, ch);
+					for (int i = low_bin_index; i < high_bin_index; i++) {
+						sum += std::norm(fft_output[i]);
+					}
+				}
+				double z = -0.691 + 10 * std::log10(1e-37 + sum / (0.5 * width_)); // 0.5は窓関数の分
+				blocks_[band_index].push_back(z);
+
+				// mid to side
+				if (channels == 2) {
+					const auto fft_output0 = batch.spectrum(frame, 0);
+					const auto fft_output1 = batch.spectrum(frame, 1);
+					double mid_sum = 0;
+					double side_sum = 0;
+					for (int i = low_bin_index; i < high_bin_index; i++) {
+						mid_sum += std::norm(fft_output0[i] + fft_output1[i]);
+						side_sum += std::norm(fft_output0[i] - fft_output1[i]);
+					}
+					z = 10 * std::log10(1e-37 + side_sum / (1e-37 + mid_sum));
+					mid_to_side_blocks_[band_index].push_back(z);
+				}
 			}
-            dft.Forward(fft_input, (float *)fft_outputs[ch]);
 		}
+	}
 
-		// binをbandに振り分けていく
+	const std::vector<std::vector<Float>> &blocks() const { return blocks_; }
+	const std::vector<std::vector<Float>> &mid_to_side_blocks() const { return mid_to_side_blocks_; }
+private:
+	int width_;
+	std::vector<std::vector<Float>> blocks_;
+	std::vector<std::vector<Float>> mid_to_side_blocks_;
+	std::vector<int> low_bin_indices_;
+	std::vector<int> high_bin_indices_;
+};
+
+// CalculateMultibandLoudness2のSTFT部分 (stereo only)
+template <typename Float>
+class MultibandLoudness2Blocks {
+public:
+	MultibandLoudness2Blocks(const Band<Float> *bands, const int band_count, const int sample_freq, const int width):
+		width_(width), mid_blocks_(band_count), side_blocks_(band_count),
+		low_bin_indices_(band_count), high_bin_indices_(band_count) {
+		const int spec_len = width / 2 + 1;
 		for (int band_index = 0; band_index < band_count; band_index++) {
-			int low_bin_index = std::floor(width * bands[band_index].low_freq / sample_freq);
-			int high_bin_index = std::min<int>(std::floor(width * bands[band_index].high_freq / sample_freq), spec_len);
+			low_bin_indices_[band_index] = std::floor(width * bands[band_index].low_freq / sample_freq);
+			high_bin_indices_[band_index] = std::min<int>(std::floor(width * bands[band_index].high_freq / sample_freq), spec_len);
+		}
+	}
 
-			// total
-			double sum = 0;
-			for (int ch = 0; ch < channels; ch++) {
+	void Add(const bakuage::SharedStftBatch &batch) {
+		assert(batch.channels() == 2);
+		for (int frame = 0; frame < batch.frame_count(); frame++) {
+			const auto fft_output0 = batch.spectrum(frame, 0);
+			const auto fft_output1 = batch.spectrum(frame, 1);
+			// binをbandに振り分けていく
+			for (int band_index = 0; band_index < mid_blocks_.size(); band_index++) {
+				int low_bin_index = low_bin_indices_[band_index];
+				int high_bin_index = high_bin_indices_[band_index];
+
+				// mid
+				double sum = 0;
 				for (int i = low_bin_index; i < high_bin_index; i++) {
-                    sum += std::norm(fft_outputs[ch][i]);
+					sum += std::norm(fft_output0[i] + fft_output1[i]);
 				}
-			}
-			double z = -0.691 + 10 * std::log10(1e-37 + sum / (0.5 * width)); // 0.5は窓関数の分
-			blocks[band_index].push_back(z);
-
-			// -70 <-> [-70, -69)
-			/*int index = std::floor(z) + 70;
-			if (0 <= index && index < histo.size()) {
-			histo[index]++;
-			}*/
-
-			// mid to side
-			if (channels == 2) {
-				double mid_sum = 0;
-				double side_sum = 0;
+				mid_blocks_[band_index].push_back(10 * std::log10(1e-7//1e-37 
+					+ sum / (0.5 * width_)));
+				// side
+				sum = 0;
 				for (int i = low_bin_index; i < high_bin_index; i++) {
-                    mid_sum += std::norm(fft_outputs[0][i] + fft_outputs[1][i]);
-                    side_sum += std::norm(fft_outputs[0][i] - fft_outputs[1][i]);
+					sum += std::norm(fft_output0[i] - fft_output1[i]);
 				}
-				z = 10 * std::log10(1e-37 + side_sum / (1e-37 + mid_sum));
-				mid_to_side_blocks[band_index].push_back(z);
+				side_blocks_[band_index].push_back(10 * std::log10(1e-7//1e-37 
+					+ sum / (0.5 * width_)));
 			}
 		}
-
-		// 75% overlap
-		pos += shift;
 	}
 
+	const std::vector<std::vector<Float>> &mid_blocks() const { return mid_blocks_; }
+	const std::vector<std::vector<Float>> &side_blocks() const { return side_blocks_; }
+private:
+	int width_;
+	std::vector<std::vector<Float>> mid_blocks_;
+	std::vector<std::vector<Float>> side_blocks_;
+	std::vector<int> low_bin_indices_;
+	std::vector<int> high_bin_indices_;
+};
+
+template <typename Float>
+void FinishMultibandLoudness(const MultibandLoudnessBlocks<Float> &multiband_blocks, const Float relative_threshold_db,
+	Band<Float> *bands, const int band_count) {
+	const auto &blocks = multiband_blocks.blocks();
+	const auto &mid_to_side_blocks = multiband_blocks.mid_to_side_blocks();
 	for (int band_index = 0; band_index < band_count; band_index++) {
 		for (int calc_index = 0; calc_index < 2; calc_index++) {
 			const auto &band_blocks = calc_index == 0 ? blocks[band_index] : mid_to_side_blocks[band_index];
@@ -227,94 +294,37 @@ void CalculateMultibandLoudness(const Float *input, const int channels, const in
 		}
 	}
 
-	if (block_samples) {
-		*block_samples = width;
-	}
-    
-    bakuage::AlignedFree(fft_input);
-    for (int ch = 0; ch < channels; ch++) {
-        bakuage::AlignedFree(fft_outputs[ch]);
-    }
 }
 
-// stereo only
 template <typename Float>
-void CalculateMultibandLoudness2(const Float *input, const int channels, const int samples, const int sample_freq,
+void CalculateMultibandLoudness(const Float *input, const int channels, const int samples, const int sample_freq,
 	const Float block_sec, const Float shift_sec, const Float relative_threshold_db,
-	Band<Float> *bands, const int band_count, std::vector<std::vector<Float>> *covariance, int *block_samples) {
-	using namespace bakuage;
-
-	assert(channels == 2);
+	Band<Float> *bands, const int band_count, int *block_samples) {
+	const auto filtered = LoudnessFilterWave(input, channels, samples, sample_freq);
 
 	// 400ms block
-	int width = (int)(sample_freq * block_sec); // nearest samples
-	int shift = (int)(sample_freq * shift_sec);
-
-	std::vector<Float> filtered(channels * samples);
-	std::vector<LoudnessFilter<double>> filters;
-	for (int i = 0; i < channels; i++) {
-		LoudnessFilter<double> filter(sample_freq);
-		for (int j = 0; j < samples; j++) {
-			int k = channels * j + i;
-			filtered[k] = filter.Clock(input[k]);
-		}
-	}
-
-    const int spec_len = width / 2 + 1;
-    float *fft_input = (float *)bakuage::AlignedMalloc(sizeof(float) * width);
-    std::vector<std::complex<float> *> fft_outputs(channels);
-    for (int ch = 0; ch < channels; ch++) {
-        fft_outputs[ch] = (std::complex<float> *)bakuage::AlignedMalloc(sizeof(std::complex<float>) * spec_len);
-    }
-    bakuage::RealDft<float> dft(width);
-
-	// FFTの正規化も行う (sqrt(hanning)窓)
-	std::vector<float> window(width);
-	for (int i = 0; i < width; i++) {
-		window[i] = std::sqrt(0.5 - 0.5 * std::cos(2.0 * M_PI * i / width)) / std::sqrt(width);
-	}
-
-	int pos = 0;
-	std::vector<std::vector<Float>> mid_blocks(band_count);
-	std::vector<std::vector<Float>> side_blocks(band_count);
+	const int width = MultibandLoudnessWidth(sample_freq, block_sec);
+	const int shift = MultibandLoudnessShift(sample_freq, shift_sec);
+	MultibandLoudnessBlocks<Float> multiband_blocks(bands, band_count, sample_freq, width);
 	// 規格では最後のブロックは使わないけど、
 	// 使ったほうが実用的なので使う
-	while (pos < samples) {
-		int end = std::min<int>(pos + width, samples);
+	bakuage::SharedStft<Float> stft(width, shift, 0, MultibandLoudnessWindow(width));
+	stft.AddConsumer([&multiband_blocks](const bakuage::SharedStftBatch &batch) { multiband_blocks.Add(batch); });
+	stft.Run(filtered.data(), channels, samples);
 
-		// FFT
-		for (int ch = 0; ch < channels; ch++) {
-			for (int i = 0; i < width; i++) {
-				fft_input[i] = pos + i < end ? filtered[channels * (pos + i) + ch] * window[i] : 0;
-			}
-            dft.Forward(fft_input, (float *)fft_outputs[ch]);
-		}
+	FinishMultibandLoudness(multiband_blocks, relative_threshold_db, bands, band_count);
 
-		// binをbandに振り分けていく
-		for (int band_index = 0; band_index < band_count; band_index++) {
-			int low_bin_index = std::floor(width * bands[band_index].low_freq / sample_freq);
-			int high_bin_index = std::min<int>(std::floor(width * bands[band_index].high_freq / sample_freq), spec_len);
+	if (block_samples) {
+		*block_samples = width;
+	}
+}
 
-			// mid
-			double sum = 0;
-			for (int i = low_bin_index; i < high_bin_index; i++) {
-                sum += std::norm(fft_outputs[0][i] + fft_outputs[1][i]) ;
-			}
-			mid_blocks[band_index].push_back(10 * std::log10(1e-7//1e-37 
-				+ sum / (0.5 * width)));
-			// side
-			sum = 0;
-			for (int i = low_bin_index; i < high_bin_index; i++) {
-                sum += std::norm(fft_outputs[0][i] - fft_outputs[1][i]);
-			}
-			side_blocks[band_index].push_back(10 * std::log10(1e-7//1e-37 
-				+ sum / (0.5 * width)));
-		}
+template <typename Float>
+void FinishMultibandLoudness2(const MultibandLoudness2Blocks<Float> &multiband_blocks, const Float relative_threshold_db,
+	Band<Float> *bands, const int band_count, std::vector<std::vector<Float>> *covariance) {
+	const auto &mid_blocks = multiband_blocks.mid_blocks();
+	const auto &side_blocks = multiband_blocks.side_blocks();
 
-		// 75% overlap
-		pos += shift;
-	}
-	
 	// calculate mean
 	std::vector<Float> mid_threshold(band_count);
 	std::vector<Float> side_threshold(band_count);
@@ -389,14 +399,31 @@ void CalculateMultibandLoudness2(const Float *input, const int channels, const i
 		}
 	}
 
+}
+
+// stereo only
+template <typename Float>
+void CalculateMultibandLoudness2(const Float *input, const int channels, const int samples, const int sample_freq,
+	const Float block_sec, const Float shift_sec, const Float relative_threshold_db,
+	Band<Float> *bands, const int band_count, std::vector<std::vector<Float>> *covariance, int *block_samples) {
+	assert(channels == 2);
+	const auto filtered = LoudnessFilterWave(input, channels, samples, sample_freq);
+
+	// 400ms block
+	const int width = MultibandLoudnessWidth(sample_freq, block_sec);
+	const int shift = MultibandLoudnessShift(sample_freq, shift_sec);
+	MultibandLoudness2Blocks<Float> multiband_blocks(bands, band_count, sample_freq, width);
+	// 規格では最後のブロックは使わないけど、
+	// 使ったほうが実用的なので使う
+	bakuage::SharedStft<Float> stft(width, shift, 0, MultibandLoudnessWindow(width));
+	stft.AddConsumer([&multiband_blocks](const bakuage::SharedStftBatch &batch) { multiband_blocks.Add(batch); });
+	stft.Run(filtered.data(), channels, samples);
+
+	FinishMultibandLoudness2(multiband_blocks, relative_threshold_db, bands, band_count, covariance);
+
 	if (block_samples) {
 		*block_samples = width;
 	}
-    
-    bakuage::AlignedFree(fft_input);
-    for (int ch = 0; ch < channels; ch++) {
-        bakuage::AlignedFree(fft_outputs[ch]);
-    }
 }
 
 }
@@ -12,6 +12,7 @@
 #include "bakuage/utils.h"
 #include "bakuage/window_func.h"
 #include "bakuage/nmf.h"
+#include "bakuage/shared_stft.h"
 #include "CImg.h"
 
 namespace audio_analyzer {
@@ -24,7 +25,7 @@ namespace audio_analyzer {
         // calculate mel spectrum
         int num_filters = image_height;
         bakuage::MfccCalculator<float> mfcc_calculator(sample_freq, 0, 22000, num_filters);
-        int width = 2 * static_cast<int>(16384 * sample_freq / 44100 / 2);
+        int width = AnalysisStftWidth(sample_freq);
         int shift = width / 2;
         int pos = -width + shift;
         int spec_len = width / 2 + 1;
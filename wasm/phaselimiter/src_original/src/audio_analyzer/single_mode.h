@@ -41,6 +41,7 @@
 #include "bakuage/mastering3_score.h"
 #include "bakuage/sound_quality.h"
 #include "bakuage/sound_quality2.h"
+#include "bakuage/sound_quality2_flat.h"
 #include "bakuage/dft.h"
 #include "bakuage/memory.h"
 
@@ -155,19 +156,22 @@ int single_mode() {
     std::vector<int> histogram;
 	std::vector<Float> loudness_time_series;
 	int loudness_block_samples;
-	tasks.emplace_back("bakuage::loudness_ebu_r128::CalculateLoudness", [&buffer, sfinfo, &loudness, &histogram, &loudness_time_series, &loudness_block_samples]() {
-		bakuage::loudness_ebu_r128::CalculateLoudness(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-			&loudness, &histogram, &loudness_time_series, &loudness_block_samples);
-	});
 	Float loudness_range;
-	tasks.emplace_back("bakuage::loudness_ebu_r128::CalculateLoudnessRange", [&buffer, sfinfo, &loudness_range]() {
-		bakuage::loudness_ebu_r128::CalculateLoudnessRange(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-			&loudness_range);
-	});
 	Float loudness_range_short;
-	tasks.emplace_back("bakuage::loudness_ebu_r128::CalculateLoudnessRangeShort", [&buffer, sfinfo, &loudness_range_short]() {
-		bakuage::loudness_ebu_r128::CalculateLoudnessRangeShort(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-			&loudness_range_short);
+	tasks.emplace_back("bakuage::loudness_ebu_r128::LoudnessAnalyzer", [&buffer, sfinfo, &loudness, &histogram, &loudness_time_series, &loudness_block_samples, &loudness_range, &loudness_range_short]() {
+		// CalculateLoudness, CalculateLoudnessRange, CalculateLoudnessRangeShortを一回のフィルタで計算する
+		bakuage::loudness_ebu_r128::LoudnessAnalyzer<Float> analyzer(sfinfo.channels, sfinfo.samplerate);
+		const int loudness_index = analyzer.AddVariant(0.4, 0.1, -70, -10);
+		const int range_index = analyzer.AddVariant(0.4, 0.1, -70, -20);
+		const int range_short_index = analyzer.AddVariant(0.04, 0.01, -70, -20);
+		analyzer.Clock(buffer.data(), sfinfo.frames);
+		analyzer.Finish();
+		loudness = analyzer.result(loudness_index).loudness;
+		histogram = analyzer.result(loudness_index).histogram;
+		loudness_time_series = analyzer.result(loudness_index).time_series;
+		loudness_block_samples = analyzer.result(loudness_index).block_samples;
+		loudness_range = analyzer.result(range_index).loudness_range;
+		loudness_range_short = analyzer.result(range_short_index).loudness_range;
 	});
     std::vector<Float> youtube_loudness(24);
     tasks.emplace_back("youtube_loudness", [&buffer, sfinfo, &youtube_loudness]() {
@@ -178,22 +182,22 @@ int single_mode() {
         bakuage::loudness_ebu_r128::CalculateLoudnessCore<Float>(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
                                                           FLAGS_youtube_loudness_window_sec, FLAGS_youtube_loudness_shift_sec, FLAGS_youtube_loudness_absolute_threshold, FLAGS_youtube_loudness_relative_threshold, &loudness, &loudness_range, &histogram, nullptr, nullptr, true, &youtube_loudness[0]);
 #else
-        int idx = 0;
-        for (int m = 0; m < 2; m++) {
-            for (int i = 0; i < 2; i++) {
-                for (int j = 0; j < 3; j++) {
-                    for (int k = 0; k < 2; k++) {
-                        Float max_loudness;
-                        bakuage::loudness_ebu_r128::CalculateLoudnessCore<Float>(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-                                                                                 k == 0 ? 0.4 : 3, k == 0 ? 0.1 : 0.1, i == 0 ? -360 : -70, j == 0 ? -360 : (j == 1 ? -10 : -20), &youtube_loudness[idx], &loudness_range, &histogram, nullptr, nullptr, true, &max_loudness);
-                        if (m == 1) {
-                            youtube_loudness[idx] = max_loudness;
-                        }
-                        idx++;
-                    }
+        // 重み付けは一回だけして、全組み合わせを一回で計算する
+        typedef bakuage::loudness_ebu_r128::LoudnessAnalyzer<Float> Analyzer;
+        Analyzer analyzer(sfinfo.channels, sfinfo.samplerate, Analyzer::kWeightingYoutube);
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 3; j++) {
+                for (int k = 0; k < 2; k++) {
+                    analyzer.AddVariant(k == 0 ? 0.4 : 3, k == 0 ? 0.1 : 0.1, i == 0 ? -360 : -70, j == 0 ? -360 : (j == 1 ? -10 : -20));
                 }
             }
         }
+        analyzer.Clock(buffer.data(), sfinfo.frames);
+        analyzer.Finish();
+        for (int idx = 0; idx < 12; idx++) {
+            youtube_loudness[idx] = analyzer.result(idx).loudness;
+            youtube_loudness[12 + idx] = analyzer.result(idx).max_loudness;
+        }
 #endif
     });
 
@@ -269,16 +273,30 @@ int single_mode() {
         });
     }
 
+    // CalculateMultibandLoudness, CalculateMultibandLoudness2 を同じSTFTで計算する
+    // (入力のLoudnessFilterも共通なので一回だけ)
+    const auto calculate_multiband_loudness = [sfinfo](const std::vector<Float> &loudness_filtered, Float block_sec, Float shift_sec,
+                                                       std::vector<Band<Float>> *bands, std::vector<std::vector<Float>> *covariance) {
+        const int width = MultibandLoudnessWidth(sfinfo.samplerate, block_sec);
+        const int shift = MultibandLoudnessShift(sfinfo.samplerate, shift_sec);
+        MultibandLoudnessBlocks<Float> blocks(bands->data(), bands->size(), sfinfo.samplerate, width);
+        MultibandLoudness2Blocks<Float> blocks2(bands->data(), bands->size(), sfinfo.samplerate, width);
+        SharedStft<Float> stft(width, shift, 0, MultibandLoudnessWindow(width));
+        stft.AddConsumer([&blocks](const SharedStftBatch &batch) { blocks.Add(batch); });
+        stft.AddConsumer([&blocks2](const SharedStftBatch &batch) { blocks2.Add(batch); });
+        stft.Run(loudness_filtered.data(), sfinfo.channels, sfinfo.frames);
+        FinishMultibandLoudness<Float>(blocks, -20, bands->data(), bands->size());
+        FinishMultibandLoudness2<Float>(blocks2, -20, bands->data(), bands->size(), covariance);
+    };
+    const auto loudness_filtered = LoudnessFilterWave(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate);
+
     std::vector<Band<Float>> bands = CreateBandsByErb<Float>(44100, 6);
     fprintf(stderr, "band count %d\n", (int)bands.size());
     std::vector<std::vector<Float>> covariance;
     double sound_quality = 0;
     float sound_quality2 = 0;
-    tasks.emplace_back("band, covariance, sound_quality", [&buffer, sfinfo, &bands, &covariance, &sound_quality, &sound_quality2]() {
-        CalculateMultibandLoudness<Float>(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-                                          0.4, 0.1, -20, bands.data(), bands.size(), nullptr);
-        CalculateMultibandLoudness2<Float>(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-                                           0.4, 0.1, -20, bands.data(), bands.size(), &covariance, nullptr);
+    tasks.emplace_back("band, covariance, sound_quality", [&loudness_filtered, &calculate_multiband_loudness, &bands, &covariance, &sound_quality, &sound_quality2]() {
+        calculate_multiband_loudness(loudness_filtered, 0.4, 0.1, &bands, &covariance);
 
         if (FLAGS_sound_quality) {
             // Sound Quality
@@ -311,8 +329,22 @@ int single_mode() {
         }
 
         if (FLAGS_sound_quality2) {
-            bakuage::SoundQuality2Calculator calculator;
-            {
+            Eigen::VectorXd mean_vec(2 * bands.size());
+            Eigen::MatrixXd covariance_mat(2 * bands.size(), 2 * bands.size());
+            for (int i = 0; i < bands.size(); i++) {
+                mean_vec(2 * i + 0) = bands[i].mid_mean;
+                mean_vec(2 * i + 1) = bands[i].side_mean;
+            }
+            for (int i = 0; i < 2 * bands.size(); i++) {
+                for (int j = 0; j < 2 * bands.size(); j++) {
+                    covariance_mat(i, j) = covariance[i][j];
+                }
+            }
+            if (FLAGS_sound_quality2_cache_archiver == "flat") {
+                const auto calculator = bakuage::LoadFlatSoundQuality2Calculator(FLAGS_sound_quality2_cache);
+                calculator->CalculateSoundQuality(mean_vec, covariance_mat, &sound_quality2, nullptr);
+            } else {
+                bakuage::SoundQuality2Calculator calculator;
                 if (FLAGS_sound_quality2_cache_archiver == "binary") {
                     std::ifstream ifs(FLAGS_sound_quality2_cache, std::ios::binary);
                     boost::archive::binary_iarchive ia(ifs);
@@ -324,42 +356,20 @@ int single_mode() {
                 } else {
                     throw std::logic_error("unknown archive type " + FLAGS_sound_quality2_cache_archiver);
                 }
+                calculator.CalculateSoundQuality(mean_vec, covariance_mat, &sound_quality2, nullptr);
             }
-            Eigen::VectorXd mean_vec(2 * bands.size());
-            Eigen::MatrixXd covariance_mat(2 * bands.size(), 2 * bands.size());
-            for (int i = 0; i < bands.size(); i++) {
-                mean_vec(2 * i + 0) = bands[i].mid_mean;
-                mean_vec(2 * i + 1) = bands[i].side_mean;
-            }
-            for (int i = 0; i < 2 * bands.size(); i++) {
-                for (int j = 0; j < 2 * bands.size(); j++) {
-                    covariance_mat(i, j) = covariance[i][j];
-                }
-            }
-            calculator.CalculateSoundQuality(mean_vec, covariance_mat, &sound_quality2, nullptr);
         }
     });
 
     std::vector<Band<Float>> bands_short = bands;
     std::vector<std::vector<Float>> covariance_short;
-    tasks.emplace_back("bands_short, covariance_short", [&buffer, sfinfo, &bands_short, &covariance_short]() {
-        CalculateMultibandLoudness<Float>(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-                                          0.04, 0.01, -20, bands_short.data(), bands_short.size(), nullptr);
-        CalculateMultibandLoudness2<Float>(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-                                           0.04, 0.01, -20, bands_short.data(), bands_short.size(), &covariance_short, nullptr);
+    tasks.emplace_back("bands_short, covariance_short", [&loudness_filtered, &calculate_multiband_loudness, &bands_short, &covariance_short]() {
+        calculate_multiband_loudness(loudness_filtered, 0.04, 0.01, &bands_short, &covariance_short);
     });
 
+    // dissonance, bandwidth, mastering3のmel bandは同じSTFT (0.372 sec, hanning, 50% overlap) を共有する
     Float dissonance;
-    tasks.emplace_back("CalculateDissonance", [&buffer, sfinfo, &dissonance]() {
-        bakuage::CalculateDissonance<Float>(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-                                        &dissonance, true);
-    });
-
     Float bandwidth, diff_bandwidth;
-    tasks.emplace_back("CalculateBandwidth", [&buffer, sfinfo, &bandwidth, &diff_bandwidth]() {
-        bakuage::CalculateBandwidth<Float>(buffer.data(), sfinfo.channels, sfinfo.frames, sfinfo.samplerate,
-                                            &bandwidth, &diff_bandwidth);
-    });
 
     Float acoustic_entropy, damage;
     tasks.emplace_back("CalculateAcousticEntropy", [&buffer, sfinfo, &acoustic_entropy, &damage]() {
@@ -377,7 +387,7 @@ int single_mode() {
 	std::vector<std::vector<float>> mastering3_band_eliminated_acoustic_entropies(mastering3_sns.size(), std::vector<float>(num_filters));
 	std::vector<std::vector<float>> mastering3_stereo_band_eliminated_acoustic_entropies(mastering3_sns.size(), std::vector<float>(num_filters));
 
-	tasks.emplace_back("Mastering3", [&buffer, sfinfo,
+	tasks.emplace_back("Mastering3, CalculateDissonance, CalculateBandwidth", [&buffer, sfinfo, &dissonance, &bandwidth, &diff_bandwidth,
 		&mastering3_loudness, &mastering3_ear_damage, &mastering3_acoustic_entropy_mfcc, &mastering3_acoustic_entropy_eigen, &mastering3_diff_acoustic_entropy_eigen,
 		&mfcc_calculator, num_filters, &mastering3_sns, &mastering3_acoustic_entropies,
 		&mastering3_band_eliminated_acoustic_entropies, &mastering3_stereo_band_eliminated_acoustic_entropies,
@@ -385,50 +395,50 @@ int single_mode() {
 
 		// calculate mfcc
 		int shift_resolution = 2;
-		int output_shift_resolution = 2;
-		int width = output_shift_resolution * ((16384 * sfinfo.samplerate / 44100) / output_shift_resolution); // 0.372 sec, 4x only
+		int width = AnalysisStftWidth(sfinfo.samplerate);
 		int shift = width / shift_resolution;
-		int output_shift = width / output_shift_resolution;
-		int mfcc_len = 13;
-		int pos = -width + shift;
 		int spec_len = width / 2 + 1;
-		std::vector<std::complex<float>> complex_spec_mid(spec_len);
-		std::vector<std::complex<float>> complex_spec_side(spec_len);
 		std::vector<float> src_mid_mel_bands;
 		std::vector<float> src_side_mel_bands;
 		std::vector<float> window(width);
 		bakuage::CopyHanning(width, window.begin());
-		bakuage::Dct dct(num_filters);
-        float *fft_input = (float *)bakuage::AlignedMalloc(sizeof(float) * width);
-        std::complex<float> *fft_output = (std::complex<float> *)bakuage::AlignedMalloc(sizeof(std::complex<float>) * spec_len);
-        bakuage::RealDft<float> dft(width);
-		while (pos < sfinfo.frames) {
-			// window and fft
-			std::fill_n(complex_spec_mid.data(), spec_len, 0);
-			std::fill_n(complex_spec_side.data(), spec_len, 0);
-			for (int i = 0; i < sfinfo.channels; i++) {
-				for (int j = 0; j < width; j++) {
-					int k = pos + j;
-					fft_input[j] = (0 <= k && k < sfinfo.frames) ? buffer[sfinfo.channels * k + i] * window[j] : 0;
-				}
-                dft.Forward(fft_input, (float *)fft_output);
-				for (int j = 0; j < spec_len; j++) {
-                    auto spec = fft_output[j];
-					complex_spec_mid[j] += spec;
-					complex_spec_side[j] += spec * (2.0f * i - 1);
+		SharedStft<Float> stft(width, shift, -width + shift, window);
+
+		std::vector<std::complex<float>> complex_spec_mid(spec_len);
+		std::vector<std::complex<float>> complex_spec_side(spec_len);
+		stft.AddConsumer([&](const SharedStftBatch &batch) {
+			for (int frame = 0; frame < batch.frame_count(); frame++) {
+				std::fill_n(complex_spec_mid.data(), spec_len, 0);
+				std::fill_n(complex_spec_side.data(), spec_len, 0);
+				for (int i = 0; i < batch.channels(); i++) {
+					const auto fft_output = batch.spectrum(frame, i);
+					for (int j = 0; j < spec_len; j++) {
+						auto spec = fft_output[j];
+						complex_spec_mid[j] += spec;
+						complex_spec_side[j] += spec * (2.0f * i - 1);
+					}
 				}
+
+				// calculate mel band (energy sum mode)
+				src_mid_mel_bands.resize(src_mid_mel_bands.size() + num_filters);
+				src_side_mel_bands.resize(src_side_mel_bands.size() + num_filters);
+				mfcc_calculator.calculateMelSpectrumFromDFT((float *)complex_spec_mid.data(),
+					width, false, true, &src_mid_mel_bands[src_mid_mel_bands.size() - num_filters]);
+				mfcc_calculator.calculateMelSpectrumFromDFT((float *)complex_spec_side.data(),
+					width, false, true, &src_side_mel_bands[src_side_mel_bands.size() - num_filters]);
 			}
+		});
 
-			// calculate mel band (energy sum mode)
-			src_mid_mel_bands.resize(src_mid_mel_bands.size() + num_filters);
-			src_side_mel_bands.resize(src_side_mel_bands.size() + num_filters);
-			mfcc_calculator.calculateMelSpectrumFromDFT((float *)complex_spec_mid.data(),
-				width, false, true, &src_mid_mel_bands[src_mid_mel_bands.size() - num_filters]);
-			mfcc_calculator.calculateMelSpectrumFromDFT((float *)complex_spec_side.data(),
-				width, false, true, &src_side_mel_bands[src_side_mel_bands.size() - num_filters]);
+		DissonanceCalculator dissonance_calculator(width, sfinfo.samplerate, true);
+		stft.AddConsumer([&dissonance_calculator](const SharedStftBatch &batch) { dissonance_calculator.Add(batch); });
+		BandwidthCalculator bandwidth_calculator(width, sfinfo.samplerate);
+		stft.AddConsumer([&bandwidth_calculator](const SharedStftBatch &batch) { bandwidth_calculator.Add(batch); });
+
+		stft.Run(buffer.data(), sfinfo.channels, sfinfo.frames);
+		dissonance = dissonance_calculator.dissonance();
+		bandwidth = bandwidth_calculator.bandwidth();
+		diff_bandwidth = bandwidth_calculator.diff_bandwidth();
 
-			pos += shift;
-		}
 		// calculate noise melband (実際のノイズではなく、エネルギー平均)
 		std::vector<std::complex<float>> complex_spec_noise(spec_len);
 		std::vector<float> noise_mel_bands(num_filters);
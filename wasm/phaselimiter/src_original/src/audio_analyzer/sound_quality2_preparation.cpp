@@ -3,6 +3,7 @@
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/filesystem.hpp>
 #include "bakuage/sound_quality2.h"
+#include "bakuage/sound_quality2_flat.h"
 
 DECLARE_string(analysis_data_dir);
 DECLARE_string(sound_quality2_cache);
@@ -28,6 +29,11 @@ void PrepareSoundQuality2() {
 		std::ofstream ofs(FLAGS_sound_quality2_cache);
         boost::archive::text_oarchive oa(ofs);
         oa << calculator;
+    } else if (FLAGS_sound_quality2_cache_archiver == "flat") {
+        std::vector<char> buffer;
+        bakuage::FlatSoundQuality2Writer::Write(calculator, &buffer);
+        std::ofstream ofs(FLAGS_sound_quality2_cache, std::ios::binary);
+        ofs.write(buffer.data(), buffer.size());
     } else {
         throw std::logic_error("unknown archive type " + FLAGS_sound_quality2_cache_archiver);
     }
@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "bakuage/decimator.h"
+
+namespace {
+    std::vector<float> CreateInput(int frames, int channels) {
+        std::vector<float> input(channels * frames);
+        for (int i = 0; i < frames; i++) {
+            for (int ch = 0; ch < channels; ch++) {
+                input[channels * i + ch] = std::sin(0.05 * i + ch) + 0.1 * ((i * 7 + ch * 3) % 11 - 5);
+            }
+        }
+        return input;
+    }
+
+    // 不揃いなchunkでProcessした出力が一回のProcessと完全に一致し、
+    // firをかけてからfactorおきに残したもの (output[m] = sum_k fir[k] * input[factor * m - k]) と一致すること
+    void TestDecimatorAgainstDirect(int factor, int channels) {
+        bakuage::Decimator<float> decimator(factor);
+        const int frames = 5000 + factor - 1;
+        const auto input = CreateInput(frames, channels);
+
+        std::vector<float> one_shot(channels * decimator.MaxOutputFrames(frames));
+        const int one_shot_frames = decimator.Process(input.data(), frames, channels, one_shot.data());
+        one_shot.resize(channels * one_shot_frames);
+
+        decimator.Reset();
+        std::vector<float> chunked;
+        const int chunk_sizes[] = { 1, factor + 1, 2, 37, 1000, factor - 1, 3 };
+        int bg = 0;
+        for (int k = 0; bg < frames; k++) {
+            const int n = std::min(chunk_sizes[k % 7], frames - bg);
+            std::vector<float> output(channels * decimator.MaxOutputFrames(n));
+            const int out_frames = decimator.Process(input.data() + channels * bg, n, channels, output.data());
+            chunked.insert(chunked.end(), output.begin(), output.begin() + channels * out_frames);
+            bg += n;
+        }
+        if (chunked != one_shot) {
+            std::cerr << "error decimator chunked " << factor << " " << channels << std::endl;
+        }
+
+        const int expected_frames = (frames + factor - 1) / factor;
+        if (one_shot_frames != expected_frames) {
+            std::cerr << "error decimator frames " << factor << " " << channels << " " << one_shot_frames << " " << expected_frames << std::endl;
+            return;
+        }
+        std::vector<float> fir = decimator.fir();
+        if (factor <= 1) {
+            fir.assign(1, 1);
+        }
+        double max_abs = 1e-37;
+        double max_error = 0;
+        for (int m = 0; m < expected_frames; m++) {
+            for (int ch = 0; ch < channels; ch++) {
+                double sum = 0;
+                for (int k = 0; k < (int)fir.size() && k <= factor * m; k++) {
+                    sum += (double)fir[k] * input[channels * (factor * m - k) + ch];
+                }
+                max_abs = std::max(max_abs, std::abs(sum));
+                max_error = std::max(max_error, std::abs(one_shot[channels * m + ch] - sum));
+            }
+        }
+        if (max_error > 1e-5 * max_abs) {
+            std::cerr << "error decimator " << factor << " " << channels << " " << max_error / max_abs << std::endl;
+        }
+
+        // 一回で処理するものはframes / factorに切り詰めた同じ出力
+        const auto vector_output = decimator.Process(input, channels);
+        if (vector_output.size() != (size_t)channels * (frames / factor)
+            || !std::equal(vector_output.begin(), vector_output.end(), one_shot.begin())) {
+            std::cerr << "error decimator vector " << factor << " " << channels << std::endl;
+        }
+    }
+}
+
+void TestDecimator() {
+    for (const int factor : { 1, 2, 3, 4, 8 }) {
+        for (const int channels : { 1, 2, 3 }) {
+            TestDecimatorAgainstDirect(factor, channels);
+        }
+    }
+}
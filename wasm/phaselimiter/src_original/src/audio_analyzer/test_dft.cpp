@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cmath>
+#include <complex>
 #include <iostream>
 #include <vector>
 #include <string>
@@ -6,7 +8,153 @@
 #include "bakuage/file_utils.h"
 #include "bakuage/dft.h"
 
+namespace {
+    // naive O(n^2) DFTとの比較 (mixed radix: 2, 3, 4, 5, generic)
+    void TestComplexDftAgainstNaive(int width) {
+        std::vector<std::complex<float>> input(width);
+        std::vector<std::complex<float>> output(width);
+        std::vector<std::complex<float>> restored(width);
+        for (int i = 0; i < width; i++) {
+            input[i] = std::complex<float>(0.1 * (i % 13), 0.05 * (i % 7));
+        }
+        bakuage::Dft<float> dft(width);
+        dft.Forward((float *)input.data(), (float *)output.data());
+
+        double max_abs = 0;
+        double max_error = 0;
+        for (int k = 0; k < width; k++) {
+            std::complex<double> sum = 0;
+            for (int i = 0; i < width; i++) {
+                const double theta = -2 * M_PI * (double)((long long)i * k % width) / width;
+                sum += std::complex<double>(input[i]) * std::complex<double>(std::cos(theta), std::sin(theta));
+            }
+            max_abs = std::max(max_abs, std::abs(sum));
+            max_error = std::max(max_error, std::abs(sum - std::complex<double>(output[k])));
+        }
+        if (max_error > 1e-5 * max_abs) {
+            std::cerr << "error complex dft " << width << " " << max_error / max_abs << std::endl;
+        }
+
+        dft.Backward((float *)output.data(), (float *)restored.data());
+        for (int i = 0; i < width; i++) {
+            const auto error = std::abs(restored[i] / (float)width - input[i]);
+            if (error > 1e-5) {
+                std::cerr << "error complex idft " << width << " " << i << " " << error << std::endl;
+                break;
+            }
+        }
+    }
+
+    enum class RealDftLayout { kCcs, kPerm, kPack };
+
+    const char *LayoutName(RealDftLayout layout) {
+        switch (layout) {
+            case RealDftLayout::kCcs: return "ccs";
+            case RealDftLayout::kPerm: return "perm";
+            default: return "pack";
+        }
+    }
+
+    // X[k] (k <= width / 2) をlayoutから取り出す
+    std::complex<double> GetSpec(const float *spec, int width, int k, RealDftLayout layout) {
+        if (layout == RealDftLayout::kCcs) {
+            return std::complex<double>(spec[2 * k], spec[2 * k + 1]);
+        }
+        if (k == 0) {
+            return spec[0];
+        }
+        if (width % 2 == 0 && k == width / 2) {
+            return layout == RealDftLayout::kPerm ? spec[1] : spec[width - 1];
+        }
+        // 偶数長のPermはR(N/2)が先頭に来るので1つずれない. 奇数長のPermはPackと同じ
+        const int offset = (layout == RealDftLayout::kPerm && width % 2 == 0) ? 0 : -1;
+        return std::complex<double>(spec[2 * k + offset], spec[2 * k + offset + 1]);
+    }
+
+    void RunForward(bakuage::RealDft<float> &dft, const float *input, float *output, RealDftLayout layout) {
+        switch (layout) {
+            case RealDftLayout::kCcs: dft.Forward(input, output); break;
+            case RealDftLayout::kPerm: dft.ForwardPerm(input, output); break;
+            case RealDftLayout::kPack: dft.ForwardPack(input, output); break;
+        }
+    }
+
+    void RunBackward(bakuage::RealDft<float> &dft, const float *input, float *output, RealDftLayout layout) {
+        switch (layout) {
+            case RealDftLayout::kCcs: dft.Backward(input, output); break;
+            case RealDftLayout::kPerm: dft.BackwardPerm(input, output); break;
+            case RealDftLayout::kPack: dft.BackwardPack(input, output); break;
+        }
+    }
+
+    // naive DFTとの比較とForward -> Backwardの往復 (in_placeならinput == output)
+    void TestRealDftAgainstNaive(int width, RealDftLayout layout, bool in_place) {
+        std::vector<float> input(width);
+        for (int i = 0; i < width; i++) {
+            input[i] = 0.1 * (i % 13) - 0.03 * (i % 5);
+        }
+        // CCSはwidth + 2
+        std::vector<float> spec(width + 2, 1);
+        std::vector<float> restored(width + 2, 1);
+        bakuage::RealDft<float> dft(width);
+        if (in_place) {
+            std::copy(input.begin(), input.end(), spec.begin());
+            RunForward(dft, spec.data(), spec.data(), layout);
+        } else {
+            RunForward(dft, input.data(), spec.data(), layout);
+        }
+
+        std::vector<std::complex<double>> expected(width / 2 + 1);
+        double max_abs = 0;
+        for (int k = 0; k <= width / 2; k++) {
+            std::complex<double> sum = 0;
+            for (int i = 0; i < width; i++) {
+                const double theta = -2 * M_PI * (double)((long long)i * k % width) / width;
+                sum += (double)input[i] * std::complex<double>(std::cos(theta), std::sin(theta));
+            }
+            expected[k] = sum;
+            max_abs = std::max(max_abs, std::abs(sum));
+        }
+        double max_error = 0;
+        for (int k = 0; k <= width / 2; k++) {
+            max_error = std::max(max_error, std::abs(GetSpec(spec.data(), width, k, layout) - expected[k]));
+        }
+        if (layout == RealDftLayout::kCcs) {
+            // DCとNyquistの虚部は0
+            max_error = std::max<double>(max_error, std::abs(spec[1]));
+            if (width % 2 == 0) {
+                max_error = std::max<double>(max_error, std::abs(spec[width + 1]));
+            }
+        }
+        if (max_error > 1e-5 * max_abs) {
+            std::cerr << "error real dft " << LayoutName(layout) << " " << width
+                << (in_place ? " in place " : " ") << max_error / max_abs << std::endl;
+        }
+
+        float *backward_output = in_place ? spec.data() : restored.data();
+        RunBackward(dft, spec.data(), backward_output, layout);
+        for (int i = 0; i < width; i++) {
+            const auto error = std::abs(backward_output[i] / width - input[i]);
+            if (error > 1e-5) {
+                std::cerr << "error real idft " << LayoutName(layout) << " " << width
+                    << (in_place ? " in place " : " ") << i << " " << error << std::endl;
+                break;
+            }
+        }
+    }
+}
+
 void TestDft() {
+    for (const int width : { 1, 2, 3, 4, 5, 6, 8, 12, 15, 16, 18, 25, 60, 97, 256, 360, 1000, 1024, 2 * 1021 }) {
+        TestComplexDftAgainstNaive(width);
+    }
+    for (const int width : { 2, 15, 16, 1000, 2228, 4096, 2 * 1021 }) {
+        for (const auto layout : { RealDftLayout::kCcs, RealDftLayout::kPerm, RealDftLayout::kPack }) {
+            TestRealDftAgainstNaive(width, layout, false);
+            TestRealDftAgainstNaive(width, layout, true);
+        }
+    }
+
     const int width = 12345;
     const int spec_len = width / 2 + 1;
     float *fft_input = (float *)bakuage::AlignedMalloc(sizeof(float) * width);
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "bakuage/partitioned_convolution.h"
+
+namespace {
+    std::vector<float> CreateSignal(int length, int seed) {
+        std::vector<float> x(length);
+        for (int i = 0; i < length; i++) {
+            x[i] = std::sin(0.07 * i + seed) + 0.1 * ((i * 7 + seed * 3) % 11 - 5);
+        }
+        return x;
+    }
+
+    // output[i] = sum_k fir[k] * input[i + delay - k] (inputは[0, frames)の外で0)
+    std::vector<double> DirectConvolution(const std::vector<float> &input, const std::vector<float> &fir, int delay) {
+        std::vector<double> output(input.size());
+        for (int i = 0; i < (int)input.size(); i++) {
+            double sum = 0;
+            for (int k = 0; k < (int)fir.size(); k++) {
+                const int t = i + delay - k;
+                if (0 <= t && t < (int)input.size()) {
+                    sum += (double)fir[k] * input[t];
+                }
+            }
+            output[i] = sum;
+        }
+        return output;
+    }
+
+    double MaxRelativeError(const float *output, int stride, const std::vector<double> &expected) {
+        double max_abs = 1e-37;
+        double max_error = 0;
+        for (int i = 0; i < (int)expected.size(); i++) {
+            max_abs = std::max(max_abs, std::abs(expected[i]));
+            max_error = std::max(max_error, std::abs(output[stride * i] - expected[i]));
+        }
+        return max_error / max_abs;
+    }
+
+    // 不揃いなchunkでClockした出力が直接のたたみこみ (遅延なし) と一致すること
+    void TestClockAgainstDirect(int fir_size, int block_size) {
+        const auto fir = CreateSignal(fir_size, 1);
+        const auto spectrum = std::make_shared<const bakuage::PartitionedFirSpectrum<float>>(fir.begin(), fir.end(), block_size);
+        bakuage::PartitionedConvolver<float> convolver(spectrum);
+        const int frames = 7 * spectrum->block_size() + 5 * fir_size + 3;
+        const auto input = CreateSignal(frames, 2);
+        const auto expected = DirectConvolution(input, fir, 0);
+
+        // 2周目はClearして同じ結果になること
+        for (int k = 0; k < 2; k++) {
+            convolver.Clear();
+            std::vector<float> output(frames);
+            const int chunk_sizes[] = { 1, 3, block_size, 2 * block_size + 1, 17, block_size - 1 };
+            int bg = 0;
+            for (int c = 0; bg < frames; c++) {
+                const int n = std::min(std::max(1, chunk_sizes[c % 6]), frames - bg);
+                convolver.Clock(input.data() + bg, input.data() + bg + n, output.data() + bg);
+                bg += n;
+            }
+            const double error = MaxRelativeError(output.data(), 1, expected);
+            if (error > 1e-5) {
+                std::cerr << "error partitioned convolution clock " << fir_size << " " << block_size
+                    << " partitions:" << spectrum->partition_count() << " " << error << std::endl;
+            }
+        }
+    }
+
+    // ProcessCompensatedが遅延補正した直接のたたみこみと一致すること
+    // (末尾のdelay分は0を入れて出し切る。interleavedとin placeも)
+    void TestProcessCompensatedAgainstDirect(int fir_size, int block_size, int delay) {
+        const auto fir = CreateSignal(fir_size, 3);
+        const auto spectrum = std::make_shared<const bakuage::PartitionedFirSpectrum<float>>(fir.begin(), fir.end(), block_size);
+        bakuage::PartitionedConvolver<float> convolver(spectrum);
+        const int frames = 3 * spectrum->block_size() + fir_size + 11;
+        const auto input = CreateSignal(frames, 4);
+        const auto expected = DirectConvolution(input, fir, delay);
+
+        std::vector<float> output(frames);
+        convolver.ProcessCompensated(input.data(), 1, frames, delay, output.data(), 1);
+        double error = MaxRelativeError(output.data(), 1, expected);
+        if (error > 1e-5) {
+            std::cerr << "error partitioned convolution compensated " << fir_size << " " << block_size << " " << delay << " " << error << std::endl;
+        }
+
+        // stereo interleavedの片方のチャンネルをその場で
+        std::vector<float> interleaved(2 * frames);
+        for (int i = 0; i < frames; i++) {
+            interleaved[2 * i] = -1;
+            interleaved[2 * i + 1] = input[i];
+        }
+        convolver.ProcessCompensated(interleaved.data() + 1, 2, frames, delay, interleaved.data() + 1, 2);
+        error = MaxRelativeError(interleaved.data() + 1, 2, expected);
+        for (int i = 0; i < frames; i++) {
+            if (interleaved[2 * i] != -1) {
+                error = 1;
+            }
+        }
+        if (error > 1e-5) {
+            std::cerr << "error partitioned convolution compensated in place " << fir_size << " " << block_size << " " << delay << " " << error << std::endl;
+        }
+    }
+}
+
+void TestPartitionedConvolution() {
+    // 1 partition, 端数のあるpartition, 複数partition
+    for (const int block_size : { 16, 64 }) {
+        for (const int fir_size : { 1, 5, block_size, block_size + 1, 3 * block_size + 7, 10 * block_size }) {
+            TestClockAgainstDirect(fir_size, block_size);
+            for (const int delay : { 0, fir_size / 2, fir_size - 1, fir_size + 3 * block_size }) {
+                TestProcessCompensatedAgainstDirect(fir_size, block_size, delay);
+            }
+        }
+    }
+    // デフォルトのblock size (about 4 partitions)
+    TestClockAgainstDirect(4000, 0);
+    TestProcessCompensatedAgainstDirect(4000, 0, 2000);
+}
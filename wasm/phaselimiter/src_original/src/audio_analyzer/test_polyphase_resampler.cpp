@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "bakuage/fir_design.h"
+#include "bakuage/memory.h"
+#include "bakuage/polyphase_resampler.h"
+
+namespace {
+    const int kChannels = 2;
+
+    // 十分ランダムな決定的な入力 (interleaved)
+    std::vector<float> CreateInput(int frames) {
+        std::vector<float> input(kChannels * frames);
+        for (int i = 0; i < frames; i++) {
+            for (int ch = 0; ch < kChannels; ch++) {
+                input[kChannels * i + ch] = std::sin(0.05 * i + ch) + 0.1 * ((i * 7 + ch * 3) % 11 - 5);
+            }
+        }
+        return input;
+    }
+
+    std::vector<double> CreateLowpassFir(int factor, int taps) {
+        return bakuage::CalculateBandPassFir<double>(0, 0.45 / factor, taps, 7);
+    }
+
+    double MaxAbs(const std::vector<double> &x) {
+        double result = 0;
+        for (const auto v : x) {
+            result = std::max(result, std::abs(v));
+        }
+        return result;
+    }
+
+    // output[factor * m + p] = factor * sum_k fir[factor * k + p] * input[m - k] との比較
+    void TestFftUpsamplerAgainstDirect(int factor, int taps) {
+        const auto fir = CreateLowpassFir(factor, taps);
+        bakuage::PolyphaseFftUpsampler<float> upsampler(factor, kChannels, fir);
+        const int block_frames = upsampler.block_frames();
+        const int blocks = 5;
+        const int frames = block_frames * blocks;
+        const auto input = CreateInput(frames);
+
+        std::vector<float> output(kChannels * frames * factor);
+        for (int b = 0; b < blocks; b++) {
+            upsampler.ProcessBlock(input.data() + kChannels * block_frames * b, output.data() + kChannels * block_frames * factor * b);
+        }
+
+        std::vector<double> expected(output.size());
+        for (int n = 0; n < frames * factor; n++) {
+            for (int ch = 0; ch < kChannels; ch++) {
+                double sum = 0;
+                for (int t = n % factor; t < (int)fir.size() && t <= n; t += factor) {
+                    sum += fir[t] * input[kChannels * ((n - t) / factor) + ch];
+                }
+                expected[kChannels * n + ch] = factor * sum;
+            }
+        }
+        const double max_abs = MaxAbs(expected);
+        double max_error = 0;
+        for (int i = 0; i < (int)output.size(); i++) {
+            max_error = std::max(max_error, std::abs(output[i] - expected[i]));
+        }
+        if (max_error > 1e-5 * max_abs) {
+            std::cerr << "error fft upsampler " << factor << " " << taps << " " << max_error / max_abs << std::endl;
+        }
+    }
+
+    // output[m] = sum_t fir[t] * input[factor * m + factor - 1 - t] との比較
+    void TestFftDownsamplerAgainstDirect(int factor, int taps) {
+        const auto fir = CreateLowpassFir(factor, taps);
+        bakuage::PolyphaseFftDownsampler<float> downsampler(factor, kChannels, fir);
+        const int block_frames = downsampler.block_frames();
+        const int blocks = 5;
+        const int frames = block_frames * blocks;
+        const auto input = CreateInput(frames * factor);
+
+        std::vector<float> output(kChannels * frames);
+        for (int b = 0; b < blocks; b++) {
+            downsampler.ProcessBlock(input.data() + kChannels * block_frames * factor * b, output.data() + kChannels * block_frames * b);
+        }
+
+        std::vector<double> expected(output.size());
+        for (int m = 0; m < frames; m++) {
+            for (int ch = 0; ch < kChannels; ch++) {
+                double sum = 0;
+                for (int t = 0; t < (int)fir.size(); t++) {
+                    const int i = factor * m + factor - 1 - t;
+                    if (i >= 0) {
+                        sum += fir[t] * input[kChannels * i + ch];
+                    }
+                }
+                expected[kChannels * m + ch] = sum;
+            }
+        }
+        const double max_abs = MaxAbs(expected);
+        double max_error = 0;
+        for (int i = 0; i < (int)output.size(); i++) {
+            max_error = std::max(max_error, std::abs(output[i] - expected[i]));
+        }
+        if (max_error > 1e-5 * max_abs) {
+            std::cerr << "error fft downsampler " << factor << " " << taps << " " << max_error / max_abs << std::endl;
+        }
+    }
+
+    // output[j] = up * sum_i fir[j * down + offset - i * up] * input[i] との比較
+    // (不揃いなchunkで入力してもchunk境界で状態が引き継がれること)
+    void TestResamplerAgainstDirect(int up, int down, const std::vector<double> &fir, int offset) {
+        bakuage::PolyphaseResampler<float> resampler(up, down, kChannels, fir, offset);
+        const int frames = 3000;
+        const auto input = CreateInput(frames);
+
+        std::vector<float> output;
+        std::vector<float> chunk_output;
+        const int chunk_sizes[] = { 1, 7, 100, 13, 999 };
+        int bg = 0;
+        for (int k = 0; bg < frames; k++) {
+            const int n = std::min(chunk_sizes[k % 5], frames - bg);
+            chunk_output.resize(kChannels * resampler.MaxOutputFrames(n));
+            const int out_frames = resampler.Process(input.data() + kChannels * bg, n, chunk_output.data());
+            output.insert(output.end(), chunk_output.begin(), chunk_output.begin() + kChannels * out_frames);
+            bg += n;
+        }
+
+        const int out_frames = output.size() / kChannels;
+        const int expected_frames = ((int64_t)frames * up - offset + down - 1) / down;
+        if (out_frames != expected_frames) {
+            std::cerr << "error resampler frames " << up << "/" << down << " " << out_frames << " " << expected_frames << std::endl;
+            return;
+        }
+        std::vector<double> expected(output.size());
+        for (int j = 0; j < out_frames; j++) {
+            const int64_t position = (int64_t)j * down + offset;
+            const int i_bg = std::max<int64_t>(0, (position - (int64_t)fir.size() + up) / up);
+            const int i_ed = std::min<int64_t>(frames - 1, position / up);
+            for (int ch = 0; ch < kChannels; ch++) {
+                double sum = 0;
+                for (int i = i_bg; i <= i_ed; i++) {
+                    const int64_t t = position - (int64_t)i * up;
+                    if (0 <= t && t < (int64_t)fir.size()) {
+                        sum += fir[t] * input[kChannels * i + ch];
+                    }
+                }
+                expected[kChannels * j + ch] = up * sum;
+            }
+        }
+        const double max_abs = MaxAbs(expected);
+        double max_error = 0;
+        for (int i = 0; i < (int)output.size(); i++) {
+            max_error = std::max(max_error, std::abs(output[i] - expected[i]));
+        }
+        if (max_error > 1e-5 * max_abs) {
+            std::cerr << "error resampler " << up << "/" << down << " " << max_error / max_abs << std::endl;
+        }
+    }
+
+    // 全体をoffset = fir size / 2で遅延補正してresampleする (phase_limiter::Resampleと同じ)
+    std::vector<float> Resample(const std::vector<float> &input, int src_sample_rate, int dest_sample_rate) {
+        int up, down;
+        bakuage::PolyphaseResampler<float>::CalcFactors(src_sample_rate, dest_sample_rate, &up, &down);
+        const auto fir = bakuage::PolyphaseResampler<float>::DesignFir(src_sample_rate, dest_sample_rate, 120, 2050);
+        bakuage::PolyphaseResampler<float> resampler(up, down, kChannels, fir, fir.size() / 2);
+
+        const int frames = input.size() / kChannels;
+        const int dest_frames = ((int64_t)frames * up + down - 1) / down;
+        // 末尾は0を入れて遅延分を出し切る
+        std::vector<float> padded(input);
+        padded.resize(padded.size() + kChannels * (fir.size() / up + 1), 0);
+        std::vector<float> output(kChannels * resampler.MaxOutputFrames(padded.size() / kChannels));
+        const int out_frames = resampler.Process(padded.data(), padded.size() / kChannels, output.data());
+        output.resize(kChannels * std::min(out_frames, dest_frames));
+        return output;
+    }
+
+    // 44100 -> 48000 -> 44100 の往復で、帯域内の信号が戻ること
+    void TestResamplerRoundTrip() {
+        const int sample_rate = 44100;
+        const int frames = sample_rate / 2;
+        std::vector<float> input(kChannels * frames);
+        for (int i = 0; i < frames; i++) {
+            for (int ch = 0; ch < kChannels; ch++) {
+                double x = 0;
+                for (const double hz : { 100.0, 1234.5, 7000.0, 15000.0 + 1000 * ch }) {
+                    x += 0.2 * std::sin(2 * M_PI * hz * i / sample_rate + ch);
+                }
+                input[kChannels * i + ch] = x;
+            }
+        }
+
+        const auto resampled = Resample(input, sample_rate, 48000);
+        const auto restored = Resample(resampled, 48000, sample_rate);
+        if (resampled.size() != kChannels * ((size_t)frames * 48000 / sample_rate) || restored.size() != input.size()) {
+            std::cerr << "error resampler round trip length " << resampled.size() << " " << restored.size() << std::endl;
+            return;
+        }
+
+        // 両端はfirが信号の外にかかるので除く
+        const int margin = sample_rate / 20;
+        double energy = 0;
+        double error = 0;
+        for (int i = kChannels * margin; i < kChannels * (frames - margin); i++) {
+            energy += input[i] * input[i];
+            error += (restored[i] - input[i]) * (restored[i] - input[i]);
+        }
+        const double error_db = 10 * std::log10((1e-37 + error) / (1e-37 + energy));
+        if (error_db > -80) {
+            std::cerr << "error resampler round trip " << error_db << " dB" << std::endl;
+        }
+    }
+}
+
+void TestPolyphaseResampler() {
+    for (const int factor : { 2, 3, 4 }) {
+        for (const int taps : { 5, 31, 257 }) {
+            TestFftUpsamplerAgainstDirect(factor, taps);
+            TestFftDownsamplerAgainstDirect(factor, taps);
+        }
+    }
+    for (const int factor : { 2, 3, 4 }) {
+        TestResamplerAgainstDirect(factor, 1, CreateLowpassFir(factor, 61), 30);
+        TestResamplerAgainstDirect(1, factor, CreateLowpassFir(factor, 61), 0);
+    }
+    TestResamplerAgainstDirect(3, 2, CreateLowpassFir(3, 95), 47);
+    TestResamplerAgainstDirect(2, 3, CreateLowpassFir(3, 95), 5);
+    {
+        int up, down;
+        bakuage::PolyphaseResampler<float>::CalcFactors(44100, 48000, &up, &down);
+        const auto fir = bakuage::PolyphaseResampler<float>::DesignFir(44100, 48000, 120, 2050);
+        TestResamplerAgainstDirect(up, down, fir, fir.size() / 2);
+    }
+    TestResamplerRoundTrip();
+}
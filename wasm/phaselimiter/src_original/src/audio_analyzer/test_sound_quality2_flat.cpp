@@ -0,0 +1,123 @@
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <boost/archive/binary_oarchive.hpp>
+
+#include "bakuage/sound_quality2.h"
+#include "bakuage/sound_quality2_flat.h"
+
+namespace {
+    bakuage::MasteringReference2 CreateRandomReference(int band_count, std::mt19937 *engine) {
+        const int dim = 2 * band_count;
+        std::normal_distribution<double> dist;
+        Eigen::VectorXd mean(dim);
+        for (int i = 0; i < dim; i++) {
+            mean[i] = -20 - 2 * i + 3 * dist(*engine);
+        }
+        Eigen::MatrixXd a(dim, dim);
+        for (int i = 0; i < dim; i++) {
+            for (int j = 0; j < dim; j++) {
+                a(i, j) = dist(*engine);
+            }
+        }
+        const Eigen::MatrixXd covariance = a * a.transpose() / dim + Eigen::MatrixXd::Identity(dim, dim);
+        return bakuage::MasteringReference2(mean, covariance);
+    }
+}
+
+// フラット形式の sound_quality2_cache が元の SoundQuality2Calculator と
+// 同じ結果を返すか (直接書き出したものと、旧形式から変換したもの)
+void TestSoundQuality2Flat() {
+    const int band_count = 6;
+    std::mt19937 engine(1);
+    std::vector<bakuage::MasteringReference2> references;
+    for (int i = 0; i < 400; i++) {
+        references.emplace_back(CreateRandomReference(band_count, &engine));
+    }
+    std::vector<bakuage::SoundQuality2CalculatorUnit::Band> bands(band_count);
+    for (int i = 0; i < band_count; i++) {
+        bands[i].low_freq = i == 0 ? 0 : 100 * (1 << i);
+        bands[i].high_freq = i == band_count - 1 ? 0 : 100 * (2 << i);
+    }
+
+    bakuage::SoundQuality2Calculator calculator;
+    calculator.Prepare(references.begin(), references.end(), bands.begin(), bands.end());
+
+    std::vector<char> flat;
+    bakuage::FlatSoundQuality2Writer::Write(calculator, &flat);
+    std::string legacy;
+    {
+        std::ostringstream os;
+        {
+            boost::archive::binary_oarchive oa(os);
+            oa << calculator;
+        }
+        legacy = os.str();
+    }
+
+    const auto direct = bakuage::LoadFlatSoundQuality2Calculator(nullptr, flat.data(), flat.size());
+    const auto converted = bakuage::LoadFlatSoundQuality2Calculator(nullptr, legacy.data(), legacy.size());
+
+    int error_count = 0;
+    std::vector<bakuage::MasteringReference2> targets(references.begin(), references.begin() + 50);
+    for (int i = 0; i < 200; i++) {
+        targets.emplace_back(CreateRandomReference(band_count, &engine));
+    }
+    for (const auto &flat_calculator : { direct, converted }) {
+        if (flat_calculator->band_count() != band_count) {
+            std::cerr << "band_count mismatch" << std::endl;
+            error_count++;
+        }
+        for (int i = 0; i < band_count; i++) {
+            if (flat_calculator->bands()[i].low_freq != bands[i].low_freq ||
+                flat_calculator->bands()[i].high_freq != bands[i].high_freq) {
+                std::cerr << "band mismatch " << i << std::endl;
+                error_count++;
+            }
+        }
+        for (int i = 0; i < targets.size(); i++) {
+            float sq, lof, expected_sq, expected_lof;
+            calculator.CalculateSoundQuality(targets[i], &expected_sq, &expected_lof);
+            flat_calculator->CalculateSoundQuality(targets[i], &sq, &lof);
+            const double expected_distance = calculator.CalculateDistance(targets[0], targets[i]);
+            const double distance = flat_calculator->CalculateDistance(targets[0], targets[i]);
+            if (sq != expected_sq || lof != expected_lof || distance != expected_distance) {
+                std::cerr << "mismatch " << i << " sq " << sq << " " << expected_sq
+                << " lof " << lof << " " << expected_lof
+                << " distance " << distance << " " << expected_distance << std::endl;
+                error_count++;
+            }
+        }
+
+        // まとめて計算しても同じ
+        std::vector<float> batch_sq(targets.size()), batch_lof(targets.size());
+        flat_calculator->CalculateSoundQuality(targets.data(), targets.size(), batch_sq.data(), batch_lof.data());
+        for (int i = 0; i < targets.size(); i++) {
+            float sq, lof;
+            flat_calculator->CalculateSoundQuality(targets[i], &sq, &lof);
+            if (batch_sq[i] != sq || batch_lof[i] != lof) {
+                std::cerr << "batch mismatch " << i << " sq " << batch_sq[i] << " " << sq
+                << " lof " << batch_lof[i] << " " << lof << std::endl;
+                error_count++;
+            }
+        }
+    }
+
+    // 壊れたデータは例外になる
+    for (const size_t size : { size_t(16), flat.size() / 2, flat.size() - 4 }) {
+        try {
+            bakuage::FlatSoundQuality2Calculator truncated(nullptr, flat.data(), size);
+            std::cerr << "truncated data (" << size << " bytes) accepted" << std::endl;
+            error_count++;
+        } catch (const std::runtime_error &) {
+        }
+    }
+
+    std::cerr << "flat size " << flat.size() << " legacy size " << legacy.size() << std::endl;
+    std::cerr << "TestSoundQuality2Flat finished errors:" << error_count << std::endl;
+}
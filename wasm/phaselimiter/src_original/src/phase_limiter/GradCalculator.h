@@ -9,6 +9,7 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <thread>
 #include <vector>
 #include <list>
@@ -30,6 +31,16 @@
 namespace phase_limiter {
     template<class SimdType> class GradCalculator;
     
+    // 評価関数の窓長 (fft_min_len, fft_max_len) の倍率
+    // 44100Hzで1として、窓の時間長がなるべく変わらないように2^xで選ぶ (48000Hzは1、96000Hzは2)
+    inline int GradFftLenScale(int sample_rate) {
+        int scale = 1;
+        while (44100.0 * scale * std::sqrt(2.0) < sample_rate) {
+            scale *= 2;
+        }
+        return scale;
+    }
+    
     namespace impl {
         template <typename T>
         int sgn(T val) {
@@ -161,10 +172,16 @@ namespace phase_limiter {
         struct TaskGroup {
             typedef typename SimdType::element_type Float;
             
-            TaskGroup(): bg(0), ed(0), channel(0), output_eval(0), output_dot_product(0), output_norm_sqr(0) {}
+            TaskGroup(): bg(0), ed(0), channel(0), output_eval(0), output_eval_hi(0), output_dot_product(0), output_norm_sqr(0), output_active(false) {}
             
             template <class WaveInputFunc, class GradOutputFunc>
             void doTask(const WaveInputFunc &wave_input_func, const GradOutputFunc &grad_output_func) {
+                output_active = isActive(wave_input_func);
+                if (!output_active) {
+                    // 誤差がほぼ無いのでevalもgradも0とみなす (tolerance以下の誤差の分は近似)。gradはGradCalculatorがクリア済み
+                    output_eval = 0;
+                    return;
+                }
                 double sumEval = 0;
                 for (const auto task: tasks) {
                     sumEval += task->doTask(wave_input_func, grad_output_func);
@@ -172,12 +189,32 @@ namespace phase_limiter {
                 output_eval = sumEval;
             };
             
+            // 入力の範囲でsrcとの差がinactive_toleranceを超えているか
+            // ceilingを超えない区間ではProxOperatorもgradも働かないので、入力がsrcのまま変化しない
+            template <class WaveInputFunc>
+            bool isActive(const WaveInputFunc &wave_input_func) const {
+                if (tasks.empty()) return false;
+                const auto calculator = tasks[0]->calculator;
+                const Float tolerance = calculator->inactive_tolerance();
+                if (tolerance < 0 || calculator->histogram) return true;
+                const int oversample = calculator->oversample();
+                const auto src = oversample == 1 ? calculator->waveSrc[channel] : calculator->waveSrc_downsample[channel];
+                const Float *wave = wave_input_func(channel, bg / oversample);
+                const int len = (ed - bg) / oversample;
+                for (int i = 0; i < len; i++) {
+                    if (std::abs(wave[i] - src[bg / oversample + i]) > tolerance) return true;
+                }
+                return false;
+            }
+            
             int bg, ed;
             int channel;
             std::vector<Task<SimdType> *, tbb::scalable_allocator<Task<SimdType> *>> tasks;
             double output_eval;
+            double output_eval_hi; // oversample時の高域の評価関数値 (before_hookで計算する)
             double output_dot_product;
             double output_norm_sqr;
+            bool output_active; // doTaskで評価関数を計算したか
             bakuage::AlignedPodVector<std::complex<Float>> wave_hi_spec;
         };
         
@@ -185,6 +222,8 @@ namespace phase_limiter {
             double eval;
             double dot_product;
             double norm_sqr;
+            int active_task_groups;
+            int task_groups;
         };
         
         template <class SimdType>
@@ -390,14 +429,17 @@ namespace phase_limiter {
                 TaskResult result = { 0 };
                 if (!before_hook_only) {
                     for (const auto &task_group: task_groups1) {
-                        result.eval += task_group.output_eval;
+                        result.eval += task_group.output_eval + task_group.output_eval_hi;
                         result.dot_product += task_group.output_dot_product;
                         result.norm_sqr += task_group.output_norm_sqr;
+                        result.active_task_groups += task_group.output_active;
                     }
                     for (const auto &task_group: task_groups2) {
                         result.eval += task_group.output_eval;
+                        result.active_task_groups += task_group.output_active;
                         // 2回目のループは、dot_productとかは無いはず
                     }
+                    result.task_groups = task_groups1.size() + task_groups2.size();
                 }
                 
                 return result;
@@ -460,16 +502,25 @@ namespace phase_limiter {
          lowpass truepeakを抑える対応を同時に考えると複雑なので、あとで考える。
          かなり複雑だがテストを書いてなんとかする
          
-         現状 (2019/02/11)
-         内部oversampleには対応してない(コードはところどころ存在するが、完成していない。現状oversample == 1の場合のみ動く想定)
+         内部oversampleの評価関数
+         eval(x) = eval_downsample(A x) + hi_weight * |B x|^2
+         A: ローパス(oversample_lowpass_spec_) + 間引き、B: ハイパス(oversample_hipass_spec_)
+         高域の項は外部oversampleのときにsrcに無い高域に対してGradCoreが返す値に合わせたもの (hiBandEvalWeight参照)
+         grad = A^T grad_downsampled + 2 * hi_weight * B^T B x
+         task_groupごとに前後にfft_len / 4の余白を付けたfft_len = oversample_filter_fft_len()の窓でFFTして計算する
+         (フィルタの半分の長さ(fft_len / 8)の2倍が余白に収まるので、B^T Bも窓の中で正確に計算できる)
+         1. before_hook (processOversampledTaskGroup) で、FISTAの点xを作って、A xをwave_downsampledに、
+            高域の評価関数値をoutput_eval_hiに、高域のgradのスペクトルをwave_hi_specに保存する
+         2. 評価関数計算 (doTask) はwave_downsampledとwaveSrc_downsampleで行い、grad_downsampledに書き込む
+         3. resynthesizeGradで、grad_downsampledのスペクトルとwave_hi_specを足してIFFTし、gradを作る
          */
         
         GradCalculator(int len, int sample_rate, int max_available_freq, int workerCount, const char *noise_update_mode, double noise_update_min_noise, double noise_update_initial_noise, double noise_update_fista_enable_ratio, int max_iter1, int max_iter2, int oversample):
-        histogram(NULL), last_iter(0), last_iter2(0), sample_rate_(sample_rate), sample_rate_downsample_(sample_rate / oversample), max_available_freq_(max_available_freq), len_(len), noise_update_mode_(noise_update_mode), noise_update_min_noise_(noise_update_min_noise), noise_update_initial_noise_(noise_update_initial_noise), noise_update_fista_enable_ratio_(noise_update_fista_enable_ratio), max_iter1_(max_iter1), max_iter2_(max_iter2), oversample_(oversample) {
+        histogram(NULL), last_iter(0), last_iter2(0), last_stop_reason(""), sample_rate_(sample_rate), sample_rate_downsample_(sample_rate / oversample), max_available_freq_(max_available_freq), len_(len), noise_update_mode_(noise_update_mode), noise_update_min_noise_(noise_update_min_noise), noise_update_initial_noise_(noise_update_initial_noise), noise_update_fista_enable_ratio_(noise_update_fista_enable_ratio), max_iter1_(max_iter1), max_iter2_(max_iter2), oversample_(oversample), max_sec_(0), convergence_eval_tolerance_(0), convergence_peak_tolerance_(0), inactive_tolerance_(-1) {
             using namespace bakuage;
             
-            if (sample_rate != 44100 * bakuage::CeilPowerOf2(sample_rate / 44100)) {
-                throw std::logic_error("sample_rate must be 44100 * 2^x");
+            if (sample_rate <= 0 || sample_rate % oversample) {
+                throw std::logic_error("sample_rate must be positive multiple of oversample");
             }
             if (oversample != bakuage::CeilPowerOf2(oversample)) {
                 throw std::logic_error("oversample must be 2^x");
@@ -490,6 +541,9 @@ namespace phase_limiter {
                     waveSrc_downsample[i] = TypedMalloc<Float>(memLen / oversample_);
                     wave_downsampled[i] = TypedMalloc<Float>(memLen / oversample_);
                     grad_downsampled[i] = TypedMalloc<Float>(memLen / oversample_);
+                    TypedFillZero(waveSrc_downsample[i], memLen / oversample_);
+                    TypedFillZero(wave_downsampled[i], memLen / oversample_);
+                    TypedFillZero(grad_downsampled[i], memLen / oversample_);
                 }
             }
             const int blockSize = fft_max_len() / 2;
@@ -525,7 +579,8 @@ namespace phase_limiter {
                 const int center = (fir_samples - 1) / 2;
                 
                 // 原点対称
-                const auto lowpass_fir = bakuage::CalculateBandPassFir<Float>(0, 0.5 - 9.0 / 2 / fir_samples, fir_samples, 7);
+                // ダウンサンプル後のナイキスト周波数で阻止域になるようにする (間引くときにスペクトルを切り捨てるので)
+                const auto lowpass_fir = bakuage::CalculateBandPassFir<Float>(0, 0.5 / oversample_ - 9.0 / 2 / fir_samples, fir_samples, 7);
                 bakuage::AlignedPodVector<Float> work(oversample_filter_fft_len());
                 work[0] = lowpass_fir[center];
                 for (int i = 1; i < center + 1; i++) {
@@ -550,7 +605,7 @@ namespace phase_limiter {
                 dft->Forward(work.data(), (Float *)work_spec.data(), pool.work());
                 oversample_hipass_spec_.resize(work_spec.size());
                 for (int i = 0; i < work_spec.size(); i++) {
-                    oversample_hipass_spec_[i] = work_spec[i].real() * normalization_scale * 0;
+                    oversample_hipass_spec_[i] = work_spec[i].real() * normalization_scale;
                 }
             }
             
@@ -576,13 +631,18 @@ namespace phase_limiter {
             }
         }
         
-        int fft_min_len() const { return (1 << 8) * (sample_rate_ / 44100); }
-        int fft_max_len() const { return PL_FFT_MAX_LEN * (sample_rate_ / 44100); }
+        int fft_min_len() const { return (1 << 8) * GradFftLenScale(sample_rate_); }
+        int fft_max_len() const { return PL_FFT_MAX_LEN * GradFftLenScale(sample_rate_); }
         int oversample_filter_fft_len() const { return 2 * fft_max_len(); }
         
         // input
         template <class DoublePtr>
-        void copyWaveSrcFrom(DoublePtr src, int stride) { CopyFromImpl<DoublePtr>(src, waveSrc, stride); }
+        void copyWaveSrcFrom(DoublePtr src, int stride) {
+            CopyFromImpl<DoublePtr>(src, waveSrc, stride);
+            if (oversample_ > 1) {
+                downsampleWaveSrc();
+            }
+        }
         template <class DoublePtr>
         void copyWaveProxFrom(DoublePtr src, int stride) { CopyFromImpl<DoublePtr>(src, waveProx, stride); }
         
@@ -608,7 +668,7 @@ namespace phase_limiter {
             
             auto local_grad = oversample_ == 1 ? grad : grad_downsampled;
             const auto local_oversample = oversample_;
-            return tasks->process(
+            const auto result = tasks->process(
                                   [local_grad, local_oversample, &before_hook](impl::TaskGroup<SimdType> *task_group) {
                                       before_hook(task_group);
                                       const int channel = task_group->channel;
@@ -620,6 +680,10 @@ namespace phase_limiter {
                                       simdpp::store(local_grad[channel] + i, x + g);
                                   }
                                   );
+            if (oversample_ > 1) {
+                resynthesizeGrad();
+            }
+            return result;
         }
         template <class BeforeHook, class WaveInputFunc>
         impl::TaskResult calcEval(double _noise, const BeforeHook &before_hook, const WaveInputFunc wave_input_func, bool serial = false) {
@@ -628,12 +692,30 @@ namespace phase_limiter {
             return tasks->process(before_hook, wave_input_func, [](int channel, int i, const SimdType &g) {}, serial);
         }
         
-#if 0
         template <class BeforeHook>
         impl::TaskResult executeBeforeHook(const BeforeHook &before_hook, bool serial = false) {
-            return tasks->process(before_hook, [](int channel, int i) { return simdpp::splat<SimdType>(0); }, [](int channel, int i, const SimdType &g) {}, serial, true);
+            return tasks->process(before_hook, [](int channel, int i) { return (Float *)nullptr; }, [](int channel, int i, const SimdType &g) {}, serial, true);
+        }
+        
+        // oversample時に、waveを評価関数の入力にするbefore_hook (高域の評価関数とgradも計算する)
+        std::function<void (TaskGroupType *)> oversampledEvalBeforeHook(Float **wave) {
+            const auto local_wave = std::array<Float *, 2>{{ wave[0], wave[1] }};
+            return [this, local_wave](TaskGroupType *task_group) {
+                processOversampledTaskGroup(task_group, [local_wave](int channel, int i) {
+                    return simdpp::load<SimdType>(local_wave[channel] + i);
+                }, nullptr, wave_downsampled, true);
+            };
+        }
+        
+        // waveを評価関数の入力にするbefore_hookとwave_input_func (oversampleの有無によらない)
+        std::pair<std::function<void (TaskGroupType *)>, std::function<Float *(int, int)>> evalTarget(Float **wave) {
+            if (oversample_ == 1) {
+                const auto local_wave = std::array<Float *, 2>{{ wave[0], wave[1] }};
+                return std::make_pair(emptyBeforeHook(), std::function<Float *(int, int)>([local_wave](int channel, int i) { return local_wave[channel] + i; }));
+            }
+            const auto local_wave_downsampled = std::array<Float *, 2>{{ wave_downsampled[0], wave_downsampled[1] }};
+            return std::make_pair(oversampledEvalBeforeHook(wave), std::function<Float *(int, int)>([local_wave_downsampled](int channel, int i) { return local_wave_downsampled[channel] + i; }));
         }
-#endif
         
         // 単位評価関数値を計算 (ホワイトノイズが1dBずれた場合の誤差値)
         // waveSrc, waveOutを汚染するので注意
@@ -687,9 +769,11 @@ namespace phase_limiter {
                         }
                     }
                 }
-                const auto local_waveOut = waveOut;
-                const auto wave_input_func = [local_waveOut](int channel, int i) { return local_waveOut[channel] + i; };
-                unit_eval = calcEval(noise_update_min_noise_, emptyBeforeHook(), wave_input_func).eval; // min noise
+                if (oversample_ > 1) {
+                    downsampleWaveSrc();
+                }
+                const auto eval_target = evalTarget(waveOut);
+                unit_eval = calcEval(noise_update_min_noise_, eval_target.first, eval_target.second).eval; // min noise
             }
             std::cerr << "unit_eval:" << unit_eval << std::endl;
             return unit_eval;
@@ -740,12 +824,35 @@ namespace phase_limiter {
             double prevNormalizedEvalProx = 1e100;
             double prevEvalProx2 = 1e100;
             double noise = noise_update_initial_noise_;
+            bakuage::StopWatch stop_watch;
+            bool time_limit_reached = false;
+            // 収束判定 (convergence_eval_tolerance_ > 0のときのみ)
+            const int kConvergencePatience = 2;
+            int converged_count = 0;
+            bool convergence_reached = false; // 以降はmin_noiseで最適化する
+            double peak_overshoot = 0;
+            last_stop_reason = "max_iter1";
             std::cerr << "optimizeWithProgressCallback loop start" << std::endl;
             while (iter <= kMaxIter1 && iter2 <= kMaxIter2) {
                 PerformanceCounter::GetInstance().Start("optimize_loop1");
                 
+                // max_sec_が指定されている場合は、時間の進み具合でもnoiseを下げて、時間内にmin_noiseまで到達させる
+                double schedule_ratio = (double)iter / kMaxIter1;
+                if (max_sec_ > 0) {
+                    const double time_ratio = stop_watch.time() / max_sec_;
+                    if (time_ratio >= 1) {
+                        time_limit_reached = true;
+                    }
+                    schedule_ratio = std::min(1.0, std::max(schedule_ratio, time_ratio));
+                }
+                // 途中のnoiseで収束したら、残りのスケジュールを飛ばしてmin_noiseに下げる
+                if (convergence_reached) {
+                    schedule_ratio = 1;
+                }
+                const bool at_min_noise = schedule_ratio >= 1;
+                
                 if (noise_update_mode_ == "linear") {
-                    const double target_noise = noise_update_initial_noise_ * std::pow(noise_update_min_noise_ / noise_update_initial_noise_, std::pow((double)iter / kMaxIter1, 1));
+                    const double target_noise = noise_update_initial_noise_ * std::pow(noise_update_min_noise_ / noise_update_initial_noise_, std::pow(schedule_ratio, 1));
                     //double target_noise = std::pow(t / 0.01, 0.5);
                     //const double iter_pow = std::log(noise_update_initial_noise_ / noise_update_min_noise_) / std::log(kMaxIter1);
                     //const double target_noise = noise_update_initial_noise_ / std::pow(iter, iter_pow);
@@ -784,6 +891,7 @@ namespace phase_limiter {
                         prevEvalProx2 = prevEvalProx;
                     }
                     if (noise < noise_update_min_noise_) {
+                        last_stop_reason = "min_noise";
                         break;
                     }
                 } else {
@@ -801,53 +909,22 @@ namespace phase_limiter {
                 
                 PerformanceCounter::GetInstance().Start("calcEvalGrad");
                 //std::cerr << "AAA" << std::endl;
-                double evalOutHi = 0;
                 auto evalTargetWave1 = oversample_ == 1 ?
                 wavePrev : // wavePrevに保存してcalcEvalGrad後にwaveOutにrenameする (キャッシュ効率のため)
                 wave_downsampled;
-                const auto eval_out_result = calcEvalGrad(noise, [this, factor1/*, &evalOutHi*/](impl::TaskGroup<SimdType> *task_group) {
+                const auto eval_out_result = calcEvalGrad(noise, [this, factor1](impl::TaskGroup<SimdType> *task_group) {
                     const int channel = task_group->channel;
                     
                     if (oversample_ > 1) {
-                        // 領域確保
-                        auto &tv = impl::ThreadVar2<SimdType>::GetThreadInstance();
-                        const auto fft_len = 2 * fft_max_len();
-                        const auto fft_len_downsample = fft_len / oversample_;
-                        const auto bg_in_work = fft_len / 4;
-                        const auto ed_in_work = task_group->ed - task_group->bg + bg_in_work;
-                        tv.Reserve(fft_len, oversample_);
-                        task_group->wave_hi_spec.resize(fft_len);
-                        
-                        // スレッドごとの一時領域(fft_max_len() * oversampleの倍の長さ)にprox結果を保存
-                        auto work = tv.work.data();
-                        const auto bg_with_margin = task_group->bg - bg_in_work;
-                        const auto ed_with_margin = bg_with_margin + fft_len;
-                        for (int i = std::max(0, bg_with_margin); i < std::min(memLen, ed_with_margin); i += SimdType::length) {
-                            const SimdType prox = simdpp::load<SimdType>(waveProx[channel] + i);
-                            const SimdType prev = simdpp::load<SimdType>(wavePrev[channel] + i);
-                            const SimdType z = Fmadd<SimdType>(factor1, prox - prev, prox);
-                            simdpp::store(work + (i - bg_with_margin), z);
-                        }
-                        bakuage::TypedFillZero(work, std::max(0, bg_with_margin) - bg_with_margin);
-                        bakuage::TypedFillZero(work + std::min(memLen, ed_with_margin) - bg_with_margin, ed_with_margin - std::min(memLen, ed_with_margin));
-                        
-                        // FFT
-                        auto &pool = bakuage::ThreadLocalDftPool<bakuage::RealDft<Float>>::GetThreadInstance();
-                        const auto dft = pool.Get(fft_len);
-                        dft->Forward(work, (Float *)task_group->wave_hi_spec.data(), pool.work());
-                        
-                        // 一時領域からwaveOutにコピー
-                        // oversampleが無い場合は、wavePrevに保存して、calcEvalGrad後にwaveOutにrenameできるが (キャッシュ効率のため)、ダウンサンプルのFIRをかけるときにtaskグループの範囲外を読み取るので、別領域に保存する必要があるので、waveOutに保存
-                        bakuage::TypedMemcpy(waveOut[channel] + task_group->bg, work + bg_in_work, ed_in_work - bg_in_work);
-                        
-                        // FIR + IFFTでwave_downsampledを作る
-                        bakuage::VectorMul(oversample_lowpass_spec_.data(), task_group->wave_hi_spec.data(), tv.work_downsample_spec.data(), fft_len_downsample / 2 + 1);
-                        const auto dft_downsample = pool.Get(fft_len / oversample_);
-                        dft_downsample->Backward((Float *)tv.work_downsample_spec.data(), work, pool.work());
-                        bakuage::TypedMemcpy(wave_downsampled[channel] + task_group->bg / oversample_, work + bg_in_work / oversample_, (ed_in_work - bg_in_work) / oversample_);
-                        
-                        // FIR + IFFTでwave_hiを作る (specのままにしておきたい)
-                        bakuage::VectorMulInplace(oversample_hipass_spec_.data(), task_group->wave_hi_spec.data(), fft_len / 2 + 1);
+                        // 余白も含めてzを計算する (余白は隣のtask_groupの範囲なので、wavePrevには保存できない)
+                        // oversampleが無い場合は、wavePrevに保存して、calcEvalGrad後にwaveOutにrenameできるが (キャッシュ効率のため)、余白の計算でtaskグループの範囲外のwavePrevを読み取るので、waveOutに保存
+                        const auto local_prox = waveProx;
+                        const auto local_prev = wavePrev;
+                        processOversampledTaskGroup(task_group, [local_prox, local_prev, factor1](int channel, int i) {
+                            const SimdType prox = simdpp::load<SimdType>(local_prox[channel] + i);
+                            const SimdType prev = simdpp::load<SimdType>(local_prev[channel] + i);
+                            return Fmadd<SimdType>(factor1, prox - prev, prox);
+                        }, waveOut, wave_downsampled, true);
                     }
                     else {
                         for (int i = task_group->bg; i < task_group->ed; i += SimdType::length) {
@@ -863,7 +940,7 @@ namespace phase_limiter {
                     return evalTargetWave1[channel] + i; // wavePrevに保存してcalcEvalGrad後にwaveOutにrenameする (キャッシュ効率のため)
                 });
                 //std::cerr << "bbb" << std::endl;
-                const auto evalOut = eval_out_result.eval + evalOutHi;
+                const auto evalOut = eval_out_result.eval;
                 if (oversample_ == 1) {
                     // waveOut = old wavePrev
                     // waveProx = old waveOut
@@ -876,58 +953,23 @@ namespace phase_limiter {
                     // wavePrev = old waveProx
                     std::swap(waveProx, wavePrev);
                 }
-                if (oversample_ > 1) {
-                    // gradをアップサンプリングして合成する
-                    // task_groupごとに、task_groupに保存させてあるwave_hi_specをベースに、
-                    // gradをinterpolate -> FFT -> エイリアシングノイズ除去フィルタしたものを足しこんで
-                    // IFFTして配置すれば、gradのできあがり
-                    
-#if 0
-                    executeBeforeHook([this](impl::TaskGroup<SimdType> *task_group) {
-                        const int channel = task_group->channel;
-                        
-                        // 領域確保
-                        auto &tv = impl::ThreadVar2<SimdType>::GetThreadInstance();
-                        const auto fft_len = 2 * fft_max_len();
-                        const auto fft_len_downsample = fft_len / oversample_;
-                        const auto bg_in_work_downsample = fft_len_downsample / 4;
-                        const auto ed_in_work_downsample = (task_group->ed - task_group->bg) / oversample_ + bg_in_work_downsample;
-                        
-                        // スレッドごとの一時領域(fft_max_len()の倍の長さ)にdownsample gradを保存
-                        auto work = tv.work.data();
-                        const auto bg_with_margin_downsample = task_group->bg / oversample_ - bg_in_work_downsample;
-                        const auto ed_with_margin_downsample = bg_with_margin_downsample + fft_len_downsample;
-                        const auto memLen_downsample = memLen / oversample_;
-                        for (int i = std::max(0, bg_with_margin_downsample); i < std::min(memLen_downsample, ed_with_margin_downsample); i += SimdType::length) {
-                            const SimdType g = simdpp::load<SimdType>(grad[channel] + i);
-                            simdpp::store(work + (i - bg_with_margin_downsample), g);
-                        }
-                        bakuage::TypedFillZero(work, std::max(0, bg_with_margin_downsample) - bg_with_margin_downsample);
-                        bakuage::TypedFillZero(work + std::min(memLen, ed_in_work_downsample) - bg_with_margin_downsample, ed_with_margin_downsample - std::min(memLen_downsample, ed_in_work_downsample));
-                        
-                        // FFT grad downsample
-                        auto &pool = bakuage::ThreadLocalDftPool<bakuage::RealDft<Float>>::GetThreadInstance();
-                        const auto dft_downsample = pool.Get(fft_len_downsample);
-                        dft_downsample->Forward(work, (Float *)tv.work_downsample_spec.data(), pool.work());
-                        
-                        // grad + work_hi由来のgrad
-                        bakuage::VectorAddInplace(tv.work_downsample_spec.data(), task_group->wave_hi_spec.data(), fft_len_downsample / 2 + 1);
-                        
-                        // IFFT grad oversample
-                        const auto dft = pool.Get(fft_len);
-                        dft->Backward((Float *)task_group->wave_hi_spec.data(), work, pool.work());
-                        
-                        // copy grad
-                        const auto bg_in_work = fft_len / 4;
-                        const auto ed_in_work = task_group->ed - task_group->bg + bg_in_work;
-                        bakuage::TypedMemcpy(grad[channel] + task_group->bg, work + bg_in_work, ed_in_work - bg_in_work);
-                    });
-#endif
-                }
                 // gradだけははみ出てくるので、ここでちゃんとはみ出た分をカットする
                 for (int channel = 0; channel < 2; channel++) {
                     bakuage::TypedFillZero(grad[channel] + bg + len_, ed - (bg + len_));
                 }
+                // FISTAの外挿点(waveOut)のceiling超え。oversample時はoversample後のピーク
+                if (convergence_eval_tolerance_ > 0) {
+                    SimdType peak = simdpp::splat<SimdType>(0);
+                    for (int channel = 0; channel < 2; channel++) {
+                        for (int i = bg; i < ed; i += SimdType::length) {
+                            const SimdType x = simdpp::load<SimdType>(waveOut[channel] + i);
+                            peak = simdpp::max(peak, simdpp::max(x, -x));
+                        }
+                    }
+                    Float peak_array[SimdType::length];
+                    simdpp::store(peak_array, peak);
+                    peak_overshoot = std::max<double>(0, *std::max_element(peak_array, peak_array + SimdType::length) - 1);
+                }
                 PerformanceCounter::GetInstance().Pause("calcEvalGrad");
                 
                 // FISTA line search
@@ -938,55 +980,32 @@ namespace phase_limiter {
                 while (iter2 <= kMaxIter2) {
                     // callback(std::max<double>((double)iter / kMaxIter1, (double)iter2 / kMaxIter2));
                     PerformanceCounter::GetInstance().Start("calcEval");
-                    double evalProxHi = 0;
                     auto evalTargetWave2 = oversample_ == 1 ?
                     waveProx :
                     wave_downsampled;
-                    const auto eval_prox_result = calcEval(noise, [this, t/*, &evalProxHi*/](impl::TaskGroup<SimdType> *task_group) {
+                    const auto eval_prox_result = calcEval(noise, [this, t](impl::TaskGroup<SimdType> *task_group) {
                         const int channel = task_group->channel;
                         SimdType dot_product = simdpp::splat<SimdType>(0);
                         SimdType norm_sqr = simdpp::splat<SimdType>(0);
                         const SimdType minusTVec = simdpp::splat<SimdType>(-t);
                         
                         if (oversample_ > 1) {
-                            // 領域確保
-                            auto &tv = impl::ThreadVar2<SimdType>::GetThreadInstance();
-                            const auto fft_len = 2 * fft_max_len();
-                            const auto fft_len_downsample = fft_len / oversample_;
-                            const auto bg_in_work = fft_len / 4;
-                            const auto ed_in_work = task_group->ed - task_group->bg + bg_in_work;
-                            
-                            // スレッドごとの一時領域(fft_max_len() * oversampleの倍の長さ)にprox結果を保存
-                            auto work = tv.work.data();
-                            const auto bg_with_margin = task_group->bg - bg_in_work;
-                            const auto ed_with_margin = bg_with_margin + fft_len;
-                            for (int i = std::max(0, bg_with_margin); i < std::min(memLen, ed_with_margin); i += SimdType::length) {
+                            // 余白も含めてproxを計算して、範囲内だけwaveProxに保存する
+                            const auto local_out = waveOut;
+                            const auto local_grad = grad;
+                            processOversampledTaskGroup(task_group, [local_out, local_grad, minusTVec](int channel, int i) {
+                                const SimdType x = simdpp::load<SimdType>(local_out[channel] + i);
+                                const SimdType y = simdpp::load<SimdType>(local_grad[channel] + i);
+                                return ProxOperator(Fmadd<SimdType>(minusTVec, y, x)); //NaNの関係で多分順番が大事
+                            }, waveProx, wave_downsampled, false);
+                            for (int i = task_group->bg; i < task_group->ed; i += SimdType::length) {
                                 const SimdType x = simdpp::load<SimdType>(waveOut[channel] + i);
                                 const SimdType y = simdpp::load<SimdType>(grad[channel] + i);
-                                const SimdType prox = ProxOperator(Fmadd<SimdType>(minusTVec, y, x)); //NaNの関係で多分順番が大事
-                                if (task_group->bg <= i && i < task_group->ed) {
-                                    const SimdType diff = prox - x;
-                                    dot_product = Fmadd<SimdType>(diff, y, dot_product);
-                                    norm_sqr = Fmadd<SimdType>(diff, diff, norm_sqr);
-                                }
-                                simdpp::store(work + (i - bg_with_margin), prox);
+                                const SimdType prox = simdpp::load<SimdType>(waveProx[channel] + i);
+                                const SimdType diff = prox - x;
+                                dot_product = Fmadd<SimdType>(diff, y, dot_product);
+                                norm_sqr = Fmadd<SimdType>(diff, diff, norm_sqr);
                             }
-                            bakuage::TypedFillZero(work, std::max(0, bg_with_margin) - bg_with_margin);
-                            bakuage::TypedFillZero(work + std::min(memLen, ed_with_margin) - bg_with_margin, ed_with_margin - std::min(memLen, ed_with_margin));
-                            
-                            // FFT
-                            auto &pool = bakuage::ThreadLocalDftPool<bakuage::RealDft<Float>>::GetThreadInstance();
-                            const auto dft = pool.Get(fft_len);
-                            dft->Forward(work, (Float *)task_group->wave_hi_spec.data(), pool.work());
-                            
-                            // 一時領域からwaveProxにコピー
-                            bakuage::TypedMemcpy(waveProx[channel] + task_group->bg, work + bg_in_work, ed_in_work - bg_in_work);
-                            
-                            // FIR + IFFTでwave_downsampledを作る
-                            bakuage::VectorMul(oversample_lowpass_spec_.data(), task_group->wave_hi_spec.data(), tv.work_downsample_spec.data(), fft_len_downsample / 2 + 1);
-                            const auto dft_downsample = pool.Get(fft_len / oversample_);
-                            dft_downsample->Backward((Float *)tv.work_downsample_spec.data(), work, pool.work());
-                            bakuage::TypedMemcpy(wave_downsampled[channel] + task_group->bg / oversample_, work + bg_in_work / oversample_, (ed_in_work - bg_in_work) / oversample_);
                         }
                         else {
                             // ここでちゃんとmax(bg, x), min(ed, x)によって、はみ出た分をカットする
@@ -1006,30 +1025,58 @@ namespace phase_limiter {
                         return evalTargetWave2[channel] + i;
                     });
                     PerformanceCounter::GetInstance().Pause("calcEval");
-                    std::cerr << "evalProx:" << eval_prox_result.eval + evalProxHi << "\tevalOut:" << evalOut << "\tdot_product:" << eval_prox_result.dot_product << "\tnorm_sqr:" << eval_prox_result.norm_sqr << std::endl;
-                    if (eval_prox_result.eval + evalProxHi <= evalOut + eval_prox_result.dot_product + (0.5f / t) * eval_prox_result.norm_sqr) {
-                        const double normalized_eval = ((eval_prox_result.eval + evalProxHi) * bakuage::Sqr(noise)) / (1e-37 + unit_eval * bakuage::Sqr(noise_update_min_noise_));
-                        prevEvalProx = eval_prox_result.eval + evalProxHi;
+                    std::cerr << "evalProx:" << eval_prox_result.eval << "\tevalOut:" << evalOut << "\tdot_product:" << eval_prox_result.dot_product << "\tnorm_sqr:" << eval_prox_result.norm_sqr << std::endl;
+                    if (eval_prox_result.eval <= evalOut + eval_prox_result.dot_product + (0.5f / t) * eval_prox_result.norm_sqr) {
+                        const double normalized_eval = ((eval_prox_result.eval) * bakuage::Sqr(noise)) / (1e-37 + unit_eval * bakuage::Sqr(noise_update_min_noise_));
+                        prevEvalProx = eval_prox_result.eval;
                         prevNormalizedEvalProx = normalized_eval;
-                        std::cerr << "eval:" << prevEvalProx << "\tt:" << t << "\tnoise:" << noise << "\tnormalized_eval:" << normalized_eval << std::endl;
+                        std::cerr << "eval:" << prevEvalProx << "\tt:" << t << "\tnoise:" << noise << "\tnormalized_eval:" << normalized_eval << "\tactive_task_groups:" << eval_out_result.active_task_groups << "/" << eval_out_result.task_groups << std::endl;
+                        if (convergence_eval_tolerance_ > 0) {
+                            // 同じnoiseでの外挿点からの改善率 (noiseが毎回変わるので反復間のevalは比較できない)
+                            const double eval_improvement = std::abs(evalOut - prevEvalProx) / (1e-37 + evalOut);
+                            std::cerr << "eval_improvement:" << eval_improvement << "\tpeak_overshoot:" << peak_overshoot << std::endl;
+                            if (eval_improvement <= convergence_eval_tolerance_ && peak_overshoot <= convergence_peak_tolerance_) {
+                                converged_count++;
+                            } else {
+                                converged_count = 0;
+                            }
+                        }
                         break;
                     }
                     t *= t_beta;
                     iter2++;
                 }
+                if (iter2 > kMaxIter2) {
+                    last_stop_reason = "max_iter2";
+                }
                 
                 iter++;
+                // min_noiseでの1回を終えてから打ち切る
+                if (time_limit_reached) {
+                    std::cerr << "optimization time limit reached:" << stop_watch.time() << std::endl;
+                    last_stop_reason = "time_limit";
+                    break;
+                }
+                if (converged_count >= kConvergencePatience) {
+                    if (at_min_noise) {
+                        std::cerr << "optimization converged:" << iter - 1 << std::endl;
+                        last_stop_reason = "converged";
+                        break;
+                    }
+                    std::cerr << "optimization converged at noise:" << noise << ". skip to min noise" << std::endl;
+                    convergence_reached = true;
+                    converged_count = 0;
+                }
             }
             last_iter = iter;
             last_iter2 = iter2;
             
             std::cerr << "optimization finished. calc eval func of the final result" << std::endl;
-            const auto eval_prox_result = calcEval(noise, [](impl::TaskGroup<SimdType> *task_group) {}, [this](int channel, int i) {
-                return waveProx[channel] + i;
-            });
+            const auto final_eval_target = evalTarget(waveProx);
+            const auto eval_prox_result = calcEval(noise, final_eval_target.first, final_eval_target.second);
             const double evalProx = eval_prox_result.eval;
             const double normalized_eval = evalProx / (1e-37 + unit_eval);
-            std::cerr << "eval:" << evalProx << "\tnoise:" << noise_update_min_noise_ << "\tnormalized_eval:" << normalized_eval << "\tlast_iter:" << last_iter << "\tlast_iter2:" << last_iter2 << std::endl;
+            std::cerr << "eval:" << evalProx << "\tnoise:" << noise_update_min_noise_ << "\tnormalized_eval:" << normalized_eval << "\tlast_iter:" << last_iter << "\tlast_iter2:" << last_iter2 << "\tstop_reason:" << last_stop_reason << std::endl;
             
             std::cerr << "calcEval:" << PerformanceCounter::GetInstance().Time("calcEval") << std::endl;
             std::cerr << "calcEvalGrad:" << PerformanceCounter::GetInstance().Time("calcEvalGrad") << std::endl;
@@ -1041,17 +1088,15 @@ namespace phase_limiter {
         // for limiting_error calculation
         double CalcEvalFromProx(double _noise, double unit_eval) {
             tasks->clearCache();
-            const auto eval_result = calcEval(_noise, [](impl::TaskGroup<SimdType> *task_group) {}, [this](int channel, int i) {
-                return waveProx[channel] + i;
-            });
+            const auto eval_target = evalTarget(waveProx);
+            const auto eval_result = calcEval(_noise, eval_target.first, eval_target.second);
             return eval_result.eval;
         }
         
         double CalcEvalGradFromProx(double _noise, double unit_eval) {
             tasks->clearCache();
-            const auto eval_result = calcEvalGrad(_noise, [](impl::TaskGroup<SimdType> *task_group) {}, [this](int channel, int i) {
-                return waveProx[channel] + i;
-            });
+            const auto eval_target = evalTarget(waveProx);
+            const auto eval_result = calcEvalGrad(_noise, eval_target.first, eval_target.second);
             return eval_result.eval;
         }
         
@@ -1060,6 +1105,29 @@ namespace phase_limiter {
         int max_available_freq() const { return max_available_freq_; }
         int oversample() const { return oversample_; }
         
+        // optimizeWithProgressCallbackの時間制限 (秒、0以下で無制限)。
+        // 超えそうな場合はnoiseを早めに下げて、min_noiseで1回最適化してから終了する
+        void set_max_sec(double value) { max_sec_ = value; }
+        double max_sec() const { return max_sec_; }
+        
+        // optimizeWithProgressCallbackの収束判定。
+        // 反復ごとの評価関数の改善率 (同じnoiseでの外挿点からの改善) が eval_tolerance 以下、
+        // かつ外挿点のceiling超えが peak_tolerance 以下の状態が続いたら収束とみなし、
+        // min_noiseになっていなければmin_noiseに下げて、そこでも収束したら終了する
+        // ceiling超えはリミッターのサンプル上のピーク (oversample == 1ならsample peakでtrue peakではない)
+        // eval_tolerance が0以下で無効 (max_iter1まで回す、デフォルト)
+        void set_convergence_tolerance(double eval_tolerance, double peak_tolerance) {
+            convergence_eval_tolerance_ = eval_tolerance;
+            convergence_peak_tolerance_ = peak_tolerance;
+        }
+        
+        // 評価関数の入力とsrcの差 (絶対値) がこれ以下のtask_groupは、evalもgradも0とみなして計算を省略する。
+        // 差が0でなければ近似なので、結果はスキップしない場合と完全には一致しない
+        // (0にしても、近くのtask_groupのgradの丸め誤差が広がるのでほとんどスキップされない)
+        // 負で無効 (デフォルト)。histogram計算時も無効
+        void set_inactive_tolerance(double value) { inactive_tolerance_ = value; }
+        double inactive_tolerance() const { return inactive_tolerance_; }
+        
         // variables
         std::vector<int> *histogram;
         bool gradEnabled;
@@ -1069,6 +1137,7 @@ namespace phase_limiter {
         Float *grad[2];
         int last_iter;
         int last_iter2;
+        std::string last_stop_reason; // max_iter1 / max_iter2 / time_limit / converged / min_noise
     private:
         template <class DoublePtr>
         void CopyFromImpl(DoublePtr src, Float **dest, int stride) const {
@@ -1089,6 +1158,137 @@ namespace phase_limiter {
                     dest[channel][i * stride] = src[channel][i + bg];
             }
         }
+
+        // 高域の評価関数の重み (GradCoreのwindowLenごとに、srcに無い帯域の誤差eに対して0.75 * |e|^2 / (noise + absolute_min_noise)^2 になる)
+        double hiBandEvalWeight() const {
+            int window_count = 0;
+            for (int w = fft_min_len(); w <= fft_max_len(); w *= 2) {
+                window_count++;
+            }
+            const double n = noise + GradCoreSettings::GetInstance().absolute_min_noise();
+            return 0.75 * window_count / (n * n);
+        }
+        
+        // task_groupの範囲を、前後にfft_len / 4の余白をつけた窓で処理する
+        // wave_func(channel, i): oversample後の位置iのFISTAの点 (余白の部分も計算できること)
+        // dest: task_groupの範囲のwave_funcを保存する (nullptr可)
+        // dest_downsample: task_groupの範囲のA xを保存する
+        // hi_eval: 高域の評価関数値をoutput_eval_hiに、gradEnabledなら高域のgradのスペクトルをwave_hi_specに保存する
+        template <class WaveFunc>
+        void processOversampledTaskGroup(TaskGroupType *task_group, const WaveFunc &wave_func, Float **dest, Float **dest_downsample, bool hi_eval) {
+            const int channel = task_group->channel;
+            const int fft_len = oversample_filter_fft_len();
+            const int fft_len_downsample = fft_len / oversample_;
+            const int margin = fft_len / 4;
+            const int work_bg = task_group->bg - margin;
+            const int group_len = task_group->ed - task_group->bg;
+            
+            auto &tv = impl::ThreadVar2<SimdType>::GetThreadInstance();
+            tv.Reserve(fft_len, oversample_);
+            auto &pool = bakuage::ThreadLocalDftPool<bakuage::RealDft<Float>>::GetThreadInstance();
+            const auto dft = pool.Get(fft_len);
+            const auto dft_downsample = pool.Get(fft_len_downsample);
+            
+            Float *work = tv.work.data();
+            for (int i = 0; i < fft_len; i += SimdType::length) {
+                const int j = work_bg + i;
+                if (0 <= j && j < memLen) {
+                    simdpp::store(work + i, wave_func(channel, j));
+                } else {
+                    simdpp::store(work + i, simdpp::splat<SimdType>(0));
+                }
+            }
+            if (dest) {
+                bakuage::TypedMemcpy(dest[channel] + task_group->bg, work + margin, group_len);
+            }
+            
+            task_group->wave_hi_spec.resize(fft_len / 2 + 1);
+            auto wave_spec = task_group->wave_hi_spec.data();
+            dft->Forward(work, (Float *)wave_spec, pool.work());
+            
+            // A x
+            auto downsample_spec = tv.work_downsample_spec.data();
+            for (int i = 0; i < fft_len_downsample / 2 + 1; i++) {
+                downsample_spec[i] = wave_spec[i] * oversample_lowpass_spec_[i];
+            }
+            dft_downsample->Backward((Float *)downsample_spec, work, pool.work());
+            bakuage::TypedMemcpy(dest_downsample[channel] + task_group->bg / oversample_, work + margin / oversample_, group_len / oversample_);
+            
+            if (!hi_eval) {
+                task_group->output_eval_hi = 0;
+                return;
+            }
+            
+            // hi_weight * |B x|^2
+            const double hi_weight = hiBandEvalWeight();
+            auto hi_spec = tv.work_hi_spec.data();
+            for (int i = 0; i < fft_len / 2 + 1; i++) {
+                hi_spec[i] = wave_spec[i] * oversample_hipass_spec_[i];
+            }
+            dft->Backward((Float *)hi_spec, work, pool.work());
+            double sum = 0;
+            for (int i = margin; i < margin + group_len; i++) {
+                sum += work[i] * work[i];
+            }
+            task_group->output_eval_hi = hi_weight * sum;
+            
+            // 2 * hi_weight * B^T B x (BはIFFTの正規化込みなので、二回かける分fft_lenで戻す)
+            if (gradEnabled) {
+                for (int i = 0; i < fft_len / 2 + 1; i++) {
+                    wave_spec[i] *= oversample_hipass_spec_[i] * oversample_hipass_spec_[i] * (Float)(2 * hi_weight * fft_len);
+                }
+            }
+        }
+        
+        // grad = A^T grad_downsampled + (before_hookで計算した高域のgrad)
+        void resynthesizeGrad() {
+            const auto local_oversample = oversample_;
+            executeBeforeHook([this, local_oversample](TaskGroupType *task_group) {
+                const int channel = task_group->channel;
+                const int fft_len = oversample_filter_fft_len();
+                const int fft_len_downsample = fft_len / local_oversample;
+                const int margin = fft_len / 4;
+                const int work_bg_downsample = (task_group->bg - margin) / local_oversample;
+                const int mem_len_downsample = memLen / local_oversample;
+                const int group_len = task_group->ed - task_group->bg;
+                
+                auto &tv = impl::ThreadVar2<SimdType>::GetThreadInstance();
+                tv.Reserve(fft_len, local_oversample);
+                auto &pool = bakuage::ThreadLocalDftPool<bakuage::RealDft<Float>>::GetThreadInstance();
+                const auto dft = pool.Get(fft_len);
+                const auto dft_downsample = pool.Get(fft_len_downsample);
+                
+                Float *work = tv.work.data();
+                for (int i = 0; i < fft_len_downsample; i++) {
+                    const int j = work_bg_downsample + i;
+                    work[i] = (0 <= j && j < mem_len_downsample) ? grad_downsampled[channel][j] : 0;
+                }
+                auto downsample_spec = tv.work_downsample_spec.data();
+                dft_downsample->Forward(work, (Float *)downsample_spec, pool.work());
+                
+                auto wave_spec = task_group->wave_hi_spec.data();
+                for (int i = 0; i < fft_len_downsample / 2 + 1; i++) {
+                    wave_spec[i] += downsample_spec[i] * oversample_lowpass_spec_[i];
+                }
+                dft->Backward((Float *)wave_spec, work, pool.work());
+                bakuage::TypedMemcpy(grad[channel] + task_group->bg, work + margin, group_len);
+            });
+            // 処理対象外の範囲はFISTAで動かないようにする
+            for (int channel = 0; channel < 2; channel++) {
+                bakuage::TypedFillZero(grad[channel], bg);
+                bakuage::TypedFillZero(grad[channel] + bg + len_, memLen - (bg + len_));
+            }
+        }
+        
+        // waveSrc_downsample = A waveSrc
+        void downsampleWaveSrc() {
+            executeBeforeHook([this](TaskGroupType *task_group) {
+                const auto local_src = waveSrc;
+                processOversampledTaskGroup(task_group, [local_src](int channel, int i) {
+                    return simdpp::load<SimdType>(local_src[channel] + i);
+                }, nullptr, waveSrc_downsample, false);
+            });
+        }
         
         int sample_rate_;
         int sample_rate_downsample_;
@@ -1111,6 +1311,10 @@ namespace phase_limiter {
         int max_iter1_;
         int max_iter2_;
         int oversample_;
+        double max_sec_;
+        double convergence_eval_tolerance_;
+        double convergence_peak_tolerance_;
+        double inactive_tolerance_;
     };
     
 }
@@ -183,7 +183,7 @@ public:
 			low_freq = band.at("low_freq").get<double>();
         }
         if (band.find("high_freq") == band.end()) {
-			high_freq = 0.5 * 44100;
+			high_freq = 0; // ナイキスト周波数まで
         }
         else {
 			high_freq = band.at("high_freq").get<double>();
@@ -255,7 +255,7 @@ void AutoMastering(std::vector<float> *_wave, const float **irs, const int *ir_l
 		for (const auto band : reference.bands) {
 			audio_analyzer::Band<Float> b;
 			b.low_freq = band.low_freq;
-			b.high_freq = band.high_freq;
+			b.high_freq = band.high_freq == 0 ? 0.5 * sample_rate : band.high_freq;
 			original_bands.push_back(b);
 		}
 		int block_samples;
@@ -286,7 +286,7 @@ void AutoMastering(std::vector<float> *_wave, const float **irs, const int *ir_l
 				fir_delay_samples = static_cast<int>(0.002 * sample_rate);
 				int n = 2 * fir_delay_samples + 1;
 				Float freq1 = std::min<Float>(0.5, band.low_freq / sample_rate);
-				Float freq2 = std::min<Float>(0.5, band.high_freq / sample_rate);
+				Float freq2 = band.high_freq == 0 ? 0.5 : std::min<Float>(0.5, band.high_freq / sample_rate);
 				fir = CalculateBandPassFir<Float>(freq1, freq2, n, 4);
 			}
 			update_progression_bound(0.1);
@@ -1,7 +1,9 @@
 #ifndef PHASE_LIMITER_AUTO_MASTERING_H_
 #define PHASE_LIMITER_AUTO_MASTERING_H_
 
+#include <cstddef>
 #include <functional>
+#include <memory>
 #include <vector>
 
 namespace phase_limiter {
@@ -11,13 +13,31 @@ namespace phase_limiter {
         std::vector<float> compressor_thresholds;
         std::vector<float> compressor_wets;
         std::vector<float> compressor_gains;
+        // 解析時のコンプバンドごとの平均エネルギー (mid, sideの順)。RenderMastering3で使う
+        std::vector<double> compressor_mean_energies;
     };
 
     void AutoMastering(std::vector<float> *_wave, const float **irs, const int *ir_lens, const int sample_rate, const std::function<void (float)> &progress_callback);
     void AutoMastering2(std::vector<float> *_wave, const int sample_rate, const std::function<void(float)> &progress_callback);
     void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std::function<void(float)> &progress_callback);
+    // AutoMastering3 = GetMastering3OptimumParams (解析 + 最適化) + RenderMastering3
     Mastering3OptimumParams GetMastering3OptimumParams(const std::vector<float> &wave, const int sample_rate, const std::function<void(float)> &progress_callback);
+    void RenderMastering3(std::vector<float> *_wave, const int sample_rate, const Mastering3OptimumParams &params);
     void AutoMastering5(std::vector<float> *_wave, const int sample_rate, const std::function<void (float)> &progress_callback);
+
+    // AutoMastering5 のエンジン単位の状態 (sound quality calculator, mastering reference,
+    // sample rateごとのバンドFIRとFFT plan)。一度作って複数のジョブで使い回す (スレッドセーフ)
+    // 作成時の FLAGS_mastering5_mastering_reference_file などが使われる
+    class AutoMastering5Context;
+    std::shared_ptr<const AutoMastering5Context> CreateAutoMastering5Context();
+    // sample_rate 用の状態を先に作っておく (呼ばなくても初回のジョブで作られる)
+    void PrepareAutoMastering5Context(const AutoMastering5Context &context, int sample_rate);
+    void AutoMastering5(std::vector<float> *_wave, const int sample_rate, const std::function<void (float)> &progress_callback, const AutoMastering5Context &context);
+    // AutoMastering5 は FLAGS_sound_quality2_cache を一度だけ読み込んでプロセス内で使い回す。
+    // (以降に作られる AutoMastering5Context から有効)
+    // これを呼ぶと代わりに data (フラット形式 or 旧形式) を使う (dataはコピーせずに参照するので、次に呼ぶまで解放しないこと)
+    // data = nullptr で FLAGS_sound_quality2_cache に戻す
+    void SetSoundQuality2CacheData(const void *data, size_t size);
 }
 
 #endif
@@ -137,8 +137,13 @@ void AutoMastering2(std::vector<float> *_wave, const int sample_rate, const std:
 
 	*/
 
-	int width = 2048;
-	int shift = 1024;
+	// 44100Hzで2048 (0.046 sec)、他のsample_rateでも時間長をほぼ合わせる
+	// (48000Hzの2228 = 4 * 557のような大きな素因数を避けて、FFTが速い長さに丸める)
+	int width = bakuage::RoundToSmoothNumber(static_cast<int>(2048LL * sample_rate / 44100), 2);
+	int shift = width / 2;
+	// configのmean, thresholdは44100Hz, width 2048でのmel bandのエネルギー。
+	// エネルギーはsample_rate * widthに比例するので補正する
+	const double mel_band_offset_db = -10 * std::log10(sample_rate / 44100.0 * width / 2048);
 	int num_filters = 40;
 	int mfcc_len = 13;
 	int pos = -width + shift;
@@ -186,7 +191,7 @@ void AutoMastering2(std::vector<float> *_wave, const int sample_rate, const std:
 		// calculate mel band
 		mfcc_calculator.calculateMelSpectrumFromDFT((float *)complex_spec_mono.data(), width, true, false, mel_bands_mono.data());
 		for (int j = 0; j < num_filters; j++) {
-			mel_bands_mono[j] = 10 * std::log10(1e-10 + mel_bands_mono[j]);
+			mel_bands_mono[j] = 10 * std::log10(1e-10 + mel_bands_mono[j]) + mel_band_offset_db;
 		}
 
 		// calculate gain
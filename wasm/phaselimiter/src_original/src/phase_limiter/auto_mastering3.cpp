@@ -17,6 +17,7 @@
 #include <numeric>
 #include "gflags/gflags.h"
 #include "picojson.h"
+#include "tbb/tbb.h"
 
 #include "audio_analyzer/reverb.h"
 #include "audio_analyzer/peak.h"
@@ -39,6 +40,8 @@
 
 DECLARE_int32(mastering3_iteration);
 DECLARE_double(mastering3_target_sn);
+DECLARE_int32(mastering3_chain_count);
+DECLARE_int32(mastering3_exchange_interval);
 
 typedef float Float;
 using namespace bakuage;
@@ -49,10 +52,6 @@ constexpr int verbose = 0;
 constexpr int verbose2 = 0;
 constexpr int verbose3 = 0;
 
-#ifdef PHASELIMITER_ENABLE_FFTW
-phase_limiter::Mastering3OptimumParams g_last_mastering3_optimum_params;
-#endif
-
 struct State {
 	int param_count() const {
 		return 4 * comp_band_count;
@@ -66,70 +65,406 @@ struct State {
 	std::vector<float> mfcc_ratios;
 };
 
-// eval_funcを最小にするようなStateを探す
+// eval_funcを最小にするようなStateを探す (parallel tempering)
+// chain_count本のチェーンを温度 t * temperature_ladder^k (k = 0が一番低温) で並列に回し、
+// exchange_interval iterationごとに隣接する温度のチェーン同士で状態の交換を試みる。
+// 全体の温度はSAと同じようにt_rateで下げていく。チェーン1本ならただのSA。
+// 乱数はチェーンごとに固定シードなので、チェーン数が同じならスレッド数によらず結果は同じ。
 template <class InitializeState, class GenerateNeighbor, class Evaluate, class State, class Progress>
-void SimulatedAnnealing(const InitializeState &initialize_state, const GenerateNeighbor &generate_neighbor,
-	const Evaluate &evaluate, int iter_count, double initial_t, double t_rate, const Progress &progress, State *optimum_state, double *optimum_eval) {
-	if (verbose) std::cerr << "SimulatedAnnealing start" << std::endl;
-
-	double t = initial_t;
-	State current_state, next_state;
-	initialize_state(&current_state);
-	double current_eval = evaluate(current_state);
-	*optimum_state = current_state;
-	*optimum_eval = current_eval;
-	if (verbose) std::cerr << "SimulatedAnnealing initialized " << current_eval << std::endl;
-
-	std::mt19937 engine(1);
-	std::uniform_real_distribution<> uniform_dist(0.0, 1.0);
-
-	const int progress_stride = iter_count / 10;
-	for (int i = 0; i < iter_count; i++) {
-		generate_neighbor(current_state, &next_state);
-		double next_eval = evaluate(next_state);
-
-		// update optimum
-		if (next_eval < *optimum_eval) {
-			if (verbose) std::cerr << "SimulatedAnnealing optimum updated " << next_eval << std::endl;
-			*optimum_state = next_state;
-			*optimum_eval = next_eval;
+void ParallelTempering(const InitializeState &initialize_state, const GenerateNeighbor &generate_neighbor,
+	const Evaluate &evaluate, int iter_count, int chain_count, int exchange_interval, double initial_t, double t_rate, double temperature_ladder,
+	const Progress &progress, State *optimum_state, double *optimum_eval) {
+	if (verbose) std::cerr << "ParallelTempering start " << chain_count << " chains" << std::endl;
+
+	struct Chain {
+		std::mt19937 engine;
+		State current_state;
+		double current_eval;
+		State optimum_state;
+		double optimum_eval;
+	};
+	chain_count = std::max(1, chain_count);
+	exchange_interval = std::max(1, exchange_interval);
+	std::vector<Chain> chains(chain_count);
+	tbb::parallel_for(0, chain_count, [&](int k) {
+		Chain &chain = chains[k];
+		chain.engine.seed(k + 1);
+		initialize_state(&chain.engine, &chain.current_state);
+		chain.current_eval = evaluate(chain.current_state);
+		chain.optimum_state = chain.current_state;
+		chain.optimum_eval = chain.current_eval;
+	});
+	if (verbose) std::cerr << "ParallelTempering initialized " << chains[0].current_eval << std::endl;
+
+	std::mt19937 exchange_engine(0);
+	std::uniform_real_distribution<> exchange_dist(0.0, 1.0);
+
+	for (int i = 0; i < iter_count; i += exchange_interval) {
+		const int segment_len = std::min(exchange_interval, iter_count - i);
+		const double segment_t = initial_t * std::pow(t_rate, i);
+		tbb::parallel_for(0, chain_count, [&](int k) {
+			Chain &chain = chains[k];
+			std::uniform_real_distribution<> uniform_dist(0.0, 1.0);
+			State next_state;
+			double t = segment_t * std::pow(temperature_ladder, k);
+			for (int m = 0; m < segment_len; m++) {
+				generate_neighbor(chain.current_state, &chain.engine, &next_state);
+				double next_eval = evaluate(next_state);
+
+				// update optimum
+				if (next_eval < chain.optimum_eval) {
+					chain.optimum_state = next_state;
+					chain.optimum_eval = next_eval;
+				}
+
+				// update current
+				double delta_eval = next_eval - chain.current_eval;
+				// double p = std::exp(-(next_eval - current_eval) / t);
+				double p = delta_eval <= 0 ? 1 : 2.0 / (1 + std::exp(delta_eval / t));
+				if (uniform_dist(chain.engine) < p) {
+					std::swap(chain.current_state, next_state);
+					chain.current_eval = next_eval;
+				}
+
+				// t = 1.0 / (1 + i);
+				t *= t_rate;
+			}
+		});
+
+		// exchange (ペアの組み方は偶数回目と奇数回目で交互にずらす)
+		const double t = initial_t * std::pow(t_rate, i + segment_len);
+		for (int k = (i / exchange_interval) % 2; k + 1 < chain_count; k += 2) {
+			const double beta1 = 1.0 / (t * std::pow(temperature_ladder, k));
+			const double beta2 = 1.0 / (t * std::pow(temperature_ladder, k + 1));
+			const double log_p = (beta1 - beta2) * (chains[k].current_eval - chains[k + 1].current_eval);
+			if (log_p >= 0 || exchange_dist(exchange_engine) < std::exp(log_p)) {
+				std::swap(chains[k].current_state, chains[k + 1].current_state);
+				std::swap(chains[k].current_eval, chains[k + 1].current_eval);
+			}
+		}
+
+		progress(1.0 * (i + segment_len) / iter_count);
+	}
+
+	// 同じ値なら番号の小さいチェーンを優先 (結果を決定的にするため)
+	int best = 0;
+	for (int k = 1; k < chain_count; k++) {
+		if (chains[k].optimum_eval < chains[best].optimum_eval) {
+			best = k;
+		}
+	}
+	if (verbose) std::cerr << "ParallelTempering optimum chain " << best << " " << chains[best].optimum_eval << std::endl;
+	*optimum_state = chains[best].optimum_state;
+	*optimum_eval = chains[best].optimum_eval;
+}
+
+#ifdef PHASELIMITER_ENABLE_FFTW
+constexpr int kMastering3NumFilters = 40;
+
+// 0.372 sec, 4x only
+// 44100Hz以外ではFFTが速い長さ (2^a 3^b 5^c) に丸める (48000Hzで17832 = 8 * 3 * 743だと数百倍遅い)
+// mel bandはwidthとsample_rateから周波数で計算するので、丸めても設定はそのまま使える
+int Mastering3StftWidth(int sample_rate) {
+	const int output_shift_resolution = 2;
+	return bakuage::RoundToSmoothNumber(static_cast<int>(16384LL * sample_rate / 44100), output_shift_resolution);
+}
+
+// 2chの波形 <-> mid/sideのスペクトル (解析とレンダリングで共通)
+class MidSideStft {
+public:
+	MidSideStft(int width): width_(width), spec_len_(width / 2 + 1), window_(width) {
+		bakuage::CopyHanning(width_, window_.begin());
+
+		std::lock_guard<std::recursive_mutex> lock(FFTW::mutex());
+		fft_input_ = (double *)fftw_malloc(sizeof(double) * width_);
+		std::fill_n(fft_input_, width_, 0);
+		fft_output_ = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * spec_len_);
+		std::fill_n((double *)fft_output_, 2 * spec_len_, 0);
+		plan_ = fftw_plan_dft_r2c_1d(width_, fft_input_, fft_output_, FFTW_ESTIMATE);
+		inv_plan_ = fftw_plan_dft_c2r_1d(width_, fft_output_, fft_input_, FFTW_ESTIMATE);
+	}
+	MidSideStft(const MidSideStft &) = delete;
+	MidSideStft &operator=(const MidSideStft &) = delete;
+	~MidSideStft() {
+		std::lock_guard<std::recursive_mutex> lock(FFTW::mutex());
+		fftw_destroy_plan(plan_);
+		fftw_destroy_plan(inv_plan_);
+		fftw_free(fft_output_);
+		fftw_free(fft_input_);
+	}
+
+	int spec_len() const { return spec_len_; }
+
+	// [pos, pos + width) を窓かけしてfft (範囲外は0)
+	void Forward(const float *wave_ptr, int frames, int pos, std::complex<float> *complex_spec_mid, std::complex<float> *complex_spec_side) {
+		std::fill_n(complex_spec_mid, spec_len_, 0);
+		std::fill_n(complex_spec_side, spec_len_, 0);
+		for (int i = 0; i < channels; i++) {
+			for (int j = 0; j < width_; j++) {
+				int k = pos + j;
+				fft_input_[j] = (0 <= k && k < frames) ? wave_ptr[channels * k + i] * window_[j] : 0;
+			}
+			fftw_execute(plan_);
+			for (int j = 0; j < spec_len_; j++) {
+				auto spec = std::complex<float>(fft_output_[j][0], fft_output_[j][1]);
+				complex_spec_mid[j] += spec;
+				complex_spec_side[j] += spec * (2.0f * i - 1);
+			}
+		}
+	}
+
+	// ifftして [pos, pos + width) にoverlap add
+	void InverseAdd(const std::complex<float> *complex_spec_mid, const std::complex<float> *complex_spec_side, int frames, int pos, double scale, float *output_ptr) {
+		for (int i = 0; i < channels; i++) {
+			for (int j = 0; j < spec_len_; j++) {
+				auto spec = 0.5f * (complex_spec_mid[j] + (2.0f * i - 1) * complex_spec_side[j]);
+				fft_output_[j][0] = spec.real();
+				fft_output_[j][1] = spec.imag();
+			}
+			fftw_execute(inv_plan_);
+			for (int j = 0; j < width_; j++) {
+				int k = pos + j;
+				if (0 <= k && k < frames) {
+					output_ptr[channels * k + i] += fft_input_[j] * scale;
+				}
+			}
+		}
+	}
+private:
+	static constexpr int channels = 2;
+	int width_;
+	int spec_len_;
+	std::vector<float> window_;
+	double *fft_input_;
+	fftw_complex *fft_output_;
+	fftw_plan plan_;
+	fftw_plan inv_plan_;
+};
+
+// コンプバンドの境界のmel bandインデックス (両端を含む)
+std::vector<int> CalculateMastering3CompBandIndicies(const bakuage::MfccCalculator<float> &mfcc_calculator, int num_filters) {
+	std::vector<float> comp_band_border_freqs =
+		// { 200, 400, 800, 1600, 3200, 6400, };
+		{ 400, 1000, 5000, };
+	std::vector<int> comp_band_indicies;
+	//comp_band_indicies.push_back(0); comp_band_indicies.push_back(num_filters);
+	/*for (int j = 0; j < comp_band_count + 1; j++) {
+		comp_band_indicies.push_back(j);
+	}*/
+	comp_band_indicies.push_back(0);
+	for (int j = 0; j < comp_band_border_freqs.size(); j++) {
+		int idx = num_filters;
+		for (int k = 0; k < num_filters; k++) {
+			if (mfcc_calculator.center_freq(k) > comp_band_border_freqs[j]) {
+				idx = k;
+				break;
+			}
 		}
+		comp_band_indicies.push_back(idx);
+	}
+	comp_band_indicies.push_back(num_filters);
+	return comp_band_indicies;
+}
+
+// countフレーム分のmel bandにコンプを適用する
+// compressor_mean_energiesは解析時のコンプバンドごとの平均エネルギー (mid, sideの順)
+// ParamsはStateかMastering3OptimumParams
+template <class Params>
+void ApplyMastering3Effects(const float *input_mid_mel_bands, const float *input_side_mel_bands, int count, int num_filters,
+	const std::vector<int> &comp_band_indicies, const std::vector<double> &compressor_mean_energies, const Params &state,
+	float *output_mid_mel_bands, float *output_side_mel_bands) {
+	const int comp_band_count = comp_band_indicies.size() - 1;
 
-		// update current
-		double delta_eval = next_eval - current_eval;
-		// double p = std::exp(-(next_eval - current_eval) / t);
-		double p = delta_eval <= 0 ? 1 : 2.0 / (1 + std::exp(delta_eval / t));
-		if (uniform_dist(engine) < p) {
-			current_state = next_state;
-			current_eval = next_eval;
+	if (verbose2) std::cerr << "Mastering3 apply_effects" << std::endl;
+
+	auto compressor_gain_func = [](double ratio, double threshold, double mean, double x) {
+		double relative_x = std::max<double>(threshold, std::min<double>(-threshold, x - mean));
+		return (1.0 / ratio - 1) * relative_x;
+	};
+
+	for (int i = 0; i < count; i++) {
+		// apply compressor
+		for (int j = 0; j < comp_band_count; j++) {
+			const int bg_idx = comp_band_indicies[j];
+			const int ed_idx = comp_band_indicies[j + 1];
+			const double input_mid = std::accumulate(input_mid_mel_bands + bg_idx, input_mid_mel_bands + ed_idx, 0.0);
+			const double input_side = std::accumulate(input_side_mel_bands + bg_idx, input_side_mel_bands + ed_idx, 0.0);
+
+			const double mean_mid = 1e-10 + compressor_mean_energies[2 * j + 0];
+			const double mean_side = 1e-10 + compressor_mean_energies[2 * j + 1];
+
+			// 合計エネルギーに両側スレッショルドのパラレルコンプ
+			const double input_sum = input_mid + input_side;
+			const double mean_sum = mean_mid + mean_side;
+			const double input_sum_db = 10 * std::log10(1e-10 + input_sum);
+			const double mean_sum_db = 10 * std::log10(1e-10 + mean_sum);
+
+			const double sum_gain = (
+				std::pow(10, 0.1 * compressor_gain_func(state.compressor_ratios[2 * j + 0],
+					state.compressor_thresholds[2 * j + 0], mean_sum_db, input_sum_db))
+				* state.compressor_wets[2 * j + 0] + (1 - state.compressor_wets[2 * j + 0])
+				) * state.compressor_gains[2 * j + 0];
+
+			// Side to Midにパラレルコンプ (side to midの理由は、パラレルコンプをしたときに、sideを圧縮せずに持ち上げる効果が期待できるから)
+			const double side_to_mid_db = 10 * std::log10(std::pow(10, 0.1 * state.compressor_thresholds[2 * j + 1]) + mean_mid / mean_side);
+			const double side_to_mid_gain =
+				std::pow(10, 0.1 * side_to_mid_db * (1.0 / state.compressor_ratios[2 * j + 1] - 1))
+				* state.compressor_wets[2 * j + 1] + (1 - state.compressor_wets[2 * j + 1]);
+
+			// solve following
+			// 1: input_mid * mid_gain + input_side * side_gain = sum_gain * (input_mid + input_side)
+			// 2: mid_gain = side_to_mid_gain * side_gain
+			const double side_gain = sum_gain *(input_mid + input_side) / (input_mid * side_to_mid_gain + input_side);
+			const double mid_gain = sum_gain *(input_mid + input_side) / (input_mid + input_side / side_to_mid_gain);
+
+			for (int m = bg_idx; m < ed_idx; m++) {
+				output_mid_mel_bands[m] = input_mid_mel_bands[m] * mid_gain;
+				output_side_mel_bands[m] = input_side_mel_bands[m] * side_gain;
+			}
+
+			/*mean = 1e-10 + compressor_energy_stats[2 * j + 0].mean();
+			threshold = mean * std::pow(10, 0.1 * state.compressor_thresholds[2 * j + 0]);
+			relative_db = 10 * std::log10((threshold + input_mid) / mean);
+			gain_db = relative_db * (1.0 / state.compressor_ratios[2 * j + 0] - 1);
+			for (int m = bg_idx; m < ed_idx; m++) {
+				output_mid_mel_bands[m] = input_mid_mel_bands[m]
+					 *(state.compressor_wets[2 * j + 0] * std::pow(10, 0.1 * gain_db) + (1 - state.compressor_wets[2 * j + 0]));
+				output_mid_mel_bands[m] *= state.compressor_gains[2 * j + 0];
+			}*/
+
+			/*if (verbose3) {
+				std::cerr
+					<< input_mid << " "
+					<< mean << " "
+					<< threshold << " "
+					<< relative_db << " "
+					<< gain_db << " "
+					<< output_mid_mel_bands[j] << " "
+					<< input_mid_mel_bands[j] << std::endl;
+			}*/
+
+			/*int k = 1;
+			mean = 1e-10 + compressor_energy_stats[2 * j + k].mean();
+			threshold = mean * std::pow(10, 0.1 * state.compressor_thresholds[2 * j + k]);
+			relative_db = 10 * std::log10((threshold + input_side) / mean);
+			gain_db = relative_db * (1.0 / state.compressor_ratios[2 * j + k] - 1);
+			for (int m = bg_idx; m < ed_idx; m++) {
+				output_side_mel_bands[m] = input_side_mel_bands[m]
+					 *(state.compressor_wets[2 * j + k] * std::pow(10, 0.1 * gain_db) + (1 - state.compressor_wets[2 * j + k]));
+				output_side_mel_bands[m] *= state.compressor_gains[2 * j + k];
+			}*/
+
+			/*if (verbose3) {
+				std::cerr
+					<< input_side << " "
+					<< mean << " "
+					<< threshold << " "
+					<< relative_db << " "
+					<< gain_db << " "
+					<< output_side_mel_bands[j] << " "
+					<< input_side_mel_bands[j] << std::endl;
+			}*/
 		}
 
-		// t = 1.0 / (1 + i);
-		t *= t_rate;
+		// MFCC空間でいじる実験
+		/*{
+			std::vector<float> log_mid_mel_bands(num_filters);
+			std::vector<float> log_side_mel_bands(num_filters);
+			for (int j = 0; j < num_filters; j++) {
+				log_mid_mel_bands[j] = 10 * std::log10(1e-10 + output_mid_mel_bands[j]);
+				log_side_mel_bands[j] = 10 * std::log10(1e-10 + output_side_mel_bands[j]);
+			}
+			std::vector<float> mid_mfcc(num_filters);
+			std::vector<float> side_mfcc(num_filters);
+			dct.DctType2(log_mid_mel_bands.data(), mid_mfcc.data());
+			dct.DctType2(log_side_mel_bands.data(), side_mfcc.data());
+
+			for (int j = 1; j < mfcc_comp_count; j++) {
+				mid_mfcc[j] = 1.0 / state.mfcc_ratios[2 * j + 0] * (mid_mfcc[j] - mid_mfcc_stats[j].mean()) + mid_mfcc_stats[j].mean();
+				side_mfcc[j] = 1.0 / state.mfcc_ratios[2 * j + 1] * (side_mfcc[j] - side_mfcc_stats[j].mean()) + side_mfcc_stats[j].mean();
+			}
 
-		if (i % progress_stride == 0) {
-			progress(1.0 * i / iter_count);
+			dct.DctType3(mid_mfcc.data(), log_mid_mel_bands.data());
+			dct.DctType3(side_mfcc.data(), log_side_mel_bands.data());
+			for (int j = 0; j < num_filters; j++) {
+				log_mid_mel_bands[j] *= (2.0 / num_filters);
+				log_side_mel_bands[j] *= (2.0 / num_filters);
+			}
+
+			for (int j = 0; j < num_filters; j++) {
+				//std::cerr << output_mid_mel_bands[j] << " " << std::pow(10, 0.1 * log_mid_mel_bands[j]) << " " << input_mid_mel_bands[j] << std::endl;
+				output_mid_mel_bands[j] = std::pow(10, 0.1 * log_mid_mel_bands[j]);
+				output_side_mel_bands[j] = std::pow(10, 0.1 * log_side_mel_bands[j]);
+				//std::cerr << output_mid_mel_bands[j] << " " << std::pow(10, 0.1 * log_mid_mel_bands[j]) << " " << input_mid_mel_bands[j] << std::endl;
+
+			}
+		}*/
+
+		// apply eq
+		for (int j = 0; j < comp_band_count; j++) {
+			// int k = 1;
+			//output_mid_mel_bands[j] *= state.eq_gains[2 * j + 0];
+			//output_side_mel_bands[j] *= state.eq_gains[2 * j + k];
+
+			/*std::cerr
+				<< input_mid_mel_bands[j] << " "
+				<< input_side_mel_bands[j] << " "
+				<< output_mid_mel_bands[j] << " "
+				<< output_side_mel_bands[j] << " "
+				<< state.eq_gains[2 * j + 0] << " "
+				<< state.eq_gains[2 * j + 1] << std::endl;*/
 		}
+
+		input_mid_mel_bands += num_filters;
+		input_side_mel_bands += num_filters;
+		output_mid_mel_bands += num_filters;
+		output_side_mel_bands += num_filters;
 	}
+
+	output_mid_mel_bands -= count * num_filters;
+	output_side_mel_bands -= count * num_filters;
+
+	// ear guard (WIP)
+	/*std::vector<float> loudness_weights(num_filters);
+	std::vector<float> ear_damage_weights(num_filters);
+	for (int j = 0; j < num_filters; j++) {
+		auto freq = mfcc_calculator.center_freq(j);
+		loudness_weights[j] = std::pow(10,
+			(bakuage::loudness_contours::HzToSplAt60Phon(1000) - bakuage::loudness_contours::HzToSplAt60Phon(freq)) * 0.1);
+		ear_damage_weights[j] = std::pow(10, (3.0 * std::log2(freq / 1000.0)) * 0.1);
+	}
+	bakuage::Statistics loudness_energy;
+	std::vector<bakuage::Statistics> ear_damage_energy;
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < num_filters; j++) {
+			const double total_energy = output_mid_mel_bands[num_filters * i + j] + output_side_mel_bands[num_filters * i + j];
+			loudness_energy.Add(total_energy * loudness_weights[j]);
+			ear_damage_energy[j].Add(total_energy * ear_damage_weights[j]);
+		}
+	}
+	const double loudness = 10 * std::log10(1e-10 + loudness_energy.mean());
+	for (int i = 0; i < count; i++) {
+		const double gain = ear_damage_energy[j].mean()
+		for (int j = 0; j < num_filters; j++) {
+			const double total_energy = output_mid_mel_bands[num_filters * i + j] + output_side_mel_bands[num_filters * i + j];
+			const double max_energy =
+			loudness_energy.Add(total_energy * loudness_weights[j]);
+			ear_damage_energy[j].Add(total_energy * ear_damage_weights[j]);
+		}
+	}*/
 }
+#endif
 
 }
 
 namespace phase_limiter {
 
-void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std::function<void(float)> &progress_callback) {
+Mastering3OptimumParams GetMastering3OptimumParams(const std::vector<float> &wave, const int sample_rate, const std::function<void(float)> &progress_callback) {
 #ifdef PHASELIMITER_ENABLE_FFTW
 	progress_callback(0);
 
-	const int frames = _wave->size() / 2;
-	const int channels = 2;
-	const float *wave_ptr = &(*_wave)[0];
-
-	std::mutex task_mtx;
-	std::mutex result_mtx;
-	std::mutex progression_mtx;
-	std::vector<std::function<void()>> tasks;
-	std::vector<Float> result(_wave->size());
+	const int frames = wave.size() / 2;
+	const float *wave_ptr = wave.data();
 
 	/*
 	処理概要
@@ -168,53 +503,23 @@ void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std:
 	*/
 
 	int shift_resolution = 2;
-	int output_shift_resolution = 2;
-	int width = output_shift_resolution * ((16384 * sample_rate / 44100) / output_shift_resolution); // 0.372 sec, 4x only
+	int width = Mastering3StftWidth(sample_rate);
 	int shift = width / shift_resolution;
-	int output_shift = width / output_shift_resolution;
-	int num_filters = 40;
+	int num_filters = kMastering3NumFilters;
 	// int mfcc_len = 13;
 	int pos = -width + shift;
-	int spec_len = width / 2 + 1;
+	MidSideStft stft(width);
+	int spec_len = stft.spec_len();
 	std::vector<std::complex<float>> complex_spec_mid(spec_len);
 	std::vector<std::complex<float>> complex_spec_side(spec_len);
 	std::vector<float> src_mid_mel_bands;
 	std::vector<float> src_side_mel_bands;
-	std::vector<float> window(width);
-	bakuage::CopyHanning(width, window.begin());
 	bakuage::MfccCalculator<float> mfcc_calculator(sample_rate, 0, 22000, num_filters);
 	bakuage::Dct dct(num_filters);
-	double *fft_input;
-	fftw_complex * fft_output;
-	fftw_plan plan;
-	fftw_plan inv_plan;
-	{
-		std::lock_guard<std::recursive_mutex> lock(FFTW::mutex());
-
-		fft_input = (double *)fftw_malloc(sizeof(double) * width);
-		std::fill_n(fft_input, width, 0);
-		fft_output = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * spec_len);
-		std::fill_n((double *)fft_output, 2 * spec_len, 0);
-		plan = fftw_plan_dft_r2c_1d(width, fft_input, fft_output, FFTW_ESTIMATE);
-		inv_plan = fftw_plan_dft_c2r_1d(width, fft_output, fft_input, FFTW_ESTIMATE);
-	}
 	if (verbose) std::cerr << "Mastering3 mel band calculation start" << std::endl;
 	while (pos < frames) {
 		// window and fft
-		std::fill_n(complex_spec_mid.data(), spec_len, 0);
-		std::fill_n(complex_spec_side.data(), spec_len, 0);
-		for (int i = 0; i < channels; i++) {
-			for (int j = 0; j < width; j++) {
-				int k = pos + j;
-				fft_input[j] = (0 <= k && k < frames) ? wave_ptr[channels * k + i] * window[j] : 0;
-			}
-			fftw_execute(plan);
-			for (int j = 0; j < spec_len; j++) {
-				auto spec = std::complex<float>(fft_output[j][0], fft_output[j][1]);
-				complex_spec_mid[j] += spec;
-				complex_spec_side[j] += spec * (2.0f * i - 1);
-			}
-		}
+		stft.Forward(wave_ptr, frames, pos, complex_spec_mid.data(), complex_spec_side.data());
 
 		// calculate mel band (energy sum mode)
 		src_mid_mel_bands.resize(src_mid_mel_bands.size() + num_filters);
@@ -297,49 +602,29 @@ void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std:
 
 	// 最適化ループ
 	if (verbose) std::cerr << "Mastering3 optimization start" << std::endl;
-	std::mt19937 engine(std::time(NULL));
-	std::normal_distribution<> norm_dist(0.0, 1.0);
-	std::uniform_real_distribution<> uniform_dist(0.0, 1.0);
 	std::vector<float> output_mid_mel_bands(src_mid_mel_bands.size());
 	std::vector<float> output_side_mel_bands(src_side_mel_bands.size());
-	std::vector<float> comp_band_border_freqs =
-		// { 200, 400, 800, 1600, 3200, 6400, };
-		{ 400, 1000, 5000, };
-	int comp_band_count = comp_band_border_freqs.size() + 1;
-	std::vector<int> comp_band_indicies;
-	//comp_band_indicies.push_back(0); comp_band_indicies.push_back(num_filters);
-	/*for (int j = 0; j < comp_band_count + 1; j++) {
-		comp_band_indicies.push_back(j);
-	}*/
-	comp_band_indicies.push_back(0);
-	for (int j = 0; j < comp_band_border_freqs.size(); j++) {
-		int idx = num_filters;
-		for (int k = 0; k < num_filters; k++) {
-			if (mfcc_calculator.center_freq(k) > comp_band_border_freqs[j]) {
-				idx = k;
-				break;
-			}
-		}
-		comp_band_indicies.push_back(idx);
-	}
-	comp_band_indicies.push_back(num_filters);
+	const std::vector<int> comp_band_indicies = CalculateMastering3CompBandIndicies(mfcc_calculator, num_filters);
+	int comp_band_count = comp_band_indicies.size() - 1;
 	if (verbose) {
 		std::cerr << "Mastering3 comp_band_indicies ";
 		for (int j = 0; j < comp_band_indicies.size(); j++) std::cerr << (int)comp_band_indicies[j] << " ";
 		std::cerr << std::endl;
 	}
 	const int mfcc_comp_count = 4;
-	auto initialize_state = [comp_band_count, &norm_dist, &engine](State *state) {
+	// engineはチェーンごと (並列に呼ばれる)
+	auto initialize_state = [comp_band_count](std::mt19937 *engine, State *state) {
 		if (verbose2) std::cerr << "Mastering3 initialize_state" << std::endl;
+		std::normal_distribution<> norm_dist(0.0, 1.0);
 		state->compressor_ratios.resize(2 * comp_band_count);
 		state->compressor_thresholds.resize(2 * comp_band_count); // dB relative to mean energy
 		state->compressor_wets.resize(2 * comp_band_count); // 0-1 (for parallel compression)
 		state->compressor_gains.resize(2 * comp_band_count);
 		for (int j = 0; j < 2 * comp_band_count; j++) {
-			state->compressor_ratios[j] = 1; // std::max<double>(1, std::pow(1, uniform_dist(engine)));
-			state->compressor_thresholds[j] = -30;// +10 * norm_dist(engine);
-			state->compressor_wets[j] = 1; // uniform_dist(engine);
-			state->compressor_gains[j] = std::pow(10, 0 * norm_dist(engine) * 0.1);
+			state->compressor_ratios[j] = 1; // std::max<double>(1, std::pow(1, uniform_dist(*engine)));
+			state->compressor_thresholds[j] = -30;// +10 * norm_dist(*engine);
+			state->compressor_wets[j] = 1; // uniform_dist(*engine);
+			state->compressor_gains[j] = std::pow(10, 0 * norm_dist(*engine) * 0.1);
 		}
 		//state->compressor_gains[2 * 3 + 0] = 1e-4;
 		//state->compressor_gains[2 * 3 + 1] = 1e-4;
@@ -350,27 +635,29 @@ void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std:
 
 		/*state->eq_gains.resize(2 * num_filters); // energy ratio
 		for (int j = 0; j < 2 * num_filters; j++) {
-			state->eq_gains[j] = std::pow(10, 0 * norm_dist(engine) * 0.1);
+			state->eq_gains[j] = std::pow(10, 0 * norm_dist(*engine) * 0.1);
 		}*/
 	};
-	auto generate_neighbor = [comp_band_count, &norm_dist, &uniform_dist, &engine](const State &input, State *output) {
+	auto generate_neighbor = [comp_band_count](const State &input, std::mt19937 *engine, State *output) {
 		if (verbose2) std::cerr << "Mastering3 generate_neighbor" << std::endl;
+		std::normal_distribution<> norm_dist(0.0, 1.0);
+		std::uniform_real_distribution<> uniform_dist(0.0, 1.0);
 		output->compressor_ratios.resize(2 * comp_band_count);
 		output->compressor_thresholds.resize(2 * comp_band_count); // dB relative to mean energy
 		output->compressor_wets.resize(2 * comp_band_count); // 0-1 (for parallel compression)
 		output->compressor_gains.resize(2 * comp_band_count);
 
 		int param_count = 4 * (2 * comp_band_count);
-		double scale = uniform_dist(engine) * 1 / std::sqrt(param_count);
+		double scale = uniform_dist(*engine) * 1 / std::sqrt(param_count);
 
 		for (int j = 0; j < 2 * comp_band_count; j++) {
 			output->compressor_ratios[j] =
-				input.compressor_ratios[j] * std::pow(1.1, norm_dist(engine) * scale);
-				// std::max<double>(1, input.compressor_ratios[j] * std::pow(1.1, norm_dist(engine) * scale));
-			output->compressor_thresholds[j] = input.compressor_thresholds[j] + 1 * norm_dist(engine) * scale;
+				input.compressor_ratios[j] * std::pow(1.1, norm_dist(*engine) * scale);
+				// std::max<double>(1, input.compressor_ratios[j] * std::pow(1.1, norm_dist(*engine) * scale));
+			output->compressor_thresholds[j] = input.compressor_thresholds[j] + 1 * norm_dist(*engine) * scale;
 			output->compressor_wets[j] = std::max<double>(0, std::min<double>(1, input.compressor_wets[j]
-				* std::pow(10, 1 * norm_dist(engine) * scale * 0.1)));
-			output->compressor_gains[j] = input.compressor_gains[j] * std::pow(10, 1.0 * norm_dist(engine) * scale * 0.1);
+				* std::pow(10, 1 * norm_dist(*engine) * scale * 0.1)));
+			output->compressor_gains[j] = input.compressor_gains[j] * std::pow(10, 1.0 * norm_dist(*engine) * scale * 0.1);
 
 			//output->compressor_wets[j] = 1;
 			//output->compressor_gains[j] = 1;
@@ -378,12 +665,12 @@ void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std:
 
 		output->mfcc_ratios.resize(2 * mfcc_comp_count);
 		for (int j = 0; j < 2 * mfcc_comp_count; j++) {
-			output->mfcc_ratios[j] = input.mfcc_ratios[j] * std::pow(1.1, norm_dist(engine) * scale);
+			output->mfcc_ratios[j] = input.mfcc_ratios[j] * std::pow(1.1, norm_dist(*engine) * scale);
 		}
 
 		/*output->eq_gains.resize(2 * num_filters); // energy ratio
 		for (int j = 0; j < 2 * num_filters; j++) {
-			output->eq_gains[j] = input.eq_gains[j] * std::pow(10, 1 * norm_dist(engine) * scale * 0.1);
+			output->eq_gains[j] = input.eq_gains[j] * std::pow(10, 1 * norm_dist(*engine) * scale * 0.1);
 		}*/
 	};
 	// detect compressor mean energy
@@ -423,194 +710,26 @@ void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std:
 		}
 	}
 
-	auto apply_effects = [&comp_band_indicies, comp_band_count, count,
-		num_filters, &compressor_energy_stats](const float *input_mid_mel_bands, const float *input_side_mel_bands,
-		const State &state,
-		float *output_mid_mel_bands, float *output_side_mel_bands) {
-		if (verbose2) std::cerr << "Mastering3 apply_effects" << std::endl;
-
-		auto compressor_gain_func = [](double ratio, double threshold, double mean, double x) {
-			double relative_x = std::max<double>(threshold, std::min<double>(-threshold, x - mean));
-			return (1.0 / ratio - 1) * relative_x;
-		};
-
-		for (int i = 0; i < count; i++) {
-			// apply compressor
-			for (int j = 0; j < comp_band_count; j++) {
-				const int bg_idx = comp_band_indicies[j];
-				const int ed_idx = comp_band_indicies[j + 1];
-				const double input_mid = std::accumulate(input_mid_mel_bands + bg_idx, input_mid_mel_bands + ed_idx, 0.0);
-				const double input_side = std::accumulate(input_side_mel_bands + bg_idx, input_side_mel_bands + ed_idx, 0.0);
-
-				const double mean_mid = 1e-10 + compressor_energy_stats[2 * j + 0].mean();
-				const double mean_side = 1e-10 + compressor_energy_stats[2 * j + 1].mean();
-
-				// 合計エネルギーに両側スレッショルドのパラレルコンプ
-				const double input_sum = input_mid + input_side;
-				const double mean_sum = mean_mid + mean_side;
-				const double input_sum_db = 10 * std::log10(1e-10 + input_sum);
-				const double mean_sum_db = 10 * std::log10(1e-10 + mean_sum);
-
-				const double sum_gain = (
-					std::pow(10, 0.1 * compressor_gain_func(state.compressor_ratios[2 * j + 0],
-						state.compressor_thresholds[2 * j + 0], mean_sum_db, input_sum_db))
-					* state.compressor_wets[2 * j + 0] + (1 - state.compressor_wets[2 * j + 0])
-					) * state.compressor_gains[2 * j + 0];
-
-				// Side to Midにパラレルコンプ (side to midの理由は、パラレルコンプをしたときに、sideを圧縮せずに持ち上げる効果が期待できるから)
-				const double side_to_mid_db = 10 * std::log10(std::pow(10, 0.1 * state.compressor_thresholds[2 * j + 1]) + mean_mid / mean_side);
-				const double side_to_mid_gain =
-					std::pow(10, 0.1 * side_to_mid_db * (1.0 / state.compressor_ratios[2 * j + 1] - 1))
-					* state.compressor_wets[2 * j + 1] + (1 - state.compressor_wets[2 * j + 1]);
-
-				// solve following
-				// 1: input_mid * mid_gain + input_side * side_gain = sum_gain * (input_mid + input_side)
-				// 2: mid_gain = side_to_mid_gain * side_gain
-				const double side_gain = sum_gain *(input_mid + input_side) / (input_mid * side_to_mid_gain + input_side);
-				const double mid_gain = sum_gain *(input_mid + input_side) / (input_mid + input_side / side_to_mid_gain);
-
-				for (int m = bg_idx; m < ed_idx; m++) {
-					output_mid_mel_bands[m] = input_mid_mel_bands[m] * mid_gain;
-					output_side_mel_bands[m] = input_side_mel_bands[m] * side_gain;
-				}
-
-				/*mean = 1e-10 + compressor_energy_stats[2 * j + 0].mean();
-				threshold = mean * std::pow(10, 0.1 * state.compressor_thresholds[2 * j + 0]);
-				relative_db = 10 * std::log10((threshold + input_mid) / mean);
-				gain_db = relative_db * (1.0 / state.compressor_ratios[2 * j + 0] - 1);
-				for (int m = bg_idx; m < ed_idx; m++) {
-					output_mid_mel_bands[m] = input_mid_mel_bands[m]
-						 *(state.compressor_wets[2 * j + 0] * std::pow(10, 0.1 * gain_db) + (1 - state.compressor_wets[2 * j + 0]));
-					output_mid_mel_bands[m] *= state.compressor_gains[2 * j + 0];
-				}*/
-
-				/*if (verbose3) {
-					std::cerr
-						<< input_mid << " "
-						<< mean << " "
-						<< threshold << " "
-						<< relative_db << " "
-						<< gain_db << " "
-						<< output_mid_mel_bands[j] << " "
-						<< input_mid_mel_bands[j] << std::endl;
-				}*/
-
-				/*int k = 1;
-				mean = 1e-10 + compressor_energy_stats[2 * j + k].mean();
-				threshold = mean * std::pow(10, 0.1 * state.compressor_thresholds[2 * j + k]);
-				relative_db = 10 * std::log10((threshold + input_side) / mean);
-				gain_db = relative_db * (1.0 / state.compressor_ratios[2 * j + k] - 1);
-				for (int m = bg_idx; m < ed_idx; m++) {
-					output_side_mel_bands[m] = input_side_mel_bands[m]
-						 *(state.compressor_wets[2 * j + k] * std::pow(10, 0.1 * gain_db) + (1 - state.compressor_wets[2 * j + k]));
-					output_side_mel_bands[m] *= state.compressor_gains[2 * j + k];
-				}*/
-
-				/*if (verbose3) {
-					std::cerr
-						<< input_side << " "
-						<< mean << " "
-						<< threshold << " "
-						<< relative_db << " "
-						<< gain_db << " "
-						<< output_side_mel_bands[j] << " "
-						<< input_side_mel_bands[j] << std::endl;
-				}*/
-			}
-
-			// MFCC空間でいじる実験
-			/*{
-				std::vector<float> log_mid_mel_bands(num_filters);
-				std::vector<float> log_side_mel_bands(num_filters);
-				for (int j = 0; j < num_filters; j++) {
-					log_mid_mel_bands[j] = 10 * std::log10(1e-10 + output_mid_mel_bands[j]);
-					log_side_mel_bands[j] = 10 * std::log10(1e-10 + output_side_mel_bands[j]);
-				}
-				std::vector<float> mid_mfcc(num_filters);
-				std::vector<float> side_mfcc(num_filters);
-				dct.DctType2(log_mid_mel_bands.data(), mid_mfcc.data());
-				dct.DctType2(log_side_mel_bands.data(), side_mfcc.data());
-
-				for (int j = 1; j < mfcc_comp_count; j++) {
-					mid_mfcc[j] = 1.0 / state.mfcc_ratios[2 * j + 0] * (mid_mfcc[j] - mid_mfcc_stats[j].mean()) + mid_mfcc_stats[j].mean();
-					side_mfcc[j] = 1.0 / state.mfcc_ratios[2 * j + 1] * (side_mfcc[j] - side_mfcc_stats[j].mean()) + side_mfcc_stats[j].mean();
-				}
-
-				dct.DctType3(mid_mfcc.data(), log_mid_mel_bands.data());
-				dct.DctType3(side_mfcc.data(), log_side_mel_bands.data());
-				for (int j = 0; j < num_filters; j++) {
-					log_mid_mel_bands[j] *= (2.0 / num_filters);
-					log_side_mel_bands[j] *= (2.0 / num_filters);
-				}
-
-				for (int j = 0; j < num_filters; j++) {
-					//std::cerr << output_mid_mel_bands[j] << " " << std::pow(10, 0.1 * log_mid_mel_bands[j]) << " " << input_mid_mel_bands[j] << std::endl;
-					output_mid_mel_bands[j] = std::pow(10, 0.1 * log_mid_mel_bands[j]);
-					output_side_mel_bands[j] = std::pow(10, 0.1 * log_side_mel_bands[j]);
-					//std::cerr << output_mid_mel_bands[j] << " " << std::pow(10, 0.1 * log_mid_mel_bands[j]) << " " << input_mid_mel_bands[j] << std::endl;
-
-				}
-			}*/
-
-			// apply eq
-			for (int j = 0; j < comp_band_count; j++) {
-				// int k = 1;
-				//output_mid_mel_bands[j] *= state.eq_gains[2 * j + 0];
-				//output_side_mel_bands[j] *= state.eq_gains[2 * j + k];
-
-				/*std::cerr
-					<< input_mid_mel_bands[j] << " "
-					<< input_side_mel_bands[j] << " "
-					<< output_mid_mel_bands[j] << " "
-					<< output_side_mel_bands[j] << " "
-					<< state.eq_gains[2 * j + 0] << " "
-					<< state.eq_gains[2 * j + 1] << std::endl;*/
-			}
-
-			input_mid_mel_bands += num_filters;
-			input_side_mel_bands += num_filters;
-			output_mid_mel_bands += num_filters;
-			output_side_mel_bands += num_filters;
-		}
-
-		output_mid_mel_bands -= count * num_filters;
-		output_side_mel_bands -= count * num_filters;
+	std::vector<double> compressor_mean_energies(2 * comp_band_count);
+	for (int j = 0; j < 2 * comp_band_count; j++) {
+		compressor_mean_energies[j] = compressor_energy_stats[j].mean();
+	}
 
-		// ear guard (WIP)
-		/*std::vector<float> loudness_weights(num_filters);
-		std::vector<float> ear_damage_weights(num_filters);
-		for (int j = 0; j < num_filters; j++) {
-			auto freq = mfcc_calculator.center_freq(j);
-			loudness_weights[j] = std::pow(10,
-				(bakuage::loudness_contours::HzToSplAt60Phon(1000) - bakuage::loudness_contours::HzToSplAt60Phon(freq)) * 0.1);
-			ear_damage_weights[j] = std::pow(10, (3.0 * std::log2(freq / 1000.0)) * 0.1);
-		}
-		bakuage::Statistics loudness_energy;
-		std::vector<bakuage::Statistics> ear_damage_energy;
-		for (int i = 0; i < count; i++) {
-			for (int j = 0; j < num_filters; j++) {
-				const double total_energy = output_mid_mel_bands[num_filters * i + j] + output_side_mel_bands[num_filters * i + j];
-				loudness_energy.Add(total_energy * loudness_weights[j]);
-				ear_damage_energy[j].Add(total_energy * ear_damage_weights[j]);
-			}
-		}
-		const double loudness = 10 * std::log10(1e-10 + loudness_energy.mean());
-		for (int i = 0; i < count; i++) {
-			const double gain = ear_damage_energy[j].mean()
-			for (int j = 0; j < num_filters; j++) {
-				const double total_energy = output_mid_mel_bands[num_filters * i + j] + output_side_mel_bands[num_filters * i + j];
-				const double max_energy =
-				loudness_energy.Add(total_energy * loudness_weights[j]);
-				ear_damage_energy[j].Add(total_energy * ear_damage_weights[j]);
-			}
-		}*/
+	auto apply_effects = [&comp_band_indicies, count, num_filters, &compressor_mean_energies](
+		const float *input_mid_mel_bands, const float *input_side_mel_bands, const State &state,
+		float *output_mid_mel_bands, float *output_side_mel_bands) {
+		ApplyMastering3Effects(input_mid_mel_bands, input_side_mel_bands, count, num_filters,
+			comp_band_indicies, compressor_mean_energies, state, output_mid_mel_bands, output_side_mel_bands);
 	};
+	// 並列に呼ばれるので出力バッファは呼び出しごとに持つ
 	auto evaluate = [comp_band_count, &apply_effects, &src_mid_mel_bands, &src_side_mel_bands,
-		&output_mid_mel_bands, &output_side_mel_bands, score_acoustic_entropy_eigen_before,
+		score_acoustic_entropy_eigen_before,
 		score_ear_damage_before, score_loudness_before, calculate_mastering3_score](const State &state, float regualization_coef = 1) {
 		if (verbose2) std::cerr << "Mastering3 evaluate" << std::endl;
 
 		// process
+		std::vector<float> output_mid_mel_bands(src_mid_mel_bands.size());
+		std::vector<float> output_side_mel_bands(src_side_mel_bands.size());
 		apply_effects(src_mid_mel_bands.data(), src_side_mel_bands.data(), state,
 			output_mid_mel_bands.data(), output_side_mel_bands.data());
 
@@ -653,17 +772,22 @@ void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std:
 	};
 	State optimum_state;
 	double optimum_eval;
-	SimulatedAnnealing(initialize_state, generate_neighbor, evaluate,
-		FLAGS_mastering3_iteration, 1, std::pow(0.01, 1.0 / FLAGS_mastering3_iteration), progress_callback, &optimum_state, &optimum_eval);
-
-	g_last_mastering3_optimum_params.comp_band_count = comp_band_count;
-	g_last_mastering3_optimum_params.compressor_ratios = optimum_state.compressor_ratios;
-	g_last_mastering3_optimum_params.compressor_thresholds = optimum_state.compressor_thresholds;
-	g_last_mastering3_optimum_params.compressor_wets = optimum_state.compressor_wets;
-	g_last_mastering3_optimum_params.compressor_gains = optimum_state.compressor_gains;
+	// チェーン数はスレッド数に依存させない (スレッド数はスケジューリングだけに影響し、結果は変わらない)
+	ParallelTempering(initialize_state, generate_neighbor, evaluate,
+		FLAGS_mastering3_iteration, FLAGS_mastering3_chain_count, FLAGS_mastering3_exchange_interval,
+		1, std::pow(0.01, 1.0 / FLAGS_mastering3_iteration), 1.5, progress_callback, &optimum_state, &optimum_eval);
+
+	Mastering3OptimumParams params;
+	params.comp_band_count = comp_band_count;
+	params.compressor_ratios = optimum_state.compressor_ratios;
+	params.compressor_thresholds = optimum_state.compressor_thresholds;
+	params.compressor_wets = optimum_state.compressor_wets;
+	params.compressor_gains = optimum_state.compressor_gains;
+	params.compressor_mean_energies = compressor_mean_energies;
 	if (verbose) {
 		State state;
-		initialize_state(&state);
+		std::mt19937 engine(1);
+		initialize_state(&engine, &state);
 		std::cerr << "Mastering3 optimum eval " << evaluate(state) << " -> " << optimum_eval << std::endl;
 		std::cerr << "Mastering3 optimum eval without regularization " << evaluate(state, 0) << " -> " << evaluate(optimum_state, 0) << std::endl;
 		std::cerr << "Mastering3 optimum state" << std::endl;
@@ -774,42 +898,71 @@ void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std:
 			<< " ac. ent. eigen " << score_acoustic_entropy_eigen << std::endl;
 	}
 
+	progress_callback(1);
+
+	return params;
+#else
+	(void)wave;
+	(void)sample_rate;
+	(void)progress_callback;
+	return Mastering3OptimumParams();
+#endif
+}
+
+void RenderMastering3(std::vector<float> *_wave, const int sample_rate, const Mastering3OptimumParams &params) {
+#ifdef PHASELIMITER_ENABLE_FFTW
+	const int frames = _wave->size() / 2;
+	const float *wave_ptr = &(*_wave)[0];
+	std::vector<Float> result(_wave->size());
+
+	int output_shift_resolution = 2;
+	int width = Mastering3StftWidth(sample_rate);
+	int output_shift = width / output_shift_resolution;
+	int num_filters = kMastering3NumFilters;
+	MidSideStft stft(width);
+	int spec_len = stft.spec_len();
+	std::vector<std::complex<float>> complex_spec_mid(spec_len);
+	std::vector<std::complex<float>> complex_spec_side(spec_len);
+	bakuage::MfccCalculator<float> mfcc_calculator(sample_rate, 0, 22000, num_filters);
+	const std::vector<int> comp_band_indicies = CalculateMastering3CompBandIndicies(mfcc_calculator, num_filters);
+	if (params.comp_band_count + 1 != comp_band_indicies.size()
+		|| params.compressor_mean_energies.size() != 2 * params.comp_band_count) {
+		throw std::logic_error("RenderMastering3: params do not match the comp bands");
+	}
+
 	// 音源処理
+	// 解析と同じフレームのmel bandをその場で計算して、解析時の平均エネルギーでコンプをかける
 	if (verbose) std::cerr << "Mastering3 output start" << std::endl;
-	pos = -width + output_shift;
+	int pos = -width + output_shift;
+	std::vector<float> src_mid_mel_bands(num_filters);
+	std::vector<float> src_side_mel_bands(num_filters);
+	std::vector<float> output_mid_mel_bands(num_filters);
+	std::vector<float> output_side_mel_bands(num_filters);
 	std::vector<float> band_gains(num_filters);
 	std::vector<float> spec_gains(spec_len);
-	apply_effects(src_mid_mel_bands.data(), src_side_mel_bands.data(), optimum_state,
-		output_mid_mel_bands.data(), output_side_mel_bands.data());
-	int mel_band_index = 0;
 	while (pos < frames) {
 		// window and fft
-		std::fill_n(complex_spec_mid.data(), spec_len, 0);
-		std::fill_n(complex_spec_side.data(), spec_len, 0);
-		for (int i = 0; i < channels; i++) {
-			for (int j = 0; j < width; j++) {
-				int k = pos + j;
-				fft_input[j] = (0 <= k && k < frames) ? wave_ptr[channels * k + i] * window[j] : 0;
-			}
-			fftw_execute(plan);
-			for (int j = 0; j < spec_len; j++) {
-				auto spec = std::complex<float>(fft_output[j][0], fft_output[j][1]);
-				complex_spec_mid[j] += spec;
-				complex_spec_side[j] += spec * (2.0f * i - 1);
-			}
-		}
+		stft.Forward(wave_ptr, frames, pos, complex_spec_mid.data(), complex_spec_side.data());
+
+		// calculate mel band (energy sum mode)
+		mfcc_calculator.calculateMelSpectrumFromDFT((float *)complex_spec_mid.data(),
+			width, false, true, src_mid_mel_bands.data());
+		mfcc_calculator.calculateMelSpectrumFromDFT((float *)complex_spec_side.data(),
+			width, false, true, src_side_mel_bands.data());
+		ApplyMastering3Effects(src_mid_mel_bands.data(), src_side_mel_bands.data(), 1, num_filters,
+			comp_band_indicies, params.compressor_mean_energies, params,
+			output_mid_mel_bands.data(), output_side_mel_bands.data());
 
 		// apply gain
 		for (int j = 0; j < num_filters; j++) {
-			//std::cerr << output_mid_mel_bands[mel_band_index * num_filters + j] << " " << src_mid_mel_bands[mel_band_index * num_filters + j] << std::endl;
-			band_gains[j] = std::sqrt(output_mid_mel_bands[mel_band_index * num_filters + j] / (1e-37 + src_mid_mel_bands[mel_band_index * num_filters + j]));
+			band_gains[j] = std::sqrt(output_mid_mel_bands[j] / (1e-37 + src_mid_mel_bands[j]));
 		}
 		mfcc_calculator.calculateSpectrumFromMelSpectrum(band_gains.data(), width, false, true, spec_gains.data());
 		for (int j = 0; j < spec_len; j++) {
 			complex_spec_mid[j] *= spec_gains[j];
 		}
 		for (int j = 0; j < num_filters; j++) {
-			band_gains[j] = std::sqrt(output_side_mel_bands[mel_band_index * num_filters + j] / (1e-37 + src_side_mel_bands[mel_band_index * num_filters + j]));
+			band_gains[j] = std::sqrt(output_side_mel_bands[j] / (1e-37 + src_side_mel_bands[j]));
 		}
 		mfcc_calculator.calculateSpectrumFromMelSpectrum(band_gains.data(), width, false, true, spec_gains.data());
 		for (int j = 0; j < spec_len; j++) {
@@ -817,50 +970,29 @@ void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std:
 		}
 
 		// ifft and output
-		for (int i = 0; i < channels; i++) {
-			for (int j = 0; j < spec_len; j++) {
-				auto spec = 0.5f * (complex_spec_mid[j] + (2.0f * i - 1) * complex_spec_side[j]);
-				fft_output[j][0] = spec.real();
-				fft_output[j][1] = spec.imag();
-			}
-			fftw_execute(inv_plan);
-			for (int j = 0; j < width; j++) {
-				int k = pos + j;
-				if (0 <= k && k < frames) {
-					result[channels * k + i] += fft_input[j] * (output_shift_resolution / 2);
-				}
-			}
-		}
+		stft.InverseAdd(complex_spec_mid.data(), complex_spec_side.data(), frames, pos, output_shift_resolution / 2, result.data());
 
 		pos += output_shift;
-		mel_band_index++;
-	}
-
-	{
-		std::lock_guard<std::recursive_mutex> lock(FFTW::mutex());
-
-		fftw_destroy_plan(plan);
-		fftw_destroy_plan(inv_plan);
-		fftw_free(fft_output);
-		fftw_free(fft_input);
 	}
 
-	progress_callback(1);
-
 	*_wave = std::move(result);
+#else
+	(void)_wave;
+	(void)sample_rate;
+	(void)params;
 #endif
 }
 
-Mastering3OptimumParams GetMastering3OptimumParams(const std::vector<float> &wave, const int sample_rate, const std::function<void(float)> &progress_callback) {
+void AutoMastering3(std::vector<float> *_wave, const int sample_rate, const std::function<void(float)> &progress_callback) {
 #ifdef PHASELIMITER_ENABLE_FFTW
-	std::vector<float> temp_wave = wave;
-	AutoMastering3(&temp_wave, sample_rate, progress_callback);
-	return g_last_mastering3_optimum_params;
-#else
-	(void)wave;
-	(void)sample_rate;
-	(void)progress_callback;
-	return Mastering3OptimumParams();
+	progress_callback(0);
+
+	const auto params = GetMastering3OptimumParams(*_wave, sample_rate, [&progress_callback](float p) {
+		progress_callback(0.9 * p);
+	});
+	RenderMastering3(_wave, sample_rate, params);
+
+	progress_callback(1);
 #endif
 }
 
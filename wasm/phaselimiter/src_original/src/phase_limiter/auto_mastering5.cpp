@@ -4,26 +4,30 @@
 #include "picojson.h"
 #include "tbb/tbb.h"
 #include <algorithm>
-#include <boost/archive/binary_iarchive.hpp>
+#include <array>
 #include <chrono>
 #include <cmath>
 #include <deque>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <mutex>
 #include <optim.hpp>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "bakuage/decimator.h"
 #include "bakuage/fir_design.h"
-#include "bakuage/fir_filter2.h"
 #include "bakuage/ms_compressor_filter.h"
+#include "bakuage/partitioned_convolution.h"
 #include "bakuage/simd_utils.h"
 #include "bakuage/sound_quality2.h"
+#include "bakuage/sound_quality2_flat.h"
 #include "bakuage/utils.h"
+#include "phase_limiter/gated_mean_cov.h"
 
 DECLARE_string(sound_quality2_cache);
 DECLARE_string(mastering5_optimization_algorithm);
@@ -349,7 +353,7 @@ int GetCompBandIndex(const SoundQuality2CalculatorUnit::Band &band,
 
 EffectParams GetLevel3WarmStart(
     const std::vector<float> &wave, int sample_rate,
-    const SoundQuality2Calculator &calculator,
+    const FlatSoundQuality2Calculator &calculator,
     const std::function<void(float)> &progress_callback) {
   const auto params3 = phase_limiter::GetMastering3OptimumParams(
       wave, sample_rate, progress_callback);
@@ -544,6 +548,109 @@ bool ShouldTerminate(const ConvergenceState &state, int patience) {
   return false;
 }
 
+struct CandidateEval {
+  float eval;
+  float main_eval;
+  float mse;
+  float msp;
+};
+
+// candidates per parallel_for chunk of calc_eval_batch. the band loudness
+// blocks are streamed once per chunk instead of once per candidate.
+const int kCandidatesPerChunk = 4;
+
+// dims of the band loudness vector (mid, side per band) whose effect
+// params differ between the two candidates
+std::vector<int> ChangedLoudnessDims(const double *params,
+                                     const double *prev_params,
+                                     int band_count) {
+  std::vector<int> dims;
+  for (int band = 0; band < band_count; band++) {
+    if (!std::equal(params + 8 * band, params + 8 * band + 8,
+                    prev_params + 8 * band)) {
+      dims.push_back(2 * band + 0);
+      dims.push_back(2 * band + 1);
+    }
+  }
+  return dims;
+}
+
+// same scheme as optim::de (DE/rand/1/bin, DE/best/1/bin with
+// de_mutation_method == 2), but every generation is handed to
+// calc_eval_batch as one population matrix (one candidate per column).
+template <class CalcEvalBatch, class ShouldStop>
+EffectParams RunBatchedDe(const CalcEvalBatch &calc_eval_batch,
+                          const ShouldStop &should_stop,
+                          const optim::algo_settings_t &settings) {
+  const arma::vec &lower_bounds = settings.de_initial_lb;
+  const arma::vec &upper_bounds = settings.de_initial_ub;
+  const int n_vals = lower_bounds.n_elem;
+  const int n_pop = std::max(4, settings.de_n_pop);
+
+  const auto sanitize = [](arma::vec *values) {
+    for (auto &v : *values) {
+      if (!std::isfinite(v)) {
+        v = std::numeric_limits<double>::infinity();
+      }
+    }
+  };
+
+  arma::mat population(n_vals, n_pop);
+  for (int i = 0; i < n_pop; i++) {
+    population.col(i) =
+        lower_bounds + (upper_bounds - lower_bounds) % arma::randu(n_vals);
+  }
+  arma::vec objfn_vals = calc_eval_batch(population);
+  sanitize(&objfn_vals);
+
+  arma::mat trial(n_vals, n_pop);
+  const auto random_index = [n_pop]() {
+    return static_cast<int>(
+        arma::as_scalar(arma::randi(1, arma::distr_param(0, n_pop - 1))));
+  };
+  for (int gen = 0; gen <= settings.de_n_gen && !should_stop(); gen++) {
+    const arma::vec best = population.col(objfn_vals.index_min());
+    for (int i = 0; i < n_pop; i++) {
+      int c1, c2, c3;
+      do {
+        c1 = random_index();
+      } while (c1 == i);
+      do {
+        c2 = random_index();
+      } while (c2 == i || c2 == c1);
+      do {
+        c3 = random_index();
+      } while (c3 == i || c3 == c1 || c3 == c2);
+
+      const int j = arma::as_scalar(
+          arma::randi(1, arma::distr_param(0, n_vals - 1)));
+      const arma::vec rand_unif = arma::randu(n_vals);
+      for (int k = 0; k < n_vals; k++) {
+        if (rand_unif(k) < settings.de_par_CR || k == j) {
+          const double base = settings.de_mutation_method == 1
+                                  ? population(k, c3)
+                                  : best(k);
+          trial(k, i) = base + settings.de_par_F *
+                                   (population(k, c1) - population(k, c2));
+        } else {
+          trial(k, i) = population(k, i);
+        }
+      }
+    }
+
+    arma::vec trial_vals = calc_eval_batch(trial);
+    sanitize(&trial_vals);
+    for (int i = 0; i < n_pop; i++) {
+      if (trial_vals(i) <= objfn_vals(i)) {
+        population.col(i) = trial.col(i);
+        objfn_vals(i) = trial_vals(i);
+      }
+    }
+  }
+
+  return population.col(objfn_vals.index_min());
+}
+
 struct StageConfig {
   int analysis_factor;
   int max_eval_count;
@@ -551,6 +658,25 @@ struct StageConfig {
   const char *name;
 };
 
+// stage1 (粗い解析) -> stage2 (細かい解析) の順
+std::array<StageConfig, 2> GetStageConfigs() {
+  const int stage1_factor =
+      std::max(1, FLAGS_mastering5_analysis_downsample_factor);
+  const int stage2_factor = std::max(1, stage1_factor / 2);
+  return {{{stage1_factor, 200, 100, "stage1_11k"},
+           {stage2_factor, 100, 50, "stage2_22k"}}};
+}
+
+int GetAnalysisRate(int sample_rate, const StageConfig &stage) {
+  return std::max(1, sample_rate / std::max(1, stage.analysis_factor));
+}
+
+// 400ms block
+int GetAnalysisFftWidth(int analysis_rate) {
+  const float block_sec = 0.4;
+  return bakuage::CeilPowerOf2(analysis_rate * block_sec);
+}
+
 struct StageResult {
   EffectParams params;
   Eigen::VectorXd original_mean;
@@ -558,16 +684,15 @@ struct StageResult {
 
 StageResult OptimizeParamsForStage(
     const std::vector<float> &wave, int sample_rate,
-    const SoundQuality2Calculator &calculator,
-    const bakuage::MasteringReference2 &mastering_reference,
+    const FlatSoundQuality2Calculator &calculator,
+    const bakuage::MasteringReference2 *mastering_reference,
     const StageConfig &stage,
     const std::function<void(float)> &progress_callback,
     const EffectParams *initial_params) {
   const int frames = wave.size() / 2;
   const int channels = 2;
-  const float block_sec = 0.4;
   const int analysis_factor = std::max(1, stage.analysis_factor);
-  const int analysis_rate = std::max(1, sample_rate / analysis_factor);
+  const int analysis_rate = GetAnalysisRate(sample_rate, stage);
   std::vector<float> analysis_wave;
   const std::vector<float> *analysis_wave_ptr = &wave;
   int analysis_frames = frames;
@@ -586,9 +711,8 @@ StageResult OptimizeParamsForStage(
   // calculate original band loudness vectors
   std::vector<bakuage::AlignedPodVector<float>> band_loudnesses;
   {
-    // 400ms block
     const int sample_freq = analysis_rate;
-    const int width = bakuage::CeilPowerOf2(sample_freq * block_sec);
+    const int width = GetAnalysisFftWidth(sample_freq);
     const int shift =
         width / 2; // 50% overlap
     const int samples = analysis_frames;
@@ -691,22 +815,13 @@ StageResult OptimizeParamsForStage(
 
   const int band_count = calculator.band_count();
 
-  const auto calc_mean_cov = [band_count, &band_loudnesses](
-                                 const Effect *effect,
-                                 Eigen::VectorXd *mean_vec,
-                                 Eigen::MatrixXd *cov, float *mse) {
-    const auto relative_threshold_db = -20;
-    mean_vec->resize(2 * band_count);
-    cov->resize(2 * band_count, 2 * band_count);
-    *mse = 0;
-
-    // apply effect
+  // band_loudnesses with the effect applied, one kernel row per dim
+  const auto apply_effect = [band_count, &band_loudnesses](
+                                const Effect *effect,
+                                phase_limiter::GatedMeanCov *kernel,
+                                float *mse) {
     bakuage::AlignedPodVector<float> applied(2 * band_count);
-    std::vector<bakuage::AlignedPodVector<float>> loudness_blocks(2 *
-                                                                  band_count);
-    for (int i = 0; i < 2 * band_count; i++) {
-      loudness_blocks[i].resize(band_loudnesses.size());
-    }
+    double sum = 0;
     for (int i = 0; i < band_loudnesses.size(); i++) {
       if (effect) {
         ApplyEffectToBandLoudness(*effect, band_loudnesses[i].data(),
@@ -716,63 +831,23 @@ StageResult OptimizeParamsForStage(
                              applied.size());
       }
       for (int j = 0; j < applied.size(); j++) {
-        *mse += bakuage::Sqr(band_loudnesses[i][j] - applied[j]);
-        loudness_blocks[j][i] = applied[j];
-      }
-    }
-    *mse /= band_loudnesses.size() * applied.size();
-
-    // calculate mean
-    bakuage::AlignedPodVector<Float> thresholds(2 * band_count);
-    for (int band_index = 0; band_index < 2 * band_count; band_index++) {
-      const auto &band_blocks = loudness_blocks[band_index];
-
-      double threshold = -1e10;
-      for (int k = 0; k < 2; k++) {
-        Float count = 0;
-        Float sum = 0;
-        for (const auto &z : band_blocks) {
-          const bool valid = z >= threshold;
-          count += valid;
-          sum += valid ? z : 0;
-        }
-
-        double mean = sum / (1e-37 + count);
-        if (k == 0) {
-          threshold = mean + relative_threshold_db;
-          thresholds[band_index] = threshold;
-        } else if (k == 1) {
-          (*mean_vec)[band_index] = mean;
-        }
+        sum += bakuage::Sqr(band_loudnesses[i][j] - applied[j]);
+        kernel->row(j)[i] = applied[j];
       }
     }
+    *mse = sum / (band_loudnesses.size() * applied.size());
+  };
 
-    // calculate covariance
-    for (int band_index1 = 0; band_index1 < 2 * band_count; band_index1++) {
-      for (int band_index2 = band_index1; band_index2 < 2 * band_count;
-           band_index2++) {
-        const Float mean1 = (*mean_vec)[band_index1];
-        const Float mean2 = (*mean_vec)[band_index2];
-        const Float threshold1 = thresholds[band_index1];
-        const Float threshold2 = thresholds[band_index2];
-
-        const auto &band_blocks1 = loudness_blocks[band_index1];
-        const auto &band_blocks2 = loudness_blocks[band_index2];
-
-        Float v = 0;
-        Float c = 0;
-        for (int i = 0; i < band_blocks1.size(); i++) {
-          const auto x1 = band_blocks1[i];
-          const auto x2 = band_blocks2[i];
-          const bool valid = (x1 >= threshold1) & (x2 >= threshold2);
-          v += valid * (x1 - mean1) * (x2 - mean2);
-          c += valid;
-        }
-        v /= (1e-37 + c);
-        (*cov)(band_index1, band_index2) = v;
-        (*cov)(band_index2, band_index1) = v;
-      }
-    }
+  const auto calc_mean_cov = [&apply_effect, &band_loudnesses, band_count](
+                                 const Effect *effect,
+                                 Eigen::VectorXd *mean_vec,
+                                 Eigen::MatrixXd *cov, float *mse) {
+    phase_limiter::GatedMeanCov kernel(2 * band_count,
+                                       band_loudnesses.size());
+    apply_effect(effect, &kernel, mse);
+    kernel.Calculate();
+    *mean_vec = kernel.mean();
+    *cov = kernel.cov();
   };
 
   Eigen::VectorXd original_mean;
@@ -812,79 +887,82 @@ StageResult OptimizeParamsForStage(
   ConvergenceState convergence_state;
   bool should_terminate_early = false;
   EffectParams best_params(8 * band_count, arma::fill::zeros);
-  const auto calc_eval = [calc_mean_cov, &calculator, &original_mean,
-                          &min_eval, &eval_count, &eval_mtx, &progress_callback,
-                          &lower_bounds, &upper_bounds, &mastering_reference,
-                          &best_params, &convergence_state,
-                          &should_terminate_early, band_count,
-                          &stage](const EffectParams &params) -> double {
-    {
-      std::lock_guard<std::mutex> lock(eval_mtx);
-      if (should_terminate_early) {
-        return min_eval;
-      }
-    }
-    if (params.size() != 8 * band_count) {
-      std::cerr << "CRITICAL ERROR: params.size() (" << params.size()
-                << ") != 8 * band_count (" << 8 * band_count << ")"
-                << std::endl;
-      throw std::runtime_error("params.size() mismatch");
-    }
-
-    Eigen::VectorXd mean;
-    Eigen::MatrixXd cov;
+  // main evals of candidates (sound quality is batched over the candidates)
+  const auto calc_main_evals =
+      [&calculator, mastering_reference](
+          const std::vector<bakuage::MasteringReference2> &targets,
+          float *main_evals) {
+        if (!mastering_reference) {
+          calculator.CalculateSoundQuality(targets.data(), targets.size(),
+                                           main_evals, nullptr);
+          for (int c = 0; c < targets.size(); c++) {
+            main_evals[c] = -main_evals[c];
+          }
+        } else {
+          for (int c = 0; c < targets.size(); c++) {
+            main_evals[c] =
+                calculator.CalculateDistance(*mastering_reference, targets[c]);
+          }
+        }
+      };
+  // pure part of the evaluation (safe to run concurrently)
+  const auto score_candidate = [&lower_bounds, &upper_bounds](
+                                   const double *params, int param_count,
+                                   float main_eval, float mse) {
     float msp = 0;
-    for (int i = 0; i < params.size(); i++) {
-      msp += bakuage::Sqr(params(i));
+    for (int i = 0; i < param_count; i++) {
+      msp += bakuage::Sqr(params[i]);
     }
-    msp /= params.size();
+    msp /= param_count;
     float bound_error = 0;
-    for (int i = 0; i < params.size(); i++) {
+    for (int i = 0; i < param_count; i++) {
       bound_error +=
           bakuage::Sqr(std::max<float>(0, lower_bounds[i] - params[i]));
       bound_error +=
           bakuage::Sqr(std::max<float>(0, params[i] - upper_bounds[i]));
     }
-    float mse;
-    Effect effect(original_mean, params);
-    calc_mean_cov(&effect, &mean, &cov, &mse);
-
-    const bakuage::MasteringReference2 target(mean, cov);
-    float main_eval = 0;
-    if (FLAGS_mastering5_mastering_reference_file.empty()) {
-      float sound_quality;
-      calculator.CalculateSoundQuality(target, &sound_quality, nullptr);
-      main_eval = -sound_quality;
-    } else {
-      main_eval = calculator.CalculateDistance(mastering_reference, target);
-    }
 
     const float target_mse =
         bakuage::Sqr(4 * (1e-2 + FLAGS_mastering5_mastering_level));
     const float alpha = 0.02 / std::sqrt(target_mse);
     const float beta = bakuage::Sqr(10.0) * alpha;
-    const float eval = main_eval + alpha * mse + beta * msp + bound_error * 1e4;
-    {
-      std::lock_guard<std::mutex> lock(eval_mtx);
+    CandidateEval result;
+    result.eval = main_eval + alpha * mse + beta * msp + bound_error * 1e4;
+    result.main_eval = main_eval;
+    result.mse = mse;
+    result.msp = msp;
+    return result;
+  };
+
+  // best / convergence bookkeeping, once per batch in candidate order
+  const auto record_evals = [&min_eval, &eval_count, &eval_mtx,
+                             &progress_callback, &best_params,
+                             &convergence_state, &should_terminate_early,
+                             &stage](const arma::mat &population,
+                                     const std::vector<CandidateEval> &evals) {
+    std::lock_guard<std::mutex> lock(eval_mtx);
+    const int progress_interval = std::max<int>(1, stage.max_eval_count / 100);
+    for (int c = 0; c < evals.size(); c++) {
+      const auto &e = evals[c];
       eval_count++;
-      PushRecent(&convergence_state.recent_evals, eval, 100);
+      PushRecent(&convergence_state.recent_evals, e.eval, 100);
       if (eval_count % 50 == 0 || eval_count < 10) {
-        std::cerr << "eval_count: " << eval_count << " eval: " << eval
+        std::cerr << "eval_count: " << eval_count << " eval: " << e.eval
                   << " min_eval: " << min_eval << std::endl;
       }
-      int progress_interval = std::max<int>(1, stage.max_eval_count / 100);
       if (eval_count % progress_interval == 0 &&
           eval_count < stage.max_eval_count) {
         progress_callback(0.1 +
                           0.5 * eval_count / stage.max_eval_count);
       }
-      if (min_eval > eval) {
-        min_eval = eval;
-        best_params = params;
+      if (min_eval > e.eval) {
+        min_eval = e.eval;
+        best_params = population.col(c);
         convergence_state.evals_since_improvement = 0;
         convergence_state.last_best = min_eval;
         std::cerr << "NEW BEST " << eval_count << "\t" << min_eval << "\t"
-                  << main_eval << "\t" << mse << "\t" << msp << std::endl;
+                  << e.main_eval << "\t" << e.mse << "\t" << e.msp
+                  << std::endl;
       } else {
         convergence_state.evals_since_improvement++;
       }
@@ -895,7 +973,108 @@ StageResult OptimizeParamsForStage(
         should_terminate_early = true;
       }
     }
-    return eval;
+  };
+
+  // evaluates every column of population. candidates are split over the tbb
+  // pool in chunks, each chunk streams band_loudnesses once. within a chunk
+  // one GatedMeanCov is reused and only the rows/cols of bands whose params
+  // differ from the previous candidate are recomputed.
+  const auto calc_eval_batch = [&calc_main_evals, &score_candidate,
+                                &record_evals,
+                                &original_mean, &min_eval, &eval_mtx,
+                                &should_terminate_early, &band_loudnesses,
+                                band_count](const arma::mat &population) {
+    arma::vec result(population.n_cols);
+    {
+      std::lock_guard<std::mutex> lock(eval_mtx);
+      if (should_terminate_early) {
+        result.fill(min_eval);
+        return result;
+      }
+    }
+    if (population.n_rows != 8 * band_count) {
+      std::cerr << "CRITICAL ERROR: params.size() (" << population.n_rows
+                << ") != 8 * band_count (" << 8 * band_count << ")"
+                << std::endl;
+      throw std::runtime_error("params.size() mismatch");
+    }
+
+    std::vector<CandidateEval> evals(population.n_cols);
+    const auto eval_chunk = [&](const tbb::blocked_range<int> &range) {
+      const int count = range.end() - range.begin();
+      std::vector<Effect> effects;
+      effects.reserve(count);
+      for (int c = range.begin(); c < range.end(); c++) {
+        effects.emplace_back(original_mean,
+                             EffectParams(population.col(c)));
+      }
+      const int dim = 2 * band_count;
+      const int block_count = band_loudnesses.size();
+      std::vector<phase_limiter::GatedMeanCov::BlockMatrix> blocks(
+          count, phase_limiter::GatedMeanCov::BlockMatrix(dim, block_count));
+      std::vector<double> sq_errors(count);
+      bakuage::AlignedPodVector<float> applied(dim);
+      for (int i = 0; i < block_count; i++) {
+        const auto &input = band_loudnesses[i];
+        for (int c = 0; c < count; c++) {
+          ApplyEffectToBandLoudness(effects[c], input.data(), applied.data());
+          for (int j = 0; j < dim; j++) {
+            sq_errors[c] += bakuage::Sqr(input[j] - applied[j]);
+            blocks[c](j, i) = applied[j];
+          }
+        }
+      }
+
+      phase_limiter::GatedMeanCov kernel(dim, block_count);
+      std::vector<bakuage::MasteringReference2> targets;
+      targets.reserve(count);
+      for (int c = 0; c < count; c++) {
+        const int index = range.begin() + c;
+        if (c == 0) {
+          for (int j = 0; j < dim; j++) {
+            bakuage::TypedMemcpy(kernel.row(j), blocks[c].row(j).data(),
+                                 block_count);
+          }
+          kernel.Calculate();
+        } else {
+          const auto dims =
+              ChangedLoudnessDims(population.colptr(index),
+                                  population.colptr(index - 1), band_count);
+          for (const int j : dims) {
+            bakuage::TypedMemcpy(kernel.row(j), blocks[c].row(j).data(),
+                                 block_count);
+          }
+          kernel.Recalculate(dims);
+        }
+        targets.emplace_back(kernel.mean(), kernel.cov());
+      }
+
+      std::vector<float> main_evals(count);
+      calc_main_evals(targets, main_evals.data());
+      for (int c = 0; c < count; c++) {
+        const int index = range.begin() + c;
+        const float mse = sq_errors[c] / (block_count * dim);
+        evals[index] = score_candidate(population.colptr(index),
+                                       population.n_rows, main_evals[c], mse);
+      }
+    };
+    tbb::parallel_for(tbb::blocked_range<int>(0, population.n_cols,
+                                              kCandidatesPerChunk),
+                      eval_chunk);
+
+    record_evals(population, evals);
+    for (int c = 0; c < evals.size(); c++) {
+      result(c) = evals[c].eval;
+    }
+    return result;
+  };
+
+  const auto calc_eval = [&calc_eval_batch](const EffectParams &params)
+      -> double { return calc_eval_batch(arma::mat(params))(0); };
+
+  const auto should_stop = [&eval_mtx, &should_terminate_early]() {
+    std::lock_guard<std::mutex> lock(eval_mtx);
+    return should_terminate_early;
   };
 
   EffectParams zero_params(8 * band_count);
@@ -909,8 +1088,9 @@ StageResult OptimizeParamsForStage(
   std::cerr << "optimization initial_eval: " << initial_eval << std::endl;
 
   const auto find_params =
-      [calc_eval, band_count, &start_params, &lower_bounds, &upper_bounds,
-       &best_params, &min_eval, &stage, initial_eval]() -> EffectParams {
+      [calc_eval, &calc_eval_batch, &should_stop, band_count, &start_params,
+       &lower_bounds, &upper_bounds, &best_params, &min_eval, &stage,
+       initial_eval]() -> EffectParams {
     optim::algo_settings_t settings;
 #if 1
     settings.de_initial_lb = lower_bounds;
@@ -948,18 +1128,9 @@ StageResult OptimizeParamsForStage(
           [calc_eval](const arma::vec &vec, arma::vec *grad_out,
                       void *opt_data) { return calc_eval(vec); },
           nullptr, settings);
-    } else if (FLAGS_mastering5_optimization_algorithm == "de") {
-      success = optim::de(
-          result,
-          [calc_eval](const arma::vec &vec, arma::vec *grad_out,
-                      void *opt_data) { return calc_eval(vec); },
-          nullptr, settings);
-    } else if (FLAGS_mastering5_optimization_algorithm == "de_prmm") {
-      success = optim::de(
-          result,
-          [calc_eval](const arma::vec &vec, arma::vec *grad_out,
-                      void *opt_data) { return calc_eval(vec); },
-          nullptr, settings);
+    } else if (FLAGS_mastering5_optimization_algorithm == "de" ||
+               FLAGS_mastering5_optimization_algorithm == "de_prmm") {
+      result = RunBatchedDe(calc_eval_batch, should_stop, settings);
     } else {
       throw std::logic_error(
           std::string("unknown FLAGS_mastering5_optimization_algorithm " +
@@ -993,38 +1164,60 @@ StageResult OptimizeParamsForStage(
   return result;
 }
 
+// sound_quality2_cache はプロセス内で一度だけ読み込む
+// (フラット形式ならmmapするだけなので、旧形式でも変換は初回だけ)
+// AutoMastering5Context はこれを共有する
+std::mutex sound_quality2_calculator_mutex;
+std::shared_ptr<const FlatSoundQuality2Calculator> sound_quality2_calculator;
+std::string sound_quality2_calculator_path;
+bool sound_quality2_calculator_from_data = false;
+
+std::shared_ptr<const FlatSoundQuality2Calculator> GetSoundQuality2Calculator() {
+  std::lock_guard<std::mutex> lock(sound_quality2_calculator_mutex);
+  if (!sound_quality2_calculator_from_data &&
+      (!sound_quality2_calculator ||
+       sound_quality2_calculator_path != FLAGS_sound_quality2_cache)) {
+    std::cerr << "load sound_quality2_cache: " << FLAGS_sound_quality2_cache
+              << std::endl;
+    sound_quality2_calculator =
+        LoadFlatSoundQuality2Calculator(FLAGS_sound_quality2_cache);
+    sound_quality2_calculator_path = FLAGS_sound_quality2_cache;
+  }
+  return sound_quality2_calculator;
+}
+
 } // namespace
 
 namespace phase_limiter {
 
-// audio_analyzer(CalculateMultibandLoudness2)の仕様に合わせて、mean,
-// covを計算する。 エフェクトはloudness vector上でシミュレーションする
-// 基準ラウドネスの違いとかはホワイトノイズを処理して補正値を計算して補正する
-void AutoMastering5(std::vector<float> *_wave, const int sample_rate,
-                    const std::function<void(float)> &progress_callback) {
-  try {
-    const int frames = _wave->size() / 2;
-    const int channels = 2;
+void SetSoundQuality2CacheData(const void *data, size_t size) {
+  std::shared_ptr<const FlatSoundQuality2Calculator> calculator;
+  if (data) {
+    // 呼び出し側が data を保持する
+    calculator = LoadFlatSoundQuality2Calculator(
+        std::shared_ptr<const void>(data, [](const void *) {}), data, size);
+  }
+  std::lock_guard<std::mutex> lock(sound_quality2_calculator_mutex);
+  sound_quality2_calculator = calculator;
+  sound_quality2_calculator_path.clear();
+  sound_quality2_calculator_from_data = !!calculator;
+}
 
-    // initialize sound quality calculator
-    bakuage::SoundQuality2Calculator calculator;
-    {
-      std::cerr << "load sound_quality2_cache: " << FLAGS_sound_quality2_cache
-                << std::endl;
-      std::ifstream ifs(FLAGS_sound_quality2_cache, std::ios::binary);
-      if (!ifs) {
-        std::cerr << "Failed to open cache file!" << std::endl;
-      }
-      std::cerr << "Opening archive..." << std::endl;
-      boost::archive::binary_iarchive ia(ifs);
-      std::cerr << "Archive initialized. Loading calculator..." << std::endl;
-      ia >> calculator;
-      std::cerr << "Calculator loaded." << std::endl;
-    }
-    const auto band_count = calculator.band_count();
+class AutoMastering5Context {
+public:
+  // sample rateごとに使い回せるもの
+  struct SampleRateState {
+    int fir_delay_samples;
+    // バンドごとのFIRの分割スペクトル (計算済み。ジョブ間で共有して使う)
+    std::vector<std::shared_ptr<const PartitionedFirSpectrum<Float>>>
+        band_firs;
+    // 解析用のFFT plan (plan registryに作らせておくためのhandle)
+    std::vector<std::unique_ptr<bakuage::RealDft<float>>> analysis_dfts;
+  };
 
-    // initialize reference
-    bakuage::MasteringReference2 mastering_reference;
+  AutoMastering5Context()
+      : calculator_(GetSoundQuality2Calculator()),
+        has_mastering_reference_(false) {
     if (!FLAGS_mastering5_mastering_reference_file.empty()) {
       Eigen::VectorXd mean;
       Eigen::MatrixXd cov;
@@ -1033,8 +1226,94 @@ void AutoMastering5(std::vector<float> *_wave, const int sample_rate,
               FLAGS_mastering5_mastering_reference_file.c_str())
               .c_str(),
           &mean, &cov);
-      mastering_reference = bakuage::MasteringReference2(mean, cov);
+      mastering_reference_ = bakuage::MasteringReference2(mean, cov);
+      has_mastering_reference_ = true;
+    }
+  }
+
+  const FlatSoundQuality2Calculator &calculator() const { return *calculator_; }
+  // 指定されていなければnullptr
+  const bakuage::MasteringReference2 *mastering_reference() const {
+    return has_mastering_reference_ ? &mastering_reference_ : nullptr;
+  }
+
+  std::shared_ptr<const SampleRateState>
+  GetSampleRateState(int sample_rate) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &state = sample_rate_states_[sample_rate];
+    if (!state) {
+      state = CreateSampleRateState(sample_rate);
+    }
+    return state;
+  }
+
+private:
+  std::shared_ptr<const SampleRateState>
+  CreateSampleRateState(int sample_rate) const {
+    auto state = std::make_shared<SampleRateState>();
+    const int band_count = calculator_->band_count();
+    state->fir_delay_samples = static_cast<int>(0.2 * sample_rate);
+    const int n = 2 * state->fir_delay_samples + 1;
+    std::vector<std::vector<Float>> firs(band_count);
+    tbb::parallel_for(0, band_count, [this, &firs, n, sample_rate](int i) {
+      const auto &band = calculator_->bands()[i];
+      Float freq1 = std::min<Float>(0.5, band.low_freq / sample_rate);
+      Float freq2 = std::min<Float>(
+          0.5, band.high_freq == 0 ? 0.5 : band.high_freq / sample_rate);
+      firs[i] = CalculateBandPassFir<Float>(freq1, freq2, n, 4);
+    });
+    state->band_firs.reserve(band_count);
+    for (const auto &fir : firs) {
+      state->band_firs.push_back(
+          std::make_shared<const PartitionedFirSpectrum<Float>>(fir.begin(),
+                                                                fir.end()));
+    }
+    for (const auto &stage : GetStageConfigs()) {
+      const int width =
+          GetAnalysisFftWidth(GetAnalysisRate(sample_rate, stage));
+      state->analysis_dfts.emplace_back(
+          new bakuage::RealDft<float>(width, true));
     }
+    return state;
+  }
+
+  std::shared_ptr<const FlatSoundQuality2Calculator> calculator_;
+  bakuage::MasteringReference2 mastering_reference_;
+  bool has_mastering_reference_;
+  mutable std::mutex mutex_;
+  mutable std::unordered_map<int, std::shared_ptr<const SampleRateState>>
+      sample_rate_states_;
+};
+
+std::shared_ptr<const AutoMastering5Context> CreateAutoMastering5Context() {
+  return std::make_shared<const AutoMastering5Context>();
+}
+
+void PrepareAutoMastering5Context(const AutoMastering5Context &context,
+                                  int sample_rate) {
+  context.GetSampleRateState(sample_rate);
+}
+
+void AutoMastering5(std::vector<float> *_wave, const int sample_rate,
+                    const std::function<void(float)> &progress_callback) {
+  const auto context = CreateAutoMastering5Context();
+  AutoMastering5(_wave, sample_rate, progress_callback, *context);
+}
+
+// audio_analyzer(CalculateMultibandLoudness2)の仕様に合わせて、mean,
+// covを計算する。 エフェクトはloudness vector上でシミュレーションする
+// 基準ラウドネスの違いとかはホワイトノイズを処理して補正値を計算して補正する
+void AutoMastering5(std::vector<float> *_wave, const int sample_rate,
+                    const std::function<void(float)> &progress_callback,
+                    const AutoMastering5Context &context) {
+  try {
+    const int frames = _wave->size() / 2;
+    const int channels = 2;
+
+    const auto &calculator = context.calculator();
+    const auto band_count = calculator.band_count();
+    const auto mastering_reference = context.mastering_reference();
+    const auto sample_rate_state = context.GetSampleRateState(sample_rate);
 
     std::cerr << "Starting optimization..." << std::endl;
     std::cerr << "INPUT wave L2 norm BEFORE optimization: "
@@ -1051,12 +1330,9 @@ void AutoMastering5(std::vector<float> *_wave, const int sample_rate,
       warm_params_ptr = &warm_params;
     }
 
-    const int stage1_factor =
-        std::max(1, FLAGS_mastering5_analysis_downsample_factor);
-    const int stage2_factor = std::max(1, stage1_factor / 2);
-
-    const StageConfig stage1{stage1_factor, 200, 100, "stage1_11k"};
-    const StageConfig stage2{stage2_factor, 100, 50, "stage2_22k"};
+    const auto stages = GetStageConfigs();
+    const StageConfig &stage1 = stages[0];
+    const StageConfig &stage2 = stages[1];
 
     const auto stage1_progress = [&progress_callback](float p) {
       const float local =
@@ -1088,123 +1364,114 @@ void AutoMastering5(std::vector<float> *_wave, const int sample_rate,
     std::cerr << std::endl;
     const Effect effect(original_mean, effect_params);
     std::cerr << "Effect object created." << std::endl;
-    std::mutex result_mtx;
-    std::mutex progression_mtx;
-    std::vector<std::function<void()>> tasks;
-    std::vector<Float> result(_wave->size(), 0);
-    bakuage::AlignedPodVector<Float> progressions(band_count);
-
-    const auto update_progression = [&progressions, &progression_mtx,
-                                     progress_callback](int i, Float p) {
-      std::lock_guard<std::mutex> lock(progression_mtx);
-      Float total = 0;
-      progressions[i] = p;
-      for (const auto &a : progressions) {
-        total += a;
-      }
-      progress_callback(0.6 + 0.4 * total / progressions.size());
-    };
 
+    // 帯域分割はフィルタバンクとして一回で行う。
+    // 入力のFFTはチャンネルごとに1ブロック一回 (全バンドで共有) で、
+    // バンドごとにはスペクトルの積和と逆FFTだけ。
+    // バンド信号はブロックごとに作ってそのままコンプレッサーに流すので、
+    // メモリはバンド数 x ブロックサイズ (曲の長さに依存しない)
+    const auto &band_firs = sample_rate_state->band_firs;
+    const int fir_delay_samples = sample_rate_state->fir_delay_samples;
+    const int block_size = band_firs[0]->block_size();
+    const int spec_len = band_firs[0]->spec_len();
+    std::vector<PartitionedInputSpectra<Float>> input_spectra;
+    input_spectra.reserve(channels);
+    for (int ch = 0; ch < channels; ch++) {
+      input_spectra.emplace_back(block_size, band_firs[0]->partition_count());
+    }
+
+    struct BandRenderer {
+      BandRenderer(const Compressor::Config &config, int block_size,
+                   int spec_len, int channels)
+          : compressor(config), output_transform(block_size),
+            spec(spec_len), channel_filtered(block_size),
+            filtered(channels * block_size), output(channels * block_size) {}
+      Compressor compressor;
+      PartitionedOutputTransform<Float> output_transform;
+      bakuage::AlignedPodVector<std::complex<Float>> spec;
+      bakuage::AlignedPodVector<Float> channel_filtered;
+      bakuage::AlignedPodVector<Float> filtered; // interleaved
+      bakuage::AlignedPodVector<Float> output;   // interleaved
+    };
+    std::vector<std::unique_ptr<BandRenderer>> renderers;
+    int max_shift = 0;
     for (int band_index = 0; band_index < band_count; band_index++) {
-      const auto &band = calculator.bands()[band_index];
-      const auto update_progression_bound =
-          std::bind(update_progression, band_index, std::placeholders::_1);
       const auto &band_effect = effect.band_effects[band_index];
-      tasks.push_back([band, band_effect, band_index, sample_rate, frames,
-                       _wave, &result, &result_mtx, update_progression_bound,
-                       channels]() {
-        const float *wave_ptr = &(*_wave)[0];
-
-        int fir_delay_samples;
-        std::vector<Float> fir;
-        {
-          fir_delay_samples = static_cast<int>(0.2 * sample_rate);
-          const int n = 2 * fir_delay_samples + 1;
-          Float freq1 = std::min<Float>(0.5, band.low_freq / sample_rate);
-          Float freq2 = std::min<Float>(
-              0.5, band.high_freq == 0 ? 0.5 : band.high_freq / sample_rate);
-          fir = CalculateBandPassFir<Float>(freq1, freq2, n, 4);
-        }
-        update_progression_bound(0.1);
-
-        const int len = frames + fir.size() - 1;
-        bakuage::AlignedPodVector<float> filtered(channels * len);
-        {
-          FirFilter2<Float> fir_filter(fir.begin(), fir.end());
-          bakuage::AlignedPodVector<Float> filter_temp_input(
-              (size_t)(frames + fir_delay_samples), 0);
-          bakuage::AlignedPodVector<Float> filter_temp_output(
-              (size_t)(frames + fir_delay_samples), 0);
-          for (int ch = 0; ch < channels; ch++) {
-            fir_filter.Clear();
-            for (int i = 0; i < frames; i++) {
-              filter_temp_input[i] = wave_ptr[channels * i + ch];
-            }
-            fir_filter.Clock(filter_temp_input.data(),
-                             filter_temp_input.data() + frames +
-                                 fir_delay_samples,
-                             filter_temp_output.data());
-            for (int i = 0; i < frames; i++) {
-              filtered[channels * i + ch] =
-                  filter_temp_output[i + fir_delay_samples];
-            }
+      Compressor::Config compressor_config;
+      compressor_config.loudness_mapping_func = band_effect.loudness_mapping;
+      compressor_config.ms_loudness_mapping_func =
+          band_effect.ms_loudness_mapping;
+      compressor_config.max_mean_sec = 0.2;
+      compressor_config.num_channels = channels;
+      compressor_config.sample_rate = sample_rate;
+      renderers.emplace_back(new BandRenderer(compressor_config, block_size,
+                                              spec_len, channels));
+      max_shift =
+          std::max(max_shift, renderers.back()->compressor.delay_samples());
+    }
+
+    // ストリーム位置nのバンド信号は遅延補正後の位置 n - fir_delay_samples。
+    // コンプレッサーには遅延補正後の [0, frames + shift) を入力する
+    // (frames以降は0)
+    std::vector<Float> result(_wave->size(), 0);
+    const float *wave_ptr = _wave->data();
+    const int stream_len = frames + fir_delay_samples + max_shift;
+    bakuage::AlignedPodVector<Float> input_block(channels * block_size);
+    for (int bg = 0; bg < stream_len; bg += block_size) {
+      const int read = std::max(0, std::min(block_size, frames - bg));
+      TypedMemcpy(input_block.data(), wave_ptr + channels * bg,
+                  channels * read);
+      TypedFillZero(input_block.data() + channels * read,
+                    channels * (block_size - read));
+      for (int ch = 0; ch < channels; ch++) {
+        input_spectra[ch].Push(input_block.data() + ch, channels);
+      }
+
+      tbb::parallel_for(0, band_count, [&](int band_index) {
+        auto &renderer = *renderers[band_index];
+        const auto &fir = *band_firs[band_index];
+        for (int ch = 0; ch < channels; ch++) {
+          TypedFillZero(renderer.spec.data(), spec_len);
+          input_spectra[ch].MultiplyAccumulate(fir, 0, renderer.spec.data());
+          renderer.output_transform.Backward(renderer.spec.data(),
+                                             renderer.channel_filtered.data());
+          for (int i = 0; i < block_size; i++) {
+            renderer.filtered[channels * i + ch] =
+                renderer.channel_filtered[i];
           }
         }
-        update_progression_bound(0.2);
-
-        Compressor::Config compressor_config;
-        compressor_config.loudness_mapping_func = band_effect.loudness_mapping;
-        compressor_config.ms_loudness_mapping_func =
-            band_effect.ms_loudness_mapping;
-        compressor_config.max_mean_sec = 0.2;
-        compressor_config.num_channels = channels;
-        compressor_config.sample_rate = sample_rate;
-        Compressor compressor(compressor_config);
-
-        const int shift = compressor.delay_samples();
-        const int len2 = frames + shift;
-        filtered.resize(channels * len2);
-        bakuage::AlignedPodVector<Float> temp_input((size_t)channels, 0);
-        bakuage::AlignedPodVector<Float> temp_output((size_t)channels, 0);
-
-        // filteredにin-placeで書き込んでから共有のresultに足しこむ
-        for (int j = 0; j < len2; j++) {
-          for (int i = 0; i < channels; i++) {
-            temp_input[i] = filtered[channels * j + i];
+
+        const int shift = renderer.compressor.delay_samples();
+        for (int i = 0; i < block_size; i++) {
+          const int j = bg + i - fir_delay_samples;
+          if (j < 0 || j >= frames + shift) {
+            continue;
           }
-          compressor.Clock(&temp_input[0], &temp_output[0]);
-          for (int i = 0; i < channels; i++) {
-            filtered[channels * j + i] = temp_output[i];
+          if (j >= frames) {
+            TypedFillZero(&renderer.filtered[channels * i], channels);
           }
+          renderer.compressor.Clock(&renderer.filtered[channels * i],
+                                    &renderer.output[channels * i]);
         }
-        update_progression_bound(0.8);
-
-        {
-          std::lock_guard<std::mutex> lock(result_mtx);
-          const int len3 = frames * channels;
-          const int channels_shift = channels * shift;
-          bakuage::VectorAddInplace(filtered.data() + channels_shift,
-                                    result.data(), len3);
-        }
-        update_progression_bound(1);
       });
-    }
 
-    std::cerr << "Starting final parallel processing with " << tasks.size()
-              << " tasks..." << std::endl;
-    tbb::parallel_for(0, (int)tasks.size(), [&tasks](int task_i) {
-      try {
-        tasks[task_i]();
-      } catch (const std::exception &e) {
-        std::cerr << "Task " << task_i << " failed: " << e.what() << std::endl;
-        throw;
-      } catch (...) {
-        std::cerr << "Task " << task_i << " failed with unknown error"
-                  << std::endl;
-        throw;
+      // バンドの合計 (順序を固定して足す)
+      for (int band_index = 0; band_index < band_count; band_index++) {
+        const auto &renderer = *renderers[band_index];
+        const int shift = renderer.compressor.delay_samples();
+        const int offset = fir_delay_samples + shift;
+        const int i_bg = std::max(0, offset - bg);
+        const int i_ed = std::min(block_size, frames + offset - bg);
+        if (i_bg < i_ed) {
+          bakuage::VectorAddInplace(
+              &renderer.output[channels * i_bg],
+              &result[channels * (bg + i_bg - offset)],
+              channels * (i_ed - i_bg));
+        }
       }
-    });
-    std::cerr << "Final parallel processing finished." << std::endl;
+      progress_callback(
+          0.6 + 0.4 * std::min(1.0, (bg + block_size) / (double)stream_len));
+    }
 
     *_wave = std::move(result);
     std::cerr << "Final wave L2 norm: "
@@ -16,8 +16,13 @@
 #define PL_MEMORY_ALIGN PL_CACHE_LINE_SIZE
 
 namespace phase_limiter {
+#ifdef __EMSCRIPTEN__
+    // wasm_simd128 は 128bit なので float32x4 (stubs/simdpp/simd.h)
+    typedef simdpp::float32x4 DefaultSimdType;
+#else
     typedef simdpp::float32x8 DefaultSimdType;
     // typedef simdpp::float64x4 DefaultSimdType;
+#endif
     
     inline void *Malloc(int size) {
         return bakuage::AlignedMalloc(size, PL_CACHE_LINE_SIZE);
@@ -89,7 +89,7 @@ float distort(float x) {
 	return a * x / (1 + std::abs(a * x));
 }
 
-void Enhance(std::vector<float> *wave, int channels) {
+void Enhance(std::vector<float> *wave, int channels, int sample_rate) {
 #ifdef PHASELIMITER_ENABLE_FFTW
 	if (wave->size() % channels) {
 		throw std::logic_error("input wave length must be multiple of channels");
@@ -122,15 +122,15 @@ void Enhance(std::vector<float> *wave, int channels) {
 		// calculate filter param
 		int delay_samples;
 		int lowpass_filter_order = 2;
-		float peak = std::min<float>(1.0, 1.0 / (44100.0 * 1 + 1e-30));
+		float peak = std::min<float>(1.0, 1.0 / (sample_rate * 1.0 + 1e-30));
 		float a = bakuage::TimeVaryingLowpassFilter<float>::CalculateAFromPeak(lowpass_filter_order, peak, &delay_samples);
 
 		// enhance
 		std::memcpy(fft_spec_temp, fft_output, sizeof(fftwf_complex) * src_freq_length);
 		std::memset(fft_wave_temp, 0, sizeof(float) * src_length);
 		for (int64_t k = 0; k < 250/*22050 / 2 - 1000*/; k += 50) {
-			int low_freq = std::min<int64_t>(src_freq_length, k * src_length / 44100);
-			int hi_freq = std::min<int64_t>(src_freq_length, (k + 50) * src_length / 44100);
+			int low_freq = std::min<int64_t>(src_freq_length, k * src_length / sample_rate);
+			int hi_freq = std::min<int64_t>(src_freq_length, (k + 50) * src_length / sample_rate);
 			std::cerr << "AAAAA" << k << std::endl;
 			std::memset(fft_output, 0, sizeof(fftwf_complex) * src_freq_length);
 			for (int i = low_freq; i < hi_freq; i++) {
@@ -146,7 +146,7 @@ void Enhance(std::vector<float> *wave, int channels) {
 				fft_input[i] = fft_input[i] * fft_input[i];
 			}
 			fftwf_execute(forward_plan);
-			for (int i = (int64_t)20 * src_length / 44100; i < src_freq_length - 1; i++) {
+			for (int i = (int64_t)20 * src_length / sample_rate; i < src_freq_length - 1; i++) {
 				fft_output[i][0] = 0;
 				fft_output[i][1] = 0;
 			}
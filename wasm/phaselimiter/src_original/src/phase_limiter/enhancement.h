@@ -4,7 +4,7 @@
 #include <vector>
 
 namespace phase_limiter {
-void Enhance(std::vector<float> *_wave, int channels);
+void Enhance(std::vector<float> *_wave, int channels, int sample_rate);
 }
 
 #endif
@@ -4,7 +4,8 @@
 #include <vector>
 
 namespace phase_limiter {
-void CutLowAndHighFreq(std::vector<float> *wave, int channels, float normalized_low_cut_off_freq, float normalized_high_cut_off_freq);
+// low_cut_off_freq, high_cut_off_freq はHz (0でカットしない)
+void CutLowAndHighFreq(std::vector<float> *wave, int channels, int sample_rate, float low_cut_off_freq, float high_cut_off_freq);
 }
 
 #endif
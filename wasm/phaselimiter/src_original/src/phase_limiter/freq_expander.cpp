@@ -28,7 +28,7 @@ void FreqExpand(std::vector<float> *wave, int channels, int sample_rate, float r
 	}
 	std::vector<float> result(wave->size());
 	const int len = wave->size() / channels;
-	const int windows_size = (int)(44100 * 0.02) & (~15);
+	const int windows_size = (int)(sample_rate * 0.02) & (~15);
 	const int shift_size = windows_size / 2;
 	std::vector<double> powers(windows_size / 2 + 1);
 
@@ -0,0 +1,96 @@
+#ifndef PHASE_LIMITER_GATED_MEAN_COV_H_
+#define PHASE_LIMITER_GATED_MEAN_COV_H_
+
+#include <algorithm>
+#include <vector>
+#include <Eigen/Dense>
+
+namespace phase_limiter {
+    // audio_analyzer(CalculateMultibandLoudness2)と同じ仕様のゲート付き mean, cov
+    // (各次元で全体平均 - 20dB 未満のブロックを除外、covは両方有効なブロックのみ)
+    //
+    // ラウドネスは dim x block のSoA (row-major) で持つ。
+    // ゲート適用後の偏差 dev = valid ? x - mean : 0 と valid (0 or 1) を行ごとに作っておくと
+    // cov(i, j) = dot(dev_i, dev_j) / dot(valid_i, valid_j) になるので、
+    // 全体の計算は2つの rank update (EigenのSIMD + キャッシュブロッキング) で済む。
+    // 一部の次元だけ変わった場合は Recalculate で該当する行と列だけ更新できる。
+    class GatedMeanCov {
+    public:
+        typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> BlockMatrix;
+
+        GatedMeanCov(int dim, int block_count):
+        loudness_(dim, block_count), dev_(dim, block_count), valid_(dim, block_count),
+        sum_dev2_(dim, dim), sum_valid_(dim, dim), mean_(dim), cov_(dim, dim) {
+            loudness_.setZero();
+        }
+
+        int dim() const { return loudness_.rows(); }
+        int block_count() const { return loudness_.cols(); }
+
+        // block_count個の連続したラウドネス (書き換えたら Calculate か Recalculate を呼ぶ)
+        float *row(int d) { return loudness_.row(d).data(); }
+        const float *row(int d) const { return loudness_.row(d).data(); }
+
+        void Calculate() {
+            for (int d = 0; d < dim(); d++) {
+                UpdateRow(d);
+            }
+            sum_dev2_.setZero();
+            sum_dev2_.selfadjointView<Eigen::Lower>().rankUpdate(dev_);
+            sum_valid_.setZero();
+            sum_valid_.selfadjointView<Eigen::Lower>().rankUpdate(valid_);
+            for (int i = 0; i < dim(); i++) {
+                for (int j = 0; j <= i; j++) {
+                    const double v = sum_dev2_(i, j) / (1e-37 + sum_valid_(i, j));
+                    cov_(i, j) = v;
+                    cov_(j, i) = v;
+                }
+            }
+        }
+
+        // 前回の計算から dims の行だけが変わった場合の差分更新
+        void Recalculate(const std::vector<int> &dims) {
+            if (2 * static_cast<int>(dims.size()) >= dim()) {
+                Calculate();
+                return;
+            }
+            for (const int d : dims) {
+                UpdateRow(d);
+            }
+            for (const int d : dims) {
+                const Eigen::RowVectorXf dev2 = dev_.row(d) * dev_.transpose();
+                const Eigen::RowVectorXf valid2 = valid_.row(d) * valid_.transpose();
+                for (int j = 0; j < dim(); j++) {
+                    const double v = dev2[j] / (1e-37 + valid2[j]);
+                    cov_(d, j) = v;
+                    cov_(j, d) = v;
+                }
+            }
+        }
+
+        const Eigen::VectorXd &mean() const { return mean_; }
+        const Eigen::MatrixXd &cov() const { return cov_; }
+    private:
+        void UpdateRow(int d) {
+            const auto relative_threshold_db = -20;
+            const auto x = loudness_.row(d).array();
+            const float threshold = x.sum() / (1e-37 + block_count()) + relative_threshold_db;
+            const auto valid = (x >= threshold);
+            const float count = valid.count();
+            const float mean = valid.select(x, 0.0f).sum() / (1e-37 + count);
+            mean_[d] = mean;
+            dev_.row(d) = valid.select(x - mean, 0.0f);
+            valid_.row(d) = valid.cast<float>();
+        }
+
+        BlockMatrix loudness_;
+        BlockMatrix dev_;
+        BlockMatrix valid_;
+        Eigen::MatrixXf sum_dev2_;
+        Eigen::MatrixXf sum_valid_;
+        Eigen::VectorXd mean_;
+        Eigen::MatrixXd cov_;
+    };
+}
+
+#endif
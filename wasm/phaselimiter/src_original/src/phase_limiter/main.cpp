@@ -28,6 +28,7 @@
 #include "bakuage/memory.h"
 #include "bakuage/ffmpeg.h"
 #include "phase_limiter/GradCalculator.h"
+#include "phase_limiter/phase_limit.h"
 #include "phase_limiter/pre_compression.h"
 #include "phase_limiter/auto_mastering.h"
 #include "phase_limiter/equalization.h"
@@ -62,6 +63,8 @@ DEFINE_string(mastering_mode, "classic", "classic / mastering2 / mastering3 / ma
 DEFINE_string(mastering2_config_file, "", "Mastering 2 config file path.");
 DEFINE_int32(mastering3_iteration, 1000, "Mastering 3 optimization iteration count.");
 DEFINE_double(mastering3_target_sn, 12, "Target S/N in dB used for Acoustic entropy calculation.");
+DEFINE_int32(mastering3_chain_count, 4, "Mastering 3 parallel tempering chain count (independent of the thread count, so the result does not depend on it).");
+DEFINE_int32(mastering3_exchange_interval, 20, "Mastering 3 iterations between parallel tempering state exchanges.");
 DEFINE_string(sound_quality2_cache, "./sound_quality2_cache", "sound quality2 cache path.");
 DEFINE_string(mastering5_optimization_algorithm, "de_prmm", "de / nm / pso / de_prmm / pso_dv");
 DEFINE_int32(mastering5_optimization_max_eval_count, 40000, "Mastering5 optimization max eval count.");
@@ -93,7 +96,7 @@ DEFINE_int32(true_peak_oversample, 4, "true peak oversample");
 
 DEFINE_string(output_format, "wav", "output format (wav/mp3/aac)");
 DEFINE_int32(bit_depth, 16, "bit depth (16 or 24)");
-DEFINE_int32(sample_rate, 44100, "Output sample rate (not processing sample rate)");
+DEFINE_int32(sample_rate, 0, "Output and processing sample rate (0: same as input, mp3 is limited to 48000)");
 
 DEFINE_string(grad_output, "", "grad output path");
 DEFINE_string(limiting_error_spectrogram_output, "", "limiting error spectrogram output png path");
@@ -103,10 +106,11 @@ DEFINE_double(limiting_error_spectrogram_gain, 60, "gain in dB");
 
 DEFINE_int32(limiter_external_oversample, 1, "limiter oversample out of phase_limiter algorithm (slow, consume memory)");
 DEFINE_int32(limiter_internal_oversample, 1, "limiter oversample in phase_limiter algorithm (fast, memory efficient)");
+DEFINE_double(limiter_segment_sec, 0, "limiter segment length in sec. optimize overlapping segments so that memory usage is proportional to the segment length (0: whole track)");
 
 DEFINE_string(max_available_freq_mode, "disabled", "disabled / detect");
 
-DEFINE_string(test_mode, "", "empty / grad / grad_calculator / perfect_hash_power_of_2");
+DEFINE_string(test_mode, "", "empty / grad / grad_calculator / grad_calculator_oversample / grad_calculator_convergence / grad_calculator_inactive / perfect_hash_power_of_2 / gated_mean_cov / mastering3_thread_count");
 
 DEFINE_string(noise_update_mode, "linear", "linear / adaptive");
 DEFINE_double(noise_update_min_noise, 1e-6, "min noise");
@@ -115,6 +119,9 @@ DEFINE_double(noise_update_fista_enable_ratio, 1.0, "the ratio of fista enable i
 DEFINE_double(absolute_min_noise, 1e-6, "absolute min noise (independent from noise weighting)");
 DEFINE_int32(max_iter1, 100, "max optimization iteration count (outer loop)");
 DEFINE_int32(max_iter2, 400, "max optimization iteration count (inner loop)");
+DEFINE_double(limiter_convergence_eval_tolerance, 0, "stop the optimization early when the relative eval improvement per iteration is below this value (0: disabled). the peak check uses the limiter samples, so it is a sample peak unless limiter_internal_oversample > 1");
+DEFINE_double(limiter_convergence_peak_tolerance, 1e-4, "peak overshoot of the FISTA iterate above the ceiling allowed for the early stop (sample peak at the limiter sample rate, not true peak)");
+DEFINE_double(limiter_inactive_tolerance, 1e-6, "approximate: treat the eval and grad of task groups whose input differs from the source by at most this value as zero and skip them (negative: disabled, exact)");
 
 DEFINE_bool(perf_src_cache, true, "use IFFT of src wave cache (performance option)");
 
@@ -174,9 +181,7 @@ void OutputProgression(double progression) {
 
 // in-place for memory efficiency
 template <class Float>
-void PhaseLimitInplace(std::vector<Float> *wave) {
-    auto original_wave = *wave;
-    const int base_sample_rate = 44100;
+void PhaseLimitInplace(std::vector<Float> *wave, const int base_sample_rate) {
     const int limiter_sample_rate = base_sample_rate * FLAGS_limiter_external_oversample * FLAGS_limiter_internal_oversample;
 
     float max_avilable_normalized_freq = 0.5;
@@ -186,12 +191,41 @@ void PhaseLimitInplace(std::vector<Float> *wave) {
         PrintMemoryUsage();
     }
 
+    if (FLAGS_limiter_segment_sec > 0) {
+        // 区間ごとに最適化する。全体を保持する必要があるもの
+        // (internal oversample, histogram, normalized evalとgradの出力) は非対応
+        if (FLAGS_limiter_internal_oversample != 1) {
+            throw std::logic_error("limiter_segment_sec does not support limiter_internal_oversample");
+        }
+        if (FLAGS_histogram) {
+            throw std::logic_error("limiter_segment_sec does not support histogram");
+        }
+        if (!FLAGS_grad_output.empty() || !FLAGS_limiting_error_spectrogram_output.empty()) {
+            throw std::logic_error("limiter_segment_sec does not support grad_output and limiting_error_spectrogram_output");
+        }
+        phase_limiter::Upsample(wave, 2, FLAGS_limiter_external_oversample);
+        Float *ptr_array[2];
+        ptr_array[0] = &(*wave)[0];
+        ptr_array[1] = &(*wave)[1];
+        phase_limiter::PhaseLimitSegmented(ptr_array, 2, wave->size() / 2, limiter_sample_rate, base_sample_rate * max_avilable_normalized_freq, FLAGS_limiter_segment_sec, FLAGS_max_iter1, FLAGS_max_iter2, 0, [](float progress) {
+            OutputProgression(0.3 + 0.7 * progress);
+        });
+        PrintMemoryUsage();
+        phase_limiter::Downsample(wave, 2, FLAGS_limiter_external_oversample);
+        std::cerr << "segmented limiting done" << std::endl;
+        return;
+    }
+
+    auto original_wave = *wave;
+
     phase_limiter::Upsample(wave, 2, FLAGS_limiter_external_oversample * FLAGS_limiter_internal_oversample);
     std::cerr << "upsampled" << std::endl;
     PrintMemoryUsage();
 
     {
         phase_limiter::GradCalculator<phase_limiter::DefaultSimdType> calculator(wave->size() / 2, limiter_sample_rate, base_sample_rate * max_avilable_normalized_freq, FLAGS_worker_count, FLAGS_noise_update_mode.c_str(), FLAGS_noise_update_min_noise, FLAGS_noise_update_initial_noise, FLAGS_noise_update_fista_enable_ratio, FLAGS_max_iter1, FLAGS_max_iter2, FLAGS_limiter_internal_oversample);
+        calculator.set_convergence_tolerance(FLAGS_limiter_convergence_eval_tolerance, FLAGS_limiter_convergence_peak_tolerance);
+        calculator.set_inactive_tolerance(FLAGS_limiter_inactive_tolerance);
         PrintMemoryUsage();
         if (FLAGS_histogram) {
             calculator.histogram = new std::vector<int>();
@@ -257,14 +291,14 @@ void PhaseLimitInplace(std::vector<Float> *wave) {
             Normalize(&grad);
 
             if (!FLAGS_grad_output.empty()) {
-                phase_limiter::SaveFloatWave(grad, FLAGS_grad_output);
+                phase_limiter::SaveFloatWave(grad, FLAGS_grad_output, 2, base_sample_rate);
             }
 
             if (!FLAGS_limiting_error_spectrogram_output.empty()) {
                 TemporaryFiles temporary_files(FLAGS_tmp);
                 std::string float_wav_filename = temporary_files.UniquePath(".wav");
                 bakuage::VectorMulConstantInplace(std::pow(10, FLAGS_limiting_error_spectrogram_gain / 20), grad.data(), grad.size());
-                phase_limiter::SaveFloatWave(grad, float_wav_filename);
+                phase_limiter::SaveFloatWave(grad, float_wav_filename, 2, base_sample_rate);
 
                 std::stringstream ss;
                 ss << "-lavfi showspectrumpic=scale=log:s=" << FLAGS_limiting_error_spectrogram_width << "x" << FLAGS_limiting_error_spectrogram_height;
@@ -277,11 +311,11 @@ void PhaseLimitInplace(std::vector<Float> *wave) {
 
 // シンプルなリミッター。あまり音質がよくない
 template <class Float>
-void SimpleLimitInplace(std::vector<Float> *wave) {
+void SimpleLimitInplace(std::vector<Float> *wave, const int sample_rate) {
 	const int frames = wave->size() / 2;
 	std::vector<Float> gains(frames, 1.0);
 	OutputProgression(0.3 + 0.7 * 0);
-	const int peak_half_window = (int)(44100 * 0.02);
+	const int peak_half_window = (int)(sample_rate * 0.02);
 	std::vector<Float> weights(peak_half_window + 1);
 	for (int i = 0; i <= peak_half_window; i++) {
 		weights[i] = 0.5 + 0.5 * std::cos(M_PI * i / peak_half_window);
@@ -383,7 +417,7 @@ std::string OutputFileExtension(const std::string &output_format) {
 }
 
 template <class Float>
-void EncodeAvoidingClipping(const std::string &input, const std::string &output, const std::string &temp, const std::string &output_format_options, std::vector<Float> *encoded_wave) {
+void EncodeAvoidingClipping(const std::string &input, const std::string &output, const std::string &temp, const std::string &output_format_options, int sample_rate, std::vector<Float> *encoded_wave) {
     const Float log2Threshold = std::log2(std::pow(10, FLAGS_ceiling / 20.0));
     const Float log2Resolution = std::log2(std::pow(10, 0.5 / 20.0));
     const int max_iter = 3;
@@ -399,7 +433,7 @@ void EncodeAvoidingClipping(const std::string &input, const std::string &output,
 		boost::filesystem::remove(temp);
 		FFMpeg::Execute(FLAGS_ffmpeg, output, temp, "-acodec pcm_f32le -ac 2 -f wav"); // not convert sample rate
         *encoded_wave = phase_limiter::LoadFloatWave<Float>(temp);
-        const auto ceiling_peak = std::pow(10, CalculateCeilingPeak(*encoded_wave, 2, FLAGS_sample_rate) / 20.0);
+        const auto ceiling_peak = std::pow(10, CalculateCeilingPeak(*encoded_wave, 2, sample_rate) / 20.0);
         const auto log2Peak = std::log2(ceiling_peak + 1e-37);
 
         if (log2Peak < log2Threshold - log2Resolution) {
@@ -418,6 +452,18 @@ void EncodeAvoidingClipping(const std::string &input, const std::string &output,
 	}
 }
 
+// 処理と出力のサンプルレート
+int ProcessingSampleRate(int input_sample_rate) {
+    if (FLAGS_sample_rate > 0) {
+        return FLAGS_sample_rate;
+    }
+    // MPEG-1 Layer IIIは48000まで
+    if (FLAGS_output_format == "mp3") {
+        return std::min(input_sample_rate, 48000);
+    }
+    return input_sample_rate;
+}
+
 void MainFunc() {
     typedef float Float;
 
@@ -436,31 +482,39 @@ void MainFunc() {
 	std::string float_wav_filename = temporary_files.UniquePath(".wav");
 	std::string float_wav_filename2 = temporary_files.UniquePath(".wav");
 
-	// 44100で処理
+	// 出力のサンプルレートで処理 (入力と同じなら変換しない)
     std::vector<Float> wave;
+    int input_sample_rate = 0;
     if (FLAGS_disable_input_encode) {
         // load wave in float
-        wave = phase_limiter::LoadFloatWave<Float>(FLAGS_input);
+        wave = phase_limiter::LoadFloatWave<Float>(FLAGS_input, &input_sample_rate);
         std::cerr << "load wave in float lap: " << stop_watch.time() << std::endl;
         PrintMemoryUsage();
     } else {
         // create normalized format wave
-        FFMpeg::Execute(FLAGS_ffmpeg, FLAGS_input, float_wav_filename, "-acodec pcm_f32le -ac 2 -ar 44100 -f wav");
+        FFMpeg::Execute(FLAGS_ffmpeg, FLAGS_input, float_wav_filename, "-acodec pcm_f32le -ac 2 -f wav"); // not convert sample rate
         std::cerr << "create normalized format wave lap: " << stop_watch.time() << std::endl;
         PrintMemoryUsage();
 
         // load wave in float
-        wave = phase_limiter::LoadFloatWave<Float>(float_wav_filename);
+        wave = phase_limiter::LoadFloatWave<Float>(float_wav_filename, &input_sample_rate);
         std::cerr << "load wave in float lap: " << stop_watch.time() << std::endl;
         PrintMemoryUsage();
     }
+    const int sample_rate = ProcessingSampleRate(input_sample_rate);
+    std::cerr << "input sample rate: " << input_sample_rate << "\tprocessing sample rate: " << sample_rate << std::endl;
+    if (sample_rate != input_sample_rate) {
+        phase_limiter::Resample(&wave, 2, input_sample_rate, sample_rate);
+        std::cerr << "resample lap: " << stop_watch.time() << std::endl;
+        PrintMemoryUsage();
+    }
 
 	// cut wave with margin
-	const int start_frame = std::max<int>(0, std::min<int>(wave.size() / 2, std::floor(44100 * FLAGS_start_at)));
+	const int start_frame = std::max<int>(0, std::min<int>(wave.size() / 2, std::floor(sample_rate * FLAGS_start_at)));
 	const int end_frame = std::max<int>(start_frame, std::min<int>(wave.size() / 2,
-		FLAGS_end_at < 0 ? wave.size() / 2 : std::floor(44100 * FLAGS_end_at)));
-	const int start_frame_with_margin = std::max<int>(start_frame - 0.5 * 44100, 0);
-	const int end_frame_with_margin = std::min<int>(end_frame + 0.5 * 44100, wave.size() / 2);
+		FLAGS_end_at < 0 ? wave.size() / 2 : std::floor(sample_rate * FLAGS_end_at)));
+	const int start_frame_with_margin = std::max<int>(start_frame - 0.5 * sample_rate, 0);
+	const int end_frame_with_margin = std::min<int>(end_frame + 0.5 * sample_rate, wave.size() / 2);
 	const int start_frame_in_margin = start_frame - start_frame_with_margin;
 	const int end_frame_in_margin = end_frame - start_frame_with_margin;
 	for (int i = start_frame_with_margin; i < end_frame_with_margin; i++) {
@@ -471,20 +525,20 @@ void MainFunc() {
 	wave.resize(2 * (end_frame_with_margin - start_frame_with_margin));
 
 	// 整える
-	phase_limiter::CutLowAndHighFreq(&wave, 2, FLAGS_low_cut_freq / 44100, FLAGS_high_cut_freq / 44100);
+	phase_limiter::CutLowAndHighFreq(&wave, 2, sample_rate, FLAGS_low_cut_freq, FLAGS_high_cut_freq);
 	std::cerr << "CutLowAndHighFreq lap: " << stop_watch.time() << std::endl;
     PrintMemoryUsage();
 
 	if (FLAGS_enhancement) {
 		std::cerr << "Enhance" << std::endl;
-		phase_limiter::Enhance(&wave, 2);
+		phase_limiter::Enhance(&wave, 2, sample_rate);
 		std::cerr << "Enhance lap: " << stop_watch.time() << std::endl;
         PrintMemoryUsage();
 	}
 
 	if (FLAGS_freq_expansion) {
 		std::cerr << "Freq Expansion" << std::endl;
-		phase_limiter::FreqExpand(&wave, 2, 44100, FLAGS_freq_expansion_ratio);
+		phase_limiter::FreqExpand(&wave, 2, sample_rate, FLAGS_freq_expansion_ratio);
 		std::cerr << "Freq Expansion lap: " << stop_watch.time() << std::endl;
         PrintMemoryUsage();
 	}
@@ -501,9 +555,12 @@ void MainFunc() {
 			std::vector<float> ir_left(2, 1);
 			std::vector<float> ir_right(2, 1);
 			if (FLAGS_mastering_reverb) {
+				std::stringstream ir_format_options_ss;
+				ir_format_options_ss << "-acodec pcm_f32le -ac 2 -ar " << sample_rate << " -f wav";
+				const std::string ir_format_options = ir_format_options_ss.str();
 				if (!FLAGS_mastering_reverb_ir.empty()) {
 					boost::filesystem::remove(float_wav_filename);
-					FFMpeg::Execute(FLAGS_ffmpeg, FLAGS_mastering_reverb_ir, float_wav_filename, "-acodec pcm_f32le -ac 2 -ar 44100 -f wav");
+					FFMpeg::Execute(FLAGS_ffmpeg, FLAGS_mastering_reverb_ir, float_wav_filename, ir_format_options);
 					std::vector<float> ir_mono_to_stereo = phase_limiter::LoadFloatWave<Float>(float_wav_filename);
 					ir_left.resize(ir_mono_to_stereo.size());
 					ir_right.resize(ir_mono_to_stereo.size());
@@ -514,31 +571,31 @@ void MainFunc() {
 				}
 				else {
 					boost::filesystem::remove(float_wav_filename);
-					FFMpeg::Execute(FLAGS_ffmpeg, FLAGS_mastering_reverb_ir_left, float_wav_filename, "-acodec pcm_f32le -ac 2 -ar 44100 -f wav");
+					FFMpeg::Execute(FLAGS_ffmpeg, FLAGS_mastering_reverb_ir_left, float_wav_filename, ir_format_options);
 					ir_left = phase_limiter::LoadFloatWave<Float>(float_wav_filename);
 					boost::filesystem::remove(float_wav_filename);
-					FFMpeg::Execute(FLAGS_ffmpeg, FLAGS_mastering_reverb_ir_right, float_wav_filename, "-acodec pcm_f32le -ac 2 -ar 44100 -f wav");
+					FFMpeg::Execute(FLAGS_ffmpeg, FLAGS_mastering_reverb_ir_right, float_wav_filename, ir_format_options);
 					ir_right = phase_limiter::LoadFloatWave<Float>(float_wav_filename);
 				}
 			}
 			const float *irs[2] = { ir_left.data(), ir_right.data() };
 			const int ir_lens[2] = { (int)ir_left.size() / 2, (int)ir_right.size() / 2 };
-			phase_limiter::AutoMastering(&wave, irs, ir_lens, 44100, [](float p) {
+			phase_limiter::AutoMastering(&wave, irs, ir_lens, sample_rate, [](float p) {
 				OutputProgression(0.3 * p);
 			});
 		}
 		else if (FLAGS_mastering_mode == "mastering2") {
-			phase_limiter::AutoMastering2(&wave, 44100, [](float p) {
+			phase_limiter::AutoMastering2(&wave, sample_rate, [](float p) {
 				OutputProgression(0.3 * p);
 			});
 		}
 		else if (FLAGS_mastering_mode == "mastering3") {
-			phase_limiter::AutoMastering3(&wave, 44100, [](float p) {
+			phase_limiter::AutoMastering3(&wave, sample_rate, [](float p) {
 				OutputProgression(0.3 * p);
 			});
 		}
         else if (FLAGS_mastering_mode == "mastering5") {
-            phase_limiter::AutoMastering5(&wave, 44100, [](float p) {
+            phase_limiter::AutoMastering5(&wave, sample_rate, [](float p) {
                 OutputProgression(0.3 * p);
             });
         }
@@ -551,7 +608,7 @@ void MainFunc() {
     }
 
 	// 整える
-	phase_limiter::CutLowAndHighFreq(&wave, 2, FLAGS_low_cut_freq / 44100, FLAGS_high_cut_freq / 44100);
+	phase_limiter::CutLowAndHighFreq(&wave, 2, sample_rate, FLAGS_low_cut_freq, FLAGS_high_cut_freq);
 	std::cerr << "CutLowAndHighFreq lap: " << stop_watch.time() << std::endl;
     PrintMemoryUsage();
 
@@ -566,26 +623,26 @@ void MainFunc() {
         if (FLAGS_output_format == "aac") { // remove priming
             wave.erase(wave.begin(), wave.begin() + std::min<int>(1024 * 2, wave.size() - 2));
         }
-		phase_limiter::SaveFloatWave(wave, float_wav_filename);
+		phase_limiter::SaveFloatWave(wave, float_wav_filename, 2, sample_rate);
 		EncodeAvoidingClipping(float_wav_filename, encoded_filename, float_wav_filename2, FFMpegOutputFormatOptions(
 			FLAGS_output_format,
 			FLAGS_bit_depth,
 			2,
-			44100
-		), &wave);
+			sample_rate
+		), sample_rate, &wave);
 		std::cerr << "pre-encode lap: " << stop_watch.time() << std::endl;
         PrintMemoryUsage();
 	}
 
     // pre-compression
     if (FLAGS_pre_compression) {
-        phase_limiter::PreCompress(&wave, 44100);
+        phase_limiter::PreCompress(&wave, sample_rate);
 		std::cerr << "pre-compression lap: " << stop_watch.time() << std::endl;
         PrintMemoryUsage();
     }
 
 	// 整える
-	phase_limiter::CutLowAndHighFreq(&wave, 2, FLAGS_low_cut_freq / 44100, FLAGS_high_cut_freq / 44100);
+	phase_limiter::CutLowAndHighFreq(&wave, 2, sample_rate, FLAGS_low_cut_freq, FLAGS_high_cut_freq);
 	std::cerr << "pre-CutLowAndHighFreq lap: " << stop_watch.time() << std::endl;
     PrintMemoryUsage();
 
@@ -596,18 +653,18 @@ void MainFunc() {
 
 	// save just after pre-compression
 	if (!FLAGS_output_after_pre_compression.empty()) {
-		const bool clip_detect = FLAGS_output_format != "wav" || FLAGS_sample_rate != 44100;
-		phase_limiter::SaveFloatWave(wave, float_wav_filename);
+		const bool clip_detect = FLAGS_output_format != "wav";
+		phase_limiter::SaveFloatWave(wave, float_wav_filename, 2, sample_rate);
 		std::stringstream options;
 		options << FFMpegOutputFormatOptions(
 			FLAGS_output_format,
 			FLAGS_bit_depth,
 			2,
-			44100
+			sample_rate
 		);
 		if (clip_detect) {
 			std::cerr << "clip detect enabled" << std::endl;
-			EncodeAvoidingClipping(float_wav_filename, encoded_filename, float_wav_filename2, options.str(), &wave);
+			EncodeAvoidingClipping(float_wav_filename, encoded_filename, float_wav_filename2, options.str(), sample_rate, &wave);
 		}
 		else {
 			std::cerr << "clip detect disabled" << std::endl;
@@ -623,9 +680,6 @@ void MainFunc() {
 		std::cout << "output_after_pre_compression" << std::endl;
 	}
 
-	// 44100で処理
-	// phase_limiter::Downsample(&wave, 2, 2);
-
     // calculate gain
     Float gain = 0;
     if (FLAGS_reference_mode == "loudness") {
@@ -633,7 +687,7 @@ void MainFunc() {
         Float loudness;
         std::vector<int> histogram;
         bakuage::loudness_ebu_r128::CalculateLoudness(wave.data(),
-            2, wave.size() / 2, 44100,
+            2, wave.size() / 2, sample_rate,
             &loudness, &histogram);
         gain = FLAGS_reference - loudness;
     }
@@ -641,7 +695,7 @@ void MainFunc() {
         // calculate loudness
         Float loudness;
         std::vector<int> histogram;
-        bakuage::loudness_ebu_r128::CalculateLoudnessCore<Float>(wave.data(), 2, wave.size() / 2, 44100,
+        bakuage::loudness_ebu_r128::CalculateLoudnessCore<Float>(wave.data(), 2, wave.size() / 2, sample_rate,
                                                                  3, 0.1, -70, -10, nullptr, nullptr, &histogram, nullptr, nullptr, true, &loudness);
         gain = FLAGS_reference - loudness;
     }
@@ -688,10 +742,10 @@ void MainFunc() {
     // phase limiting
 	if (need_limiting) {
 		if (FLAGS_limiting_mode == "phase") {
-			PhaseLimitInplace(&wave);
+			PhaseLimitInplace(&wave, sample_rate);
 		}
 		else if (FLAGS_limiting_mode == "simple") {
-			SimpleLimitInplace(&wave);
+			SimpleLimitInplace(&wave, sample_rate);
 		}
 		else {
 			throw std::logic_error("unknown limiting mode: " + FLAGS_limiting_mode);
@@ -714,7 +768,7 @@ void MainFunc() {
 
     // 強制的にceilingに収める
     {
-        const auto ceiling_peak_db = CalculateCeilingPeak(wave, 2, 44100);
+        const auto ceiling_peak_db = CalculateCeilingPeak(wave, 2, sample_rate);
         if (ceiling_peak_db > FLAGS_ceiling) {
             bakuage::VectorMulConstantInplace(std::pow(10, (FLAGS_ceiling - ceiling_peak_db) / 20.0), wave.data(), wave.size());
         }
@@ -722,17 +776,17 @@ void MainFunc() {
 
     // save
 	{
-		const bool clip_detect = FLAGS_output_format != "wav" || FLAGS_sample_rate != 44100;
+		const bool clip_detect = FLAGS_output_format != "wav";
         if (FLAGS_output_format == "aac") { // remove priming
             wave.erase(wave.begin(), wave.begin() + std::min<int>(1024 * 2, wave.size() - 2));
         }
-		phase_limiter::SaveFloatWave(wave, float_wav_filename);
+		phase_limiter::SaveFloatWave(wave, float_wav_filename, 2, sample_rate);
 		std::stringstream options;
 		options << FFMpegOutputFormatOptions(
 			FLAGS_output_format,
 			FLAGS_bit_depth,
 			2,
-			FLAGS_sample_rate
+			sample_rate
 		);
 		// 無視されるっぽい
 		/* << FormatMetadata("bakuage_version", Version())
@@ -740,7 +794,7 @@ void MainFunc() {
 		<< FormatMetadata("bakuage_reference_mode", FLAGS_reference_mode)*/;
 		if (clip_detect) {
 			std::cerr << "clip detect enabled" << std::endl;
-			EncodeAvoidingClipping(float_wav_filename, encoded_filename, float_wav_filename2, options.str(), &wave);
+			EncodeAvoidingClipping(float_wav_filename, encoded_filename, float_wav_filename2, options.str(), sample_rate, &wave);
 		}
 		else {
 			std::cerr << "clip detect disabled" << std::endl;
@@ -760,7 +814,12 @@ void MainFunc() {
 
 void TestGrad();
 void TestGradCalculator();
+void TestGradCalculatorOversample();
+void TestGradCalculatorConvergence();
+void TestGradCalculatorInactive();
 void TestPerfectHashPowerOf2();
+void TestGatedMeanCov();
+void TestMastering3ThreadCount();
 
 int main(int argc, char* argv[]) {
     int exit_status = 0;
@@ -789,8 +848,18 @@ int main(int argc, char* argv[]) {
             TestGrad();
         } else if (FLAGS_test_mode == "grad_calculator") {
             TestGradCalculator();
+        } else if (FLAGS_test_mode == "grad_calculator_oversample") {
+            TestGradCalculatorOversample();
+        } else if (FLAGS_test_mode == "grad_calculator_convergence") {
+            TestGradCalculatorConvergence();
+        } else if (FLAGS_test_mode == "grad_calculator_inactive") {
+            TestGradCalculatorInactive();
         } else if (FLAGS_test_mode == "perfect_hash_power_of_2") {
             TestPerfectHashPowerOf2();
+        } else if (FLAGS_test_mode == "gated_mean_cov") {
+            TestGatedMeanCov();
+        } else if (FLAGS_test_mode == "mastering3_thread_count") {
+            TestMastering3ThreadCount();
         } else {
             MainFunc();
         }
@@ -0,0 +1,140 @@
+#include "phase_limiter/phase_limit.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include "gflags/gflags.h"
+#include "phase_limiter/GradCalculator.h"
+
+DECLARE_int32(worker_count);
+DECLARE_bool(erb_eval_func_weighting);
+DECLARE_bool(perf_src_cache);
+DECLARE_double(absolute_min_noise);
+DECLARE_string(noise_update_mode);
+DECLARE_double(noise_update_min_noise);
+DECLARE_double(noise_update_initial_noise);
+DECLARE_double(noise_update_fista_enable_ratio);
+DECLARE_double(limiter_convergence_eval_tolerance);
+DECLARE_double(limiter_convergence_peak_tolerance);
+DECLARE_double(limiter_inactive_tolerance);
+
+namespace phase_limiter {
+
+void PhaseLimit(std::vector<float> *_wave, const int sample_rate, const double max_available_freq, int max_iter1, int max_iter2, double max_sec, const std::function<void (float)> &progress_callback) {
+    auto &wave = *_wave;
+    if (wave.size() % 2) {
+        throw std::logic_error("input wave length must be multiple of channels");
+    }
+    const int frames = wave.size() / 2;
+    if (frames == 0) {
+        progress_callback(1);
+        return;
+    }
+
+    // main() で設定しているものと同じ
+    GradCoreSettings::GetInstance().set_erb_eval_func_weighting(FLAGS_erb_eval_func_weighting);
+    GradCoreSettings::GetInstance().set_src_cache(FLAGS_perf_src_cache);
+    GradCoreSettings::GetInstance().set_absolute_min_noise(FLAGS_absolute_min_noise);
+
+    GradCalculator<DefaultSimdType> calculator(frames, sample_rate, max_available_freq, FLAGS_worker_count, FLAGS_noise_update_mode.c_str(), FLAGS_noise_update_min_noise, FLAGS_noise_update_initial_noise, FLAGS_noise_update_fista_enable_ratio, max_iter1, max_iter2, 1);
+    calculator.set_max_sec(max_sec);
+    calculator.set_convergence_tolerance(FLAGS_limiter_convergence_eval_tolerance, FLAGS_limiter_convergence_peak_tolerance);
+    calculator.set_inactive_tolerance(FLAGS_limiter_inactive_tolerance);
+
+    float *ptr_array[2];
+    ptr_array[0] = &wave[0];
+    ptr_array[1] = &wave[1];
+    calculator.copyWaveSrcFrom(ptr_array, 2);
+    const auto unit_eval = calculator.outputUnitEval("src_with_cut"); // waveSrcとwaveOutを汚染
+    calculator.copyWaveSrcFrom(ptr_array, 2);
+
+    calculator.optimizeWithProgressCallback([&progress_callback](double progress) {
+        progress_callback(progress);
+    }, unit_eval);
+
+    calculator.copyWaveProxTo(ptr_array, 2);
+}
+
+void PhaseLimitSegmented(float *const *channels, int stride, int frames, const int sample_rate, const double max_available_freq, double segment_sec, int max_iter1, int max_iter2, double max_sec, const std::function<void (float)> &progress_callback) {
+    if (frames <= 0) {
+        progress_callback(1);
+        return;
+    }
+
+    // 区間の外側の余白 (この長さより離れたサンプルは評価関数で干渉しない)
+    const int margin = PL_FFT_MAX_LEN * GradFftLenScale(sample_rate);
+    // つなぎ目のクロスフェード長 (区間境界を中心とする)
+    const int fade = margin / 2;
+
+    int segment_count = 1;
+    if (segment_sec > 0) {
+        const double segment_frames = std::max<double>(2 * fade, segment_sec * sample_rate);
+        // 丸めるので各区間はsegment_framesの0.75倍以上 (> fade) になる
+        segment_count = std::max<int>(1, std::round(frames / segment_frames));
+    }
+    const auto boundary = [frames, segment_count](int k) {
+        return (int)((int64_t)frames * k / segment_count);
+    };
+
+    std::vector<float> fade_in(fade);
+    for (int i = 0; i < fade; i++) {
+        fade_in[i] = 0.5 - 0.5 * std::cos(M_PI * (i + 0.5) / fade);
+    }
+
+    std::vector<float> segment;
+    std::vector<float> head_src; // 次の区間の入力のうち、この区間の出力で上書きされる部分の原音
+    std::vector<float> tail; // 次の区間とクロスフェードするために保留しているこの区間の出力
+    for (int k = 0; k < segment_count; k++) {
+        const bool last = k == segment_count - 1;
+        const int center_bg = boundary(k);
+        const int center_ed = boundary(k + 1);
+        // 出力する範囲 [keep_bg, keep_ed)、最初と最後のfadeサンプルは隣の区間とクロスフェード
+        const int keep_bg = k == 0 ? 0 : center_bg - fade / 2;
+        const int keep_ed = last ? frames : center_ed + fade / 2;
+        // 最適化する範囲
+        const int src_bg = std::max(0, keep_bg - margin);
+        const int src_ed = std::min(frames, keep_ed + margin);
+
+        // [src_bg, keep_bg) は前の区間の出力で上書き済みなのでhead_srcから読む
+        segment.resize(2 * (src_ed - src_bg));
+        for (int i = src_bg; i < src_ed; i++) {
+            for (int c = 0; c < 2; c++) {
+                segment[2 * (i - src_bg) + c] = i < keep_bg ? head_src[2 * (i - src_bg) + c] : channels[c][stride * i];
+            }
+        }
+        if (!last) {
+            const int next_keep_bg = center_ed - fade / 2;
+            const int next_src_bg = std::max(0, next_keep_bg - margin);
+            head_src.assign(segment.begin() + 2 * (next_src_bg - src_bg), segment.begin() + 2 * (next_keep_bg - src_bg));
+        }
+
+        const double segment_ratio = (double)(center_ed - center_bg) / frames;
+        PhaseLimit(&segment, sample_rate, max_available_freq, max_iter1, max_iter2, max_sec * segment_ratio, [&progress_callback, center_bg, center_ed, frames](float progress) {
+            progress_callback((center_bg + progress * (center_ed - center_bg)) / frames);
+        });
+
+        // 両方の区間の出力が±1以下なので、クロスフェード(凸結合)しても±1以下
+        const int tail_bg = last ? keep_ed : keep_ed - fade;
+        std::vector<float> next_tail(2 * (keep_ed - tail_bg));
+        for (int i = keep_bg; i < keep_ed; i++) {
+            for (int c = 0; c < 2; c++) {
+                float x = segment[2 * (i - src_bg) + c];
+                if (k > 0 && i < keep_bg + fade) {
+                    const float w = fade_in[i - keep_bg];
+                    x = w * x + (1 - w) * tail[2 * (i - keep_bg) + c];
+                }
+                if (i < tail_bg) {
+                    channels[c][stride * i] = x;
+                } else {
+                    next_tail[2 * (i - tail_bg) + c] = x;
+                }
+            }
+        }
+        tail.swap(next_tail);
+    }
+    progress_callback(1);
+}
+
+}
@@ -0,0 +1,27 @@
+#ifndef PHASE_LIMITER_PHASE_LIMIT_H_
+#define PHASE_LIMITER_PHASE_LIMIT_H_
+
+#include <functional>
+#include <vector>
+
+namespace phase_limiter {
+    // main.cpp の PhaseLimitInplace (外部/内部oversampleなし) をライブラリとして使えるようにしたもの
+    // _wave はステレオのインターリーブで、ceilingを1に正規化済みであること
+    // max_iter1, max_iter2 はFISTAの外側ループとline searchの反復回数上限、
+    // max_sec は最適化の時間制限 (0以下で無制限)
+    // noise_update_*, limiter_convergence_*, worker_count と GradCoreSettings の値 (erb_eval_func_weighting など) は FLAGS から読む
+    // sample_rate は任意 (評価関数の窓長はGradFftLenScaleでsample_rateから決まる)
+    // max_available_freq (Hz) より上の誤差は評価しない (外部oversample時は元のナイキスト周波数を渡す)
+    void PhaseLimit(std::vector<float> *_wave, const int sample_rate, const double max_available_freq, int max_iter1, int max_iter2, double max_sec, const std::function<void (float)> &progress_callback);
+
+    // PhaseLimit を segment_sec 秒ごとの区間に分けて行う (長い入力用)
+    // 各区間は両側に fft_max_len() の余白を付けて最適化し、つなぎ目はクロスフェードする
+    // GradCalculator のメモリ使用量はトラック長ではなく区間長に比例する
+    // channels[c][stride * i] がチャンネルcのi番目のサンプル (ステレオのみ)
+    // segment_sec が0以下のときは全体を一つの区間として処理する
+    // max_sec はトラック全体の時間制限で、各区間に長さに比例して割り振る
+    // max_available_freq は PhaseLimit と同じ
+    void PhaseLimitSegmented(float *const *channels, int stride, int frames, const int sample_rate, const double max_available_freq, double segment_sec, int max_iter1, int max_iter2, double max_sec, const std::function<void (float)> &progress_callback);
+}
+
+#endif
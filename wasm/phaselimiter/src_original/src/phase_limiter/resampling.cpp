@@ -1,10 +1,12 @@
 #include "phase_limiter/resampling.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <stdexcept>
-#include "bakuage/fir_filter2.h"
 #include "bakuage/fir_design.h"
 #include "bakuage/memory.h"
+#include "bakuage/polyphase_resampler.h"
 #include "bakuage/vector_math.h"
 
 namespace {
@@ -53,77 +55,136 @@ namespace phase_limiter{
         }
     }
     
+    namespace {
+        // transition_width: normalized freq of the upsampled rate
+        std::vector<double> CalcOversampleFir(int n, double cutoff_margin) {
+            const double transition_width = 20.0 / 44100 / n; // normalized freq
+            const double stopband_reduce_db = 140; // dB
+            int filter_len;
+            double alpha;
+            bakuage::CalcKeiserFirParams(stopband_reduce_db, transition_width, &filter_len, &alpha);
+            return bakuage::CalculateBandPassFir<double>(0, 0.5 / n - cutoff_margin * transition_width, filter_len, alpha);
+        }
+    }
+    
+    // ゼロ詰めしたn倍の長さのバッファを作らずに、ポリフェーズで必要な出力だけ計算する
+    // (フィルタが長いのでFFTでたたみこむ。ブロックごとに処理するので一時バッファはブロック長)
     void Upsample(std::vector<float> *wave, int channels, int n) {
         if (n == 1) return;
         
         if (wave->size() % channels) {
             throw std::logic_error("input wave length must be multiple of channels");
         }
-        int src_length = wave->size() / channels;
-        int dest_length = src_length * n;
-        wave->resize(channels * dest_length);
-        
-        const double transition_width = 20.0 / 44100 / n; // normalized freq
-        const double stopband_reduce_db = 140; // dB
-        int filter_len;
-        double alpha;
-        bakuage::CalcKeiserFirParams(stopband_reduce_db, transition_width, &filter_len, &alpha);
+        const int src_length = wave->size() / channels;
+        const int dest_length = src_length * n;
         
         // UpsampleフィルタはDownsampleよりもカットオフ周波数を低くする
-        const auto fir = bakuage::CalculateBandPassFir<double>(0, 0.5 / n - 2 * transition_width, filter_len, alpha);
-        bakuage::FirFilter2<float> fir_filter(fir.begin(), fir.end());
-        const int delay_samples = filter_len / 2;
-        bakuage::AlignedPodVector<float> temp_input(dest_length + delay_samples);
-        bakuage::AlignedPodVector<float> temp_output(dest_length + delay_samples);
-        for (int ch = 0; ch < channels; ch++) {
-            fir_filter.Clear();
-            for (int i = 0; i < src_length; i++) {
-                temp_input[n * i] = (*wave)[channels * i + ch] * n;
+        const auto fir = CalcOversampleFir(n, 2);
+        const int delay_samples = fir.size() / 2;
+        bakuage::PolyphaseFftUpsampler<float> upsampler(n, channels, fir);
+        const int block_frames = upsampler.block_frames();
+        
+        std::vector<float> src;
+        src.swap(*wave);
+        wave->resize(channels * dest_length);
+        bakuage::AlignedPodVector<float> input(channels * block_frames);
+        bakuage::AlignedPodVector<float> output(channels * block_frames * n);
+        for (int bg = 0; n * bg < dest_length + delay_samples; bg += block_frames) {
+            const int input_frames = std::max(0, std::min(block_frames, src_length - bg));
+            if (input_frames > 0) {
+                bakuage::TypedMemcpy(input.data(), src.data() + channels * bg, channels * input_frames);
             }
-            fir_filter.Clock(temp_input.data(), temp_input.data() + dest_length + delay_samples, temp_output.data());
-            for (int i = 0; i < dest_length; i++) {
-                (*wave)[channels * i + ch] = temp_output[i + delay_samples];
+            bakuage::TypedFillZero(input.data() + channels * input_frames, channels * (block_frames - input_frames));
+            upsampler.ProcessBlock(input.data(), output.data());
+            
+            // output[i]はupsample後の位置n * bg + i
+            const int out_bg = std::max(0, delay_samples - n * bg);
+            const int out_ed = std::min(n * block_frames, dest_length + delay_samples - n * bg);
+            if (out_bg < out_ed) {
+                bakuage::TypedMemcpy(wave->data() + channels * (n * bg + out_bg - delay_samples), output.data() + channels * out_bg, channels * (out_ed - out_bg));
             }
         }
     }
-
+    
+    // n - 1個おきに捨てる出力は計算しない (ポリフェーズ)。waveをその場で書き換える
     void Downsample(std::vector<float> *wave, int channels, int n) {
         if (n == 1) return;
         
         if (wave->size() % channels) {
             throw std::logic_error("input wave length must be multiple of channels");
         }
-        int src_length = wave->size() / channels;
+        const int src_length = wave->size() / channels;
         if (src_length % n) {
             throw std::logic_error("src_length must be multiple of n");
         }
-        int dest_length = src_length / n;
+        const int dest_length = src_length / n;
         
-        {
-            const double transition_width = 20.0 / 44100 / n; // normalized freq
-            const double stopband_reduce_db = 140; // dB
-            int filter_len;
-            double alpha;
-            bakuage::CalcKeiserFirParams(stopband_reduce_db, transition_width, &filter_len, &alpha);
+        const auto fir = CalcOversampleFir(n, 1);
+        const int delay_samples = fir.size() / 2;
+        bakuage::PolyphaseFftDownsampler<float> downsampler(n, channels, fir);
+        const int block_frames = downsampler.block_frames();
+        
+        // 先頭にzeros個の0を足して、downsamplerの出力q (位置n * q + n - 1) が
+        // 元の位置n * m + delay_samples (m = q - q_offset) に揃うようにする
+        const int zeros = ((n - 1 - delay_samples) % n + n) % n;
+        const int q_offset = (delay_samples + zeros - (n - 1)) / n;
+        
+        bakuage::AlignedPodVector<float> input(channels * block_frames * n);
+        bakuage::AlignedPodVector<float> output(channels * block_frames);
+        for (int bg = 0; bg < dest_length + q_offset; bg += block_frames) {
+            // 入力の位置 (0を足した後) はn * bg ~
+            const int src_bg = n * bg - zeros;
+            const int copy_bg = std::max(0, -src_bg);
+            const int copy_ed = std::max(copy_bg, std::min(n * block_frames, src_length - src_bg));
+            bakuage::TypedFillZero(input.data(), input.size());
+            if (copy_bg < copy_ed) {
+                bakuage::TypedMemcpy(input.data() + channels * copy_bg, wave->data() + channels * (src_bg + copy_bg), channels * (copy_ed - copy_bg));
+            }
+            downsampler.ProcessBlock(input.data(), output.data());
             
-            const auto fir = bakuage::CalculateBandPassFir<double>(0, 0.5 / n - transition_width, filter_len, alpha);
-            bakuage::FirFilter2<float> fir_filter(fir.begin(), fir.end());
-            const int delay_samples = filter_len / 2;
-            bakuage::AlignedPodVector<float> temp_input(src_length + delay_samples);
-            bakuage::AlignedPodVector<float> temp_output(src_length + delay_samples);
-            for (int ch = 0; ch < channels; ch++) {
-                fir_filter.Clear();
-                for (int i = 0; i < src_length; i++) {
-                    temp_input[i] = (*wave)[channels * i + ch];
-                }
-                fir_filter.Clock(temp_input.data(), temp_input.data() + src_length + delay_samples, temp_output.data());
-                for (int i = 0; i < dest_length; i++) {
-                    (*wave)[channels * i + ch] = temp_output[i * n + delay_samples];
-                }
+            // 出力位置mは読み終わった入力位置より前なので、その場で書いて良い
+            const int out_bg = std::max(0, q_offset - bg);
+            const int out_ed = std::min(block_frames, dest_length + q_offset - bg);
+            if (out_bg < out_ed) {
+                bakuage::TypedMemcpy(wave->data() + channels * (bg + out_bg - q_offset), output.data() + channels * out_bg, channels * (out_ed - out_bg));
             }
         }
-
+        
         wave->resize(channels * dest_length);
     }
+    
+    void Resample(std::vector<float> *wave, int channels, int src_sample_rate, int dest_sample_rate) {
+        if (src_sample_rate == dest_sample_rate) return;
+        
+        if (wave->size() % channels) {
+            throw std::logic_error("input wave length must be multiple of channels");
+        }
+        const int src_length = wave->size() / channels;
+        int up, down;
+        bakuage::PolyphaseResampler<float>::CalcFactors(src_sample_rate, dest_sample_rate, &up, &down);
+        const int dest_length = ((int64_t)src_length * up + down - 1) / down;
+        
+        // 低い方のナイキスト周波数以上で120dB減衰、遷移帯域2050Hz (bakuage::FirResampleFilterと同じ)
+        const auto fir = bakuage::PolyphaseResampler<float>::DesignFir(src_sample_rate, dest_sample_rate, 120, 2050);
+        bakuage::PolyphaseResampler<float> resampler(up, down, channels, fir, fir.size() / 2);
+        
+        const int chunk_frames = 1 << 16;
+        std::vector<float> dest(channels * dest_length);
+        bakuage::AlignedPodVector<float> input(channels * chunk_frames);
+        bakuage::AlignedPodVector<float> output(channels * resampler.MaxOutputFrames(chunk_frames));
+        int dest_pos = 0;
+        for (int bg = 0; dest_pos < dest_length; bg += chunk_frames) {
+            // 末尾は0を入れて遅延分を出し切る
+            const int input_frames = std::max(0, std::min(chunk_frames, src_length - bg));
+            if (input_frames > 0) {
+                bakuage::TypedMemcpy(input.data(), wave->data() + channels * bg, channels * input_frames);
+            }
+            bakuage::TypedFillZero(input.data() + channels * input_frames, channels * (chunk_frames - input_frames));
+            const int output_frames = std::min(resampler.Process(input.data(), chunk_frames, output.data()), dest_length - dest_pos);
+            bakuage::TypedMemcpy(dest.data() + channels * dest_pos, output.data(), channels * output_frames);
+            dest_pos += output_frames;
+        }
+        wave->swap(dest);
+    }
 
 }
@@ -10,6 +10,9 @@ namespace phase_limiter {
     void Upsample(std::vector<float> *wave, int channels, int n);
     // downsample n -> 1
     void Downsample(std::vector<float> *wave, int channels, int n);
+    // src_sample_rate -> dest_sample_rate (rational, e.g. 48000 <-> 44100)
+    // output length: ceil(input length * dest_sample_rate / src_sample_rate)
+    void Resample(std::vector<float> *wave, int channels, int src_sample_rate, int dest_sample_rate);
 }
 
 #endif
@@ -0,0 +1,69 @@
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "gflags/gflags.h"
+#include "tbb/tbb.h"
+#include "phase_limiter/auto_mastering.h"
+
+DECLARE_int32(mastering3_iteration);
+DECLARE_int32(worker_count);
+
+namespace {
+    int CountDiff(const char *name, const std::vector<float> &a, const std::vector<float> &b) {
+        if (a != b) {
+            std::cerr << "TestMastering3ThreadCount " << name << " differs" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+}
+
+// スレッド数を変えてもGetMastering3OptimumParamsの結果が完全に一致することの確認
+void TestMastering3ThreadCount() {
+    const int sample_rate = 44100;
+    const int frames = sample_rate * 10;
+    std::vector<float> wave(2 * frames);
+    std::mt19937 engine(1);
+    std::normal_distribution<float> dist;
+    float lowpass[2] = { 0, 0 };
+    for (int i = 0; i < frames; i++) {
+        // 低域寄りのノイズ + 1秒ごとに音量が変わるサイン波
+        const float env = 0.1 + 0.05 * (i / sample_rate % 3);
+        const float tone = env * std::sin(2 * M_PI * 220 * i / sample_rate);
+        for (int ch = 0; ch < 2; ch++) {
+            lowpass[ch] = 0.95 * lowpass[ch] + 0.05 * dist(engine);
+            wave[2 * i + ch] = tone + 0.3 * lowpass[ch];
+        }
+    }
+
+    const int original_iteration = FLAGS_mastering3_iteration;
+    FLAGS_mastering3_iteration = 200;
+
+    phase_limiter::Mastering3OptimumParams params[2];
+    const int thread_counts[2] = { 1, 4 };
+    for (int i = 0; i < 2; i++) {
+        tbb::task_scheduler_init tbb_init(thread_counts[i]);
+        params[i] = phase_limiter::GetMastering3OptimumParams(wave, sample_rate, [](float) {});
+    }
+
+    FLAGS_mastering3_iteration = original_iteration;
+    tbb::task_scheduler_init tbb_init(FLAGS_worker_count ? FLAGS_worker_count : tbb::task_scheduler_init::default_num_threads());
+
+    int error_count = 0;
+    if (params[0].comp_band_count != params[1].comp_band_count) {
+        std::cerr << "TestMastering3ThreadCount comp_band_count differs" << std::endl;
+        error_count++;
+    }
+    error_count += CountDiff("compressor_ratios", params[0].compressor_ratios, params[1].compressor_ratios);
+    error_count += CountDiff("compressor_thresholds", params[0].compressor_thresholds, params[1].compressor_thresholds);
+    error_count += CountDiff("compressor_wets", params[0].compressor_wets, params[1].compressor_wets);
+    error_count += CountDiff("compressor_gains", params[0].compressor_gains, params[1].compressor_gains);
+    if (params[0].compressor_mean_energies != params[1].compressor_mean_energies) {
+        std::cerr << "TestMastering3ThreadCount compressor_mean_energies differs" << std::endl;
+        error_count++;
+    }
+
+    std::cerr << "TestMastering3ThreadCount finished comp_band_count:" << params[0].comp_band_count
+        << " errors:" << error_count << std::endl;
+}
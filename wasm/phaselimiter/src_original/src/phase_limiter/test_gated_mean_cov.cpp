@@ -0,0 +1,99 @@
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "gated_mean_cov.h"
+
+namespace {
+    // auto_mastering5の元の実装 (ブロックごとのループ)
+    void NaiveGatedMeanCov(const phase_limiter::GatedMeanCov &kernel, Eigen::VectorXd *mean, Eigen::MatrixXd *cov) {
+        const int dim = kernel.dim();
+        const int blocks = kernel.block_count();
+        std::vector<double> thresholds(dim);
+        mean->resize(dim);
+        cov->resize(dim, dim);
+        for (int d = 0; d < dim; d++) {
+            double sum = 0;
+            for (int i = 0; i < blocks; i++) sum += kernel.row(d)[i];
+            thresholds[d] = sum / blocks - 20;
+            double count = 0;
+            sum = 0;
+            for (int i = 0; i < blocks; i++) {
+                const bool valid = kernel.row(d)[i] >= thresholds[d];
+                count += valid;
+                sum += valid ? kernel.row(d)[i] : 0;
+            }
+            (*mean)[d] = sum / (1e-37 + count);
+        }
+        for (int d1 = 0; d1 < dim; d1++) {
+            for (int d2 = 0; d2 < dim; d2++) {
+                double v = 0;
+                double c = 0;
+                for (int i = 0; i < blocks; i++) {
+                    const double x1 = kernel.row(d1)[i];
+                    const double x2 = kernel.row(d2)[i];
+                    const bool valid = (x1 >= thresholds[d1]) & (x2 >= thresholds[d2]);
+                    v += valid * (x1 - (*mean)[d1]) * (x2 - (*mean)[d2]);
+                    c += valid;
+                }
+                (*cov)(d1, d2) = v / (1e-37 + c);
+            }
+        }
+    }
+
+    double MaxDiff(const Eigen::MatrixXd &a, const Eigen::MatrixXd &b) {
+        return (a - b).cwiseAbs().maxCoeff();
+    }
+}
+
+void TestGatedMeanCov() {
+    std::mt19937 engine(1);
+    std::normal_distribution<float> dist(-30, 10);
+    int error_count = 0;
+
+    for (const int dim : { 1, 2, 18, 80 }) {
+        for (const int blocks : { 1, 7, 400 }) {
+            phase_limiter::GatedMeanCov kernel(dim, blocks);
+            for (int d = 0; d < dim; d++) {
+                for (int i = 0; i < blocks; i++) {
+                    // 無音ブロック (ゲートで除外される) を混ぜる
+                    kernel.row(d)[i] = i % 5 == 0 ? -120 : dist(engine);
+                }
+            }
+            kernel.Calculate();
+
+            Eigen::VectorXd mean;
+            Eigen::MatrixXd cov;
+            NaiveGatedMeanCov(kernel, &mean, &cov);
+            const double mean_diff = (mean - kernel.mean()).cwiseAbs().maxCoeff();
+            const double cov_diff = MaxDiff(cov, kernel.cov());
+            if (mean_diff > 1e-4 || cov_diff > 1e-3) {
+                std::cerr << "TestGatedMeanCov full error dim:" << dim << " blocks:" << blocks
+                << " mean_diff:" << mean_diff << " cov_diff:" << cov_diff << std::endl;
+                error_count++;
+            }
+
+            // 一部の次元だけ変えて差分更新とフル計算が一致すること
+            std::vector<int> dims;
+            for (int d = 0; d < dim; d += 7) {
+                dims.push_back(d);
+                for (int i = 0; i < blocks; i++) {
+                    kernel.row(d)[i] = dist(engine);
+                }
+            }
+            kernel.Recalculate(dims);
+            const Eigen::VectorXd incremental_mean = kernel.mean();
+            const Eigen::MatrixXd incremental_cov = kernel.cov();
+            kernel.Calculate();
+            const double inc_mean_diff = (incremental_mean - kernel.mean()).cwiseAbs().maxCoeff();
+            const double inc_cov_diff = MaxDiff(incremental_cov, kernel.cov());
+            if (inc_mean_diff > 1e-6 || inc_cov_diff > 1e-3) {
+                std::cerr << "TestGatedMeanCov incremental error dim:" << dim << " blocks:" << blocks
+                << " mean_diff:" << inc_mean_diff << " cov_diff:" << inc_cov_diff << std::endl;
+                error_count++;
+            }
+        }
+    }
+
+    std::cerr << "TestGatedMeanCov finished errors:" << error_count << std::endl;
+}
@@ -1,9 +1,13 @@
 #include <vector>
 #include <iostream>
 #include <random>
+#include "gflags/gflags.h"
 #include "bakuage/memory.h"
 #include "bakuage/utils.h"
 #include "GradCalculator.h"
+#include "resampling.h"
+
+DECLARE_double(limiter_inactive_tolerance);
 
 template <class SimdType>
 void TestGradCalculatorImpl() {
@@ -84,3 +88,265 @@ void TestGradCalculator() {
     TestGradCalculatorImpl<simdpp::float64x2>();
     TestGradCalculatorImpl<simdpp::float64x4>();
 }
+
+namespace {
+    // unit_evalを返す
+    template <class SimdType>
+    double OptimizeForTest(phase_limiter::GradCalculator<SimdType> *calculator, std::vector<float> *wave) {
+        float *ptr_array[2] = { &(*wave)[0], &(*wave)[1] };
+        calculator->copyWaveSrcFrom(ptr_array, 2);
+        const auto unit_eval = calculator->outputUnitEval("src_with_cut"); // waveSrcとwaveOutを汚染
+        calculator->copyWaveSrcFrom(ptr_array, 2);
+        calculator->optimizeWithProgressCallback([](double progress) {}, unit_eval);
+        calculator->copyWaveProxTo(ptr_array, 2);
+        return unit_eval;
+    }
+}
+
+// 内部oversample (oversample > 1) が外部oversample (oversample = 1) と同じ評価関数を最適化していることの確認
+template <class SimdType>
+void TestGradCalculatorOversampleImpl() {
+    typedef typename SimdType::element_type Float;
+    
+    const int oversample = 4;
+    const int sample_rate = 44100 * oversample;
+    const int frames_downsample = 44100 * 2;
+    const int frames = frames_downsample * oversample;
+    const double noise = 0.01;
+    
+    // 44100Hzの信号をoversampleしたもの (22050Hz以上が無い)
+    std::vector<float> src(2 * frames_downsample);
+    std::mt19937 engine(1);
+    std::normal_distribution<double> dist;
+    for (int i = 0; i < frames_downsample; i++) {
+        for (int channel = 0; channel < 2; channel++) {
+            src[2 * i + channel] = 0.6 * std::sin(2 * M_PI * (220 + 3 * channel) * i / 44100) + 0.3 * dist(engine);
+        }
+    }
+    phase_limiter::Upsample(&src, 2, oversample);
+    std::vector<float> prox(src);
+    for (auto &x: prox) {
+        x = std::max<float>(-1, std::min<float>(1, x));
+    }
+    float *src_ptr[2] = { &src[0], &src[1] };
+    float *prox_ptr[2] = { &prox[0], &prox[1] };
+    
+    phase_limiter::GradCalculator<SimdType> external_calculator(frames, sample_rate, 22050, 0, "linear", 1e-6, 1, 0.5, 100, 400, 1);
+    phase_limiter::GradCalculator<SimdType> internal_calculator(frames, sample_rate, 22050, 0, "linear", 1e-6, 1, 0.5, 100, 400, oversample);
+    
+    int error_count = 0;
+    
+    // 評価関数が外部oversampleと概ね一致すること (10%以内)
+    {
+        external_calculator.copyWaveSrcFrom(src_ptr, 2);
+        external_calculator.copyWaveProxFrom(prox_ptr, 2);
+        internal_calculator.copyWaveSrcFrom(src_ptr, 2);
+        internal_calculator.copyWaveProxFrom(prox_ptr, 2);
+        const double external_eval = external_calculator.CalcEvalFromProx(noise, 1);
+        const double internal_eval = internal_calculator.CalcEvalFromProx(noise, 1);
+        std::cerr << "external_eval:" << external_eval << "\tinternal_eval:" << internal_eval << "\tratio:" << internal_eval / external_eval << std::endl;
+        if (std::abs(internal_eval / external_eval - 1) > 0.1) {
+            error_count++;
+        }
+    }
+    
+    // gradが差分近似と一致すること (floatはdeltaが大きいので許容誤差も大きい)
+    {
+        std::vector<float> grad(2 * frames);
+        float *grad_ptr[2] = { &grad[0], &grad[1] };
+        internal_calculator.copyWaveProxFrom(prox_ptr, 2);
+        internal_calculator.CalcEvalGradFromProx(noise, 1);
+        internal_calculator.copyGradTo(grad_ptr, 2);
+        
+        std::uniform_int_distribution<int> index_dist(0, 2 * frames - 1);
+        const Float delta = sizeof(Float) == 4 ? 1e-2 : 1e-4;
+        double max_relative_error = 0;
+        for (int k = 0; k < 8; k++) {
+            const int i = index_dist(engine);
+            const float original = prox[i];
+            prox[i] = original + delta;
+            internal_calculator.copyWaveProxFrom(prox_ptr, 2);
+            const double eval_plus = internal_calculator.CalcEvalFromProx(noise, 1);
+            prox[i] = original - delta;
+            internal_calculator.copyWaveProxFrom(prox_ptr, 2);
+            const double eval_minus = internal_calculator.CalcEvalFromProx(noise, 1);
+            prox[i] = original;
+            const double numerical = (eval_plus - eval_minus) / (2 * delta);
+            const double relative_error = std::abs(numerical - grad[i]) / (1e-37 + std::abs(numerical));
+            max_relative_error = std::max(max_relative_error, relative_error);
+            std::cerr << "index:" << i << "\tgrad:" << grad[i] << "\tnumerical:" << numerical << std::endl;
+        }
+        std::cerr << "max_relative_error:" << max_relative_error << std::endl;
+        if (max_relative_error > (sizeof(Float) == 4 ? 0.25 : 0.15)) {
+            error_count++;
+        }
+    }
+    
+    // 最適化結果の比較
+    // oversampleしたサンプルのピークはceiling以下、内部oversampleの誤差は外部oversampleより0.5dB以上大きくない
+    double error_dbs[2];
+    for (int k = 0; k < 2; k++) {
+        phase_limiter::GradCalculator<SimdType> &calculator = k == 0 ? external_calculator : internal_calculator;
+        std::vector<float> wave(src);
+        bakuage::StopWatch sw;
+        sw.Start();
+        OptimizeForTest(&calculator, &wave);
+        const double sec = sw.Stop();
+        
+        double true_peak = 0;
+        for (const auto x: wave) {
+            true_peak = std::max<double>(true_peak, std::abs(x));
+        }
+        double error = 0;
+        double energy = 0;
+        for (int i = 0; i < wave.size(); i++) {
+            error += bakuage::Sqr(wave[i] - src[i]);
+            energy += bakuage::Sqr(src[i]);
+        }
+        phase_limiter::Downsample(&wave, 2, oversample);
+        double sample_peak = 0;
+        for (const auto x: wave) {
+            sample_peak = std::max<double>(sample_peak, std::abs(x));
+        }
+        error_dbs[k] = 10 * std::log10(error / energy);
+        std::cerr << (k == 0 ? "external" : "internal") << "\tsec:" << sec << "\tsample_peak:" << sample_peak << "\ttrue_peak:" << true_peak << "\terror_db:" << error_dbs[k] << std::endl;
+        if (true_peak > 1 + 1e-4) {
+            error_count++;
+        }
+    }
+    if (error_dbs[1] - error_dbs[0] > 0.5) {
+        error_count++;
+    }
+    std::cerr << "TestGradCalculatorOversample"
+        << " error_db_diff:" << error_dbs[1] - error_dbs[0]
+        << " errors:" << error_count << std::endl;
+}
+
+void TestGradCalculatorOversample() {
+    TestGradCalculatorOversampleImpl<simdpp::float32x4>();
+    TestGradCalculatorOversampleImpl<simdpp::float64x2>();
+}
+
+// 収束判定で早期終了した結果が、max_iter1まで回した結果と許容範囲内で一致することの確認
+// (外挿点のピークは内部oversample無しではsample peakなので、true peakも比較する)
+void TestGradCalculatorConvergence() {
+    typedef phase_limiter::DefaultSimdType SimdType;
+    const int sample_rate = 44100;
+    const int frames = sample_rate * 3;
+    const int true_peak_oversample = 4;
+    const double min_noise = 1e-6;
+
+    std::vector<float> src(2 * frames);
+    std::mt19937 engine(1);
+    std::normal_distribution<double> dist;
+    for (int i = 0; i < frames; i++) {
+        for (int channel = 0; channel < 2; channel++) {
+            src[2 * i + channel] = 0.8 * std::sin(2 * M_PI * (220 + 3 * channel) * i / sample_rate) + 0.3 * dist(engine);
+        }
+    }
+
+    std::vector<float> results[2];
+    double normalized_evals[2];
+    double true_peaks[2];
+    int iters[2];
+    for (int k = 0; k < 2; k++) {
+        phase_limiter::GradCalculator<SimdType> calculator(frames, sample_rate, sample_rate / 2, 0, "linear", min_noise, 1, 0.5, 100, 400, 1);
+        // k == 0: 早期終了なし, k == 1: 早期終了あり
+        calculator.set_convergence_tolerance(k == 0 ? 0 : 1e-4, 1e-4);
+        results[k] = src;
+        const double unit_eval = OptimizeForTest(&calculator, &results[k]);
+        normalized_evals[k] = calculator.CalcEvalFromProx(min_noise, unit_eval) / (1e-37 + unit_eval);
+        iters[k] = calculator.last_iter;
+
+        std::vector<float> upsampled(results[k]);
+        phase_limiter::Upsample(&upsampled, 2, true_peak_oversample);
+        true_peaks[k] = 0;
+        for (const auto x: upsampled) {
+            true_peaks[k] = std::max<double>(true_peaks[k], std::abs(x));
+        }
+    }
+
+    double diff = 0;
+    double limiting = 0;
+    for (int i = 0; i < 2 * frames; i++) {
+        diff += bakuage::Sqr(results[1][i] - results[0][i]);
+        limiting += bakuage::Sqr(results[0][i] - src[i]);
+    }
+    const double diff_db = 10 * std::log10((1e-37 + diff) / (1e-37 + limiting));
+
+    int error_count = 0;
+    // 評価関数は5%以内、true peakは0.1dB以内、差は制限による変化より20dB以上小さい
+    if (normalized_evals[1] > normalized_evals[0] * 1.05) {
+        error_count++;
+    }
+    if (true_peaks[1] > true_peaks[0] * std::pow(10, 0.1 / 20)) {
+        error_count++;
+    }
+    if (diff_db > -20) {
+        error_count++;
+    }
+    std::cerr << "TestGradCalculatorConvergence"
+        << " iter:" << iters[0] << "->" << iters[1]
+        << " normalized_eval:" << normalized_evals[0] << "->" << normalized_evals[1]
+        << " true_peak:" << true_peaks[0] << "->" << true_peaks[1]
+        << " diff_db:" << diff_db
+        << " errors:" << error_count << std::endl;
+}
+
+// inactive task groupのスキップ (デフォルトのlimiter_inactive_tolerance) が、スキップなしと許容範囲内で一致することの確認
+// (スキップしたtask groupのgradを0とみなすので近似。toleranceを0にしても丸め誤差のgradが広がるだけでほとんどスキップされない)
+void TestGradCalculatorInactive() {
+    typedef phase_limiter::DefaultSimdType SimdType;
+    const int sample_rate = 44100;
+    const int frames = sample_rate * 8;
+    const double min_noise = 1e-6;
+
+    // 静かな信号に2秒ごとにceilingを超えるトランジェントを入れる (大半のtask groupはceilingを超えない)
+    std::vector<float> src(2 * frames);
+    std::mt19937 engine(1);
+    std::normal_distribution<double> dist;
+    for (int i = 0; i < frames; i++) {
+        const int pos = i % (2 * sample_rate);
+        const double transient = pos < sample_rate / 20 ? 1.5 * std::exp(-20.0 * pos / sample_rate) : 0;
+        for (int channel = 0; channel < 2; channel++) {
+            src[2 * i + channel] = 0.3 * std::sin(2 * M_PI * (220 + 3 * channel) * i / sample_rate) + 0.05 * dist(engine) + transient;
+        }
+    }
+
+    std::vector<float> results[2];
+    double normalized_evals[2];
+    double secs[2];
+    for (int k = 0; k < 2; k++) {
+        phase_limiter::GradCalculator<SimdType> calculator(frames, sample_rate, sample_rate / 2, 0, "linear", min_noise, 1, 0.5, 100, 400, 1);
+        // k == 0: スキップなし, k == 1: デフォルト
+        calculator.set_inactive_tolerance(k == 0 ? -1 : FLAGS_limiter_inactive_tolerance);
+        results[k] = src;
+        bakuage::StopWatch sw;
+        sw.Start();
+        const double unit_eval = OptimizeForTest(&calculator, &results[k]);
+        secs[k] = sw.Stop();
+        normalized_evals[k] = calculator.CalcEvalFromProx(min_noise, unit_eval) / (1e-37 + unit_eval);
+    }
+
+    double diff = 0;
+    double limiting = 0;
+    for (int i = 0; i < 2 * frames; i++) {
+        diff += bakuage::Sqr(results[1][i] - results[0][i]);
+        limiting += bakuage::Sqr(results[0][i] - src[i]);
+    }
+    const double diff_db = 10 * std::log10((1e-37 + diff) / (1e-37 + limiting));
+
+    int error_count = 0;
+    // 評価関数は5%以内、差は制限による変化より20dB以上小さい
+    if (normalized_evals[1] > normalized_evals[0] * 1.05) {
+        error_count++;
+    }
+    if (diff_db > -20) {
+        error_count++;
+    }
+    std::cerr << "TestGradCalculatorInactive"
+        << " sec:" << secs[0] << "->" << secs[1]
+        << " normalized_eval:" << normalized_evals[0] << "->" << normalized_evals[1]
+        << " diff_db:" << diff_db
+        << " errors:" << error_count << std::endl;
+}
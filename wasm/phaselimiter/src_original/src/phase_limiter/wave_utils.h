@@ -45,8 +45,9 @@ namespace phase_limiter {
         }
     }
     
+    // sample_rate != nullptr のときはファイルのサンプルレートを返す
     template <class Float>
-    std::vector<Float> LoadFloatWave(const std::string &filename) {
+    std::vector<Float> LoadFloatWave(const std::string &filename, int *sample_rate = nullptr) {
         bakuage::SndfileWrapper infile;
         SF_INFO sfinfo = { 0 };
         
@@ -82,6 +83,9 @@ namespace phase_limiter {
             message << "sf_readf_float error: " << read_size;
             throw std::logic_error(message.str());
         }
+        if (sample_rate) {
+            *sample_rate = sfinfo.samplerate;
+        }
         
         return buffer;
     }
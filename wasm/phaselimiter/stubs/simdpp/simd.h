@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
+// Subset of libsimdpp used by GradCore.h / GradCalculator.h.
+//
+// Vector types are plain arrays whose element loops the compiler vectorizes.
+// With -msimd128, float32x4 (DefaultSimdType of the wasm build, see
+// phase_limiter/config.h) is backed by v128_t and wasm_simd128 intrinsics.
+//
+// min / max keep the operand order semantics of SSE minps / maxps
+// (a < b ? a : b), which ProxOperator relies on for NaN.
+// rcp_e / rsqrt_e are exact (wasm has no estimate instructions).
+
+namespace simdpp {
+
+template <class T, unsigned N> struct vec {
+  typedef T element_type;
+  static constexpr unsigned length = N;
+  T v[N];
+};
+
+typedef vec<float, 4> float32x4;
+typedef vec<float, 8> float32x8;
+typedef vec<double, 2> float64x2;
+typedef vec<double, 4> float64x4;
+
+#define SIMDPP_STUB_BINARY_OP(op)                                              \
+  template <class T, unsigned N>                                               \
+  inline vec<T, N> operator op(const vec<T, N> &a, const vec<T, N> &b) {       \
+    vec<T, N> r;                                                               \
+    for (unsigned i = 0; i < N; i++)                                           \
+      r.v[i] = a.v[i] op b.v[i];                                               \
+    return r;                                                                  \
+  }                                                                            \
+  template <class T, unsigned N>                                               \
+  inline vec<T, N> &operator op##=(vec<T, N> &a, const vec<T, N> &b) {         \
+    return a = a op b;                                                         \
+  }
+SIMDPP_STUB_BINARY_OP(+)
+SIMDPP_STUB_BINARY_OP(-)
+SIMDPP_STUB_BINARY_OP(*)
+SIMDPP_STUB_BINARY_OP(/)
+#undef SIMDPP_STUB_BINARY_OP
+
+template <class T, unsigned N> inline vec<T, N> operator-(const vec<T, N> &a) {
+  vec<T, N> r;
+  for (unsigned i = 0; i < N; i++)
+    r.v[i] = -a.v[i];
+  return r;
+}
+
+template <class T, unsigned N>
+inline vec<T, N> min(const vec<T, N> &a, const vec<T, N> &b) {
+  vec<T, N> r;
+  for (unsigned i = 0; i < N; i++)
+    r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+  return r;
+}
+
+template <class T, unsigned N>
+inline vec<T, N> max(const vec<T, N> &a, const vec<T, N> &b) {
+  vec<T, N> r;
+  for (unsigned i = 0; i < N; i++)
+    r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+  return r;
+}
+
+template <class T, unsigned N> inline vec<T, N> sqrt(const vec<T, N> &a) {
+  vec<T, N> r;
+  for (unsigned i = 0; i < N; i++)
+    r.v[i] = std::sqrt(a.v[i]);
+  return r;
+}
+
+template <class T, unsigned N> inline T reduce_add(const vec<T, N> &a) {
+  T r = 0;
+  for (unsigned i = 0; i < N; i++)
+    r += a.v[i];
+  return r;
+}
+
+namespace detail {
+template <class V> inline V splat_element(typename V::element_type x) {
+  V r;
+  for (unsigned i = 0; i < V::length; i++)
+    r.v[i] = x;
+  return r;
+}
+} // namespace detail
+
+template <class V, class S> inline V splat(S x) {
+  return detail::splat_element<V>((typename V::element_type)x);
+}
+
+template <class V> inline V load(const void *p) {
+  V r;
+  const auto *src = static_cast<const typename V::element_type *>(p);
+  for (unsigned i = 0; i < V::length; i++)
+    r.v[i] = src[i];
+  return r;
+}
+
+template <class T, unsigned N> inline void store(void *p, const vec<T, N> &a) {
+  T *dest = static_cast<T *>(p);
+  for (unsigned i = 0; i < N; i++)
+    dest[i] = a.v[i];
+}
+
+// a = p[0], p[2], ...  b = p[1], p[3], ...
+template <class T, unsigned N>
+inline void load_packed2(vec<T, N> &a, vec<T, N> &b, const void *p) {
+  const T *src = static_cast<const T *>(p);
+  for (unsigned i = 0; i < N; i++) {
+    a.v[i] = src[2 * i];
+    b.v[i] = src[2 * i + 1];
+  }
+}
+
+template <class T, unsigned N>
+inline void store_packed2(void *p, const vec<T, N> &a, const vec<T, N> &b) {
+  T *dest = static_cast<T *>(p);
+  for (unsigned i = 0; i < N; i++) {
+    dest[2 * i] = a.v[i];
+    dest[2 * i + 1] = b.v[i];
+  }
+}
+
+template <unsigned I, class T, unsigned N>
+inline T extract(const vec<T, N> &a) {
+  static_assert(I < N, "lane out of range");
+  return a.v[I];
+}
+
+#ifdef __wasm_simd128__
+// float32x4 on wasm_simd128
+
+template <> struct vec<float, 4> {
+  typedef float element_type;
+  static constexpr unsigned length = 4;
+  v128_t v;
+};
+
+inline float32x4 make_float32x4(v128_t v) {
+  float32x4 r;
+  r.v = v;
+  return r;
+}
+
+inline float32x4 operator+(const float32x4 &a, const float32x4 &b) {
+  return make_float32x4(wasm_f32x4_add(a.v, b.v));
+}
+inline float32x4 operator-(const float32x4 &a, const float32x4 &b) {
+  return make_float32x4(wasm_f32x4_sub(a.v, b.v));
+}
+inline float32x4 operator*(const float32x4 &a, const float32x4 &b) {
+  return make_float32x4(wasm_f32x4_mul(a.v, b.v));
+}
+inline float32x4 operator/(const float32x4 &a, const float32x4 &b) {
+  return make_float32x4(wasm_f32x4_div(a.v, b.v));
+}
+inline float32x4 operator-(const float32x4 &a) {
+  return make_float32x4(wasm_f32x4_neg(a.v));
+}
+// pmin(b, a) = a < b ? a : b (minps)
+inline float32x4 min(const float32x4 &a, const float32x4 &b) {
+  return make_float32x4(wasm_f32x4_pmin(b.v, a.v));
+}
+// pmax(b, a) = b < a ? a : b (maxps)
+inline float32x4 max(const float32x4 &a, const float32x4 &b) {
+  return make_float32x4(wasm_f32x4_pmax(b.v, a.v));
+}
+inline float32x4 sqrt(const float32x4 &a) {
+  return make_float32x4(wasm_f32x4_sqrt(a.v));
+}
+inline float reduce_add(const float32x4 &a) {
+  return (wasm_f32x4_extract_lane(a.v, 0) + wasm_f32x4_extract_lane(a.v, 1)) +
+         (wasm_f32x4_extract_lane(a.v, 2) + wasm_f32x4_extract_lane(a.v, 3));
+}
+namespace detail {
+template <> inline float32x4 splat_element<float32x4>(float x) {
+  return make_float32x4(wasm_f32x4_splat(x));
+}
+} // namespace detail
+template <> inline float32x4 load<float32x4>(const void *p) {
+  return make_float32x4(wasm_v128_load(p));
+}
+inline void store(void *p, const float32x4 &a) { wasm_v128_store(p, a.v); }
+inline void load_packed2(float32x4 &a, float32x4 &b, const void *p) {
+  const v128_t lo = wasm_v128_load(p);
+  const v128_t hi = wasm_v128_load(static_cast<const float *>(p) + 4);
+  a.v = wasm_i32x4_shuffle(lo, hi, 0, 2, 4, 6);
+  b.v = wasm_i32x4_shuffle(lo, hi, 1, 3, 5, 7);
+}
+inline void store_packed2(void *p, const float32x4 &a, const float32x4 &b) {
+  wasm_v128_store(p, wasm_i32x4_shuffle(a.v, b.v, 0, 4, 1, 5));
+  wasm_v128_store(static_cast<float *>(p) + 4,
+                  wasm_i32x4_shuffle(a.v, b.v, 2, 6, 3, 7));
+}
+template <unsigned I> inline float extract(const float32x4 &a) {
+  static_assert(I < 4, "lane out of range");
+  return wasm_f32x4_extract_lane(a.v, I);
+}
+#endif
+
+template <class V> inline V fmadd(const V &a, const V &b, const V &c) {
+  return a * b + c;
+}
+template <class V> inline V fmsub(const V &a, const V &b, const V &c) {
+  return a * b - c;
+}
+template <class V> inline V rcp_e(const V &a) {
+  return splat<V>(1) / a;
+}
+template <class V> inline V rsqrt_e(const V &a) {
+  return splat<V>(1) / sqrt(a);
+}
+// one Newton-Raphson step of a reciprocal estimate
+template <class V> inline V rcp_rh(const V &r, const V &a) {
+  return r * (splat<V>(2) - a * r);
+}
+
+namespace detail {
+// simdpp::load(p) / simdpp::splat(x) without a type, converted on assignment
+struct load_expr {
+  const void *p;
+  template <class V> operator V() const { return load<V>(p); }
+};
+template <class S> struct splat_expr {
+  S x;
+  template <class V> operator V() const { return splat<V>(x); }
+};
+} // namespace detail
+
+inline detail::load_expr load(const void *p) { return detail::load_expr{p}; }
+template <class S> inline detail::splat_expr<S> splat(S x) {
+  return detail::splat_expr<S>{x};
+}
+
+} // namespace simdpp
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "tbb/scalable_allocator.h"
+
+namespace tbb {
+
+// allocations start on their own cache line (no false sharing between
+// per-thread objects allocated back to back)
+template <typename T> class cache_aligned_allocator {
+public:
+  typedef T value_type;
+  static const std::size_t kCacheLineSize = 64;
+
+  cache_aligned_allocator() noexcept {}
+  template <typename U>
+  cache_aligned_allocator(const cache_aligned_allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    const std::size_t size =
+        (n * sizeof(T) + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize;
+    void *ptr = scalable_aligned_malloc(size, kCacheLineSize);
+    if (!ptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(ptr);
+  }
+  void deallocate(T *ptr, std::size_t) noexcept {
+    scalable_aligned_free(ptr);
+  }
+  // tbb 2019 API (GradCalculator places tasks with these)
+  template <typename U, typename... Args> void construct(U *ptr, Args &&...args) {
+    ::new (static_cast<void *>(ptr)) U(std::forward<Args>(args)...);
+  }
+  template <typename U> void destroy(U *ptr) { ptr->~U(); }
+
+  template <typename U> struct rebind {
+    typedef cache_aligned_allocator<U> other;
+  };
+};
+
+template <typename T, typename U>
+bool operator==(const cache_aligned_allocator<T> &,
+                const cache_aligned_allocator<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const cache_aligned_allocator<T> &,
+                const cache_aligned_allocator<U> &) {
+  return false;
+}
+
+} // namespace tbb
@@ -1,9 +1,11 @@
 #pragma once
+#include <cstddef>
 #include <cstdlib>
+#include <new>
 
 inline void *scalable_aligned_malloc(size_t size, size_t alignment) {
-  // Emscripten/WASM doesn't strictly need scalable_allocator for a single
-  // thread, so we redirect to standard aligned allocation.
+  // The system allocator is thread safe (emmalloc/dlmalloc take a lock
+  // under -pthread), so we redirect to standard aligned allocation.
 #ifdef _WIN32
   return _aligned_malloc(size, alignment);
 #else
@@ -21,3 +23,40 @@ inline void scalable_aligned_free(void *ptr) {
   free(ptr);
 #endif
 }
+
+namespace tbb {
+
+template <typename T> class scalable_allocator {
+public:
+  typedef T value_type;
+
+  scalable_allocator() noexcept {}
+  template <typename U>
+  scalable_allocator(const scalable_allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    const std::size_t alignment =
+        alignof(T) < sizeof(void *) ? sizeof(void *) : alignof(T);
+    void *ptr = scalable_aligned_malloc(n * sizeof(T), alignment);
+    if (!ptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(ptr);
+  }
+  void deallocate(T *ptr, std::size_t) noexcept { scalable_aligned_free(ptr); }
+
+  template <typename U> struct rebind {
+    typedef scalable_allocator<U> other;
+  };
+};
+
+template <typename T, typename U>
+bool operator==(const scalable_allocator<T> &, const scalable_allocator<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const scalable_allocator<T> &, const scalable_allocator<U> &) {
+  return false;
+}
+
+} // namespace tbb
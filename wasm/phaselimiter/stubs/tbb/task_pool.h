@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool backing the tbb subset in tbb.h.
+//
+// Every worker owns a deque: the owner pushes/pops at the back (LIFO, cache
+// friendly for nested fork-join), idle threads steal from the front. Threads
+// that are not workers (the caller of AutoMastering etc.) push into an extra
+// shared queue. A thread waiting for its children never blocks: it keeps
+// executing queued tasks until the group is done, so nested parallel_invoke
+// (GradCalculator divide and conquer) cannot deadlock.
+//
+// Emscripten builds without -pthread get zero workers and everything runs
+// inline on the calling thread, exactly like the previous serial stub.
+
+namespace tbb {
+namespace detail {
+
+// Counts outstanding tasks of one fork-join region and keeps the first
+// exception so that it can be rethrown on the waiting thread.
+class TaskGroup {
+public:
+  TaskGroup() : pending_(0) {}
+  void Add(int count) { pending_.fetch_add(count, std::memory_order_relaxed); }
+  void Done() { pending_.fetch_sub(1, std::memory_order_acq_rel); }
+  bool finished() const {
+    return pending_.load(std::memory_order_acquire) == 0;
+  }
+  void SetException(std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!exception_) {
+      exception_ = e;
+    }
+  }
+  void RethrowIfFailed() {
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+  }
+
+private:
+  std::atomic<int> pending_;
+  std::mutex mtx_;
+  std::exception_ptr exception_;
+};
+
+class TaskPool {
+public:
+  struct Task {
+    std::function<void()> func;
+    TaskGroup *group;
+  };
+
+  static TaskPool &GetInstance() {
+    static TaskPool instance(DefaultWorkerCount());
+    return instance;
+  }
+
+  static int DefaultWorkerCount() {
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+    return 0;
+#else
+    const int hardware = static_cast<int>(std::thread::hardware_concurrency());
+    return std::max(0, hardware - 1);
+#endif
+  }
+
+  ~TaskPool() { Stop(); }
+
+  // workers + calling thread
+  int concurrency() const { return static_cast<int>(workers_.size()) + 1; }
+
+  // (re)start with the given worker count. only call while idle.
+  void Resize(int worker_count) {
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+    worker_count = 0;
+#endif
+    worker_count = std::max(0, worker_count);
+    if (worker_count == static_cast<int>(workers_.size())) {
+      return;
+    }
+    Stop();
+    Start(worker_count);
+  }
+
+  void Spawn(std::function<void()> func, TaskGroup *group) {
+    group->Add(1);
+    if (workers_.empty()) {
+      Run(Task{std::move(func), group});
+      return;
+    }
+    const int self = CurrentWorkerIndex();
+    Queue &queue = *queues_[self >= 0 ? self : queues_.size() - 1];
+    {
+      std::lock_guard<std::mutex> lock(queue.mtx);
+      queue.tasks.push_back(Task{std::move(func), group});
+    }
+    queued_.fetch_add(1, std::memory_order_release);
+    {
+      // pairs with the predicate check in WorkerLoop (no lost wakeup)
+      std::lock_guard<std::mutex> lock(sleep_mtx_);
+    }
+    sleep_cv_.notify_one();
+  }
+
+  // help executing tasks until every task of the group finished
+  void Wait(TaskGroup *group) {
+    const int self = CurrentWorkerIndex();
+    int idle_rounds = 0;
+    while (!group->finished()) {
+      if (TryRunOne(self)) {
+        idle_rounds = 0;
+      } else if (++idle_rounds > 64) {
+        std::this_thread::yield();
+      }
+    }
+    group->RethrowIfFailed();
+  }
+
+private:
+  struct Queue {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+  };
+
+  explicit TaskPool(int worker_count) : queued_(0), stop_(false) {
+    Start(worker_count);
+  }
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  static int &CurrentWorkerIndexRef() {
+    static thread_local int index = -1;
+    return index;
+  }
+  static int CurrentWorkerIndex() { return CurrentWorkerIndexRef(); }
+
+  void Start(int worker_count) {
+    stop_ = false;
+    queues_.clear();
+    // [0, worker_count): per worker, worker_count: shared by external threads
+    for (int i = 0; i < worker_count + 1; i++) {
+      queues_.emplace_back(new Queue());
+    }
+    for (int i = 0; i < worker_count; i++) {
+      workers_.emplace_back([this, i]() { WorkerLoop(i); });
+    }
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mtx_);
+      stop_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+  }
+
+  void WorkerLoop(int index) {
+    CurrentWorkerIndexRef() = index;
+    while (true) {
+      if (TryRunOne(index)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mtx_);
+      sleep_cv_.wait(lock, [this]() {
+        return stop_ || queued_.load(std::memory_order_acquire) > 0;
+      });
+      if (stop_) {
+        return;
+      }
+    }
+  }
+
+  bool PopBack(Queue *queue, Task *task) {
+    std::lock_guard<std::mutex> lock(queue->mtx);
+    if (queue->tasks.empty()) {
+      return false;
+    }
+    *task = std::move(queue->tasks.back());
+    queue->tasks.pop_back();
+    return true;
+  }
+
+  bool PopFront(Queue *queue, Task *task) {
+    std::lock_guard<std::mutex> lock(queue->mtx);
+    if (queue->tasks.empty()) {
+      return false;
+    }
+    *task = std::move(queue->tasks.front());
+    queue->tasks.pop_front();
+    return true;
+  }
+
+  bool TryRunOne(int self) {
+    if (queues_.empty()) {
+      return false;
+    }
+    Task task;
+    bool found = self >= 0 && PopBack(queues_[self].get(), &task);
+    // steal, starting next to ourselves to spread the contention
+    const int queue_count = queues_.size();
+    const int start = self >= 0 ? self + 1 : 0;
+    for (int i = 0; !found && i < queue_count; i++) {
+      const int victim = (start + i) % queue_count;
+      if (victim != self) {
+        found = PopFront(queues_[victim].get(), &task);
+      }
+    }
+    if (!found) {
+      return false;
+    }
+    queued_.fetch_sub(1, std::memory_order_acq_rel);
+    Run(std::move(task));
+    return true;
+  }
+
+  static void Run(Task task) {
+    try {
+      task.func();
+    } catch (...) {
+      task.group->SetException(std::current_exception());
+    }
+    task.group->Done();
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<int> queued_;
+  std::mutex sleep_mtx_;
+  std::condition_variable sleep_cv_;
+  bool stop_;
+};
+
+// split [0, n) into roughly equal chunks for the current concurrency
+inline int ChunkCount(size_t n, size_t grainsize) {
+  const size_t max_chunks = 4 * TaskPool::GetInstance().concurrency();
+  const size_t by_grain = (n + std::max<size_t>(1, grainsize) - 1) /
+                          std::max<size_t>(1, grainsize);
+  return static_cast<int>(std::max<size_t>(1, std::min(max_chunks, by_grain)));
+}
+
+// run func(chunk_index) for chunk_index in [0, chunk_count) in parallel.
+// the last chunk runs on the calling thread.
+template <class Func> void RunChunks(int chunk_count, const Func &func) {
+  if (chunk_count <= 1) {
+    if (chunk_count == 1) {
+      func(0);
+    }
+    return;
+  }
+  auto &pool = TaskPool::GetInstance();
+  TaskGroup group;
+  for (int i = 0; i < chunk_count - 1; i++) {
+    pool.Spawn([&func, i]() { func(i); }, &group);
+  }
+  try {
+    func(chunk_count - 1);
+  } catch (...) {
+    group.SetException(std::current_exception());
+  }
+  pool.Wait(&group);
+}
+
+} // namespace detail
+} // namespace tbb
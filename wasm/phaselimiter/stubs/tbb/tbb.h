@@ -1,38 +1,108 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "tbb/task_pool.h"
+
+// Subset of the TBB API used by bakuage / phase_limiter / optim, implemented
+// on top of the work-stealing pool in task_pool.h.
 
 namespace tbb {
 
-template <typename Int> class blocked_range {
+template <typename Value> class blocked_range {
 public:
-  blocked_range(Int begin, Int end) : begin_(begin), end_(end) {}
-  Int begin() const { return begin_; }
-  Int end() const { return end_; }
+  typedef Value const_iterator;
+  typedef std::size_t size_type;
+
+  blocked_range(Value begin, Value end, size_type grainsize = 1)
+      : begin_(begin), end_(end), grainsize_(grainsize) {}
+  Value begin() const { return begin_; }
+  Value end() const { return end_; }
+  size_type size() const { return static_cast<size_type>(end_ - begin_); }
+  size_type grainsize() const { return grainsize_; }
+  bool empty() const { return !(begin_ < end_); }
+
+  // i-th of chunk_count nearly equal sub ranges
+  blocked_range sub_range(int i, int chunk_count) const {
+    const size_type n = size();
+    return blocked_range(begin_ + n * i / chunk_count,
+                         begin_ + n * (i + 1) / chunk_count, grainsize_);
+  }
 
 private:
-  Int begin_;
-  Int end_;
+  Value begin_;
+  Value end_;
+  size_type grainsize_;
 };
 
-template <typename Int, typename Body>
-inline void parallel_for(Int begin, Int end, const Body &body) {
-  for (Int i = begin; i < end; i++) {
-    body(i);
+template <typename Index, typename Body>
+inline void parallel_for(Index first, Index last, const Body &body) {
+  if (!(first < last)) {
+    return;
+  }
+  const blocked_range<Index> range(first, last);
+  const int chunk_count = detail::ChunkCount(range.size(), 1);
+  detail::RunChunks(chunk_count, [&](int chunk) {
+    const auto sub = range.sub_range(chunk, chunk_count);
+    for (Index i = sub.begin(); i < sub.end(); i++) {
+      body(i);
+    }
+  });
+}
+
+template <typename Value, typename Body>
+inline void parallel_for(const blocked_range<Value> &range, const Body &body) {
+  if (range.empty()) {
+    return;
   }
+  const int chunk_count = detail::ChunkCount(range.size(), range.grainsize());
+  detail::RunChunks(chunk_count, [&](int chunk) {
+    body(range.sub_range(chunk, chunk_count));
+  });
 }
 
-template <typename Range, typename Body>
-inline void parallel_for(const Range &range, const Body &body) {
-  for (auto i = range.begin(); i < range.end(); i++) {
-    body(i);
+// sub ranges are reduced in index order, so the result does not depend on
+// the thread count (as long as reduction is associative)
+template <typename Value, typename Result, typename Body, typename Reduction>
+inline Result parallel_reduce(const blocked_range<Value> &range,
+                              const Result &identity, const Body &body,
+                              const Reduction &reduction) {
+  if (range.empty()) {
+    return identity;
   }
+  const int chunk_count = detail::ChunkCount(range.size(), range.grainsize());
+  std::vector<Result> partials(chunk_count, identity);
+  detail::RunChunks(chunk_count, [&](int chunk) {
+    partials[chunk] = body(range.sub_range(chunk, chunk_count), identity);
+  });
+  Result result = partials[0];
+  for (int i = 1; i < chunk_count; i++) {
+    result = reduction(result, partials[i]);
+  }
+  return result;
 }
 
-template <typename Range, typename Value, typename Body, typename Reduction>
-inline Value parallel_reduce(const Range &range, const Value &identity,
-                             const Body &body, const Reduction &reduction) {
-  return body(range, identity);
+template <typename... Funcs> inline void parallel_invoke(const Funcs &... funcs) {
+  const std::function<void()> table[] = {std::function<void()>(funcs)...};
+  detail::RunChunks(sizeof...(Funcs), [&table](int i) { table[i](); });
 }
 
+class task_scheduler_init {
+public:
+  static const int automatic = -1;
+
+  explicit task_scheduler_init(int number_of_threads = automatic) {
+    const int threads = number_of_threads == automatic ? default_num_threads()
+                                                       : number_of_threads;
+    detail::TaskPool::GetInstance().Resize(threads - 1);
+  }
+
+  static int default_num_threads() {
+    return detail::TaskPool::DefaultWorkerCount() + 1;
+  }
+};
+
 } // namespace tbb
@@ -5,13 +5,16 @@ async function ensureModule() {
 
     modulePromise = (async () => {
         const cacheBust = Date.now();
-        importScripts("/js/phaselimiter_pro.js?v=" + cacheBust);
+        const scriptUrl = "/js/phaselimiter_pro.js?v=" + cacheBust;
+        importScripts(scriptUrl);
         if (typeof createPhaseLimiterProModule !== "function") {
             throw new Error("PhaseLimiter Pro loader missing: createPhaseLimiterProModule is not defined");
         }
         return await createPhaseLimiterProModule({
+            // pthread builds spawn their pool workers from this script
+            mainScriptUrlOrBlob: scriptUrl,
             locateFile: (path) => {
-                if (path.endsWith(".wasm") || path.endsWith(".data")) {
+                if (path.endsWith(".wasm") || path.endsWith(".data") || path.endsWith(".worker.js")) {
                     return "/js/" + path + "?v=" + cacheBust;
                 }
                 return path;
@@ -22,6 +25,25 @@ async function ensureModule() {
     return modulePromise;
 }
 
+// Level 5 engine state (sound_quality2_cache, reference, band filters) is
+// built once per module and reused by every later job.
+// null = not tried yet, 0 = init failed (use the per-call API).
+let mastering5Context = null;
+
+function ensureMastering5Context(Module, sampleRate) {
+    if (mastering5Context !== null) return mastering5Context;
+    if (typeof Module._phaselimiter_pro_init !== "function") {
+        mastering5Context = 0;
+        return mastering5Context;
+    }
+    // void *phaselimiter_pro_init(int sample_rate)
+    mastering5Context = Module.ccall("phaselimiter_pro_init", "number", ["number"], [sampleRate]) || 0;
+    if (!mastering5Context) {
+        console.warn("[PhaseLimiterWorker] phaselimiter_pro_init failed, processing without context");
+    }
+    return mastering5Context;
+}
+
 function asFloat32Array(value) {
     if (value instanceof Float32Array) return value;
     if (value instanceof ArrayBuffer) return new Float32Array(value);
@@ -41,7 +63,7 @@ self.onmessage = async (event) => {
         const sampleRate = Number(data.sampleRate);
         const config = data.config ?? {};
         // Pro mode selection (default to 3). 
-        // 2=AutoMastering2, 3=AutoMastering3 (Pro), 5=AutoMastering5
+        // 1=phase limiter only, 2=AutoMastering2, 3=AutoMastering3 (Pro), 5=AutoMastering5
         const mode = Number(config.mode ?? 3);
 
         const sampleCount = leftChannel.length;
@@ -80,13 +102,44 @@ self.onmessage = async (event) => {
             }
         }
 
-        // int phaselimiter_pro_process(float *left_ptr, float *right_ptr, int length, int sample_rate, int mode, void (*progress_cb)(float))
-        const errorCode = Module.ccall(
-            "phaselimiter_pro_process",
-            "number",
-            ["number", "number", "number", "number", "number", "number"],
-            [leftPtrRaw, rightPtrRaw, sampleCount, sampleRate, mode, progressPtr]
-        );
+        const context = mode === 5 ? ensureMastering5Context(Module, sampleRate) : 0;
+        let errorCode;
+        if (mode === 1) {
+            // int phaselimiter_limit(float *left_ptr, float *right_ptr, int length, int sample_rate, float ceiling_db,
+            //                        int max_iter1, int max_iter2, float max_sec, float segment_sec, void (*progress_cb)(float))
+            // 0 for max_iter1/max_iter2/max_sec means the native defaults (100 / 400 / unlimited).
+            // Segments of 30 s keep the limiter's memory independent of the track length (0: whole track).
+            errorCode = Module.ccall(
+                "phaselimiter_limit",
+                "number",
+                ["number", "number", "number", "number", "number", "number", "number", "number", "number", "number"],
+                [
+                    leftPtrRaw, rightPtrRaw, sampleCount, sampleRate,
+                    Number(config.ceilingDb ?? -0.1),
+                    Number(config.maxIter1 ?? 0),
+                    Number(config.maxIter2 ?? 0),
+                    Number(config.maxSec ?? 0),
+                    Number(config.segmentSec ?? 30),
+                    progressPtr
+                ]
+            );
+        } else if (context) {
+            // int phaselimiter_pro_process_with_context(void *context, float *left_ptr, float *right_ptr, int length, int sample_rate, int mode, void (*progress_cb)(float))
+            errorCode = Module.ccall(
+                "phaselimiter_pro_process_with_context",
+                "number",
+                ["number", "number", "number", "number", "number", "number", "number"],
+                [context, leftPtrRaw, rightPtrRaw, sampleCount, sampleRate, mode, progressPtr]
+            );
+        } else {
+            // int phaselimiter_pro_process(float *left_ptr, float *right_ptr, int length, int sample_rate, int mode, void (*progress_cb)(float))
+            errorCode = Module.ccall(
+                "phaselimiter_pro_process",
+                "number",
+                ["number", "number", "number", "number", "number", "number"],
+                [leftPtrRaw, rightPtrRaw, sampleCount, sampleRate, mode, progressPtr]
+            );
+        }
 
         // Cleanup progress callback
         if (progressPtr !== 0 && typeof Module.removeFunction === "function") {